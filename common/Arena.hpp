@@ -0,0 +1,139 @@
+#ifndef __ARENA_HPP__
+#define __ARENA_HPP__
+
+#include <algorithm>
+#include <assert.h>
+#include <stddef.h>
+#include <vector>
+
+// Growable bump allocator with an upper limit on reserved memory. Memory is
+// reused between Reset() calls and returned to the system only on Release().
+class Arena
+{
+public:
+    enum { Alignment = 16 };
+
+    Arena( size_t limit, size_t blockSize = 1024*1024 )
+        : m_limit( limit )
+        , m_blockSize( blockSize )
+        , m_current( 0 )
+        , m_offset( 0 )
+        , m_reserved( 0 )
+        , m_used( 0 )
+        , m_peak( 0 )
+    {}
+
+    ~Arena()
+    {
+        Release();
+    }
+
+    // Returns nullptr if the allocation would exceed memory limit.
+    void* Alloc( size_t size )
+    {
+        size = Align( size );
+        while( m_current < m_blocks.size() )
+        {
+            auto& block = m_blocks[m_current];
+            if( m_offset + size <= block.size )
+            {
+                void* ret = block.ptr + m_offset;
+                m_offset += size;
+                m_used += size;
+                if( m_used > m_peak ) m_peak = m_used;
+                return ret;
+            }
+            if( m_current + 1 == m_blocks.size() ) break;
+            m_current++;
+            m_offset = 0;
+        }
+
+        const auto bsize = std::max( size, std::min( m_blockSize << std::min<size_t>( m_blocks.size(), 6 ), MaxBlockSize ) );
+        if( m_reserved + bsize > m_limit )
+        {
+            if( m_reserved + size > m_limit ) return nullptr;
+            return AllocBlock( size );
+        }
+        return AllocBlock( bsize, size );
+    }
+
+    // Returns size bytes from the tail of the last allocation. Size must be a multiple of Alignment.
+    void Unalloc( size_t size )
+    {
+        assert( size % Alignment == 0 );
+        assert( size <= m_offset );
+        m_offset -= size;
+        m_used -= size;
+    }
+
+    // Discards all allocations, but keeps the memory for reuse.
+    void Reset()
+    {
+        m_current = 0;
+        m_offset = 0;
+        m_used = 0;
+    }
+
+    // Discards all allocations and frees the memory.
+    void Release()
+    {
+        for( auto& v : m_blocks )
+        {
+            delete[] v.ptr;
+        }
+        m_blocks.clear();
+        m_reserved = 0;
+        Reset();
+    }
+
+    void ResetPeak() { m_peak = m_used; }
+
+    size_t Used() const { return m_used; }
+    size_t Peak() const { return m_peak; }
+    size_t Reserved() const { return m_reserved; }
+    size_t Limit() const { return m_limit; }
+    void SetLimit( size_t limit ) { m_limit = limit; }
+
+    Arena( const Arena& ) = delete;
+    Arena( Arena&& ) = delete;
+
+    Arena& operator=( const Arena& ) = delete;
+    Arena& operator=( Arena&& ) = delete;
+
+private:
+    static constexpr size_t MaxBlockSize = 64*1024*1024;
+
+    struct Block
+    {
+        char* ptr;
+        size_t size;
+    };
+
+    static size_t Align( size_t size ) { return ( size + Alignment - 1 ) & ~size_t( Alignment - 1 ); }
+
+    void* AllocBlock( size_t bsize, size_t size )
+    {
+        auto ptr = new char[bsize];
+        const auto pos = m_blocks.empty() ? 0 : m_current + 1;
+        m_blocks.insert( m_blocks.begin() + pos, Block { ptr, bsize } );
+        m_current = pos;
+        m_offset = size;
+        m_reserved += bsize;
+        m_used += size;
+        if( m_used > m_peak ) m_peak = m_used;
+        return ptr;
+    }
+
+    void* AllocBlock( size_t size ) { return AllocBlock( size, size ); }
+
+    size_t m_limit;
+    size_t m_blockSize;
+    size_t m_current;
+    size_t m_offset;
+    size_t m_reserved;
+    size_t m_used;
+    size_t m_peak;
+    std::vector<Block> m_blocks;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <string.h>
+
+#include "BodyLines.hpp"
+#include "LineEnd.hpp"
+#include "MessageLogic.hpp"
+
+static inline bool IsSignatureMark( const char* ptr, const char* end )
+{
+    return end - ptr == 3 && ptr[0] == '-' && ptr[1] == '-' && ptr[2] == ' ';
+}
+
+BodyLines::BodyLines()
+{
+    m_lines.reserve( 1024 );
+}
+
+void BodyLines::Parse( const char* body )
+{
+    m_lines.clear();
+
+    bool signature = false;
+    auto ptr = body;
+    for(;;)
+    {
+        const auto end = FindLineEnd( ptr );
+        Line line = { uint32_t( ptr - body ), uint32_t( end - ptr ), 0, 0, 0 };
+        if( IsSignatureMark( ptr, end ) )
+        {
+            signature = true;
+            line.flags = F_Signature | F_SignatureMark;
+        }
+        else
+        {
+            auto text = ptr;
+            line.level = std::min( QuotationLevel( text, end ), 0xFFFF );
+            line.text = uint32_t( text - ptr );
+            if( signature ) line.flags = F_Signature;
+        }
+        m_lines.emplace_back( line );
+        if( *end == '\0' ) break;
+        ptr = end + 1;
+    }
+
+    DetectWrote( body );
+}
+
+// Attribution is a single line of unquoted text, optionally followed by a line ending with one
+// of typical markers, which is then followed by quoted text. Blank lines are skipped.
+void BodyLines::DetectWrote( const char* body )
+{
+    const auto size = m_lines.size();
+    auto skipBlank = [this, body, size] ( size_t idx ) {
+        while( idx < size )
+        {
+            const auto& line = m_lines[idx];
+            auto ptr = body + line.offset;
+            const auto end = ptr + line.len;
+            while( ptr < end && ( *ptr == ' ' || *ptr == '\t' ) ) ptr++;
+            if( ptr != end ) break;
+            idx++;
+        }
+        return idx;
+    };
+
+    // Lines ending the body are not considered.
+    const auto l1 = skipBlank( 0 );
+    if( l1 + 1 >= size ) return;
+    auto ptr = body + m_lines[l1].offset;
+    auto end = ptr + m_lines[l1].len;
+    while( *ptr == ' ' || *ptr == '\t' ) ptr++;
+    if( IsSignatureMark( ptr, end ) || m_lines[l1].level != 0 ) return;
+
+    const auto l2 = skipBlank( l1 + 1 );
+    if( l2 + 1 >= size ) return;
+    if( m_lines[l2].level != 0 )
+    {
+        m_lines[l1].flags |= F_Wrote;
+        return;
+    }
+
+    ptr = body + m_lines[l2].offset;
+    end = ptr + m_lines[l2].len;
+    while( *ptr == ' ' || *ptr == '\t' ) ptr++;
+    while( end > ptr && ( end[-1] == ' ' || end[-1] == '\t' ) ) end--;
+    const auto len = end - ptr;
+    const bool marker =
+        ( len >= 1 && end[-1] == ':' ) ||                                   // "something something wrote:"
+        ( len >= 2 && *ptr == '[' && end[-1] == ']' ) ||                    // "[cut content]"
+        ( len >= 2 && *ptr == '<' && end[-1] == '>' ) ||                    // "<cut content>"
+        ( len >= 3 && strncmp( end - 3, "...", 3 ) == 0 );                  // "something something wrote..."
+    if( !marker ) return;
+
+    const auto l3 = skipBlank( l2 + 1 );
+    if( l3 + 1 >= size ) return;
+    if( m_lines[l3].level != 0 )
+    {
+        m_lines[l1].flags |= F_Wrote;
+        m_lines[l2].flags |= F_Wrote;
+    }
+}
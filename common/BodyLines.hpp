@@ -0,0 +1,40 @@
+#ifndef __BODYLINES_HPP__
+#define __BODYLINES_HPP__
+
+#include <stdint.h>
+#include <vector>
+
+// Splits message body into lines and classifies them in a single pass. All lines, except the
+// last one, end with '\n'. The last line ends with '\0'.
+class BodyLines
+{
+public:
+    enum Flags
+    {
+        F_Signature = 1,        // signature separator, or any line after it
+        F_SignatureMark = 2,    // signature separator, "-- "
+        F_Wrote = 4,            // attribution of quoted text, for example "someone wrote:"
+    };
+
+    struct Line
+    {
+        uint32_t offset;        // line start, relative to body
+        uint32_t len;
+        uint32_t text;          // text after quotation marks, relative to line start
+        uint16_t level;         // quotation level
+        uint16_t flags;
+    };
+
+    BodyLines();
+
+    void Parse( const char* body );
+
+    const std::vector<Line>& Lines() const { return m_lines; }
+
+private:
+    void DetectWrote( const char* body );
+
+    std::vector<Line> m_lines;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Checkpoint.hpp"
+
+enum { Magic = 0x4B435455 };   // "UTCK"
+
+Checkpoint::Checkpoint( const std::string& fn, int interval )
+    : m_fn( fn )
+    , m_interval( interval )
+    , m_next( interval > 0 ? std::chrono::steady_clock::now() + m_interval : std::chrono::steady_clock::time_point::max() )
+    , m_read( 0 )
+{
+}
+
+// File layout: magic, size of parameters, size of state, parameters, state.
+bool Checkpoint::Load()
+{
+    FILE* f = fopen( m_fn.c_str(), "rb" );
+    if( !f ) return false;
+
+    uint32_t hdr[3];
+    bool ok = fread( hdr, 1, sizeof( hdr ), f ) == sizeof( hdr ) && hdr[0] == Magic && hdr[1] == m_params.size();
+    if( ok )
+    {
+        std::vector<uint8_t> params( hdr[1] );
+        m_loaded.resize( hdr[2] );
+        ok = fread( params.data(), 1, params.size(), f ) == params.size() &&
+             fread( m_loaded.data(), 1, m_loaded.size(), f ) == m_loaded.size() &&
+             params == m_params;
+    }
+    fclose( f );
+
+    if( !ok ) m_loaded.clear();
+    m_read = 0;
+    return ok;
+}
+
+void Checkpoint::Save()
+{
+    if( m_interval.count() == 0 )
+    {
+        m_data.clear();
+        return;
+    }
+
+    const auto tmp = m_fn + ".tmp";
+    FILE* f = fopen( tmp.c_str(), "wb" );
+    if( !f )
+    {
+        fprintf( stderr, "Cannot create checkpoint %s\n", tmp.c_str() );
+        exit( 1 );
+    }
+    const uint32_t hdr[3] = { Magic, uint32_t( m_params.size() ), uint32_t( m_data.size() ) };
+    fwrite( hdr, 1, sizeof( hdr ), f );
+    fwrite( m_params.data(), 1, m_params.size(), f );
+    fwrite( m_data.data(), 1, m_data.size(), f );
+    if( fclose( f ) != 0 )
+    {
+        fprintf( stderr, "Cannot write checkpoint %s\n", tmp.c_str() );
+        exit( 1 );
+    }
+    // Previous checkpoint stays valid until it is replaced.
+#ifdef _WIN32
+    remove( m_fn.c_str() );
+#endif
+    rename( tmp.c_str(), m_fn.c_str() );
+    m_data.clear();
+
+    const auto now = std::chrono::steady_clock::now();
+    if( m_start == std::chrono::steady_clock::time_point() ) m_start = now;
+    const auto cost = std::chrono::duration_cast<std::chrono::seconds>( ( now - m_start ) * int( CostRatio ) );
+    m_next = now + std::max( m_interval, cost );
+    m_start = std::chrono::steady_clock::time_point();
+}
+
+void Checkpoint::Remove()
+{
+    remove( m_fn.c_str() );
+}
+
+void Checkpoint::Read( void* ptr, size_t size )
+{
+    if( m_read + size > m_loaded.size() )
+    {
+        fprintf( stderr, "Damaged checkpoint %s\n", m_fn.c_str() );
+        exit( 1 );
+    }
+    memcpy( ptr, m_loaded.data() + m_read, size );
+    m_read += size;
+}
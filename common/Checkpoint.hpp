@@ -0,0 +1,80 @@
+#ifndef __CHECKPOINT_HPP__
+#define __CHECKPOINT_HPP__
+
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Progress of a long running tool, periodically saved in the archive directory, so that an
+// interrupted run can be resumed. Saved state is used only if the tool is run again with the
+// same parameters. Tools keep partial outputs in their own files, checkpoint records how much
+// of them is valid.
+class Checkpoint
+{
+public:
+    enum { DefaultInterval = 600 };
+    // Time between checkpoints is at least this many times longer than taking the last one.
+    enum { CostRatio = 20 };
+
+    // Interval is in seconds. Zero disables saving, but saved state can still be loaded.
+    Checkpoint( const std::string& fn, int interval );
+
+    template<class T> void Param( const T& v ) { Append( m_params, v ); }
+    void Param( const std::string& v ) { Append( m_params, v ); }
+
+    // Returns false if there is no saved state, or it was saved with different parameters.
+    bool Load();
+    // Checked by workers, which should then stop at the nearest point where state can be saved.
+    bool Due() const { return std::chrono::steady_clock::now() >= m_next; }
+    // Called when workers have stopped, before partial outputs are written. Time until Save is
+    // the cost of the checkpoint.
+    void Begin() { m_start = std::chrono::steady_clock::now(); }
+    // Writes state put since the last save. Can also be called when not due, at the end of a phase.
+    void Save();
+    void Remove();
+
+    // Loaded state is read with Get, state to be saved is added with Put.
+    template<class T> void Put( const T& v ) { Append( m_data, v ); }
+    template<class T> void Put( const std::vector<T>& v ) { Append( m_data, v ); }
+    template<class T> T Get() { T v; Read( &v, sizeof( T ) ); return v; }
+    template<class T> void Get( std::vector<T>& v )
+    {
+        static_assert( std::is_trivially_copyable<T>::value, "Only plain data can be saved." );
+        v.resize( Get<uint64_t>() );
+        Read( v.data(), v.size() * sizeof( T ) );
+    }
+
+private:
+    template<class T> static void Append( std::vector<uint8_t>& buf, const T& v )
+    {
+        static_assert( std::is_trivially_copyable<T>::value, "Only plain data can be saved." );
+        buf.insert( buf.end(), (const uint8_t*)&v, (const uint8_t*)&v + sizeof( T ) );
+    }
+    template<class T> static void Append( std::vector<uint8_t>& buf, const std::vector<T>& v )
+    {
+        static_assert( std::is_trivially_copyable<T>::value, "Only plain data can be saved." );
+        Append( buf, uint64_t( v.size() ) );
+        buf.insert( buf.end(), (const uint8_t*)v.data(), (const uint8_t*)( v.data() + v.size() ) );
+    }
+    static void Append( std::vector<uint8_t>& buf, const std::string& v )
+    {
+        Append( buf, uint64_t( v.size() ) );
+        buf.insert( buf.end(), v.begin(), v.end() );
+    }
+
+    void Read( void* ptr, size_t size );
+
+    std::string m_fn;
+    std::chrono::seconds m_interval;
+    std::chrono::steady_clock::time_point m_next;
+    std::chrono::steady_clock::time_point m_start;
+    std::vector<uint8_t> m_params;
+    std::vector<uint8_t> m_data;
+    std::vector<uint8_t> m_loaded;
+    size_t m_read;
+};
+
+#endif
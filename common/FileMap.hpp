@@ -18,7 +18,8 @@ template<typename T>
 class FileMap
 {
 public:
-    FileMap( const std::string& fn, bool mayFail = false )
+    // Copy-on-write mapping can be modified. Changes are never written back to the file.
+    FileMap( const std::string& fn, bool mayFail = false, bool copyOnWrite = false )
         : m_ptr( nullptr )
         , m_size( GetFileSize( fn.c_str() ) )
         , m_release( true )
@@ -30,7 +31,14 @@ public:
             fprintf( stderr, "Cannot open %s\n", fn.c_str() );
             exit( 1 );
         }
-        m_ptr = (T*)mmap( nullptr, m_size, PROT_READ, MAP_SHARED, fileno( f ), 0 );
+        if( copyOnWrite )
+        {
+            m_ptr = (T*)mmap( nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno( f ), 0 );
+        }
+        else
+        {
+            m_ptr = (T*)mmap( nullptr, m_size, PROT_READ, MAP_SHARED, fileno( f ), 0 );
+        }
         fclose( f );
     }
 
@@ -69,6 +77,7 @@ public:
     }
 
     operator const T*() const { return m_ptr; }
+    T* Writable() const { return m_ptr; }
     uint64_t Size() const { return m_size; }
     uint64_t DataSize() const { return m_size / sizeof( T ); }
 
@@ -3,6 +3,9 @@
 
 #ifdef _WIN32
 #  include <direct.h>
+#  include <fcntl.h>
+#  include <io.h>
+#  include <share.h>
 #  include <windows.h>
 #else
 #  include <dirent.h>
@@ -137,6 +140,19 @@ void CopyFile( const std::string& from, const std::string& to )
     fclose( dst );
 }
 
+bool TruncateFile( const std::string& path, uint64_t size )
+{
+#ifdef _WIN32
+    int fd;
+    if( _sopen_s( &fd, path.c_str(), _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IWRITE ) != 0 ) return false;
+    const bool ret = _chsize_s( fd, size ) == 0;
+    _close( fd );
+    return ret;
+#else
+    return truncate( path.c_str(), size ) == 0;
+#endif
+}
+
 void CopyCommonFiles( const std::string& source, const std::string& target )
 {
     if( Exists( source + "name" ) ) CopyFile( source + "name", target + "name" );
@@ -14,6 +14,7 @@
 bool CreateDirStruct( const std::string& path );
 std::vector<std::string> ListDirectory( const std::string& path );
 void CopyFile( const std::string& from, const std::string& to );
+bool TruncateFile( const std::string& path, uint64_t size );
 
 void CopyCommonFiles( const std::string& source, const std::string& target );
 
@@ -0,0 +1,142 @@
+#include <assert.h>
+#include <stdint.h>
+
+#include "HeaderIndex.hpp"
+#include "LineEnd.hpp"
+#include "String.hpp"
+
+static inline uint32_t Lower( char c )
+{
+    return ( c >= 'A' && c <= 'Z' ) ? c - 'A' + 'a' : uint8_t( c );
+}
+
+// Names are hashed with FNV-1a of lowercase characters.
+static constexpr uint32_t HashSeed = 0x811C9DC5;
+static constexpr uint32_t HashPrime = 0x01000193;
+
+static inline uint32_t HashName( const char* name, int len )
+{
+    uint32_t hash = HashSeed;
+    while( len-- ) hash = ( hash ^ Lower( *name++ ) ) * HashPrime;
+    return hash;
+}
+
+static inline bool SameName( const char* l, const char* r, int len )
+{
+    while( len-- )
+    {
+        if( Lower( *l++ ) != Lower( *r++ ) ) return false;
+    }
+    return true;
+}
+
+HeaderIndex::HeaderIndex()
+    : m_mask( 0 )
+    , m_body( nullptr )
+{
+    m_headers.reserve( 64 );
+}
+
+HeaderIndex::HeaderIndex( const char* msg )
+    : HeaderIndex()
+{
+    Parse( msg );
+}
+
+void HeaderIndex::Parse( const char* msg )
+{
+    m_headers.clear();
+
+    auto ptr = msg;
+    while( *ptr != '\n' && *ptr != '\0' )
+    {
+        if( *ptr == ' ' || *ptr == '\t' )
+        {
+            ptr = FindLineEnd( ptr );
+        }
+        else
+        {
+            auto name = ptr;
+            uint32_t hash = HashSeed;
+            while( *ptr != ':' && *ptr != '\n' && *ptr != '\0' )
+            {
+                hash = ( hash ^ Lower( *ptr++ ) ) * HashPrime;
+            }
+            if( *ptr == ':' )
+            {
+                const auto nameLen = uint32_t( ptr - name );
+                ptr = FindLineEnd( ptr );
+                m_headers.emplace_back( Header { name, ptr, nameLen, hash, -1 } );
+            }
+        }
+        if( *ptr == '\0' ) break;
+        ptr++;
+    }
+    m_body = ptr;
+
+    // Chains of headers with the same name are in message order.
+    uint32_t size = 32;
+    while( size < m_headers.size() * 2 ) size *= 2;
+    m_mask = size - 1;
+    m_table.assign( size, -1 );
+    for( int32_t i=int32_t( m_headers.size() )-1; i>=0; i-- )
+    {
+        auto& hdr = m_headers[i];
+        auto idx = hdr.hash & m_mask;
+        for(;;)
+        {
+            const auto head = m_table[idx];
+            if( head < 0 )
+            {
+                m_table[idx] = i;
+                break;
+            }
+            auto& other = m_headers[head];
+            if( other.hash == hdr.hash && other.nameLen == hdr.nameLen && SameName( other.name, hdr.name, hdr.nameLen ) )
+            {
+                hdr.next = head;
+                m_table[idx] = i;
+                break;
+            }
+            idx = ( idx + 1 ) & m_mask;
+        }
+    }
+}
+
+const char* HeaderIndex::Find( const char* header, int hlen ) const
+{
+    for( auto i = Lookup( header, hlen ); i >= 0; i = m_headers[i].next )
+    {
+        if( Match( m_headers[i], header, hlen ) ) return m_headers[i].name;
+    }
+    return nullptr;
+}
+
+bool HeaderIndex::Is( const Header& hdr, const char* name, int len )
+{
+    return hdr.nameLen == uint32_t( len ) && strnicmpl( hdr.name, name, len ) == 0;
+}
+
+int32_t HeaderIndex::Lookup( const char* header, int hlen ) const
+{
+    if( m_table.empty() ) return -1;
+
+    int len = 0;
+    while( len < hlen && header[len] != ':' ) len++;
+    assert( len < hlen );
+    const auto hash = HashName( header, len );
+    auto idx = hash & m_mask;
+    for(;;)
+    {
+        const auto head = m_table[idx];
+        if( head < 0 ) return -1;
+        auto& hdr = m_headers[head];
+        if( hdr.hash == hash && Is( hdr, header, len ) ) return head;
+        idx = ( idx + 1 ) & m_mask;
+    }
+}
+
+bool HeaderIndex::Match( const Header& hdr, const char* header, int hlen )
+{
+    return hdr.end - hdr.name >= hlen && strnicmpl( hdr.name, header, hlen ) == 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __HEADERINDEX_HPP__
+#define __HEADERINDEX_HPP__
+
+#include <stdint.h>
+#include <vector>
+
+// Index of message headers, built in a single pass over the header block. Header names are
+// matched case-insensitively. Lookups take header names with separator, lowercase, for example
+// "date: ", and only return headers which start with the exact string.
+class HeaderIndex
+{
+public:
+    struct Header
+    {
+        const char* name;       // start of the header line
+        const char* end;        // '\n' ending the header line
+        uint32_t nameLen;       // name length, up to the colon
+        uint32_t hash;
+        int32_t next;           // next header with the same name, or -1
+    };
+
+    HeaderIndex();
+    explicit HeaderIndex( const char* msg );
+
+    void Parse( const char* msg );
+
+    // Returns start of the first matching header line, or nullptr.
+    const char* Find( const char* header, int hlen ) const;
+
+    template<class T>
+    void ForEach( const char* header, int hlen, T fn ) const
+    {
+        for( auto i = Lookup( header, hlen ); i >= 0; i = m_headers[i].next )
+        {
+            if( Match( m_headers[i], header, hlen ) ) fn( m_headers[i].name );
+        }
+    }
+
+    // Checks header name, given in lowercase without separator.
+    static bool Is( const Header& hdr, const char* name, int len );
+
+    // Headers in message order. Continuation lines are not included.
+    const std::vector<Header>& Headers() const { return m_headers; }
+    // Empty line ending the headers, or '\0' if there is no message body.
+    const char* Body() const { return m_body; }
+
+private:
+    int32_t Lookup( const char* header, int hlen ) const;
+    static bool Match( const Header& hdr, const char* header, int hlen );
+
+    std::vector<Header> m_headers;
+    std::vector<int32_t> m_table;
+    uint32_t m_mask;
+    const char* m_body;
+};
+
+#endif
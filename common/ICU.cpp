@@ -1,47 +1,177 @@
 #include <assert.h>
+#include <memory>
+#include <string.h>
 #include <unicode/locid.h>
 #include <unicode/brkiter.h>
+#include <unicode/uchar.h>
 #include <unicode/unistr.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 #include "ICU.hpp"
 #include "LexiconTypes.hpp"
-#include "Slab.hpp"
 
-UErrorCode wordItErr = U_ZERO_ERROR;
-auto wordIt = icu::BreakIterator::createWordInstance( icu::Locale::getEnglish(), wordItErr );
+// Character classes of ASCII word splitting.
+enum
+{
+    C_Alpha = 1,
+    C_Digit = 2,
+    C_Underscore = 4,
+    C_MidLetter = 8,    // joins letters
+    C_MidNum = 16       // joins digits
+};
 
-static inline bool _isalpha( char c )
+static const struct AsciiClass
 {
-    return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' );
-}
+    AsciiClass()
+    {
+        memset( cls, 0, sizeof( cls ) );
+        for( int i='a'; i<='z'; i++ ) cls[i] = cls[i-'a'+'A'] = C_Alpha;
+        for( int i='0'; i<='9'; i++ ) cls[i] = C_Digit;
+        cls['_'] = C_Underscore;
+        cls[':'] = C_MidLetter;
+        cls['.'] = C_MidLetter | C_MidNum;
+        cls['\''] = C_MidLetter | C_MidNum;
+        cls[','] = C_MidNum;
+        cls[';'] = C_MidNum;
+    }
+
+    uint8_t operator[]( char c ) const { return cls[(uint8_t)c]; }
+
+    uint8_t cls[256];
+} s_ascii;
 
-static inline bool _isdigit( char c )
+// Word break classes of code points handled without ICU. Other code points, including these
+// which are ignored by word break rules (extend, format), are left to ICU.
+enum
 {
-    return c >= '0' && c <= '9';
-}
+    W_Other,
+    W_Letter,
+    W_Numeric,
+    W_MidLetter,
+    W_MidNum,
+    W_MidNumLet,
+    W_ExtendNumLet,
+    W_Complex
+};
+
+// Latin-1 and Latin Extended-A, which cover most European languages.
+enum { LatinEnd = 0x180 };
 
-static inline bool _isalnum( char c )
+// Lower case mapping and word break classes are taken from ICU, so that results are the same
+// as if ICU was used.
+static const struct LatinTables
 {
-    return _isalpha( c ) || _isdigit( c );
-}
+    LatinTables()
+    {
+        for( UChar32 i=0; i<LatinEnd; i++ )
+        {
+            type[i] = Classify( i );
+            const auto lc = icu::UnicodeString( i ).toLower( icu::Locale::getEnglish() );
+            lower[i] = ( lc.countChar32() == 1 && lc.char32At( 0 ) < LatinEnd ) ? lc.char32At( 0 ) : 0;
+        }
+        // Space can only be found alone, at the start of a part split by ICU.
+        type[' '] = W_Other;
+        // ICU follows CLDR root tailoring, which does not join letters with colons.
+        type[':'] = W_Other;
+    }
+
+    static uint8_t Classify( UChar32 c )
+    {
+        switch( u_getIntPropertyValue( c, UCHAR_WORD_BREAK ) )
+        {
+        case U_WB_OTHER:
+        case U_WB_CR:
+        case U_WB_LF:
+        case U_WB_NEWLINE:
+        case U_WB_DOUBLE_QUOTE:
+            return W_Other;
+        case U_WB_ALETTER:
+            return W_Letter;
+        case U_WB_NUMERIC:
+            return W_Numeric;
+        case U_WB_MIDLETTER:
+            return W_MidLetter;
+        case U_WB_MIDNUM:
+            return W_MidNum;
+        case U_WB_MIDNUMLET:
+        case U_WB_SINGLE_QUOTE:
+            return W_MidNumLet;
+        case U_WB_EXTENDNUMLET:
+            return W_ExtendNumLet;
+        default:
+            return W_Complex;
+        }
+    }
+
+    uint8_t type[LatinEnd];
+    // Zero if lower case is not a single Latin code point.
+    char32_t lower[LatinEnd];
+} s_latin;
 
-static inline bool IsUtf( const char* begin, const char* end )
+static inline const char* FindNonAscii( const char* ptr, const char* end )
 {
-    assert( begin <= end );
-    while( begin != end )
+#ifdef __SSE2__
+    while( end - ptr >= 16 )
     {
-        if( *begin++ & 0x80 )
+        const auto mask = _mm_movemask_epi8( _mm_loadu_si128( (const __m128i*)ptr ) );
+        if( mask != 0 )
         {
-            return true;
+            while( ( *ptr & 0x80 ) == 0 ) ptr++;
+            return ptr;
         }
+        ptr += 16;
+    }
+#endif
+    while( ptr < end && ( *ptr & 0x80 ) == 0 ) ptr++;
+    return ptr;
+}
+
+static inline void LowerAscii( const char* ptr, const char* end, char* dst )
+{
+#ifdef __SSE2__
+    const auto va = _mm_set1_epi8( 'A' - 1 );
+    const auto vz = _mm_set1_epi8( 'Z' + 1 );
+    const auto vd = _mm_set1_epi8( 'a' - 'A' );
+    while( end - ptr >= 16 )
+    {
+        const auto v = _mm_loadu_si128( (const __m128i*)ptr );
+        const auto upper = _mm_and_si128( _mm_cmpgt_epi8( v, va ), _mm_cmplt_epi8( v, vz ) );
+        _mm_storeu_si128( (__m128i*)dst, _mm_add_epi8( v, _mm_and_si128( upper, vd ) ) );
+        ptr += 16;
+        dst += 16;
+    }
+#endif
+    while( ptr < end )
+    {
+        const auto c = *ptr++;
+        *dst++ = ( c >= 'A' && c <= 'Z' ) ? c - 'A' + 'a' : c;
     }
-    return false;
 }
 
-static void SplitICU( const char* ptr, const char* end, std::vector<std::string>& out, bool toLower )
+// Break iterator keeps the text it works on, so each thread needs its own.
+static icu::BreakIterator* GetWordIterator()
+{
+    thread_local std::unique_ptr<icu::BreakIterator> wordIt( [] {
+        UErrorCode err = U_ZERO_ERROR;
+        return icu::BreakIterator::createWordInstance( icu::Locale::getEnglish(), err );
+    }() );
+    return wordIt.get();
+}
+
+void WordSplitter::AddWord( size_t offset, size_t size )
+{
+    m_offsets.emplace_back( offset );
+    m_offsets.emplace_back( size );
+}
+
+void WordSplitter::SplitICU( const char* ptr, const char* end, bool toLower )
 {
     assert( ptr != end );
 
+    auto wordIt = GetWordIterator();
     auto us = icu::UnicodeString::fromUTF8( icu::StringPiece( ptr, end-ptr ) );
     icu::UnicodeString lower;
 
@@ -57,6 +187,7 @@ static void SplitICU( const char* ptr, const char* end, std::vector<std::string>
 
     const icu::UnicodeString& data = toLower ? lower : us;
 
+    std::string str;
     int32_t p0 = 0;
     int32_t p1 = wordIt->first();
     while( p1 != icu::BreakIterator::DONE )
@@ -65,13 +196,12 @@ static void SplitICU( const char* ptr, const char* end, std::vector<std::string>
         auto len = part.countChar32();
         if( len >= LexiconMinLen )
         {
-            std::string str;
+            str.clear();
             part.toUTF8String( str );
 
             auto start = str.c_str();
             auto end = start + str.size();
 
-            auto origlen = len;
             while( *start == '_' )
             {
                 start++;
@@ -85,14 +215,8 @@ static void SplitICU( const char* ptr, const char* end, std::vector<std::string>
 
             if( len >= LexiconMinLen && len <= LexiconMaxLen )
             {
-                if( origlen == len )
-                {
-                    out.emplace_back( std::move( str ) );
-                }
-                else
-                {
-                    out.emplace_back( start, end-start );
-                }
+                AddWord( m_text.size(), end-start );
+                m_text.insert( m_text.end(), start, end );
             }
         }
         p0 = p1;
@@ -100,99 +224,210 @@ static void SplitICU( const char* ptr, const char* end, std::vector<std::string>
     }
 }
 
-static void SplitASCII( const char* ptr, const char* end, std::vector<std::string>& out, bool toLower )
+// Follows Unicode word boundary rules (UAX #29), as implemented by ICU, for code points which
+// do not need special handling. Returns false, if the text has to be split by ICU.
+bool WordSplitter::SplitLatin( const char* ptr, const char* end, bool toLower )
 {
-    static Slab<256*1024> tmpSlab;
-
     assert( ptr != end );
 
-    const auto size = end - ptr;
-    const char* bptr;
-    if( toLower )
+    m_cp.clear();
+    m_cpOffset.clear();
+    const auto base = m_text.size();
+    while( ptr < end )
     {
-        tmpSlab.Reset();
-        auto buf = (char*)tmpSlab.Alloc( size );
-        auto lc = buf;
-        for( int i=0; i<size; i++ )
+        char32_t c = (uint8_t)*ptr;
+        if( c < 0x80 )
+        {
+            ptr++;
+        }
+        else if( c >= 0xC2 && c < 0xC0 + ( LatinEnd >> 6 ) && end - ptr >= 2 && ( ptr[1] & 0xC0 ) == 0x80 )
+        {
+            c = ( ( c & 0x1F ) << 6 ) | ( ptr[1] & 0x3F );
+            ptr += 2;
+        }
+        else
+        {
+            m_text.resize( base );
+            return false;
+        }
+        if( toLower )
         {
-            if( *ptr >= 'A' && *ptr <= 'Z' )
+            c = s_latin.lower[c];
+            if( c == 0 )
             {
-                *lc++ = *ptr++ - 'A' + 'a';
+                m_text.resize( base );
+                return false;
             }
-            else
+        }
+        if( s_latin.type[c] == W_Complex )
+        {
+            m_text.resize( base );
+            return false;
+        }
+        m_cp.emplace_back( c );
+        m_cpOffset.emplace_back( m_text.size() - base );
+        if( c < 0x80 )
+        {
+            m_text.emplace_back( char( c ) );
+        }
+        else
+        {
+            m_text.emplace_back( char( 0xC0 | ( c >> 6 ) ) );
+            m_text.emplace_back( char( 0x80 | ( c & 0x3F ) ) );
+        }
+    }
+    m_cpOffset.emplace_back( m_text.size() - base );
+
+    const auto size = m_cp.size();
+    auto type = [this, size] ( size_t i ) { return i < size ? s_latin.type[m_cp[i]] : W_Other; };
+    auto isLetter = [] ( int t ) { return t == W_Letter; };
+    auto isNumeric = [] ( int t ) { return t == W_Numeric; };
+    auto isMidLetter = [] ( int t ) { return t == W_MidLetter || t == W_MidNumLet; };
+    auto isMidNum = [] ( int t ) { return t == W_MidNum || t == W_MidNumLet; };
+
+    size_t start = 0;
+    for( size_t i=1; i<=size; i++ )
+    {
+        bool join = false;
+        if( i < size )
+        {
+            const auto t0 = type( i-1 );
+            const auto t1 = type( i );
+            const auto tp = i > 1 ? type( i-2 ) : W_Other;
+            const auto tn = type( i+1 );
+            join =
+                ( ( isLetter( t0 ) || isNumeric( t0 ) ) && ( isLetter( t1 ) || isNumeric( t1 ) ) ) ||
+                ( isLetter( t0 ) && isMidLetter( t1 ) && isLetter( tn ) ) ||
+                ( isLetter( tp ) && isMidLetter( t0 ) && isLetter( t1 ) ) ||
+                ( isNumeric( t0 ) && isMidNum( t1 ) && isNumeric( tn ) ) ||
+                ( isNumeric( tp ) && isMidNum( t0 ) && isNumeric( t1 ) ) ||
+                ( ( isLetter( t0 ) || isNumeric( t0 ) || t0 == W_ExtendNumLet ) && t1 == W_ExtendNumLet ) ||
+                ( t0 == W_ExtendNumLet && ( isLetter( t1 ) || isNumeric( t1 ) ) );
+        }
+        if( !join )
+        {
+            auto b = start;
+            auto e = i;
+            while( b < e && m_cp[b] == '_' ) b++;
+            while( e > b && m_cp[e-1] == '_' ) e--;
+            const auto len = e - b;
+            if( len >= LexiconMinLen && len <= LexiconMaxLen && i - start >= LexiconMinLen )
             {
-                *lc++ = *ptr++;
+                AddWord( base + m_cpOffset[b], m_cpOffset[e] - m_cpOffset[b] );
             }
+            start = i;
         }
-        bptr = buf;
+    }
+    return true;
+}
+
+void WordSplitter::SplitASCII( const char* ptr, const char* end, bool toLower )
+{
+    assert( ptr != end );
+
+    const auto size = end - ptr;
+    const auto base = m_text.size();
+    m_text.resize( base + size );
+    if( toLower )
+    {
+        LowerAscii( ptr, end, m_text.data() + base );
     }
     else
     {
-        bptr = ptr;
+        memcpy( m_text.data() + base, ptr, size );
     }
-    const char* bend = bptr + size;
+
+    const char* const bstart = m_text.data() + base;
+    const char* const bend = bstart + size;
+    const char* bptr = bstart;
     for(;;)
     {
-        while( bptr < bend && !_isalnum( *bptr ) ) bptr++;
+        while( bptr < bend && ( s_ascii[*bptr] & ( C_Alpha | C_Digit ) ) == 0 ) bptr++;
         auto e = bptr+1;
-        while( e < bend && ( _isalnum( *e ) || *e == '_' || ( e < bend-1 && (
-            ( _isalpha( e[-1] ) && _isalpha( e[1] ) && ( *e == ':' || *e == '.' || *e == '\'' ) ) ||
-            ( _isdigit( e[-1] ) && _isdigit( e[1] ) && ( *e == ',' || *e == '.' || *e == '\'' || *e == ';' ) )
-            ) ) ) ) e++;
+        while( e < bend )
+        {
+            const auto c = s_ascii[*e];
+            if( c & ( C_Alpha | C_Digit | C_Underscore ) )
+            {
+                e++;
+            }
+            else if( e < bend-1 && (
+                ( ( c & C_MidLetter ) && ( s_ascii[e[-1]] & s_ascii[e[1]] & C_Alpha ) ) ||
+                ( ( c & C_MidNum ) && ( s_ascii[e[-1]] & s_ascii[e[1]] & C_Digit ) ) ) )
+            {
+                e++;
+            }
+            else
+            {
+                break;
+            }
+        }
         while( e > bptr+2 && e[-1] == '_' ) e--;
         auto len = e - bptr;
         if( len >= LexiconMinLen && len <= LexiconMaxLen )
         {
-            out.emplace_back( bptr, e );
+            AddWord( bptr - bstart + base, len );
         }
         if( e >= bend ) break;
         bptr = e+1;
     }
 }
 
-void SplitLine( const char* ptr, const char* end, std::vector<std::string>& out, bool toLower )
+const std::vector<std::string_view>& WordSplitter::Split( const char* ptr, const char* end, bool toLower )
 {
-    out.clear();
-    if( ptr == end ) return;
+    m_text.clear();
+    m_offsets.clear();
+    m_words.clear();
+    if( ptr == end ) return m_words;
 
-    if( IsUtf( ptr, end ) )
+    while( ptr <= end )
     {
-        while( ptr <= end )
+        auto putf = FindNonAscii( ptr, end );
+        if( putf == end )
         {
-            auto putf = ptr;
-            while( putf < end && ( *putf & 0x80 ) == 0 ) putf++;
-            if( putf == end )
-            {
-                if( ptr != end )
-                {
-                    SplitASCII( ptr, end, out, toLower );
-                }
-                break;
-            }
-            auto split = putf;
-            while( split > ptr && *split != ' ' && *split != '\t' ) split--;
-            if( split > ptr )
+            if( ptr != end )
             {
-                SplitASCII( ptr, split, out, toLower );
-                ptr = split+1;
+                SplitASCII( ptr, end, toLower );
             }
-            while( putf < end && *putf != ' ' && *putf != '\t' ) putf++;
-            SplitICU( ptr, putf, out, toLower );
-            ptr = putf + 1;
+            break;
         }
+        auto split = putf;
+        while( split > ptr && *split != ' ' && *split != '\t' ) split--;
+        if( split > ptr )
+        {
+            SplitASCII( ptr, split, toLower );
+            ptr = split+1;
+        }
+        while( putf < end && *putf != ' ' && *putf != '\t' ) putf++;
+        if( !SplitLatin( ptr, putf, toLower ) )
+        {
+            SplitICU( ptr, putf, toLower );
+        }
+        ptr = putf + 1;
     }
-    else
+
+    for( size_t i=0; i<m_offsets.size(); i+=2 )
+    {
+        m_words.emplace_back( m_text.data() + m_offsets[i], m_offsets[i+1] );
+    }
+    return m_words;
+}
+
+void SplitLine( const char* ptr, const char* end, std::vector<std::string>& out, bool toLower )
+{
+    thread_local WordSplitter splitter;
+    out.clear();
+    for( auto& w : splitter.Split( ptr, end, toLower ) )
     {
-        SplitASCII( ptr, end, out, toLower );
+        out.emplace_back( w );
     }
 }
 
 std::string ToLower( const char* ptr, const char* end )
 {
-    const auto size = end - ptr;
-    if( IsUtf( ptr, end ) )
+    if( FindNonAscii( ptr, end ) != end )
     {
-        auto us = icu::UnicodeString::fromUTF8( icu::StringPiece( ptr, size ) );
+        auto us = icu::UnicodeString::fromUTF8( icu::StringPiece( ptr, end-ptr ) );
         const icu::UnicodeString lower = us.toLower( icu::Locale::getEnglish() );
         std::string ret;
         lower.toUTF8String( ret );
@@ -200,19 +435,8 @@ std::string ToLower( const char* ptr, const char* end )
     }
     else
     {
-        auto buf = (char*)alloca( size );
-        auto lc = buf;
-        for( int i=0; i<size; i++ )
-        {
-            if( *ptr >= 'A' && *ptr <= 'Z' )
-            {
-                *lc++ = *ptr++ - 'A' + 'a';
-            }
-            else
-            {
-                *lc++ = *ptr++;
-            }
-        }
-        return { buf, buf+size };
+        std::string ret( end-ptr, '\0' );
+        LowerAscii( ptr, end, ret.data() );
+        return ret;
     }
 }
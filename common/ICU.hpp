@@ -1,9 +1,35 @@
 #ifndef __ICU_HPP__
 #define __ICU_HPP__
 
+#include <stdint.h>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// Splits lines into words, as used by lexicon. Found words are copies kept by the splitter and
+// are valid until the next call. Buffers are reused, so no memory is allocated once they are
+// large enough. Text in scripts other than Latin is passed to ICU, which allocates memory.
+// Each thread needs its own splitter.
+class WordSplitter
+{
+public:
+    const std::vector<std::string_view>& Split( const char* ptr, const char* end, bool toLower = true );
+
+private:
+    void SplitASCII( const char* ptr, const char* end, bool toLower );
+    bool SplitLatin( const char* ptr, const char* end, bool toLower );
+    void SplitICU( const char* ptr, const char* end, bool toLower );
+
+    void AddWord( size_t offset, size_t size );
+
+    std::vector<char> m_text;
+    // Offsets and sizes of words in m_text.
+    std::vector<uint32_t> m_offsets;
+    std::vector<char32_t> m_cp;
+    std::vector<uint32_t> m_cpOffset;
+    std::vector<std::string_view> m_words;
+};
+
 void SplitLine( const char* ptr, const char* end, std::vector<std::string>& out, bool toLower = true );
 std::string ToLower( const char* ptr, const char* end );
 
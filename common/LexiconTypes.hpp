@@ -33,6 +33,17 @@ enum { LexiconHitShift = 30 };
 enum { LexiconHitMask = 0xC0000000 };
 enum { LexiconHitOffsetMask = 0x3FFFFFFF };
 
+// Words present in at least 1/LexiconBitmapDensity of messages also have a bitmap of posts in lexbmp.
+enum { LexiconBitmapDensity = 32 };
+enum : uint32_t { LexiconNoBitmap = 0xFFFFFFFF };
+
+// Postings of words present in at least LexiconRankMinSize messages are also listed in lexrank, in order of
+// decreasing static rank, so that searches for the best results only have to look at the start of the list.
+enum { LexiconRankMinSize = 1024 };
+
+// Number of front-coded words in a lexdict block. First word of each block is stored in full.
+enum { LexiconDictBlock = 16 };
+
 extern const uint8_t LexiconHitTypeEncoding[];
 extern const uint8_t LexiconHitPosMask[];
 
@@ -92,6 +103,31 @@ struct LexiconDataPacket
     uint32_t hitoffset;
 };
 
+// Variable length integers used by lexpos and lexdict.
+// Word positions in lexpos are stored as a varint count followed by varint deltas.
+static inline uint8_t* LexiconEncodeVarInt( uint8_t* out, uint32_t v )
+{
+    while( v >= 0x80 )
+    {
+        *out++ = uint8_t( v ) | 0x80;
+        v >>= 7;
+    }
+    *out++ = uint8_t( v );
+    return out;
+}
+
+static inline const uint8_t* LexiconDecodeVarInt( const uint8_t* in, uint32_t& v )
+{
+    v = *in & 0x7F;
+    int shift = 7;
+    while( *in++ & 0x80 )
+    {
+        v |= uint32_t( *in & 0x7F ) << shift;
+        shift += 7;
+    }
+    return in;
+}
+
 static inline float LexiconHitRank( uint8_t v )
 {
     auto type = LexiconDecodeType( v );
@@ -99,6 +135,13 @@ static inline float LexiconHitRank( uint8_t v )
     return LexiconWeights[type] * ( pos * 0.9f + 0.1f );
 }
 
+// Query independent rank of a posting. Hits have to be sorted by rank. Must match search engine ranking.
+static inline float LexiconPostingRank( uint8_t topHit, uint8_t hitnum, uint8_t children )
+{
+    const float ramp = 1.f + 2.0f * float( hitnum ) / 255;
+    return ( ( float( children ) / LexiconChildMax ) * 0.75f + 0.25f ) * ( LexiconHitRank( topHit ) * ramp );
+}
+
 static inline uint8_t LexiconHitPos( uint8_t v )
 {
     auto type = LexiconDecodeType( v );
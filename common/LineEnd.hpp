@@ -0,0 +1,45 @@
+#ifndef __LINEEND_HPP__
+#define __LINEEND_HPP__
+
+#include <stdint.h>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#  include <intrin.h>
+#endif
+
+// Returns pointer to the first '\n' or '\0' at or after ptr.
+static inline const char* FindLineEnd( const char* ptr )
+{
+#ifdef __SSE2__
+    // Aligned loads do not cross page boundaries, so bytes past the terminator can be read.
+    const auto nl = _mm_set1_epi8( '\n' );
+    const auto zero = _mm_setzero_si128();
+    auto aligned = (const char*)( uintptr_t( ptr ) & ~uintptr_t( 15 ) );
+    auto v = _mm_load_si128( (const __m128i*)aligned );
+    uint32_t mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, nl ), _mm_cmpeq_epi8( v, zero ) ) );
+    mask >>= ptr - aligned;
+    while( mask == 0 )
+    {
+        aligned += 16;
+        v = _mm_load_si128( (const __m128i*)aligned );
+        mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, nl ), _mm_cmpeq_epi8( v, zero ) ) );
+        ptr = aligned;
+    }
+#  ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward( &idx, mask );
+    return ptr + idx;
+#  else
+    return ptr + __builtin_ctz( mask );
+#  endif
+#else
+    while( *ptr != '\n' && *ptr != '\0' ) ptr++;
+    return ptr;
+#endif
+}
+
+#endif
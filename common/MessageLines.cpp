@@ -2,6 +2,7 @@
 #include <limits>
 #include <string.h>
 
+#include "LineEnd.hpp"
 #include "MessageLines.hpp"
 #include "MessageLogic.hpp"
 #include "String.hpp"
@@ -21,62 +22,71 @@ void MessageLines::PrepareLines( const char* text, bool skipHeaders )
     m_lines.clear();
 
     auto txt = text;
-    bool headers = true;
-    bool sig = false;
+    bool body = false;
     for(;;)
     {
-        auto end = txt;
-        while( *end != '\n' && *end != '\0' ) end++;
+        auto end = FindLineEnd( txt );
         const auto len = std::min<uint32_t>( end - txt, ( 1 << LenBits ) - 1 );
         const auto offset = uint32_t( txt - text );
         if( offset >= ( 1 << OffsetBits ) ) return;
-        if( headers )
+        if( len == 0 )
         {
-            if( len == 0 )
+            AddEmptyLine();
+            body = true;
+            while( *end == '\n' ) end++;
+            end--;
+            txt = end + 1;
+            break;
+        }
+        else
+        {
+            const bool essentialHeader =
+                strnicmpl( txt, "from: ", 6 ) == 0 ||
+                strnicmpl( txt, "newsgroups: ", 12 ) == 0 ||
+                strnicmpl( txt, "subject: ", 9 ) == 0 ||
+                strnicmpl( txt, "date: ", 6 ) == 0 ||
+                strnicmpl( txt, "to: ", 3 ) == 0;
+            if( !skipHeaders || essentialHeader )
             {
-                AddEmptyLine();
-                headers = false;
-                while( *end == '\n' ) end++;
-                end--;
-            }
-            else
-            {
-                const bool essentialHeader =
-                    strnicmpl( txt, "from: ", 6 ) == 0 ||
-                    strnicmpl( txt, "newsgroups: ", 12 ) == 0 ||
-                    strnicmpl( txt, "subject: ", 9 ) == 0 ||
-                    strnicmpl( txt, "date: ", 6 ) == 0 ||
-                    strnicmpl( txt, "to: ", 3 ) == 0;
-                if( !skipHeaders || essentialHeader )
-                {
-                    BreakLine( offset, len, LineType::Header, m_tmpParts, text, essentialHeader );
-                }
+                BreakLine( offset, len, LineType::Header, 0, m_tmpParts, text, essentialHeader );
             }
         }
-        else
+        if( *end == '\0' ) break;
+        txt = end + 1;
+    }
+
+    if( body )
+    {
+        m_body.Parse( txt );
+        const auto& lines = m_body.Lines();
+        const auto base = uint32_t( txt - text );
+        bool sig = false;
+        for( auto& line : lines )
         {
+            const auto len = std::min<uint32_t>( line.len, ( 1 << LenBits ) - 1 );
+            const auto offset = base + line.offset;
+            if( offset >= ( 1 << OffsetBits ) ) return;
             if( len == 0 )
             {
                 AddEmptyLine();
             }
             else
             {
-                if( strncmp( "-- \n", txt, 4 ) == 0 )
+                // Signature separator must be followed by a newline.
+                if( ( line.flags & BodyLines::F_SignatureMark ) && &line != &lines.back() )
                 {
                     sig = true;
                 }
                 if( sig )
                 {
-                    BreakLine( offset, len, LineType::Signature, m_tmpParts, text, false );
+                    BreakLine( offset, len, LineType::Signature, 0, m_tmpParts, text, false );
                 }
                 else
                 {
-                    BreakLine( offset, len, LineType::Body, m_tmpParts, text, false );
+                    BreakLine( offset, len, LineType::Body, line.level, m_tmpParts, text, false );
                 }
             }
         }
-        if( *end == '\0' ) break;
-        txt = end + 1;
     }
     while( !m_lines.empty() && m_lines.back().parts == 0 ) m_lines.pop_back();
     m_tmpParts.clear();
@@ -93,7 +103,7 @@ void MessageLines::AddEmptyLine()
     m_lines.emplace_back( Line { 0, 0 } );
 }
 
-void MessageLines::BreakLine( uint32_t offset, uint32_t len, LineType type, std::vector<LinePart>& parts, const char* text, bool essential )
+void MessageLines::BreakLine( uint32_t offset, uint32_t len, LineType type, int level, std::vector<LinePart>& parts, const char* text, bool essential )
 {
     assert( len != 0 );
 
@@ -105,7 +115,7 @@ void MessageLines::BreakLine( uint32_t offset, uint32_t len, LineType type, std:
         SplitHeader( offset, len, parts, text );
         break;
     case LineType::Body:
-        SplitBody( offset, len, parts, text );
+        SplitBody( offset, len, level, parts, text );
         break;
     case LineType::Signature:
         SplitSignature( offset, len, parts, text );
@@ -250,12 +260,12 @@ static int FindUrl( const char*& start, const char* end )
     }
 }
 
-void MessageLines::SplitBody( uint32_t offset, uint32_t len, std::vector<LinePart>& parts, const char* text )
+void MessageLines::SplitBody( uint32_t offset, uint32_t len, int quotLevel, std::vector<LinePart>& parts, const char* text )
 {
     auto str = text + offset;
     const auto end = str + len;
     auto test = str;
-    const int level = std::min( QuotationLevel( test, end ), 5 );
+    const int level = std::min( quotLevel, 5 );
 
     for( int i=0; i<level; i++ )
     {
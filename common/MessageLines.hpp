@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <vector>
 
+#include "BodyLines.hpp"
+
 class MessageLines
 {
 public:
@@ -68,15 +70,16 @@ public:
 
 private:
     void AddEmptyLine();
-    void BreakLine( uint32_t offset, uint32_t len, LineType type, std::vector<LinePart>& partsTmpBuf, const char* text, bool essential );
+    void BreakLine( uint32_t offset, uint32_t len, LineType type, int level, std::vector<LinePart>& partsTmpBuf, const char* text, bool essential );
     void SplitHeader( uint32_t offset, uint32_t len, std::vector<LinePart>& parts, const char* text );
-    void SplitBody( uint32_t offset, uint32_t len, std::vector<LinePart>& parts, const char* text );
+    void SplitBody( uint32_t offset, uint32_t len, int quotLevel, std::vector<LinePart>& parts, const char* text );
     void SplitSignature( uint32_t offset, uint32_t len, std::vector<LinePart>& parts, const char* text );
     void Decorate( const char* begin, const char* end, uint64_t flags, std::vector<LinePart>& parts, const char* text );
 
     std::vector<LinePart> m_lineParts;
     std::vector<Line> m_lines;
     std::vector<LinePart> m_tmpParts;
+    BodyLines m_body;
     int m_width;
 
     static_assert( sizeof( LinePart ) == sizeof( uint64_t ), "Size of LinePart greater than 8 bytes." );
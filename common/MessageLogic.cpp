@@ -61,26 +61,6 @@ const char* NextQuotationLevel( const char* ptr )
     }
 }
 
-const char* FindOptionalHeader( const char* msg, const char* header, int hlen )
-{
-    while( strnicmpl( msg, header, hlen ) != 0 && *msg != '\n' )
-    {
-        msg++;
-        while( *msg++ != '\n' ) {}
-    }
-    return msg;
-}
-
-const char* FindHeader( const char* msg, const char* header, int hlen )
-{
-    while( strnicmpl( msg, header, hlen ) != 0 )
-    {
-        msg++;
-        while( *msg++ != '\n' ) {}
-    }
-    return msg;
-}
-
 // Note that this function doesn't perform strict validation. Many message-ids are broken,
 // for example containing forbidden space character. UAT can handle that.
 bool IsMsgId( const char* begin, const char* end )
@@ -105,97 +85,3 @@ bool IsMsgId( const char* begin, const char* end )
     }
     return a == 1 && u > 0 && h > 0;
 }
-
-// Returns number of lines in "wrote" context
-int DetectWrote( const char* ptr )
-{
-    // First line must be T_Content
-    while( *ptr == '\n' || *ptr == ' ' || *ptr == '\t' ) ptr++;
-    auto end = ptr;
-    while( *end != '\n' && *end != '\0' ) end++;
-    if( *end == '\0' ) return 0;
-    if( end - ptr == 3 && strncmp( ptr, "-- ", 3 ) == 0 ) return 0;
-    if( QuotationLevel( ptr, end ) != 0 ) return 0;
-
-    // If second line is T_Quote -> wrote context
-    while( *end == '\n' || *end == ' ' || *end == '\t' ) end++;
-    ptr = end;
-    while( *end != '\n' && *end != '\0' ) end++;
-    if( *end == '\0' ) return 0;
-    if( QuotationLevel( ptr, end ) != 0 ) return 1;
-
-    // Check for typical "wrote:" markers
-    auto e = end - 1;
-    while( e > ptr && ( *e == ' ' || *e == '\t' ) ) e--;
-    e++;
-    if( e - ptr >= 1 )
-    {
-        if( *(e-1) == ':' ) goto found;     // "something something wrote:"
-    }
-    if( e - ptr >= 2 )
-    {
-        if( *ptr == '[' && *(e-1) == ']' ) goto found;      // "[cut content]"
-        if( *ptr == '<' && *(e-1) == '>' ) goto found;      // "<cut content>"
-    }
-    if( e - ptr >= 3 )
-    {
-        if( strncmp( e - 3, "...", 3 ) == 0 ) goto found;   // "something something wrote..."
-    }
-    return 0;
-
-found:
-    // But only if next line is T_Quote
-    while( *end == '\n' || *end == ' ' || *end == '\t' ) end++;
-    ptr = end;
-    while( *end != '\n' && *end != '\0' ) end++;
-    if( *end == '\0' ) return 0;
-    if( QuotationLevel( ptr, end ) != 0 ) return 2;
-    return 0;
-}
-
-const char* DetectWroteEnd( const char* ptr, int baseLevel )
-{
-    const char* orig = ptr;
-
-    // First line must be baseLevel
-    while( *ptr == '\n' || *ptr == ' ' || *ptr == '\t' ) ptr++;
-    auto end = ptr;
-    while( *end != '\n' && *end != '\0' ) end++;
-    if( *end == '\0' ) return orig;
-    if( QuotationLevel( ptr, end ) != baseLevel ) return orig;
-
-    // If second line is baseLevel+1 -> wrote context
-    while( *end == '\n' || *end == ' ' || *end == '\t' ) end++;
-    ptr = end;
-    while( *end != '\n' && *end != '\0' ) end++;
-    if( *end == '\0' ) return orig;
-    if( QuotationLevel( ptr, end ) == baseLevel+1 ) return ptr;
-
-    // Check for typical "wrote:" markers
-    auto e = end - 1;
-    while( e > ptr && ( *e == ' ' || *e == '\t' ) ) e--;
-    e++;
-    if( e - ptr >= 1 )
-    {
-        if( *(e-1) == ':' ) goto found;     // "something something wrote:"
-    }
-    if( e - ptr >= 2 )
-    {
-        if( *ptr == '[' && *(e-1) == ']' ) goto found;      // "[cut content]"
-        if( *ptr == '<' && *(e-1) == '>' ) goto found;      // "<cut content>"
-    }
-    if( e - ptr >= 3 )
-    {
-        if( strncmp( e - 3, "...", 3 ) == 0 ) goto found;   // "something something wrote..."
-    }
-    return orig;
-
-found:
-    // But only if next line is baseLevel+1
-    while( *end == '\n' || *end == ' ' || *end == '\t' ) end++;
-    ptr = end;
-    while( *end != '\n' && *end != '\0' ) end++;
-    if( *end == '\0' ) return orig;
-    if( QuotationLevel( ptr, end ) == baseLevel+1 ) return ptr;
-    return orig;
-}
@@ -34,7 +34,17 @@ static const PackMeta PackageContents[] = {
     { "lexdist", true },
     { "lexdistmeta", true },
     { "prefix", true },
-    { "msgid.codebook", false }
+    { "msgid.codebook", false },
+    { "lexpos", true },
+    { "lexposmeta", true },
+    { "lexdict", true },
+    { "lexdictmeta", true },
+    { "lexhdr", true },
+    { "lexhdrmeta", true },
+    { "lexbmp", true },
+    { "lexbmpmeta", true },
+    { "lexrank", true },
+    { "lexrankmeta", true }
 };
 
 struct PackageFile
@@ -65,6 +75,16 @@ struct PackageFile
         lexdistmeta,
         prefix,
         codebook,
+        lexpos,
+        lexposmeta,
+        lexdict,
+        lexdictmeta,
+        lexhdr,
+        lexhdrmeta,
+        lexbmp,
+        lexbmpmeta,
+        lexrank,
+        lexrankmeta,
         NUM_PACKAGE_FILE_TYPES
     };
 };
@@ -73,12 +93,33 @@ enum { PackageFiles = sizeof( PackageContents ) / sizeof( PackMeta ) };
 enum { AdditionalFilesV1 = 2 };
 enum { AdditionalFilesV2 = 1 };
 enum { AdditionalFilesV3 = 1 };
+enum { AdditionalFilesV4 = 2 };
+enum { AdditionalFilesV5 = 2 };
+enum { AdditionalFilesV6 = 2 };
+enum { AdditionalFilesV7 = 2 };
+enum { AdditionalFilesV8 = 2 };
 
-enum : char { PackageVersion = 3 };
+enum : char { PackageVersion = 8 };
+// Oldest package version readable by libuat. Files added in later versions are optional.
+enum : char { PackageMinVersion = 3 };
 enum { PackageHeaderSize = 8 };
 enum { PackageMagicSize = PackageHeaderSize - 1 };
 static const char PackageHeader[PackageHeaderSize] = { '\0', 'U', 's', 'e', 'n', 'e', 't', PackageVersion };
 
+static inline int PackageFilesInVersion( int version )
+{
+    int numfiles = PackageFiles;
+    if( version < 8 ) numfiles -= AdditionalFilesV8;
+    if( version < 7 ) numfiles -= AdditionalFilesV7;
+    if( version < 6 ) numfiles -= AdditionalFilesV6;
+    if( version < 5 ) numfiles -= AdditionalFilesV5;
+    if( version < 4 ) numfiles -= AdditionalFilesV4;
+    if( version < 3 ) numfiles -= AdditionalFilesV3;
+    if( version < 2 ) numfiles -= AdditionalFilesV2;
+    if( version < 1 ) numfiles -= AdditionalFilesV1;
+    return numfiles;
+}
+
 static inline uint64_t PackageAlign( uint64_t offset ) { return ( ( offset + 7 ) / 8 ) * 8; }
 
 
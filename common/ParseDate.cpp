@@ -1,12 +1,12 @@
 #include <algorithm>
 #include <assert.h>
 #include <limits>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "MessageLogic.hpp"
+#include "HeaderIndex.hpp"
 #include "ParseDate.hpp"
-#include "String.hpp"
 
 extern "C" { time_t parsedate_rfc5322_lax(const char *date); }
 
@@ -19,31 +19,25 @@ struct TimeGroup
 };
 
 
-time_t ParseDate( const char* post, ParseDateStats& stats, std::vector<const char*>& cache )
+time_t ParseDate( const HeaderIndex& hdr, ParseDateStats& stats, std::vector<const char*>& cache )
 {
     char tmp[1024];
 
     cache.clear();
-    auto buf = post;
 
-    while( *buf != '\n' )
-    {
-        if( strnicmpl( buf, "received: ", 10 ) == 0 )
+    hdr.ForEach( "received: ", 10, [&cache] ( const char* buf ) {
+        buf += 10;
+        while( *buf != ';' && *buf != '\n' ) buf++;
+        if( *buf == ';' )
         {
-            buf += 10;
-            while( *buf != ';' && *buf != '\n' ) buf++;
-            if( *buf == ';' )
-            {
-                buf++;
-                while( *buf == ' ' || *buf == '\t' ) buf++;
-                cache.emplace_back( buf );
-            }
+            buf++;
+            while( *buf == ' ' || *buf == '\t' ) buf++;
+            cache.emplace_back( buf );
         }
-        while( *buf++ != '\n' ) {}
-    }
+    } );
 
-    buf = FindOptionalHeader( post, "nntp-posting-date: ", 19 );
-    if( *buf != '\n' )
+    auto buf = hdr.Find( "nntp-posting-date: ", 19 );
+    if( buf )
     {
         buf += 19;
         if( *buf != '\n' )
@@ -51,8 +45,8 @@ time_t ParseDate( const char* post, ParseDateStats& stats, std::vector<const cha
             cache.emplace_back( buf );
         }
     }
-    buf = FindOptionalHeader( post, "injection-date: ", 16 );
-    if( *buf != '\n' )
+    buf = hdr.Find( "injection-date: ", 16 );
+    if( buf )
     {
         buf += 16;
         if( *buf != '\n' )
@@ -125,12 +119,12 @@ time_t ParseDate( const char* post, ParseDateStats& stats, std::vector<const cha
     }
 
     time_t date = -1;
-    buf = FindOptionalHeader( post, "date: ", 6 );
-    if( *buf == '\n' )
+    buf = hdr.Find( "date: ", 6 );
+    if( !buf )
     {
-        buf = FindOptionalHeader( post, "date:\t", 6 );
+        buf = hdr.Find( "date:\t", 6 );
     }
-    if( *buf != '\n' )
+    if( buf )
     {
         buf += 6;
         auto end = buf;
@@ -154,7 +148,7 @@ time_t ParseDate( const char* post, ParseDateStats& stats, std::vector<const cha
         if( recvdate == -1 )
         {
             struct tm tm = {};
-            if( sscanf( buf, "%d/%d/%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday ) == 3 )
+            if( buf && sscanf( buf, "%d/%d/%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday ) == 3 )
             {
                 if( tm.tm_year >= 1970 && tm.tm_mon <= 12 && tm.tm_mday <= 31 )
                 {
@@ -5,6 +5,8 @@
 #include <time.h>
 #include <vector>
 
+class HeaderIndex;
+
 struct ParseDateStats
 {
     uint32_t baddate;
@@ -12,6 +14,6 @@ struct ParseDateStats
     uint32_t timetravel;
 };
 
-time_t ParseDate( const char* post, ParseDateStats& stats, std::vector<const char*>& cache );
+time_t ParseDate( const HeaderIndex& hdr, ParseDateStats& stats, std::vector<const char*>& cache );
 
 #endif
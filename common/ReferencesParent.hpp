@@ -5,16 +5,18 @@
 #include <string>
 #include <vector>
 
+#include "HeaderIndex.hpp"
 #include "MessageLogic.hpp"
 #include "StringCompress.hpp"
 
-inline const char* FindReferences( const char* msg )
+// Returns pointer to references, or nullptr if there are none.
+inline const char* FindReferences( const HeaderIndex& hdr )
 {
-    auto buf = FindOptionalHeader( msg, "references: ", 12 );
-    if( *buf != '\n' ) return buf + 12;
-    buf = FindOptionalHeader( msg, "in-reply-to: ", 13 );
-    if( *buf != '\n' ) return buf + 13;
-    return buf;
+    auto buf = hdr.Find( "references: ", 12 );
+    if( buf ) return buf + 12;
+    buf = hdr.Find( "in-reply-to: ", 13 );
+    if( buf ) return buf + 13;
+    return nullptr;
 }
 
 inline bool ValidateMsgId( const char* begin, const char* end, char* dst )
@@ -40,10 +42,10 @@ inline bool ValidateMsgId( const char* begin, const char* end, char* dst )
 //  -1 indicates no parent
 //  -2 indicates broken, unrecoverable reference information
 template<class Search>
-inline int GetParentFromReferences( const char* post, const StringCompress& compress, const Search& hash, char* tmp )
+inline int GetParentFromReferences( const HeaderIndex& hdr, const StringCompress& compress, const Search& hash, char* tmp )
 {
-    auto buf = FindReferences( post );
-    if( *buf == '\n' ) return -1;
+    auto buf = FindReferences( hdr );
+    if( !buf ) return -1;
 
     const auto terminate = buf;
     while( *buf != '\n' ) buf++;
@@ -87,12 +89,12 @@ inline int GetParentFromReferences( const char* post, const StringCompress& comp
     }
 }
 
-std::vector<std::string> GetAllReferences( const char* post, const StringCompress& compress )
+std::vector<std::string> GetAllReferences( const HeaderIndex& hdr, const StringCompress& compress )
 {
     std::vector<std::string> ret;
 
-    auto buf = FindReferences( post );
-    if( *buf == '\n' ) return ret;
+    auto buf = FindReferences( hdr );
+    if( !buf ) return ret;
 
     const auto terminate = buf;
     while( *buf != '\n' ) buf++;
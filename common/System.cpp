@@ -1,8 +1,10 @@
 #include <algorithm>
 #ifdef _WIN32
 #  include <windows.h>
+#  include <psapi.h>
 #else
 #  include <pthread.h>
+#  include <sys/resource.h>
 #  include <unistd.h>
 #endif
 
@@ -66,3 +68,37 @@ void System::SetThreadName( std::thread& thread, const char* name )
     pthread_setname_np( thread.native_handle(), name );
 #endif
 }
+
+void System::PageFaults( uint64_t& minor, uint64_t& major )
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    minor = GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) ) ? pmc.PageFaultCount : 0;
+    major = 0;
+#else
+    struct rusage usage;
+#  ifdef RUSAGE_THREAD
+    getrusage( RUSAGE_THREAD, &usage );
+#  else
+    getrusage( RUSAGE_SELF, &usage );
+#  endif
+    minor = usage.ru_minflt;
+    major = usage.ru_majflt;
+#endif
+}
+
+uint64_t System::PeakMemoryUsage()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    return GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) ) ? pmc.PeakWorkingSetSize : 0;
+#else
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+#  ifdef __APPLE__
+    return usage.ru_maxrss;
+#  else
+    return uint64_t( usage.ru_maxrss ) * 1024;
+#  endif
+#endif
+}
@@ -1,6 +1,7 @@
 #ifndef __DARKRL__SYSTEM_HPP__
 #define __DARKRL__SYSTEM_HPP__
 
+#include <stdint.h>
 #include <thread>
 
 class System
@@ -10,6 +11,10 @@ public:
 
     static unsigned int CPUCores();
     static void SetThreadName( std::thread& thread, const char* name );
+    // Page faults of the calling thread, where supported. Otherwise of the whole process.
+    static void PageFaults( uint64_t& minor, uint64_t& major );
+    // Peak resident memory of the process, in bytes.
+    static uint64_t PeakMemoryUsage();
 };
 
 #endif
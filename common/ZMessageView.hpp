@@ -2,8 +2,10 @@
 #define __ZMESSAGEVIEW_HPP__
 
 #include <assert.h>
+#include <mutex>
 #include <stdlib.h>
 #include <string>
+#include <vector>
 
 #define ZSTD_STATIC_LINKING_ONLY
 #include "../contrib/zstd/zstd.h"
@@ -19,7 +21,7 @@ public:
         : m_meta( meta )
         , m_data( data )
         , m_dictdata( dict )
-        , m_ctx( nullptr )
+        , m_dict( nullptr )
     {
     }
 
@@ -27,26 +29,26 @@ public:
         : m_meta( meta )
         , m_data( data )
         , m_dictdata( dict )
-        , m_ctx( nullptr )
+        , m_dict( nullptr )
     {
     }
 
     ~ZMessageView()
     {
-        if( m_ctx )
-        {
-            ZSTD_freeDCtx( m_ctx );
-            ZSTD_freeDDict( m_dict );
-        }
+        for( auto& v : m_ctx ) ZSTD_freeDCtx( v );
+        if( m_dict ) ZSTD_freeDDict( m_dict );
     }
 
-    const char* GetMessage( const size_t idx, ExpandingBuffer& eb )
+    // May be called from many threads at once. Each thread has to use its own buffer.
+    const char* GetMessage( const size_t idx, ExpandingBuffer& eb ) const
     {
-        if( !m_ctx ) InitZstd();
+        std::call_once( m_dictInit, [this] { m_dict = ZSTD_createDDict_byReference( m_dictdata, m_dictdata.Size() ); } );
         assert( idx < m_meta.Size() );
         const auto meta = m_meta[idx];
         auto buf = eb.Request( meta.size + 1 );
-        const auto dec = ZSTD_decompress_usingDDict( m_ctx, buf, meta.size, m_data + meta.offset, meta.compressedSize, m_dict );
+        auto ctx = AcquireContext();
+        const auto dec = ZSTD_decompress_usingDDict( ctx, buf, meta.size, m_data + meta.offset, meta.compressedSize, m_dict );
+        ReleaseContext( ctx );
         assert( dec == meta.size );
         buf[meta.size] = '\0';
         return buf;
@@ -83,19 +85,37 @@ public:
     }
 
 private:
-    void InitZstd()
+    // Decompression contexts cannot be shared by threads. Idle ones are kept for reuse, so that there are never
+    // more of them than concurrent decompressions.
+    ZSTD_DCtx* AcquireContext() const
+    {
+        {
+            std::lock_guard<std::mutex> lock( m_ctxLock );
+            if( !m_ctx.empty() )
+            {
+                auto ctx = m_ctx.back();
+                m_ctx.pop_back();
+                return ctx;
+            }
+        }
+        return ZSTD_createDCtx();
+    }
+
+    void ReleaseContext( ZSTD_DCtx* ctx ) const
     {
-        assert( !m_ctx );
-        m_ctx = ZSTD_createDCtx();
-        m_dict = ZSTD_createDDict_byReference( m_dictdata, m_dictdata.Size() );
+        std::lock_guard<std::mutex> lock( m_ctxLock );
+        m_ctx.emplace_back( ctx );
     }
 
     const FileMap<RawImportMeta> m_meta;
     const FileMap<char> m_data;
     const FileMap<char> m_dictdata;
 
-    ZSTD_DCtx* m_ctx;
-    ZSTD_DDict* m_dict;
+    // The dictionary is read-only and shared by all decompressions.
+    mutable ZSTD_DDict* m_dict;
+    mutable std::once_flag m_dictInit;
+    mutable std::vector<ZSTD_DCtx*> m_ctx;
+    mutable std::mutex m_ctxLock;
 };
 
 #endif
@@ -25,6 +25,14 @@ void* mmap( void* addr, size_t length, int prot, int flags, int fd, off_t offset
             CloseHandle( hnd );
         }
         break;
+    case PROT_READ | PROT_WRITE:
+        // only used with MAP_PRIVATE
+        if( hnd = CreateFileMapping( HANDLE( _get_osfhandle( fd ) ), nullptr, PAGE_WRITECOPY, 0, 0, nullptr ) )
+        {
+            map = MapViewOfFile( hnd, FILE_MAP_COPY, 0, 0, length );
+            CloseHandle( hnd );
+        }
+        break;
     }
 
     return map ? (char*)map + offset : (void*)-1;
@@ -10,6 +10,7 @@
 #  define PROT_READ 1
 #  define PROT_WRITE 2
 #  define MAP_SHARED 0
+#  define MAP_PRIVATE 1
 
 void* mmap( void* addr, size_t length, int prot, int flags, int fd, off_t offset );
 int munmap( void* addr, size_t length );
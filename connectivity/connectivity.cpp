@@ -13,6 +13,7 @@
 #include "../contrib/martinus/robin_hood.h"
 #include "../common/Filesystem.hpp"
 #include "../common/HashSearch.hpp"
+#include "../common/HeaderIndex.hpp"
 #include "../common/MessageView.hpp"
 #include "../common/ParseDate.hpp"
 #include "../common/ReferencesParent.hpp"
@@ -60,6 +61,11 @@ int main( int argc, char** argv )
     std::vector<uint32_t> toplevel;
     auto data = new Message[size];
 
+    // Headers are indexed once per message, for both references and timestamps.
+    HeaderIndex hdr;
+    std::vector<const char*> cache;
+    ParseDateStats stats = {};
+
     for( uint32_t i=0; i<size; i++ )
     {
         if( ( i & 0xFFF ) == 0 )
@@ -68,10 +74,11 @@ int main( int argc, char** argv )
             fflush( stdout );
         }
 
-        auto post = mview[i];
+        hdr.Parse( mview[i] );
+        data[i].epoch = ParseDate( hdr, stats, cache );
 
         char tmp[1024];
-        auto parent = GetParentFromReferences( post, compress, hash, tmp );
+        auto parent = GetParentFromReferences( hdr, compress, hash, tmp );
         if( parent == -2 )
         {
             broken++;
@@ -87,21 +94,6 @@ int main( int argc, char** argv )
         }
     }
 
-    printf( "\nRetrieving timestamps...\n" );
-    fflush( stdout );
-
-    std::vector<const char*> cache;
-    ParseDateStats stats = {};
-    for( uint32_t i=0; i<size; i++ )
-    {
-        if( ( i & 0xFFF ) == 0 )
-        {
-            printf( "%i/%zu\r", i, size );
-            fflush( stdout );
-        }
-        data[i].epoch = ParseDate( mview[i], stats, cache );
-    }
-
     unsigned int loopcnt = 0;
     robin_hood::unordered_flat_set<uint32_t> visited;
     printf( "\nFixing loops...\n" );
@@ -14,6 +14,7 @@
 #include <vector>
 
 #include "../contrib/xxhash/xxhash.h"
+#include "../common/HeaderIndex.hpp"
 #include "../common/MessageLogic.hpp"
 #include "../common/MessageView.hpp"
 #include "../common/MsgIdHash.hpp"
@@ -54,6 +55,7 @@ int main( int argc, char** argv )
 
     Slab<32*1024*1024> slab;
     ExpandingBuffer eb;
+    HeaderIndex hdr;
     for( uint32_t i=0; i<size; i++ )
     {
         if( ( i & 0x1FFF ) == 0 )
@@ -62,14 +64,14 @@ int main( int argc, char** argv )
             fflush( stdout );
         }
 
-        auto post = mview[i];
-        auto buf = FindOptionalHeader( post, "message-id: ", 12 );
-        if( *buf == '\n' )
+        hdr.Parse( mview[i] );
+        auto buf = hdr.Find( "message-id: ", 12 );
+        if( !buf )
         {
-            buf = FindOptionalHeader( post, "message-id:\t", 12 );
+            buf = hdr.Find( "message-id:\t", 12 );
         }
         const char* end;
-        if( *buf != '\n' )
+        if( buf )
         {
             buf += 12;
             end = buf;
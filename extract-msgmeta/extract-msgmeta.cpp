@@ -10,6 +10,7 @@
 
 #include "../contrib/martinus/robin_hood.h"
 #include "../common/CharUtil.hpp"
+#include "../common/HeaderIndex.hpp"
 #include "../common/MessageView.hpp"
 #include "../common/String.hpp"
 
@@ -43,6 +44,7 @@ int main( int argc, char** argv )
 
     robin_hood::unordered_flat_map<std::string, uint32_t> refs;
 
+    HeaderIndex hdr;
     for( uint32_t i=0; i<size; i++ )
     {
         if( ( i & 0x1FFF ) == 0 )
@@ -51,44 +53,20 @@ int main( int argc, char** argv )
             fflush( stdout );
         }
 
-        auto post = mview[i];
-        auto buf = post;
-
-        bool fdone = false;
-        bool sdone = false;
-        const char* fptr;
-        const char* sptr;
-        while( !fdone || !sdone )
+        hdr.Parse( mview[i] );
+        auto fptr = hdr.Find( "from: ", 6 );
+        assert( fptr );
+        fptr += 6;
+        auto sptr = hdr.Find( "subject: ", 9 );
+        if( sptr )
         {
-            bool skip = false;
-            if( !fdone )
-            {
-                if( strnicmpl( buf, "from: ", 6 ) == 0 )
-                {
-                    buf += 6;
-                    fptr = buf;
-                    skip = true;
-                    fdone = true;
-                }
-            }
-            if( !sdone && !skip )
-            {
-                if( strnicmpl( buf, "subject: ", 9 ) == 0 )
-                {
-                    buf += 9;
-                    sptr = *buf != '\n' ? buf : EmptySubject;
-                    sdone = true;
-                }
-            }
-            while( *buf++ != '\n' ) {};
-            if( *buf == '\n' ) break;
+            sptr += 9;
+            if( *sptr == '\n' ) sptr = EmptySubject;
         }
-
-        if( !sdone )
+        else
         {
             sptr = EmptySubject;
         }
-        assert( fdone );
 
         auto fend = fptr;
         while( *++fend != '\n' ) {};
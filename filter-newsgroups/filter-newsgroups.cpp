@@ -11,10 +11,10 @@
 
 #include "../common/ExpandingBuffer.hpp"
 #include "../common/Filesystem.hpp"
+#include "../common/HeaderIndex.hpp"
 #include "../common/MetaView.hpp"
 #include "../common/MessageView.hpp"
 #include "../common/RawImportMeta.hpp"
-#include "../common/String.hpp"
 
 int main( int argc, char** argv )
 {
@@ -58,6 +58,7 @@ int main( int argc, char** argv )
     uint32_t cntgood = 0;
     uint64_t savec = 0, saveu = 0;
     uint64_t offset = 0;
+    HeaderIndex hdr;
     for( uint32_t i=0; i<size; i++ )
     {
         if( ( i & 0x3FF ) == 0 )
@@ -76,15 +77,9 @@ int main( int argc, char** argv )
             continue;
         }
 
-        auto post = mview[i];
-        auto buf = post;
-
-        while( strnicmpl( buf, "newsgroups: ", 12 ) != 0 && buf - post < raw.size )
-        {
-            buf++;
-            while( *buf++ != '\n' && buf - post < raw.size ) {}
-        }
-        if( buf - post >= raw.size ) continue;
+        hdr.Parse( mview[i] );
+        auto buf = hdr.Find( "newsgroups: ", 12 );
+        if( !buf ) continue;
         buf += 12;
         auto end = buf;
         bool good = false;
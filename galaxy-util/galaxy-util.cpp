@@ -360,6 +360,7 @@ int main( int argc, char** argv )
         FILE* data = fopen( ( base + "midgr" ).c_str(), "wb" );
         FILE* meta = fopen( ( base + "midgr.meta" ).c_str(), "wb" );
         ExpandingBuffer eb;
+        HeaderIndex hdr;
         for( int i=0; i<unique; i++ )
         {
             if( ( i & 0x3FF ) == 0 )
@@ -387,8 +388,8 @@ int main( int argc, char** argv )
             if( refarch->GetParent( idx ) == -1 )
             {
                 char tmp[1024];
-                auto post = refarch->GetMessage( idx, eb );
-                auto parent = GetParentFromReferences( post, *compress, midhash, tmp );
+                hdr.Parse( refarch->GetMessage( idx, eb ) );
+                auto parent = GetParentFromReferences( hdr, *compress, midhash, tmp );
                 if( parent >= 0 )
                 {
                     bool ok = true;
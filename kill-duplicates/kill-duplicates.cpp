@@ -11,6 +11,7 @@
 #include "../contrib/martinus/robin_hood.h"
 #include "../common/ExpandingBuffer.hpp"
 #include "../common/Filesystem.hpp"
+#include "../common/HeaderIndex.hpp"
 #include "../common/MessageLogic.hpp"
 #include "../common/MessageView.hpp"
 #include "../common/RawImportMeta.hpp"
@@ -65,6 +66,7 @@ int main( int argc, char** argv )
     uint32_t cntb = 0;
     robin_hood::unordered_flat_set<std::string> unique;
     uint64_t offset = 0;
+    HeaderIndex hdr;
     for( uint32_t i=0; i<size; i++ )
     {
         if( ( i & 0x3FF ) == 0 )
@@ -73,13 +75,13 @@ int main( int argc, char** argv )
             fflush( stdout );
         }
 
-        auto post = mview[i];
-        auto buf = FindOptionalHeader( post, "message-id: ", 12 );
-        if( *buf == '\n' )
+        hdr.Parse( mview[i] );
+        auto buf = hdr.Find( "message-id: ", 12 );
+        if( !buf )
         {
-            buf = FindOptionalHeader( post, "message-id:\t", 12 );
+            buf = hdr.Find( "message-id:\t", 12 );
         }
-        if( *buf != '\n' )
+        if( buf )
         {
             buf += 12;
             auto end = buf;
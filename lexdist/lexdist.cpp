@@ -4,6 +4,7 @@
 #include <codecvt>
 #include <locale>
 #include <math.h>
+#include <memory>
 #include <mutex>
 #include <stdint.h>
 #include <stdio.h>
@@ -12,13 +13,23 @@
 #include <string.h>
 #include <vector>
 
+#include "../common/Checkpoint.hpp"
 #include "../common/FileMap.hpp"
+#include "../common/Filesystem.hpp"
+#include "../common/HashSearch.hpp"
 #include "../common/LexiconTypes.hpp"
 #include "../common/System.hpp"
 #include "../common/TaskDispatch.hpp"
+#include "../contrib/xxhash/xxhash.h"
 
-#ifdef __AVX512F__
+#if defined __x86_64__ || defined __i386__ || defined _M_X64 || defined _M_IX86
+#  define X86_SIMD
 #  include <immintrin.h>
+#  ifdef _MSC_VER
+#    define TARGET( x )
+#  else
+#    define TARGET( x ) __attribute__((target( x )))
+#  endif
 #endif
 
 #ifdef _MSC_VER
@@ -54,30 +65,73 @@ static size_t utflen( const char* str )
     return ret;
 }
 
-// https://en.wikibooks.org/wiki/Algorithm_Implementation/Strings/Levenshtein_distance#C.2B.2B
-static int levenshtein_distance( const char32_t* s1, const unsigned int len1, const char32_t* s2, const unsigned int len2, int threshold )
+// Word for which similar words are searched. Unused positions never match any code point.
+struct Pattern
 {
-    // max word length generated in lexicon is 13 letters
-    static thread_local int _col[16], _prevCol[16];
-    int *col = _col, *prevCol = _prevCol;
+    Pattern( const char32_t* str, unsigned int len )
+        : len( len )
+    {
+        assert( len <= 16 );
+        char32_t chr[16];
+        for( unsigned int i=0; i<16; i++ ) chr[i] = i < len ? str[i] : 0xFFFFFFFF;
+#ifdef __SSE2__
+        for( int i=0; i<4; i++ ) v[i] = _mm_loadu_si128( (const __m128i*)( chr + i*4 ) );
+#else
+        memcpy( this->chr, chr, sizeof( chr ) );
+#endif
+    }
 
-    for( unsigned int i = 0; i < len2+1; i++ )
+    // Returns bit mask of word positions containing code point c.
+    uint32_t Match( char32_t c ) const
     {
-        prevCol[i] = i;
+#ifdef __SSE2__
+        const auto vc = _mm_set1_epi32( c );
+        const auto m0 = _mm_packs_epi32( _mm_cmpeq_epi32( v[0], vc ), _mm_cmpeq_epi32( v[1], vc ) );
+        const auto m1 = _mm_packs_epi32( _mm_cmpeq_epi32( v[2], vc ), _mm_cmpeq_epi32( v[3], vc ) );
+        return _mm_movemask_epi8( _mm_packs_epi16( m0, m1 ) );
+#else
+        uint32_t ret = 0;
+        for( int i=0; i<16; i++ ) ret |= uint32_t( chr[i] == c ) << i;
+        return ret;
+#endif
     }
-    for( unsigned int i = 0; i < len1; i++ )
+
+#ifdef __SSE2__
+    __m128i v[4];
+#else
+    char32_t chr[16];
+#endif
+    unsigned int len;
+};
+
+static_assert( LexiconMaxLen <= 16, "Words do not fit in pattern" );
+
+// Bit-parallel edit distance (Myers, Hyyro). One column of the distance matrix fits
+// in a machine word, as words generated in lexicon are at most 13 letters long.
+static int levenshtein_distance( const Pattern& p, const char32_t* s2, const unsigned int len2, int threshold )
+{
+    const uint32_t last = 1 << ( p.len - 1 );
+    uint32_t pv = ~0;
+    uint32_t mv = 0;
+    int score = p.len;
+    for( unsigned int j=0; j<len2; j++ )
     {
-        col[0] = i+1;
-        auto min = col[0];
-        for( unsigned int j = 0; j < len2; j++ )
-        {
-            col[j+1] = std::min( { prevCol[1 + j], col[j], prevCol[j] - (s1[i]==s2[j] ? 1 : 0) } ) + 1;
-            if( col[j+1] < min ) min = col[j+1];
-        }
-        if( min >= threshold ) return threshold;
-        std::swap( col, prevCol );
+        const auto eq = p.Match( s2[j] );
+        const auto xv = eq | mv;
+        const auto xh = ( ( ( eq & pv ) + pv ) ^ pv ) | eq;
+        auto ph = mv | ~( xh | pv );
+        auto mh = pv & xh;
+        if( ph & last ) score++;
+        else if( mh & last ) score--;
+        ph = ( ph << 1 ) | 1;
+        mh <<= 1;
+        pv = mh | ~( xv | ph );
+        mv = ph & xv;
+
+        // each remaining letter can lower the distance by at most one
+        if( score - int( len2 - j - 1 ) >= threshold ) return threshold;
     }
-    return prevCol[len2];
+    return std::min( score, threshold );
 }
 
 static int GetMaxLD( int len )
@@ -87,6 +141,164 @@ static int GetMaxLD( int len )
     return 3;
 }
 
+// Words within distance d of each other can be reduced to a common string by deleting at most
+// d code points from each. Deletions from the longer word include the length difference, so
+// the shorter word needs fewer of them. Returns the number of deletions needed from words of
+// given length, to be found by searches for words of all other lengths.
+static int GetMaxDeletions( int len )
+{
+    int ret = 0;
+    for( int i=LexiconMinLen; i<=LexiconMaxLen; i++ )
+    {
+        const auto maxld = GetMaxLD( i );
+        if( abs( i - len ) <= maxld ) ret = std::max( ret, maxld - std::max( 0, i - len ) );
+    }
+    return ret;
+}
+
+static inline void Prefetch( const void* ptr )
+{
+#ifdef X86_SIMD
+    _mm_prefetch( (const char*)ptr, _MM_HINT_T0 );
+#endif
+}
+
+static uint64_t HashString( const char32_t* str, int len )
+{
+    return XXH64( str, len * sizeof( char32_t ), 0 );
+}
+
+struct Deletion
+{
+    uint64_t hash;
+    uint32_t len;
+
+    bool operator<( const Deletion& other ) const { return len < other.len || ( len == other.len && hash < other.hash ); }
+    bool operator==( const Deletion& other ) const { return len == other.len && hash == other.hash; }
+};
+
+// Calls fn( hash, len ) for strings created by deleting up to maxdel code points from str.
+// Positions are deleted in increasing order, so most strings are visited only once.
+template<class T>
+static void ForEachDeletion( const char32_t* str, int len, int maxdel, int start, T&& fn )
+{
+    fn( HashString( str, len ), len );
+    if( maxdel == 0 ) return;
+    char32_t tmp[LexiconMaxLen];
+    memcpy( tmp, str, start * sizeof( char32_t ) );
+    for( int i=start; i<len; i++ )
+    {
+        // Deleting any code point of a repeated sequence gives the same string.
+        if( i == start || str[i] != str[i-1] )
+        {
+            memcpy( tmp+i, str+i+1, ( len-i-1 ) * sizeof( char32_t ) );
+            ForEachDeletion( tmp, len-1, maxdel-1, i, fn );
+        }
+        tmp[i] = str[i];
+    }
+}
+
+// Deletion neighborhood of all words of a single length. Hashes of strings created by deleting
+// code points from words are spread over buckets. Bucket entries contain upper half of the hash
+// and position of the word in byLen.
+class DeletionIndex
+{
+public:
+    void Build( const char32_t* chars, uint32_t size, int len, TaskDispatch& tasks, int cpus )
+    {
+        const auto maxdel = GetMaxDeletions( len );
+        uint64_t bound = 0;
+        uint64_t binom = 1;
+        for( int i=0; i<=maxdel; i++ )
+        {
+            bound += binom;
+            binom = binom * ( len - i ) / ( i + 1 );
+        }
+        bound *= size;
+
+        uint32_t buckets = 1024;
+        while( buckets < bound / 4 ) buckets *= 2;
+        m_mask = buckets - 1;
+
+        // Deletions are generated twice, first to count bucket sizes, then to fill buckets.
+        std::vector<std::atomic<uint32_t>> pos( buckets + 1 );
+        for( int pass=0; pass<2; pass++ )
+        {
+            std::atomic<uint32_t> cnt( 0 );
+            for( int t=0; t<cpus; t++ )
+            {
+                tasks.Queue( [this, &cnt, &pos, chars, size, len, maxdel, pass] {
+                    for(;;)
+                    {
+                        const auto start = cnt.fetch_add( WordBlock, std::memory_order_relaxed );
+                        if( start >= size ) break;
+                        const auto end = std::min<uint32_t>( start + WordBlock, size );
+                        for( uint32_t i=start; i<end; i++ )
+                        {
+                            ForEachDeletion( chars + i * len, len, maxdel, 0, [this, &pos, i, pass] ( uint64_t hash, uint32_t ) {
+                                const auto bucket = hash & m_mask;
+                                if( pass == 0 )
+                                {
+                                    pos[bucket+1].fetch_add( 1, std::memory_order_relaxed );
+                                }
+                                else
+                                {
+                                    const auto idx = pos[bucket].fetch_add( 1, std::memory_order_relaxed );
+                                    m_entries[idx] = ( hash & 0xFFFFFFFF00000000 ) | i;
+                                }
+                            } );
+                        }
+                    }
+                } );
+            }
+            tasks.Sync();
+
+            if( pass == 0 )
+            {
+                m_heads.resize( buckets + 1 );
+                m_heads[0] = 0;
+                for( uint32_t i=1; i<=buckets; i++ )
+                {
+                    m_heads[i] = m_heads[i-1] + pos[i].load( std::memory_order_relaxed );
+                    pos[i].store( m_heads[i], std::memory_order_relaxed );
+                }
+                m_entries.resize( m_heads[buckets] );
+            }
+        }
+    }
+
+    void Clear()
+    {
+        m_heads = std::vector<uint32_t>();
+        m_entries = std::vector<uint64_t>();
+    }
+
+    // Appends positions of words which may have a deletion with one of the given hashes.
+    // Buckets and their entries are prefetched for all hashes before they are read.
+    void Find( const uint64_t* hash, size_t num, std::vector<uint32_t>& out ) const
+    {
+        for( size_t i=0; i<num; i++ ) Prefetch( m_heads.data() + ( hash[i] & m_mask ) );
+        for( size_t i=0; i<num; i++ ) Prefetch( m_entries.data() + m_heads[hash[i] & m_mask] );
+        for( size_t i=0; i<num; i++ )
+        {
+            const auto bucket = hash[i] & m_mask;
+            const auto end = m_heads[bucket+1];
+            for( auto j=m_heads[bucket]; j<end; j++ )
+            {
+                const auto v = m_entries[j];
+                if( ( v ^ hash[i] ) >> 32 == 0 ) out.emplace_back( uint32_t( v ) );
+            }
+        }
+    }
+
+private:
+    enum { WordBlock = 256 };
+
+    uint64_t m_mask;
+    std::vector<uint32_t> m_heads;
+    std::vector<uint64_t> m_entries;
+};
+
 uint64_t BuildHeuristicData( const char* str )
 {
     uint64_t v = 0;
@@ -122,6 +334,126 @@ uint64_t BuildHeuristicData( const char* str )
     return v;
 }
 
+// Candidate filter. Stores indices of heuristic data differing from heur in at most hld bits,
+// in increasing order. Returns number of stored indices.
+typedef size_t(*FilterFn)( uint64_t heur, int hld, const uint64_t* data, size_t size, uint32_t* out );
+
+static inline size_t FilterRange( uint64_t heur, int hld, const uint64_t* data, size_t begin, size_t end, uint32_t* out )
+{
+    size_t num = 0;
+    for( size_t i=begin; i<end; i++ )
+    {
+        out[num] = i;
+        num += CountBits( heur ^ data[i] ) <= hld;
+    }
+    return num;
+}
+
+static size_t FilterScalar( uint64_t heur, int hld, const uint64_t* data, size_t size, uint32_t* out )
+{
+    return FilterRange( heur, hld, data, 0, size, out );
+}
+
+// Stores indices of set bits of a N bit mask.
+template<int N>
+static inline size_t StoreMask( uint32_t mask, size_t base, uint32_t* out )
+{
+    size_t num = 0;
+    for( int i=0; i<N; i++ )
+    {
+        out[num] = base + i;
+        num += ( mask >> i ) & 1;
+    }
+    return num;
+}
+
+#ifdef X86_SIMD
+// AVX2 has no 64-bit popcount. Bits are counted in nibbles with a lookup table, then summed.
+TARGET( "avx2" ) static size_t FilterAVX2( uint64_t heur, int hld, const uint64_t* data, size_t size, uint32_t* out )
+{
+    const auto lut = _mm256_setr_epi8( 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 );
+    const auto nibble = _mm256_set1_epi8( 0x0F );
+    const auto vheur = _mm256_set1_epi64x( heur );
+    const auto vhld = _mm256_set1_epi64x( hld );
+    size_t num = 0;
+    size_t i = 0;
+    for( ; i+4<=size; i+=4 )
+    {
+        const auto vxor = _mm256_xor_si256( vheur, _mm256_loadu_si256( (const __m256i*)( data + i ) ) );
+        const auto vlo = _mm256_shuffle_epi8( lut, _mm256_and_si256( vxor, nibble ) );
+        const auto vhi = _mm256_shuffle_epi8( lut, _mm256_and_si256( _mm256_srli_epi64( vxor, 4 ), nibble ) );
+        const auto vcnt = _mm256_sad_epu8( _mm256_add_epi8( vlo, vhi ), _mm256_setzero_si256() );
+        const auto vcmp = _mm256_cmpgt_epi64( vcnt, vhld );
+        const uint32_t mask = ~_mm256_movemask_pd( _mm256_castsi256_pd( vcmp ) ) & 0xF;
+        num += StoreMask<4>( mask, i, out + num );
+    }
+    return num + FilterRange( heur, hld, data, i, size, out + num );
+}
+
+TARGET( "avx512f,avx512vpopcntdq" ) static size_t FilterAVX512( uint64_t heur, int hld, const uint64_t* data, size_t size, uint32_t* out )
+{
+    const auto vheur = _mm512_set1_epi64( heur );
+    const auto vhld = _mm512_set1_epi64( hld );
+    size_t num = 0;
+    size_t i = 0;
+    for( ; i+8<=size; i+=8 )
+    {
+        const auto vxor = _mm512_xor_si512( vheur, _mm512_loadu_si512( data + i ) );
+        const auto vcnt = _mm512_popcnt_epi64( vxor );
+        const uint32_t mask = _mm512_cmple_epu64_mask( vcnt, vhld );
+        num += StoreMask<8>( mask, i, out + num );
+    }
+    return num + FilterRange( heur, hld, data, i, size, out + num );
+}
+
+#  ifdef _MSC_VER
+// Checks cpuid feature bits, and if the operating system saves the required register state.
+static bool CpuSupports( int ebx7, int ecx7, int xcr0 )
+{
+    int regs[4];
+    __cpuid( regs, 0 );
+    if( regs[0] < 7 ) return false;
+    __cpuid( regs, 1 );
+    if( ( regs[2] & ( 1 << 27 ) ) == 0 ) return false;
+    if( ( _xgetbv( 0 ) & xcr0 ) != xcr0 ) return false;
+    __cpuidex( regs, 7, 0 );
+    return ( regs[1] & ebx7 ) == ebx7 && ( regs[2] & ecx7 ) == ecx7;
+}
+#  endif
+#endif
+
+// Selects the fastest filter supported by the CPU the program runs on.
+static FilterFn GetFilter( const char*& name )
+{
+#ifdef X86_SIMD
+#  ifdef _MSC_VER
+    const bool avx512 = CpuSupports( 1 << 16, 1 << 14, 0xE6 );
+    const bool avx2 = CpuSupports( 1 << 5, 0, 0x06 );
+#  else
+    __builtin_cpu_init();
+    const bool avx512 = __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512vpopcntdq" );
+    const bool avx2 = __builtin_cpu_supports( "avx2" );
+#  endif
+    if( avx512 )
+    {
+        name = "AVX-512";
+        return FilterAVX512;
+    }
+    if( avx2 )
+    {
+        name = "AVX2";
+        return FilterAVX2;
+    }
+#endif
+    name = "scalar";
+    return FilterScalar;
+}
+
+// Minimum number of words of a length, and searches for similar words among them, for which
+// deletion neighborhood index is built. Smaller sets of words are scanned.
+enum { IndexMinSize = 4096 };
+enum { IndexMinQueries = 4096 };
+
 struct CandidateData
 {
     uint32_t distance : 2;  // max value is 3
@@ -131,11 +463,103 @@ struct CandidateData
 
 static_assert( sizeof( CandidateData ) == 2 * sizeof( uint32_t ), "CandidateData size overflow" );
 
+// Stores positions of words of length k which pass the heuristic filter, and may be within maxld of the
+// word of length i. If words of length k are indexed, sorted deletions of the word, up to maxld, are used.
+static void FindMatches( int i, int k, int maxld, uint64_t heur1, const std::vector<uint64_t>& heurdata2, const DeletionIndex* index, const std::vector<Deletion>& deletions, FilterFn filter, std::vector<uint64_t>& lookups, std::vector<uint32_t>& matches )
+{
+    const auto hld = maxld * 2 - abs( k - i );
+    if( index )
+    {
+        // Deletions needed from each word, and in total.
+        const auto del1 = maxld - std::max( 0, k - i );
+        const auto del2 = maxld - std::max( 0, i - k );
+        lookups.clear();
+        for( auto& v : deletions )
+        {
+            const int d1 = i - v.len;
+            const int d2 = k - v.len;
+            if( d1 <= del1 && d2 >= 0 && d2 <= del2 && d1 + d2 <= hld ) lookups.emplace_back( v.hash );
+        }
+        matches.clear();
+        index->Find( lookups.data(), lookups.size(), matches );
+        std::sort( matches.begin(), matches.end() );
+        matches.erase( std::unique( matches.begin(), matches.end() ), matches.end() );
+        matches.erase( std::remove_if( matches.begin(), matches.end(), [heur1, hld, &heurdata2] ( uint32_t m ) { return CountBits( heur1 ^ heurdata2[m] ) > hld; } ), matches.end() );
+    }
+    else
+    {
+        matches.resize( heurdata2.size() );
+        matches.resize( filter( heur1, hld, heurdata2.data(), heurdata2.size(), matches.data() ) );
+    }
+}
+
+static void GetDeletions( const char32_t* str, int len, int maxld, std::vector<Deletion>& deletions )
+{
+    deletions.clear();
+    ForEachDeletion( str, len, maxld, 0, [&deletions] ( uint64_t hash, uint32_t len ) { deletions.emplace_back( Deletion { hash, len } ); } );
+    std::sort( deletions.begin(), deletions.end() );
+    deletions.erase( std::unique( deletions.begin(), deletions.end() ), deletions.end() );
+}
+
+// Loads lists of similar words from partial output file. The whole file is validated first, so that nothing is
+// loaded if it is damaged.
+static bool LoadPart( const std::string& fn, uint64_t size, uint32_t words, std::vector<uint32_t>* data )
+{
+    if( size % sizeof( uint32_t ) != 0 ) return false;
+    std::vector<uint32_t> part( size / sizeof( uint32_t ) );
+    FILE* f = fopen( fn.c_str(), "rb" );
+    if( !f ) return false;
+    const auto read = fread( part.data(), 1, size, f );
+    fclose( f );
+    if( read != size ) return false;
+
+    size_t pos = 0;
+    while( pos != part.size() )
+    {
+        if( part.size() - pos < 2 ) return false;
+        if( part[pos] >= words || part.size() - pos - 2 < part[pos+1] ) return false;
+        pos += 2 + part[pos+1];
+    }
+    pos = 0;
+    while( pos != part.size() )
+    {
+        const auto ptr = part.data() + pos;
+        data[ptr[0]].assign( ptr + 2, ptr + 2 + ptr[1] );
+        pos += 2 + ptr[1];
+    }
+    return true;
+}
+
 int main( int argc, char** argv )
 {
+    std::string source;
+    int interval = Checkpoint::DefaultInterval;
+    for(;;)
+    {
+        if( argc > 3 && strcmp( argv[1], "-u" ) == 0 )
+        {
+            source = argv[2];
+            source.append( "/" );
+            argv += 2;
+            argc -= 2;
+        }
+        else if( argc > 3 && strcmp( argv[1], "-c" ) == 0 )
+        {
+            interval = std::max( 0, atoi( argv[2] ) );
+            argv += 2;
+            argc -= 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+
     if( argc != 2 )
     {
-        fprintf( stderr, "USAGE: %s directory\n", argv[0] );
+        fprintf( stderr, "USAGE: %s [params] directory\nParams:\n", argv[0] );
+        fprintf( stderr, " -u source       - reuse similar words of source archive, process only new words and words similar to them\n" );
+        fprintf( stderr, " -c seconds      - save progress for resuming at given interval, 0 disables (default: %i)\n", interval );
         exit( 1 );
     }
 
@@ -143,14 +567,34 @@ int main( int argc, char** argv )
     base.append( "/" );
     FileMap<LexiconMetaPacket> meta( base + "lexmeta" );
     FileMap<char> str( base + "lexstr" );
+    const HashSearch<char> hash( base + "lexstr", base + "lexhash", base + "lexhashdata" );
+
+    // In update mode words already present in source keep their lists of similar words, unless a new word is similar.
+    const bool update = !source.empty();
+    std::unique_ptr<FileMap<char>> sstr;
+    std::unique_ptr<HashSearch<char>> shash;
+    std::unique_ptr<FileMap<uint32_t>> sdist, sdistmeta;
+    if( update )
+    {
+        sstr = std::make_unique<FileMap<char>>( source + "lexstr" );
+        shash = std::make_unique<HashSearch<char>>( source + "lexstr", source + "lexhash", source + "lexhashdata" );
+        sdist = std::make_unique<FileMap<uint32_t>>( source + "lexdist" );
+        sdistmeta = std::make_unique<FileMap<uint32_t>>( source + "lexdistmeta" );
+    }
 
     const auto size = meta.DataSize();
     auto data = new std::vector<uint32_t>[size];
-    auto stru32 = new std::u32string[size];
     auto counts = new unsigned int[size];
     auto offsets = new uint32_t[size];
     std::vector<uint32_t> byLen[LexiconMaxLen+1];
     std::vector<uint64_t> heurdata[LexiconMaxLen+1];
+    // Code points of words, parallel to byLen. Each word takes its length of entries.
+    std::vector<char32_t> chars[LexiconMaxLen+1];
+    // Positions in byLen of words for which similar words have to be found.
+    std::vector<uint32_t> todo[LexiconMaxLen+1];
+    // Words reused from source.
+    std::vector<uint8_t> reuse( size );
+    size_t reused = 0;
 
 #ifdef _MSC_VER
     std::wstring_convert<std::codecvt_utf8<unsigned int>, unsigned int> conv;
@@ -171,17 +615,38 @@ int main( int argc, char** argv )
         auto len = utflen( s );
         assert( len <= LexiconMaxLen );
 
-#ifdef _MSC_VER
-        stru32[i] = std::u32string( (const char32_t*)conv.from_bytes( s ).data() );
-#else
-        stru32[i] = conv.from_bytes( s );
-#endif
+        const auto u32 = conv.from_bytes( s );
+        assert( u32.size() == len );
+        chars[len].insert( chars[len].end(), (const char32_t*)u32.data(), (const char32_t*)u32.data() + len );
+        const auto sidx = update ? shash->Search( s ) : -1;
+        if( sidx >= 0 )
+        {
+            // Similar words are referenced by string offsets, which differ between lexicons.
+            const auto soffset = (*sdistmeta)[sidx];
+            if( soffset != 0 )
+            {
+                const auto sptr = *sdist + soffset / sizeof( uint32_t );
+                for( uint32_t j=0; j<*sptr; j++ )
+                {
+                    const auto v = sptr[j+1];
+                    const auto widx = hash.Search( *sstr + ( v & 0x3FFFFFFF ) );
+                    if( widx >= 0 ) data[i].emplace_back( meta[widx].str | ( v & 0xC0000000 ) );
+                }
+            }
+            reuse[i] = 1;
+            reused++;
+        }
+        else
+        {
+            todo[len].emplace_back( byLen[len].size() );
+        }
         byLen[len].emplace_back( i );
         heurdata[len].emplace_back( BuildHeuristicData( s ) );
 
         counts[i] = mp->dataSize;
     }
 
+    if( update ) printf( "\n%zu of %zu words not present in source.", size - reused, size );
     printf( "\nWord length histogram\n" );
     for( int i=LexiconMinLen; i<=LexiconMaxLen; i++ )
     {
@@ -189,96 +654,216 @@ int main( int argc, char** argv )
     }
 
     const auto cpus = System::CPUCores();
-    printf( "Working... (%i threads)\n", cpus );
+    const char* filterName;
+    const auto filter = GetFilter( filterName );
+    printf( "Working... (%i threads, %s filter)\n", cpus, filterName );
 
     TaskDispatch tasks( cpus-1 );
 
+    // A new word may be similar to source words, which then have to be processed again. LD is symmetric, so
+    // these are found by searching from new words, with distance limits of the source word lengths.
+    if( reused != 0 && reused != size )
+    {
+        size_t redo = 0;
+        std::vector<uint32_t> found[LexiconMaxLen+1];
+        DeletionIndex sindex;
+        for( int i=LexiconMinLen; i<=LexiconMaxLen; i++ )
+        {
+            const auto maxld = GetMaxLD( i );
+            std::vector<std::pair<int, uint32_t>> words;
+            for( int k=std::max<int>( i-maxld, LexiconMinLen ); k<=std::min<int>( i+maxld, LexiconMaxLen ); k++ )
+            {
+                for( auto& v : todo[k] ) words.emplace_back( k, v );
+            }
+            if( words.empty() || byLen[i].empty() ) continue;
+
+            printf( "%2i: checking source words...\r", i );
+            fflush( stdout );
+            const bool useIndex = byLen[i].size() >= IndexMinSize && words.size() >= IndexMinQueries;
+            if( useIndex ) sindex.Build( chars[i].data(), byLen[i].size(), i, tasks, cpus );
+
+            std::mutex lock;
+            std::atomic<uint32_t> cnt( 0 );
+            for( int t=0; t<cpus; t++ )
+            {
+                tasks.Queue( [&words, &cnt, &lock, &found, &chars, &byLen, &heurdata, &reuse, &sindex, i, maxld, useIndex, filter] {
+                    std::vector<uint32_t> matches;
+                    std::vector<Deletion> deletions;
+                    std::vector<uint64_t> lookups;
+                    std::vector<uint32_t> local;
+                    for(;;)
+                    {
+                        const auto n = cnt.fetch_add( 1, std::memory_order_relaxed );
+                        if( n >= words.size() ) break;
+                        const auto k = words[n].first;
+                        const auto j = words[n].second;
+                        const auto chars1 = chars[k].data() + j * k;
+                        const Pattern str1( chars1, k );
+                        if( useIndex ) GetDeletions( chars1, k, maxld, deletions );
+                        FindMatches( k, i, maxld, heurdata[k][j], heurdata[i], useIndex ? &sindex : nullptr, deletions, filter, lookups, matches );
+                        for( auto m : matches )
+                        {
+                            if( !reuse[byLen[i][m]] ) continue;
+                            const auto ld = levenshtein_distance( str1, chars[i].data() + m * i, i, maxld+1 );
+                            if( ld > 0 && ld <= maxld ) local.emplace_back( m );
+                        }
+                    }
+                    std::lock_guard<std::mutex> guard( lock );
+                    found[i].insert( found[i].end(), local.begin(), local.end() );
+                } );
+            }
+            tasks.Sync();
+            if( useIndex ) sindex.Clear();
+
+            std::sort( found[i].begin(), found[i].end() );
+            found[i].erase( std::unique( found[i].begin(), found[i].end() ), found[i].end() );
+        }
+        // Searches use todo of other lengths, so it is extended only when all are done.
+        for( int i=LexiconMinLen; i<=LexiconMaxLen; i++ )
+        {
+            for( auto& m : found[i] ) data[byLen[i][m]].clear();
+            todo[i].insert( todo[i].end(), found[i].begin(), found[i].end() );
+            std::sort( todo[i].begin(), todo[i].end() );
+            redo += found[i].size();
+        }
+        printf( "%zu source words have new similar words.\n", redo );
+    }
+
+    // Number of searches for words of each length.
+    size_t queries[LexiconMaxLen+1] = {};
     for( int i=LexiconMinLen; i<=LexiconMaxLen; i++ )
+    {
+        const auto maxld = GetMaxLD( i );
+        for( int k=std::max<int>( i-maxld, LexiconMinLen ); k<=std::min<int>( i+maxld, LexiconMaxLen ); k++ )
+        {
+            queries[k] += todo[i].size();
+        }
+    }
+
+    // Lists of similar words found before the last checkpoint are kept in a partial output file.
+    // Each record is word index, list size and the list.
+    const auto partfn = base + ".lexdist.part";
+    Checkpoint checkpoint( base + ".lexdist.checkpoint", interval );
+    checkpoint.Param( uint64_t( size ) );
+    checkpoint.Param( GetFileSize( ( base + "lexstr" ).c_str() ) );
+    checkpoint.Param( source );
+
+    int startLen = LexiconMinLen;
+    uint32_t startPos = 0;
+    uint64_t partSize = 0;
+    if( checkpoint.Load() )
+    {
+        startLen = checkpoint.Get<int>();
+        startPos = checkpoint.Get<uint32_t>();
+        partSize = checkpoint.Get<uint64_t>();
+        if( GetFileSize( partfn.c_str() ) >= partSize && TruncateFile( partfn, partSize ) && LoadPart( partfn, partSize, size, data ) )
+        {
+            printf( "Resuming at word length %i, %i/%zu.\n", startLen, startPos, todo[startLen].size() );
+        }
+        else
+        {
+            // Damaged partial output, search starts from the beginning.
+            startLen = LexiconMinLen;
+            startPos = 0;
+            partSize = 0;
+        }
+    }
+
+    FILE* fpart = fopen( partfn.c_str(), partSize != 0 ? "ab" : "wb" );
+    int partLen = startLen;
+    uint32_t partPos = startPos;
+    auto writePart = [&] ( int len, uint32_t end ) {
+        for( ; partLen<=len; partLen++, partPos=0 )
+        {
+            const auto num = partLen == len ? end : todo[partLen].size();
+            for( ; partPos<num; partPos++ )
+            {
+                const auto idx = byLen[partLen][todo[partLen][partPos]];
+                const uint32_t hdr[2] = { idx, uint32_t( data[idx].size() ) };
+                partSize += fwrite( hdr, 1, sizeof( hdr ), fpart );
+                partSize += fwrite( data[idx].data(), 1, sizeof( uint32_t ) * data[idx].size(), fpart );
+            }
+            if( partLen == len ) break;
+        }
+    };
+
+    // Deletion neighborhoods are used only if scanning all words would be slower.
+    DeletionIndex index[LexiconMaxLen+1];
+    bool indexed[LexiconMaxLen+1] = {};
+
+    for( int i=startLen; i<=LexiconMaxLen; i++ )
     {
         const auto maxld = GetMaxLD( i );
         const auto ldstart = std::max<int>( i-maxld, LexiconMinLen );
         const auto ldend = std::min<int>( i+maxld, LexiconMaxLen );
         const auto& byLen1 = byLen[i];
         const auto& heurdata1 = heurdata[i];
+        const auto& todo1 = todo[i];
 
-        const auto size = byLen1.size();
-        std::atomic<uint32_t> cnt( 0 );
-        for( int t=0; t<cpus; t++ )
+        for( int k=LexiconMinLen; k<ldstart; k++ )
         {
-            tasks.Queue( [&stru32, &byLen1, &byLen, size, &cnt, i, counts, ldstart, ldend, maxld, offsets, &data, &heurdata, heurdata1]() {
-                std::vector<CandidateData> candidates;
-                for(;;)
-                {
-                    auto j = cnt.fetch_add( 1, std::memory_order_relaxed );
-                    if( j >= size ) break;
-                    if( ( j & 0x1FF ) == 0 )
-                    {
-                        printf( "%2i: %i/%zu\r", i, j, size );
-                        fflush( stdout );
-                    }
-
-                    const auto idx = byLen1[j];
-                    const auto heur1 = heurdata1[j];
-                    const auto cnt = counts[idx];
-                    const auto tcnt = cnt / 10;    // 10%
-                    const auto& str1 = stru32[idx];
+            if( indexed[k] )
+            {
+                index[k].Clear();
+                indexed[k] = false;
+            }
+        }
+        for( int k=ldstart; k<=ldend; k++ )
+        {
+            if( !indexed[k] && byLen[k].size() >= IndexMinSize && queries[k] >= IndexMinQueries )
+            {
+                printf( "%2i: indexing...\r", k );
+                fflush( stdout );
+                index[k].Build( chars[k].data(), byLen[k].size(), k, tasks, cpus );
+                indexed[k] = true;
+            }
+        }
 
-                    unsigned int maxCount = 0;
-                    candidates.clear();
-                    for( int k=ldstart; k<=ldend; k++ )
+        const auto size = todo1.size();
+        std::atomic<uint32_t> cnt( i == startLen ? startPos : 0 );
+        for(;;)
+        {
+            for( int t=0; t<cpus; t++ )
+            {
+                tasks.Queue( [&chars, &byLen1, &byLen, &todo1, size, &cnt, i, counts, ldstart, ldend, maxld, offsets, &data, &heurdata, &heurdata1, filter, &index, &indexed, &checkpoint]() {
+                    std::vector<CandidateData> candidates;
+                    std::vector<uint32_t> matches;
+                    std::vector<Deletion> deletions;
+                    std::vector<uint64_t> lookups;
+                    while( !checkpoint.Due() )
                     {
-                        const auto hld = maxld * 2 - abs( k - i );
-                        const auto& byLen2 = byLen[k];
-                        const auto& heurdata2 = heurdata[k];
-                        const auto size2 = byLen2.size();
-                        int l=0;
-#ifdef __AVX512F__
-                        auto vheur1 = _mm512_set1_epi64( heur1 );
-                        auto vhld = _mm512_set1_epi64( hld );
-                        for( int v=0; v<size2/8; v++, l+=8 )
+                        auto n = cnt.fetch_add( 1, std::memory_order_relaxed );
+                        if( n >= size ) break;
+                        if( ( n & 0x1FF ) == 0 )
                         {
-                            auto vheur2 = _mm512_loadu_si512( heurdata2.data() + l );
-                            auto vxor = _mm512_xor_si512( vheur1, vheur2 );
-                            auto vcnt = _mm512_popcnt_epi64( vxor );
-                            auto vcmp = _mm512_cmple_epu64_mask( vcnt, vhld );
-                            if( vcmp != 0 )
-                            {
-                                int m = 0;
-                                do
-                                {
-                                    if( ( vcmp & 1 ) != 0 )
-                                    {
-                                        const auto idx2 = byLen2[l+m];
-                                        const auto cnt2 = counts[idx2];
-                                        if( cnt2 >= tcnt )
-                                        {
-                                            const auto& str2 = stru32[idx2];
-                                            const auto ld = levenshtein_distance( str1.c_str(), i, str2.c_str(), k, maxld+1 );
-                                            if( ld > 0 && ld <= maxld )
-                                            {
-                                                candidates.emplace_back( CandidateData { uint32_t( ld ), cnt2, offsets[idx2] } );
-                                                if( cnt2 > maxCount ) maxCount = cnt2;
-                                            }
-                                        }
-                                    }
-                                    vcmp >>= 1;
-                                    m++;
-                                }
-                                while( vcmp != 0 );
-                            }
+                            printf( "%2i: %i/%zu\r", i, n, size );
+                            fflush( stdout );
                         }
-#endif
-                        for( ; l<size2; l++ )
+
+                        const auto j = todo1[n];
+                        const auto idx = byLen1[j];
+                        const auto heur1 = heurdata1[j];
+                        const auto cnt = counts[idx];
+                        const auto tcnt = cnt / 10;    // 10%
+                        const auto chars1 = chars[i].data() + j * i;
+                        const Pattern str1( chars1, i );
+
+                        unsigned int maxCount = 0;
+                        candidates.clear();
+                        deletions.clear();
+                        for( int k=ldstart; k<=ldend; k++ )
                         {
-                            const auto heur2 = heurdata2[l];
-                            if( CountBits( heur1 ^ heur2 ) <= hld )
+                            const auto& byLen2 = byLen[k];
+                            const auto chars2 = chars[k].data();
+                            if( indexed[k] && deletions.empty() ) GetDeletions( chars1, i, maxld, deletions );
+                            FindMatches( i, k, maxld, heur1, heurdata[k], indexed[k] ? &index[k] : nullptr, deletions, filter, lookups, matches );
+                            for( auto m : matches )
                             {
-                                const auto idx2 = byLen2[l];
+                                const auto idx2 = byLen2[m];
                                 const auto cnt2 = counts[idx2];
                                 if( cnt2 >= tcnt )
                                 {
-                                    const auto& str2 = stru32[idx2];
-                                    const auto ld = levenshtein_distance( str1.c_str(), i, str2.c_str(), k, maxld+1 );
+                                    const auto ld = levenshtein_distance( str1, chars2 + m * k, k, maxld+1 );
                                     if( ld > 0 && ld <= maxld )
                                     {
                                         candidates.emplace_back( CandidateData { uint32_t( ld ), cnt2, offsets[idx2] } );
@@ -287,23 +872,35 @@ int main( int argc, char** argv )
                                 }
                             }
                         }
-                    }
-                    const auto tmc = maxCount / 5;  // 20%
-                    for( auto& v : candidates )
-                    {
-                        if( v.count >= tmc )
+                        const auto tmc = maxCount / 5;  // 20%
+                        for( auto& v : candidates )
                         {
-                            assert( ( v.offset & 0xC0000000 ) == 0 );
-                            data[idx].emplace_back( v.offset | ( v.distance << 30 ) );
+                            if( v.count >= tmc )
+                            {
+                                assert( ( v.offset & 0xC0000000 ) == 0 );
+                                data[idx].emplace_back( v.offset | ( v.distance << 30 ) );
+                            }
                         }
                     }
-                }
-            } );
+                } );
+            }
+            tasks.Sync();
+            if( cnt.load() >= size ) break;
+
+            // Workers finish taken words, so lists of all words before the counter are complete.
+            checkpoint.Begin();
+            writePart( i, cnt.load() );
+            fflush( fpart );
+            checkpoint.Put( i );
+            checkpoint.Put( cnt.load() );
+            checkpoint.Put( partSize );
+            checkpoint.Save();
         }
-        tasks.Sync();
         printf( "%2i: %zu/%zu\n", i, size, size );
     }
 
+    fclose( fpart );
+
     FILE* fdata = fopen( ( base + "lexdist" ).c_str(), "wb" );
     FILE* fmeta = fopen( ( base + "lexdistmeta" ).c_str(), "wb" );
 
@@ -337,6 +934,9 @@ int main( int argc, char** argv )
     fclose( fdata );
     fclose( fmeta );
 
+    checkpoint.Remove();
+    remove( partfn.c_str() );
+
     if( statnum == 0 )
     {
         printf( "No similar words found for %i words.\n", statnone );
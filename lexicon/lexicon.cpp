@@ -1,244 +1,857 @@
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
 #include <ctype.h>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <stdint.h>
 #include <stdio.h>
 #include <string>
 #include <string.h>
+#include <string_view>
 #include <vector>
 
 #include "../contrib/xxhash/xxhash.h"
+#include "../common/BodyLines.hpp"
+#include "../common/Checkpoint.hpp"
+#include "../common/FileMap.hpp"
+#include "../common/Filesystem.hpp"
+#include "../common/HashSearch.hpp"
+#include "../common/HeaderIndex.hpp"
 #include "../common/ICU.hpp"
 #include "../common/LexiconTypes.hpp"
 #include "../common/MetaView.hpp"
-#include "../common/MessageLogic.hpp"
 #include "../common/MessageView.hpp"
 #include "../common/MsgIdHash.hpp"
+#include "../common/RawImportMeta.hpp"
+#include "../common/StringCompress.hpp"
+#include "../common/System.hpp"
+#include "../common/TaskDispatch.hpp"
 
 #include "../contrib/martinus/robin_hood.h"
 
-enum class HeaderType
+// Number of messages taken by a worker at once.
+enum { ChunkSize = 256 };
+// Approximate memory used by a dictionary entry of a batch, in addition to word characters.
+enum { WordOverhead = 48 };
+// Source message which is not present in the updated archive.
+enum { MessageRemoved = 0xFFFFFFFF };
+
+struct PostHits
 {
-    From,
-    Subject,
-    Invalid
+    std::vector<uint8_t> hits;
+    std::vector<uint8_t> pos;
+    uint32_t last;
+    uint32_t count;
 };
 
-const char* AllowedHeaders[] = {
-    "from",
-    "subject",
-    nullptr
+// Words of a message are looked up by views into the splitter buffer and copied only when new.
+// Hash is the same as the robin_hood string hash.
+struct WordHash
+{
+    using is_transparent = void;
+    size_t operator()( std::string_view str ) const { return robin_hood::hash_bytes( str.data(), str.size() ); }
+};
+
+struct WordEqual
+{
+    using is_transparent = void;
+    bool operator()( std::string_view l, std::string_view r ) const { return l == r; }
+};
+
+// Postings gathered by a single worker. Each record is a varint word id,
+// followed by post id, hit count, hits and, if enabled, varint position
+// count, varint position data size and position data.
+struct Batch
+{
+    robin_hood::unordered_flat_map<std::string, uint32_t> words;
+    std::vector<uint8_t> records;
+    size_t wordMemory = 0;
+
+    size_t Memory() const { return records.size() + wordMemory; }
+    bool Empty() const { return records.empty(); }
+
+    void Clear()
+    {
+        words.clear();
+        records.clear();
+        wordMemory = 0;
+    }
 };
 
-HeaderType IsHeaderAllowed( const char* hdr, const char* end )
+static const uint8_t* SkipRecord( const uint8_t* ptr, bool positions )
 {
-    int size = end - hdr;
-    char* tmp = (char*)alloca( size+1 );
-    for( int i=0; i<size; i++ )
+    ptr += sizeof( uint32_t );
+    ptr += 1 + *ptr;
+    if( positions )
     {
-        tmp[i] = tolower( hdr[i] );
+        uint32_t v;
+        ptr = LexiconDecodeVarInt( ptr, v );
+        ptr = LexiconDecodeVarInt( ptr, v );
+        ptr += v;
     }
-    tmp[size] = '\0';
+    return ptr;
+}
+
+class Indexer
+{
+public:
+    Indexer( bool positions ) : m_positions( positions ) {}
+
+    void Process( const char* post, uint32_t idx, int children );
+
+    Batch& GetBatch() { return m_batch; }
+
+private:
+    void Add( const std::vector<std::string_view>& words, int type, int basePos, uint32_t* wordPos );
+    void Flush( uint32_t idx, int children );
 
-    auto test = AllowedHeaders;
-    while( *test )
+    bool m_positions;
+    HeaderIndex m_headers;
+    BodyLines m_body;
+    WordSplitter m_splitter;
+    // Hits of the currently processed message.
+    robin_hood::unordered_flat_map<std::string, uint32_t, WordHash, WordEqual> m_msgWords;
+    std::vector<PostHits> m_msgHits;
+    Batch m_batch;
+};
+
+void Indexer::Add( const std::vector<std::string_view>& words, int type, int basePos, uint32_t* wordPos )
+{
+    uint8_t enc = LexiconHitTypeEncoding[type];
+    uint8_t max = LexiconHitPosMask[type];
+    for( auto& w : words )
     {
-        if( strncmp( tmp, *test, size+1 ) == 0 )
+        auto it = m_msgWords.find( w );
+        if( it == m_msgWords.end() )
+        {
+            const uint32_t slot = m_msgWords.size();
+            if( slot == m_msgHits.size() ) m_msgHits.emplace_back();
+            auto& post = m_msgHits[slot];
+            post.hits.clear();
+            post.pos.clear();
+            post.count = 0;
+            it = m_msgWords.emplace( std::string( w ), slot ).first;
+        }
+        auto& post = m_msgHits[it->second];
+        auto& vec = post.hits;
+        if( vec.size() < std::numeric_limits<uint8_t>::max() )
         {
-            switch( test - AllowedHeaders )
+            if( basePos < max )
+            {
+                uint8_t hit = enc | std::min<uint8_t>( max, basePos++ );
+                vec.emplace_back( hit );
+            }
+            else
             {
-            case 0:
-                return HeaderType::From;
-            case 1:
-                return HeaderType::Subject;
-            default:
-                assert( false );
-                return HeaderType::Invalid;
+                uint8_t hit = enc | max;
+                if( std::find( vec.begin(), vec.end(), hit ) == vec.end() )
+                {
+                    vec.emplace_back( hit );
+                }
             }
         }
-        test++;
+        if( wordPos )
+        {
+            uint8_t tmp[5];
+            const auto p = *wordPos;
+            const auto end = LexiconEncodeVarInt( tmp, post.pos.empty() ? p : p - post.last );
+            post.pos.insert( post.pos.end(), tmp, end );
+            post.last = p;
+            post.count++;
+            (*wordPos)++;
+        }
     }
-    return HeaderType::Invalid;
 }
 
-using HitData = robin_hood::unordered_flat_map<std::string, robin_hood::unordered_flat_map<uint32_t, std::vector<uint8_t>>>;
-
-static void Add( HitData& data, std::vector<std::string>& words, uint32_t idx, int type, int basePos, int childCount )
+void Indexer::Flush( uint32_t idx, int children )
 {
     assert( ( idx & LexiconPostMask ) == idx );
-    assert( childCount <= LexiconChildMax );
-    idx = ( idx & LexiconPostMask ) | ( childCount << LexiconChildShift );
+    assert( children <= LexiconChildMax );
+    const uint32_t postid = ( idx & LexiconPostMask ) | ( children << LexiconChildShift );
 
-    uint8_t enc = LexiconHitTypeEncoding[type];
-    uint8_t max = LexiconHitPosMask[type];
-    for( auto& w : words )
+    auto& rec = m_batch.records;
+    for( auto& v : m_msgWords )
+    {
+        auto it = m_batch.words.find( v.first );
+        if( it == m_batch.words.end() )
+        {
+            const uint32_t id = m_batch.words.size();
+            it = m_batch.words.emplace( v.first, id ).first;
+            m_batch.wordMemory += v.first.size() + WordOverhead;
+        }
+        // Hits are stored in rank order, as expected by search.
+        auto& post = m_msgHits[v.second];
+        std::stable_sort( post.hits.begin(), post.hits.end(), [] ( const auto& l, const auto& r ) { return LexiconHitRank( l ) > LexiconHitRank( r ); } );
+        uint8_t tmp[5];
+        rec.insert( rec.end(), tmp, LexiconEncodeVarInt( tmp, it->second ) );
+        rec.insert( rec.end(), (const uint8_t*)&postid, (const uint8_t*)&postid + sizeof( uint32_t ) );
+        rec.emplace_back( uint8_t( post.hits.size() ) );
+        rec.insert( rec.end(), post.hits.begin(), post.hits.end() );
+        if( m_positions )
+        {
+            rec.insert( rec.end(), tmp, LexiconEncodeVarInt( tmp, post.count ) );
+            rec.insert( rec.end(), tmp, LexiconEncodeVarInt( tmp, post.pos.size() ) );
+            rec.insert( rec.end(), post.pos.begin(), post.pos.end() );
+        }
+    }
+    m_msgWords.clear();
+}
+
+void Indexer::Process( const char* post, uint32_t idx, int children )
+{
+    int basePos[NUM_LEXICON_TYPES] = {};
+
+    // Position gaps between headers and between differently typed text blocks prevent phrase matches across them.
+    uint32_t wordPos = 0;
+    int lastType = -1;
+    uint32_t* wordPosPtr = m_positions ? &wordPos : nullptr;
+
+    m_headers.Parse( post );
+    for( auto& hdr : m_headers.Headers() )
     {
-        auto it = data.find( w );
-        if( it == data.end() )
+        int type;
+        if( HeaderIndex::Is( hdr, "from", 4 ) )
         {
-            uint8_t hit = enc | std::min<uint8_t>( max, basePos++ );
-            data.emplace( std::move( w ), robin_hood::unordered_flat_map<uint32_t, std::vector<uint8_t>>( { { idx, std::vector<uint8_t> { hit } } } ) );
+            type = T_From;
+        }
+        else if( HeaderIndex::Is( hdr, "subject", 7 ) )
+        {
+            type = T_Subject;
         }
         else
         {
-            auto& vec = it->second[idx];
-            if( vec.size() < std::numeric_limits<uint8_t>::max() )
+            continue;
+        }
+        const auto line = std::min( hdr.name + hdr.nameLen + 2, hdr.end );
+        Add( m_splitter.Split( line, hdr.end ), type, 0, wordPosPtr );
+        wordPos++;
+    }
+
+    auto body = m_headers.Body();
+    while( *body == '\n' ) body++;
+    m_body.Parse( body );
+    for( auto& bl : m_body.Lines() )
+    {
+        if( bl.text == bl.len ) continue;
+        const auto line = body + bl.offset;
+        LexiconType t;
+        if( bl.flags & BodyLines::F_Signature )
+        {
+            t = T_Signature;
+        }
+        else if( bl.flags & BodyLines::F_Wrote )
+        {
+            t = T_Wrote;
+        }
+        else
+        {
+            t = LexiconTypeFromQuotLevel( bl.level );
+        }
+        if( t != lastType )
+        {
+            wordPos++;
+            lastType = t;
+        }
+        auto& words = m_splitter.Split( line + bl.text, line + bl.len );
+        Add( words, t, basePos[t], wordPosPtr );
+        basePos[t] += words.size();
+    }
+
+    Flush( idx, children );
+}
+
+// Sorted run of postings. For each word, in strcmp order: zero terminated
+// word, varint record count, varint size of records and batch records
+// without word id, in increasing post order.
+template<class Write>
+static void WriteRun( const Batch& batch, bool positions, Write write )
+{
+    const uint32_t wnum = batch.words.size();
+    std::vector<const char*> str( wnum );
+    for( auto& v : batch.words ) str[v.second] = v.first.c_str();
+    std::vector<uint32_t> order( wnum );
+    for( uint32_t i=0; i<wnum; i++ ) order[i] = i;
+    std::sort( order.begin(), order.end(), [&str] ( const auto& l, const auto& r ) { return strcmp( str[l], str[r] ) < 0; } );
+
+    const auto begin = batch.records.data();
+    const auto end = begin + batch.records.size();
+    assert( batch.records.size() <= std::numeric_limits<uint32_t>::max() );
+
+    std::vector<uint32_t> count( wnum );
+    std::vector<uint32_t> size( wnum );
+    auto ptr = begin;
+    while( ptr < end )
+    {
+        uint32_t id;
+        auto rec = LexiconDecodeVarInt( ptr, id );
+        ptr = SkipRecord( rec, positions );
+        count[id]++;
+        size[id] += ptr - rec;
+    }
+
+    // Records are grouped by word with a counting sort, which keeps post order of each word.
+    std::vector<uint32_t> next( wnum );
+    uint32_t total = 0;
+    for( auto id : order )
+    {
+        next[id] = total;
+        total += count[id];
+    }
+    std::vector<uint32_t> recs( total );
+    ptr = begin;
+    while( ptr < end )
+    {
+        uint32_t id;
+        auto rec = LexiconDecodeVarInt( ptr, id );
+        recs[next[id]++] = rec - begin;
+        ptr = SkipRecord( rec, positions );
+    }
+
+    uint32_t idx = 0;
+    for( auto id : order )
+    {
+        uint8_t tmp[10];
+        write( str[id], strlen( str[id] ) + 1 );
+        auto te = LexiconEncodeVarInt( tmp, count[id] );
+        te = LexiconEncodeVarInt( te, size[id] );
+        write( tmp, te - tmp );
+        for( uint32_t i=0; i<count[id]; i++ )
+        {
+            auto rec = begin + recs[idx++];
+            write( rec, SkipRecord( rec, positions ) - rec );
+        }
+    }
+}
+
+class PreviousLexicon;
+
+struct RunReader
+{
+    const uint8_t* ptr;
+    const uint8_t* end;
+
+    const char* word;
+    uint32_t count;
+    const uint8_t* data;
+
+    // Words of a previous lexicon are converted to run records in buf.
+    PreviousLexicon* prev = nullptr;
+    std::vector<uint8_t> buf;
+
+    bool Next();
+};
+
+// Lexicon of the archive before update, read in sorted word order. Posts are
+// moved to message indices of the updated archive and get current child counts.
+class PreviousLexicon
+{
+public:
+    PreviousLexicon( const std::string& base, bool positions, const std::vector<uint32_t>& remap, const MetaView<uint32_t, uint32_t>& conn )
+        : m_meta( base + "lexmeta" )
+        , m_data( base + "lexdata" )
+        , m_hit( base + "lexhit" )
+        , m_str( base + "lexstr" )
+        , m_pos( base + "lexpos", true )
+        , m_posmeta( base + "lexposmeta", true )
+        , m_positions( positions )
+        , m_remap( remap )
+        , m_conn( conn )
+        , m_next( 0 )
+    {
+        const uint32_t wnum = m_meta.DataSize();
+        m_order.resize( wnum );
+        for( uint32_t i=0; i<wnum; i++ ) m_order[i] = i;
+        std::sort( m_order.begin(), m_order.end(), [this] ( const auto& l, const auto& r ) { return strcmp( m_str + m_meta[l].str, m_str + m_meta[r].str ) < 0; } );
+    }
+
+    bool Next( RunReader& reader )
+    {
+        while( m_next < m_order.size() )
+        {
+            const auto& meta = m_meta[m_order[m_next++]];
+            const auto base = meta.data / sizeof( LexiconDataPacket );
+
+            m_posts.clear();
+            for( uint32_t i=0; i<meta.dataSize; i++ )
             {
-                if( basePos < max )
+                const auto idx = m_remap[m_data[base+i].postid & LexiconPostMask];
+                if( idx != MessageRemoved ) m_posts.emplace_back( idx, base+i );
+            }
+            if( m_posts.empty() ) continue;
+            std::sort( m_posts.begin(), m_posts.end() );
+
+            auto& rec = reader.buf;
+            rec.clear();
+            for( auto& v : m_posts )
+            {
+                const uint32_t postid = v.first | ( LexiconTransformChildNum( m_conn[v.first][2] - 1 ) << LexiconChildShift );
+                rec.insert( rec.end(), (const uint8_t*)&postid, (const uint8_t*)&postid + sizeof( uint32_t ) );
+
+                const auto hitoffset = m_data[v.second].hitoffset;
+                const uint8_t num = hitoffset >> LexiconHitShift;
+                if( num != 0 )
                 {
-                    uint8_t hit = enc | std::min<uint8_t>( max, basePos++ );
-                    vec.emplace_back( hit );
+                    rec.emplace_back( num );
+                    rec.insert( rec.end(), (const uint8_t*)&hitoffset, (const uint8_t*)&hitoffset + num );
                 }
                 else
                 {
-                    uint8_t hit = enc | max;
-                    if( std::find( vec.begin(), vec.end(), hit ) == vec.end() )
-                    {
-                        vec.emplace_back( hit );
-                    }
+                    const auto hits = m_hit + ( hitoffset & LexiconHitOffsetMask );
+                    rec.insert( rec.end(), hits, hits + 1 + *hits );
+                }
+
+                if( m_positions )
+                {
+                    const auto pos = m_pos + m_posmeta[v.second];
+                    uint32_t count, tmp;
+                    auto ptr = LexiconDecodeVarInt( pos, count );
+                    const auto start = ptr;
+                    for( uint32_t i=0; i<count; i++ ) ptr = LexiconDecodeVarInt( ptr, tmp );
+                    uint8_t buf[5];
+                    rec.insert( rec.end(), pos, start );
+                    rec.insert( rec.end(), buf, LexiconEncodeVarInt( buf, ptr - start ) );
+                    rec.insert( rec.end(), start, ptr );
                 }
             }
+
+            reader.word = m_str + meta.str;
+            reader.count = m_posts.size();
+            reader.data = rec.data();
+            return true;
         }
+        return false;
     }
+
+private:
+    FileMap<LexiconMetaPacket> m_meta;
+    FileMap<LexiconDataPacket> m_data;
+    FileMap<uint8_t> m_hit;
+    FileMap<char> m_str;
+    FileMap<uint8_t> m_pos;
+    FileMap<uint32_t> m_posmeta;
+
+    bool m_positions;
+    const std::vector<uint32_t>& m_remap;
+    const MetaView<uint32_t, uint32_t>& m_conn;
+
+    std::vector<uint32_t> m_order;
+    uint32_t m_next;
+    // New message index and data packet index of each post of current word.
+    std::vector<std::pair<uint32_t, uint32_t>> m_posts;
+};
+
+bool RunReader::Next()
+{
+    if( prev ) return prev->Next( *this );
+    if( ptr == end ) return false;
+    word = (const char*)ptr;
+    ptr += strlen( word ) + 1;
+    uint32_t size;
+    ptr = LexiconDecodeVarInt( ptr, count );
+    ptr = LexiconDecodeVarInt( ptr, size );
+    data = ptr;
+    ptr += size;
+    return true;
+}
+
+// Runs which did not fit in memory budget are written to temporary files.
+struct Runs
+{
+    std::mutex lock;
+    std::vector<std::vector<uint8_t>> memory;
+    std::vector<std::string> files;
+};
+
+static std::string RunName( const std::string& base, size_t idx )
+{
+    return base + "lexrun" + std::to_string( idx );
+}
+
+static void Spill( Batch& batch, bool positions, const std::string& base, Runs& runs )
+{
+    std::string fn;
+    {
+        std::lock_guard<std::mutex> lock( runs.lock );
+        fn = RunName( base, runs.files.size() );
+        runs.files.emplace_back( fn );
+    }
+    FILE* f = fopen( fn.c_str(), "wb" );
+    if( !f )
+    {
+        fprintf( stderr, "Cannot create temporary file %s\n", fn.c_str() );
+        exit( 1 );
+    }
+    WriteRun( batch, positions, [f] ( const void* ptr, size_t size ) { fwrite( ptr, 1, size, f ); } );
+    fclose( f );
+    batch.Clear();
 }
 
 int main( int argc, char** argv )
 {
-    if( argc != 2 )
+    bool positions = false;
+    int budget = 2048;
+    int interval = Checkpoint::DefaultInterval;
+    std::string source;
+
+    if( argc < 2 )
     {
-        fprintf( stderr, "USAGE: %s raw\n", argv[0] );
+        fprintf( stderr, "USAGE: %s [params] raw\nParams:\n", argv[0] );
+        fprintf( stderr, " -p              - build word position index for phrase search\n" );
+        fprintf( stderr, " -m megabytes    - memory for postings, before they are moved to temporary files (default: %i)\n", budget );
+        fprintf( stderr, " -u source       - extend lexicon of source archive, indexing only messages not present there\n" );
+        fprintf( stderr, " -c seconds      - save progress for resuming at given interval, 0 disables (default: %i)\n", interval );
         exit( 1 );
     }
 
+    for(;;)
+    {
+        if( argc > 2 && strcmp( argv[1], "-p" ) == 0 )
+        {
+            positions = true;
+            argv++;
+            argc--;
+        }
+        else if( argc > 3 && strcmp( argv[1], "-m" ) == 0 )
+        {
+            budget = std::max( 1, atoi( argv[2] ) );
+            argv += 2;
+            argc -= 2;
+        }
+        else if( argc > 3 && strcmp( argv[1], "-c" ) == 0 )
+        {
+            interval = std::max( 0, atoi( argv[2] ) );
+            argv += 2;
+            argc -= 2;
+        }
+        else if( argc > 3 && strcmp( argv[1], "-u" ) == 0 )
+        {
+            source = argv[2];
+            source.append( "/" );
+            argv += 2;
+            argc -= 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+
     std::string base = argv[1];
     base.append( "/" );
 
-    MessageView mview( base + "meta", base + "data" );
     MetaView<uint32_t, uint32_t> conn( base + "connmeta", base + "conndata" );
-    const auto size = mview.Size();
-    std::vector<std::string> wordbuf;
+    const auto size = MessageView( base + "meta", base + "data" ).Size();
 
-    // Purposefully disable destruction to not waste time at application exit
-    HitData* dataPtr = new HitData();
-    HitData& data = *dataPtr;
-
-    for( uint32_t i=0; i<size; i++ )
+    // In update mode source messages are found by message id. Only messages not present in source are indexed.
+    const bool update = !source.empty();
+    std::vector<uint32_t> remap;
+    std::vector<uint32_t> todo;
+    if( update )
     {
-        if( ( i & 0x3FF ) == 0 )
+        if( source == base )
         {
-            printf( "%i/%zu\r", i, size );
-            fflush( stdout );
+            fprintf( stderr, "Source and updated archive must be different.\n" );
+            exit( 1 );
+        }
+        if( positions && !Exists( source + "lexpos" ) )
+        {
+            fprintf( stderr, "Source lexicon has no word positions.\n" );
+            exit( 1 );
         }
 
-        bool headers = true;
-        bool signature = false;
-        int wrote;
-        int basePos[NUM_LEXICON_TYPES] = {};
-
-        int children = LexiconTransformChildNum( conn[i][2] - 1 );
+        const MetaView<uint32_t, uint8_t> middb( base + "midmeta", base + "middata" );
+        const StringCompress comp( base + "msgid.codebook" );
+        const FileMap<RawImportMeta> meta( base + "meta" );
+        const HashSearch<uint8_t> shash( source + "middata", source + "midhash", source + "midhashdata" );
+        const StringCompress scomp( source + "msgid.codebook" );
+        const FileMap<RawImportMeta> smeta( Exists( source + "zmeta" ) ? source + "zmeta" : source + "meta" );
 
-        auto post = mview[i];
-        for(;;)
+        remap.resize( smeta.DataSize(), MessageRemoved );
+        for( uint32_t i=0; i<size; i++ )
         {
-            auto end = post;
-            if( headers )
+            uint8_t repack[2048];
+            scomp.Repack( middb[i], repack, comp );
+            const auto idx = shash.Search( repack );
+            // Message replaced by update has the same message id, but different content.
+            if( idx >= 0 && smeta[idx].size == meta[i].size )
             {
-                if( *end == '\n' )
-                {
-                    headers = false;
-                    while( *end == '\n' ) end++;
-                    post = end;
-                    wrote = DetectWrote( post );
-                    continue;
-                }
-                while( *end != ':' ) end++;
-                end += 2;
-                auto headerType = IsHeaderAllowed( post, end-2 );
-                if( headerType != HeaderType::Invalid )
-                {
-                    int type;
-                    switch( headerType )
-                    {
-                    case HeaderType::From:
-                        type = T_From;
-                        break;
-                    case HeaderType::Subject:
-                        type = T_Subject;
-                        break;
-                    default:
-                        assert( false );
-                        type = 0;
-                        break;
-                    }
-                    const char* line = end;
-                    while( *end != '\n' ) end++;
-                    SplitLine( line, end, wordbuf );
-                    Add( data, wordbuf, i, type, 0, children );
-                }
-                else
-                {
-                    while( *end != '\n' ) end++;
-                }
-                post = end + 1;
+                remap[idx] = i;
             }
             else
             {
-                const char* line = end;
-                int quotLevel = 0;
-                while( *end != '\n' && *end != '\0' ) end++;
-                if( end - line == 3 && strncmp( line, "-- ", 3 ) == 0 )
-                {
-                    signature = true;
-                }
-                else
-                {
-                    quotLevel = QuotationLevel( line, end );
-                    assert( wrote <= 0 || quotLevel == 0 );
-                }
-                if( line != end )
+                todo.emplace_back( i );
+            }
+        }
+        printf( "%zu of %zu messages not present in source.\n", todo.size(), size );
+    }
+    const size_t num = update ? todo.size() : size;
+
+    const auto cpus = System::CPUCores();
+    const size_t batchBudget = std::min<size_t>( size_t( budget ) * 1024 * 1024 / cpus, std::numeric_limits<uint32_t>::max() / 2 );
+
+    // Interrupted run continues with runs spilled at the last checkpoint, which contain all messages before it.
+    Checkpoint checkpoint( base + ".lexicon.checkpoint", interval );
+    checkpoint.Param( positions );
+    checkpoint.Param( source );
+    checkpoint.Param( uint64_t( size ) );
+    checkpoint.Param( uint64_t( num ) );
+
+    Runs runs;
+    uint32_t done = 0;
+    if( checkpoint.Load() )
+    {
+        done = checkpoint.Get<uint32_t>();
+        const auto files = checkpoint.Get<uint32_t>();
+        for( uint32_t i=0; i<files; i++ ) runs.files.emplace_back( RunName( base, i ) );
+        if( std::all_of( runs.files.begin(), runs.files.end(), [] ( const auto& v ) { return Exists( v ); } ) )
+        {
+            printf( "Resuming after %i of %zu messages.\n", done, num );
+        }
+        else
+        {
+            done = 0;
+            runs.files.clear();
+        }
+    }
+    // Runs spilled after the checkpoint are not valid.
+    for( auto i=runs.files.size(); Exists( RunName( base, i ) ); i++ ) remove( RunName( base, i ).c_str() );
+
+    printf( "Indexing... (%i threads)\n", cpus );
+
+    std::vector<std::unique_ptr<Indexer>> indexers;
+    for( int t=0; t<cpus; t++ ) indexers.emplace_back( std::make_unique<Indexer>( positions ) );
+
+    TaskDispatch tasks( cpus-1 );
+    std::atomic<uint32_t> cnt( done );
+    for(;;)
+    {
+        for( auto& v : indexers )
+        {
+            tasks.Queue( [&cnt, num, &todo, update, &base, &conn, &runs, positions, batchBudget, &checkpoint, &indexer = *v] {
+                MessageView mview( base + "meta", base + "data" );
+                auto& batch = indexer.GetBatch();
+                while( !checkpoint.Due() )
                 {
-                    SplitLine( line, end, wordbuf );
-                    LexiconType t;
-                    if( signature )
+                    const auto start = cnt.fetch_add( ChunkSize, std::memory_order_relaxed );
+                    if( start >= num ) break;
+                    const auto end = std::min<uint32_t>( start + ChunkSize, num );
+                    for( uint32_t j=start; j<end; j++ )
                     {
-                        t = T_Signature;
+                        if( ( j & 0x3FF ) == 0 )
+                        {
+                            printf( "%i/%zu\r", j, num );
+                            fflush( stdout );
+                        }
+                        const auto i = update ? todo[j] : j;
+                        indexer.Process( mview[i], i, LexiconTransformChildNum( conn[i][2] - 1 ) );
+                        if( batch.Memory() > batchBudget ) Spill( batch, positions, base, runs );
                     }
-                    else if( wrote > 0 )
-                    {
-                        t = T_Wrote;
-                        wrote--;
-                    }
-                    else
-                    {
-                        t = LexiconTypeFromQuotLevel( quotLevel );
-                    }
-                    Add( data, wordbuf, i, t, basePos[t], children );
-                    basePos[t] += wordbuf.size();
                 }
-                if( *end == '\0' ) break;
-                post = end + 1;
-            }
+            } );
+        }
+        tasks.Sync();
+        if( cnt.load() >= num ) break;
+
+        // Workers finish taken chunks, so all messages before the counter are indexed.
+        checkpoint.Begin();
+        for( auto& v : indexers )
+        {
+            tasks.Queue( [&base, &runs, positions, &batch = v->GetBatch()] {
+                if( !batch.Empty() ) Spill( batch, positions, base, runs );
+            } );
         }
+        tasks.Sync();
+        checkpoint.Put( cnt.load() );
+        checkpoint.Put( uint32_t( runs.files.size() ) );
+        checkpoint.Save();
     }
 
-    auto it = data.begin();
-    while( it != data.end() )
+    for( auto& v : indexers )
     {
-        if( it->second.size() == 1 )
+        tasks.Queue( [&runs, positions, &batch = v->GetBatch()] {
+            if( batch.Empty() ) return;
+            std::vector<uint8_t> run;
+            WriteRun( batch, positions, [&run] ( const void* ptr, size_t size ) { run.insert( run.end(), (const uint8_t*)ptr, (const uint8_t*)ptr + size ); } );
+            batch.Clear();
+            std::lock_guard<std::mutex> lock( runs.lock );
+            runs.memory.emplace_back( std::move( run ) );
+        } );
+    }
+    tasks.Sync();
+    indexers.clear();
+
+    printf( "\nMerging %zu runs (%zu in temporary files)%s...\n", runs.memory.size() + runs.files.size(), runs.files.size(), update ? " with source lexicon" : "" );
+    fflush( stdout );
+
+    std::vector<FileMap<uint8_t>> runFiles;
+    runFiles.reserve( runs.files.size() );
+    std::vector<RunReader> readers;
+    for( auto& v : runs.memory )
+    {
+        readers.emplace_back( RunReader { v.data(), v.data() + v.size() } );
+    }
+    for( auto& v : runs.files )
+    {
+        runFiles.emplace_back( v );
+        const uint8_t* ptr = runFiles.back();
+        readers.emplace_back( RunReader { ptr, ptr + runFiles.back().Size() } );
+    }
+    std::unique_ptr<PreviousLexicon> prev;
+    if( update )
+    {
+        prev = std::make_unique<PreviousLexicon>( source, positions, remap, conn );
+        readers.emplace_back( RunReader { nullptr, nullptr } );
+        readers.back().prev = prev.get();
+    }
+
+    const auto cmp = [&readers] ( const auto& l, const auto& r ) { return strcmp( readers[l].word, readers[r].word ) > 0; };
+    std::priority_queue<uint32_t, std::vector<uint32_t>, decltype( cmp )> queue( cmp );
+    for( uint32_t i=0; i<readers.size(); i++ )
+    {
+        if( readers[i].Next() ) queue.push( i );
+    }
+
+    FILE* fdata = fopen( ( base + "lexdata" ).c_str(), "wb" );
+    FILE* fhit = fopen( ( base + "lexhit" ).c_str(), "wb" );
+
+    FILE* fpos = nullptr;
+    FILE* fposmeta = nullptr;
+    if( positions )
+    {
+        fpos = fopen( ( base + "lexpos" ).c_str(), "wb" );
+        fposmeta = fopen( ( base + "lexposmeta" ).c_str(), "wb" );
+    }
+    else
+    {
+        // stale position data would not match the new lexicon
+        remove( ( base + "lexpos" ).c_str() );
+        remove( ( base + "lexposmeta" ).c_str() );
+    }
+
+    uint32_t odata = 0;
+    uint32_t ohit = 0;
+    uint32_t opos = 0;
+
+    // Words are merged in sorted order, which is also the order of word indices.
+    std::vector<char> strdata;
+    std::vector<uint32_t> stroffset;
+    std::vector<LexiconMetaPacket> meta;
+    std::vector<uint32_t> active;
+    std::vector<const uint8_t*> posts;
+
+    for(;;)
+    {
+        // Readers of the previous word are advanced only now, as their data may be in reusable buffers.
+        for( auto idx : active )
         {
-            it = data.erase( it );
+            if( readers[idx].Next() ) queue.push( idx );
         }
-        else
+        active.clear();
+        if( queue.empty() ) break;
+
+        const auto word = readers[queue.top()].word;
+        uint32_t total = 0;
+        while( !queue.empty() && strcmp( readers[queue.top()].word, word ) == 0 )
+        {
+            active.emplace_back( queue.top() );
+            total += readers[queue.top()].count;
+            queue.pop();
+        }
+
+        // Words found in only one message are not useful for search.
+        if( total == 1 ) continue;
+
+        if( ( meta.size() & 0x3FF ) == 0 )
+        {
+            printf( "%zu\r", meta.size() );
+            fflush( stdout );
+        }
+
+        posts.clear();
+        for( auto idx : active )
         {
-            ++it;
+            auto ptr = readers[idx].data;
+            for( uint32_t i=0; i<readers[idx].count; i++ )
+            {
+                posts.emplace_back( ptr );
+                ptr = SkipRecord( ptr, positions );
+            }
         }
+        if( active.size() > 1 )
+        {
+            std::sort( posts.begin(), posts.end(), [] ( const auto& l, const auto& r ) {
+                uint32_t lp, rp;
+                memcpy( &lp, l, sizeof( uint32_t ) );
+                memcpy( &rp, r, sizeof( uint32_t ) );
+                return ( lp & LexiconPostMask ) < ( rp & LexiconPostMask );
+            } );
+        }
+
+        stroffset.emplace_back( strdata.size() );
+        strdata.insert( strdata.end(), word, word + strlen( word ) + 1 );
+        meta.emplace_back( LexiconMetaPacket { 0, odata, total } );
+
+        for( auto ptr : posts )
+        {
+            fwrite( ptr, 1, sizeof( uint32_t ), fdata );
+            ptr += sizeof( uint32_t );
+            const uint8_t num = *ptr++;
+            const auto hits = ptr;
+            ptr += num;
+
+            if( num < 4 )
+            {
+                // Inline hits are read in memory order.
+                uint32_t v = 0;
+                memcpy( &v, hits, num );
+                v |= num << LexiconHitShift;
+                fwrite( &v, 1, sizeof( uint32_t ), fdata );
+            }
+            else
+            {
+                fwrite( &ohit, 1, sizeof( uint32_t ), fdata );
+                ohit += fwrite( &num, 1, sizeof( uint8_t ), fhit );
+                ohit += fwrite( hits, 1, sizeof( uint8_t ) * num, fhit );
+            }
+
+            if( positions )
+            {
+                uint32_t count, psize;
+                const auto pcount = ptr;
+                ptr = LexiconDecodeVarInt( ptr, count );
+                const auto bsize = ptr - pcount;
+                ptr = LexiconDecodeVarInt( ptr, psize );
+                assert( uint64_t( opos ) + bsize + psize <= std::numeric_limits<uint32_t>::max() );
+                fwrite( &opos, 1, sizeof( uint32_t ), fposmeta );
+                opos += fwrite( pcount, 1, bsize, fpos );
+                opos += fwrite( ptr, 1, psize, fpos );
+            }
+        }
+        odata += sizeof( uint32_t ) * total * 2;
+    }
+
+    fclose( fdata );
+    fclose( fhit );
+    if( positions )
+    {
+        fclose( fpos );
+        fclose( fposmeta );
     }
 
+    readers.clear();
+    prev.reset();
+    runFiles.clear();
+    runs.memory.clear();
+    checkpoint.Remove();
+    for( auto& v : runs.files ) remove( v.c_str() );
+
     printf( "\nSaving...\n" );
     fflush( stdout );
 
-    auto wordNum = data.size();
+    const auto wordNum = meta.size();
     auto hashbits = MsgIdHashBits( wordNum, 90 );
     auto hashsize = MsgIdHashSize( hashbits );
     auto hashmask = MsgIdHashMask( hashbits );
@@ -248,23 +861,22 @@ int main( int argc, char** argv )
     memset( distance, 0xFF, hashsize );
     uint8_t distmax = 0;
 
-    int cnt = 0;
     std::vector<const char*> strings;
     strings.reserve( wordNum );
-    for( auto& v : data )
+    for( uint32_t i=0; i<wordNum; i++ )
     {
-        if( ( cnt & 0xFFF ) == 0 )
+        if( ( i & 0xFFF ) == 0 )
         {
-            printf( "%i/%zu\r", cnt, wordNum );
+            printf( "%i/%zu\r", i, wordNum );
             fflush( stdout );
         }
 
-        const auto& s = v.first;
-        strings.emplace_back( s.c_str() );
+        const auto s = strdata.data() + stroffset[i];
+        strings.emplace_back( s );
 
-        uint32_t hash = XXH32( s.c_str(), s.size(), 0 ) & hashmask;
+        uint32_t hash = XXH32( s, strlen( s ), 0 ) & hashmask;
         uint8_t dist = 0;
-        uint32_t idx = cnt;
+        uint32_t idx = i;
         for(;;)
         {
             if( distance[hash] == 0xFF )
@@ -284,8 +896,6 @@ int main( int argc, char** argv )
             assert( dist < std::numeric_limits<uint8_t>::max() );
             hash = (hash+1) & hashmask;
         }
-
-        cnt++;
     }
 
     printf( "\n" );
@@ -298,11 +908,9 @@ int main( int argc, char** argv )
     FILE* fstr = fopen( ( base + "lexstr" ).c_str(), "wb" );
 
     uint32_t zero = 0;
-    uint32_t stroffset = fwrite( &zero, 1, 1, fstr );
-
-    auto offsetData = new uint32_t[wordNum];
+    uint32_t ostr = fwrite( &zero, 1, 1, fstr );
 
-    cnt = 0;
+    uint32_t stored = 0;
     for( int i=0; i<hashsize; i++ )
     {
         if( ( i & 0x3FFF ) == 0 )
@@ -318,78 +926,58 @@ int main( int argc, char** argv )
         }
         else
         {
-            fwrite( &stroffset, 1, sizeof( uint32_t ), fhash );
+            fwrite( &ostr, 1, sizeof( uint32_t ), fhash );
             fwrite( hashdata+i, 1, sizeof( uint32_t ), fhash );
 
-            offsetData[hashdata[i]] = stroffset;
-            cnt++;
+            meta[hashdata[i]].str = ostr;
+            stored++;
             auto str = strings[hashdata[i]];
-            stroffset += fwrite( str, 1, strlen( str ) + 1, fstr );
+            ostr += fwrite( str, 1, strlen( str ) + 1, fstr );
         }
     }
-    assert( cnt == data.size() );
+    assert( stored == wordNum );
     fclose( fhash );
     fclose( fstr );
 
     printf( "\n" );
 
     FILE* fmeta = fopen( ( base + "lexmeta" ).c_str(), "wb" );
-    FILE* fdata = fopen( ( base + "lexdata" ).c_str(), "wb" );
-    FILE* fhit = fopen( ( base + "lexhit" ).c_str(), "wb" );
-
-    uint32_t odata = 0;
-    uint32_t ohit = 0;
+    fwrite( meta.data(), 1, sizeof( LexiconMetaPacket ) * wordNum, fmeta );
+    fclose( fmeta );
 
-    uint32_t idx = 0;
-    const auto dataSize = data.size();
-    for( auto& v : data )
     {
-        if( ( idx & 0x3FF ) == 0 )
-        {
-            printf( "%i/%zu\r", idx, dataSize );
-            fflush( stdout );
-        }
-
-        uint32_t dsize = v.second.size();
-        fwrite( &offsetData[idx], 1, sizeof( uint32_t ), fmeta );
-        fwrite( &odata, 1, sizeof( uint32_t ), fmeta );
-        fwrite( &dsize, 1, sizeof( uint32_t ), fmeta );
+        // Sorted, front-coded dictionary for prefix searches. Word indices are already in sorted order.
+        FILE* fdict = fopen( ( base + "lexdict" ).c_str(), "wb" );
+        FILE* fdictmeta = fopen( ( base + "lexdictmeta" ).c_str(), "wb" );
 
-        for( auto& d : v.second )
+        uint32_t odict = 0;
+        const char* prev = "";
+        for( uint32_t i=0; i<wordNum; i++ )
         {
-            uint8_t num = std::min<uint8_t>( std::numeric_limits<uint8_t>::max(), d.second.size() );
-
-            fwrite( &d.first, 1, sizeof( uint32_t ), fdata );
-
-            if( num < 4 )
+            const auto str = strings[i];
+            uint32_t shared = 0;
+            if( i % LexiconDictBlock == 0 )
             {
-                uint32_t numshift = num << LexiconHitShift;
-                uint32_t v = 0;
-                for( int i=0; i<num; i++ )
-                {
-                    v <<= 8;
-                    v |= d.second[i];
-                }
-                v |= numshift;
-                fwrite( &v, 1, sizeof( uint32_t ), fdata );
+                fwrite( &odict, 1, sizeof( uint32_t ), fdictmeta );
             }
             else
             {
-                fwrite( &ohit, 1, sizeof( uint32_t ), fdata );
-                ohit += fwrite( &num, 1, sizeof( uint8_t ), fhit );
-                ohit += fwrite( d.second.data(), 1, sizeof( uint8_t ) * num, fhit );
+                while( str[shared] != '\0' && str[shared] == prev[shared] ) shared++;
             }
-        }
-        odata += sizeof( uint32_t ) * dsize * 2;
+            const uint32_t len = strlen( str + shared );
 
-        idx++;
-    }
+            uint8_t buf[5];
+            odict += fwrite( buf, 1, LexiconEncodeVarInt( buf, shared ) - buf, fdict );
+            odict += fwrite( buf, 1, LexiconEncodeVarInt( buf, len ) - buf, fdict );
+            odict += fwrite( str + shared, 1, len, fdict );
+            odict += fwrite( buf, 1, LexiconEncodeVarInt( buf, i ) - buf, fdict );
 
-    printf( "\n" );
+            prev = str;
+        }
 
-    fclose( fmeta );
-    fclose( fdata );
-    fclose( fhit );
+        fclose( fdict );
+        fclose( fdictmeta );
+    }
 
     return 0;
 }
@@ -1,5 +1,8 @@
 #include <algorithm>
+#include <assert.h>
+#include <atomic>
 #include <inttypes.h>
+#include <memory>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,7 +11,66 @@
 #include <vector>
 
 #include "../common/FileMap.hpp"
+#include "../common/Filesystem.hpp"
 #include "../common/LexiconTypes.hpp"
+#include "../common/MetaView.hpp"
+#include "../common/System.hpp"
+#include "../common/TaskDispatch.hpp"
+
+// Number of words processed by a task at once.
+enum { WordBlock = 64 };
+
+// Per-word lists built for a block of words. Meta offsets are relative to the block.
+struct Block
+{
+    std::vector<uint32_t> hdr;
+    std::vector<uint32_t> hdrmeta;
+    std::vector<uint32_t> rank;
+    std::vector<uint32_t> rankmeta;
+};
+
+static bool PostOrder( const LexiconDataPacket& l, const LexiconDataPacket& r )
+{
+    return ( l.postid & LexiconPostMask ) < ( r.postid & LexiconPostMask );
+}
+
+static bool HitOrder( uint8_t l, uint8_t r )
+{
+    return LexiconHitRank( l ) > LexiconHitRank( r );
+}
+
+// Files are mapped while being replaced, so new content is written aside. It is moved over the original file
+// with Commit(), after the mapping is released.
+static void WriteTemp( const std::string& fn, const void* data, size_t size )
+{
+    const auto tmp = fn + ".tmp";
+    FILE* f = fopen( tmp.c_str(), "wb" );
+    if( !f )
+    {
+        fprintf( stderr, "Cannot create %s\n", tmp.c_str() );
+        exit( 1 );
+    }
+    const auto written = fwrite( data, 1, size, f );
+    if( fclose( f ) != 0 || written != size )
+    {
+        fprintf( stderr, "Cannot write %s\n", tmp.c_str() );
+        remove( tmp.c_str() );
+        exit( 1 );
+    }
+}
+
+static void Commit( const std::string& fn )
+{
+    const auto tmp = fn + ".tmp";
+#ifdef _WIN32
+    remove( fn.c_str() );
+#endif
+    if( rename( tmp.c_str(), fn.c_str() ) != 0 )
+    {
+        fprintf( stderr, "Cannot replace %s\n", fn.c_str() );
+        exit( 1 );
+    }
+}
 
 int main( int argc, char** argv )
 {
@@ -22,70 +84,242 @@ int main( int argc, char** argv )
     base.append( "/" );
     FileMap<LexiconMetaPacket> meta( base + "lexmeta" );
 
-    LexiconDataPacket* data;
-    uint8_t* hits;
-    uint32_t datasize, hitssize;
+    // Lexicon normally is already sorted. Data is mapped copy-on-write, so that only pages
+    // which need fixing are copied, and the files are rewritten only if anything was fixed.
+    auto mdata = std::make_unique<FileMap<LexiconDataPacket>>( base + "lexdata", false, true );
+    auto mhits = std::make_unique<FileMap<uint8_t>>( base + "lexhit", false, true );
+    LexiconDataPacket* data = mdata->Writable();
+    uint8_t* hits = mhits->Writable();
+    const auto datasize = mdata->DataSize();
+
+    // Position index entries are parallel to data packets and have to follow them.
+    std::unique_ptr<FileMap<uint32_t>> mposmeta;
+    uint32_t* posmeta = nullptr;
+    if( Exists( base + "lexposmeta" ) )
+    {
+        mposmeta = std::make_unique<FileMap<uint32_t>>( base + "lexposmeta", false, true );
+        assert( mposmeta->DataSize() == datasize );
+        posmeta = mposmeta->Writable();
+    }
+
+    // Very common words also get a bitmap of posts, for fast set logic.
+    uint32_t msgnum;
+    {
+        MetaView<uint32_t, uint32_t> conn( base + "connmeta", base + "conndata" );
+        msgnum = conn.Size();
+    }
+    const uint32_t bmpsize = ( msgnum + 63 ) / 64;
+    const uint32_t bmpthreshold = std::max<uint32_t>( 1, msgnum / LexiconBitmapDensity );
+
+    const uint32_t size = meta.DataSize();
+    const uint32_t blocks = ( size + WordBlock - 1 ) / WordBlock;
+    std::vector<Block> result( blocks );
+
+    const auto cpus = System::CPUCores();
+    printf( "Verifying... (%i threads)\n", cpus );
+
+    TaskDispatch tasks( cpus-1 );
+    std::atomic<uint32_t> cnt( 0 );
+    std::atomic<uint32_t> fixedPosts( 0 );
+    std::atomic<uint32_t> fixedHits( 0 );
+    for( int t=0; t<cpus; t++ )
     {
-        FileMap<LexiconDataPacket> mdata( base + "lexdata" );
-        FileMap<uint8_t> mhits( base + "lexhit" );
+        tasks.Queue( [&cnt, &fixedPosts, &fixedHits, &result, &meta, blocks, size, data, hits, posmeta] {
+            std::vector<uint32_t> order;
+            std::vector<LexiconDataPacket> tmpdata;
+            std::vector<uint32_t> tmppos;
+            std::vector<float> prank;
+            uint32_t posts = 0;
+            uint32_t hitlists = 0;
+            for(;;)
+            {
+                const auto b = cnt.fetch_add( 1, std::memory_order_relaxed );
+                if( b >= blocks ) break;
+                if( ( b & 0x7F ) == 0 )
+                {
+                    printf( "%i/%i\r", b * WordBlock, size );
+                    fflush( stdout );
+                }
 
-        datasize = mdata.DataSize();
-        hitssize = mhits.DataSize();
+                auto& block = result[b];
+                const auto end = std::min<uint32_t>( ( b + 1 ) * WordBlock, size );
+                for( uint32_t i=b*WordBlock; i<end; i++ )
+                {
+                    auto mp = meta + i;
+                    auto dptr = data + ( mp->data / sizeof( LexiconDataPacket ) );
+                    auto dsize = mp->dataSize;
+                    if( !std::is_sorted( dptr, dptr + dsize, PostOrder ) )
+                    {
+                        posts++;
+                        if( posmeta )
+                        {
+                            auto pptr = posmeta + ( mp->data / sizeof( LexiconDataPacket ) );
+                            order.resize( dsize );
+                            for( uint32_t j=0; j<dsize; j++ ) order[j] = j;
+                            std::sort( order.begin(), order.end(), [dptr] ( const auto& l, const auto& r ) { return PostOrder( dptr[l], dptr[r] ); } );
+                            tmpdata.assign( dptr, dptr + dsize );
+                            tmppos.assign( pptr, pptr + dsize );
+                            for( uint32_t j=0; j<dsize; j++ )
+                            {
+                                dptr[j] = tmpdata[order[j]];
+                                pptr[j] = tmppos[order[j]];
+                            }
+                        }
+                        else
+                        {
+                            std::sort( dptr, dptr + dsize, PostOrder );
+                        }
+                    }
 
-        data = new LexiconDataPacket[datasize];
-        hits = new uint8_t[hitssize];
+                    // Postings of long lists, in order of decreasing static rank. Indices are relative to the start of word data.
+                    const bool ranked = dsize >= LexiconRankMinSize;
+                    if( ranked ) prank.resize( dsize );
 
-        memcpy( data, mdata, mdata.Size() );
-        memcpy( hits, mhits, mhits.Size() );
+                    // Header posting lists contain indices of data packets with subject or from hits, in post order.
+                    block.hdrmeta.emplace_back( block.hdr.size() );
+                    for( uint32_t j=0; j<dsize; j++ )
+                    {
+                        uint8_t hnum = dptr[j].hitoffset >> LexiconHitShift;
+                        uint8_t* hptr;
+                        if( hnum == 0 )
+                        {
+                            hptr = hits + ( dptr[j].hitoffset & LexiconHitOffsetMask );
+                            hnum = *hptr++;
+                        }
+                        else
+                        {
+                            hptr = (uint8_t*)&dptr[j].hitoffset;
+                        }
+                        if( hnum > 1 && !std::is_sorted( hptr, hptr + hnum, HitOrder ) )
+                        {
+                            hitlists++;
+                            std::sort( hptr, hptr + hnum, HitOrder );
+                        }
+                        if( ranked ) prank[j] = LexiconPostingRank( *hptr, hnum, dptr[j].postid >> LexiconChildShift );
+                        for( int k=0; k<hnum; k++ )
+                        {
+                            const auto type = LexiconDecodeType( hptr[k] );
+                            if( type == T_Subject || type == T_From )
+                            {
+                                block.hdr.emplace_back( dptr + j - data );
+                                break;
+                            }
+                        }
+                    }
+
+                    block.rankmeta.emplace_back( block.rank.size() );
+                    if( ranked )
+                    {
+                        order.resize( dsize );
+                        for( uint32_t j=0; j<dsize; j++ ) order[j] = j;
+                        std::stable_sort( order.begin(), order.end(), [&prank] ( const auto& l, const auto& r ) { return prank[l] > prank[r]; } );
+                        block.rank.insert( block.rank.end(), order.begin(), order.end() );
+                    }
+                }
+            }
+            fixedPosts.fetch_add( posts, std::memory_order_relaxed );
+            fixedHits.fetch_add( hitlists, std::memory_order_relaxed );
+        } );
     }
+    tasks.Sync();
 
-    const auto size = meta.DataSize();
-    for( uint32_t i=0; i<size; i++ )
+    printf( "%i/%i\n", size, size );
+    if( fixedPosts != 0 || fixedHits != 0 )
     {
-        if( ( i & 0x1FFF ) == 0 )
-        {
-            printf( "%i/%zu\r", i, size );
-            fflush( stdout );
-        }
+        printf( "Sorted %i post lists and %i hit lists.\n", fixedPosts.load(), fixedHits.load() );
+    }
+    fflush( stdout );
 
-        auto mp = meta + i;
-        auto dptr = data + ( mp->data / sizeof( LexiconDataPacket ) );
-        auto dsize = mp->dataSize;
-        std::sort( dptr, dptr + dsize, [] ( const auto& l, const auto& r ) { return ( l.postid & LexiconPostMask ) < ( r.postid & LexiconPostMask ); } );
+    std::vector<uint32_t> hdrmeta;
+    std::vector<uint32_t> rankmeta;
+    uint32_t hdrsize = 0;
+    uint32_t ranksize = 0;
+
+    FILE* fhdr = fopen( ( base + "lexhdr" ).c_str(), "wb" );
+    FILE* frank = fopen( ( base + "lexrank" ).c_str(), "wb" );
+    for( auto& block : result )
+    {
+        for( auto& v : block.hdrmeta ) hdrmeta.emplace_back( v + hdrsize );
+        for( auto& v : block.rankmeta ) rankmeta.emplace_back( v + ranksize );
+        hdrsize += fwrite( block.hdr.data(), 1, block.hdr.size() * sizeof( uint32_t ), fhdr ) / sizeof( uint32_t );
+        ranksize += fwrite( block.rank.data(), 1, block.rank.size() * sizeof( uint32_t ), frank ) / sizeof( uint32_t );
+        block = Block();
+    }
+    hdrmeta.emplace_back( hdrsize );
+    rankmeta.emplace_back( ranksize );
+    fclose( fhdr );
+    fclose( frank );
+
+    FILE* fhdrmeta = fopen( ( base + "lexhdrmeta" ).c_str(), "wb" );
+    fwrite( hdrmeta.data(), 1, hdrmeta.size() * sizeof( uint32_t ), fhdrmeta );
+    fclose( fhdrmeta );
+
+    if( ranksize == 0 )
+    {
+        remove( ( base + "lexrank" ).c_str() );
+        remove( ( base + "lexrankmeta" ).c_str() );
+    }
+    else
+    {
+        FILE* frankmeta = fopen( ( base + "lexrankmeta" ).c_str(), "wb" );
+        fwrite( rankmeta.data(), 1, rankmeta.size() * sizeof( uint32_t ), frankmeta );
+        fclose( frankmeta );
+    }
 
-        for( int i=0; i<dsize; i++ )
+    std::vector<uint64_t> bmp( bmpsize );
+    std::vector<uint32_t> bmpmeta;
+    uint32_t bmpoffset = 0;
+    FILE* fbmp = fopen( ( base + "lexbmp" ).c_str(), "wb" );
+    for( uint32_t i=0; i<size; i++ )
+    {
+        auto mp = meta + i;
+        if( mp->dataSize >= bmpthreshold )
         {
-            uint8_t hnum = dptr[i].hitoffset >> LexiconHitShift;
-            uint8_t* hptr;
-            if( hnum == 0 )
-            {
-                hptr = hits + ( dptr[i].hitoffset & LexiconHitOffsetMask );
-                hnum = *hptr++;
-            }
-            else
-            {
-                hptr = (uint8_t*)&dptr[i].hitoffset;
-            }
-            if( hnum > 1 )
+            auto dptr = data + ( mp->data / sizeof( LexiconDataPacket ) );
+            std::fill( bmp.begin(), bmp.end(), 0 );
+            for( uint32_t j=0; j<mp->dataSize; j++ )
             {
-                std::sort( hptr, hptr + hnum, [] ( const auto& l, const auto& r ) { return LexiconHitRank( l ) > LexiconHitRank( r ); } );
+                const auto postid = dptr[j].postid & LexiconPostMask;
+                bmp[postid / 64] |= uint64_t( 1 ) << ( postid % 64 );
             }
+            fwrite( bmp.data(), 1, bmpsize * sizeof( uint64_t ), fbmp );
+            bmpmeta.emplace_back( bmpoffset );
+            bmpoffset += bmpsize;
+        }
+        else
+        {
+            bmpmeta.emplace_back( LexiconNoBitmap );
         }
     }
+    fclose( fbmp );
 
-    printf( "\n" );
-
-    FILE* fdata = fopen( ( base + "lexdata" ).c_str(), "wb" );
-    FILE* fhits = fopen( ( base + "lexhit" ).c_str(), "wb" );
+    if( bmpoffset == 0 )
+    {
+        remove( ( base + "lexbmp" ).c_str() );
+        remove( ( base + "lexbmpmeta" ).c_str() );
+    }
+    else
+    {
+        FILE* fbmpmeta = fopen( ( base + "lexbmpmeta" ).c_str(), "wb" );
+        fwrite( bmpmeta.data(), 1, bmpmeta.size() * sizeof( uint32_t ), fbmpmeta );
+        fclose( fbmpmeta );
+    }
 
-    fwrite( data, 1, datasize * sizeof( LexiconDataPacket ), fdata );
-    fwrite( hits, 1, hitssize * sizeof( uint8_t ), fhits );
+    // Inline hits are stored in data packets, so sorting any hits may change both files.
+    const bool replaceData = fixedPosts != 0 || fixedHits != 0;
+    const bool replaceHits = fixedHits != 0;
+    const bool replacePos = posmeta && fixedPosts != 0;
+    if( replaceData ) WriteTemp( base + "lexdata", data, mdata->Size() );
+    if( replaceHits ) WriteTemp( base + "lexhit", hits, mhits->Size() );
+    if( replacePos ) WriteTemp( base + "lexposmeta", posmeta, mposmeta->Size() );
 
-    fclose( fdata );
-    fclose( fhits );
+    mdata.reset();
+    mhits.reset();
+    mposmeta.reset();
 
-    delete[] data;
-    delete[] hits;
+    if( replaceData ) Commit( base + "lexdata" );
+    if( replaceHits ) Commit( base + "lexhit" );
+    if( replacePos ) Commit( base + "lexposmeta" );
 
     return 0;
 }
@@ -1,5 +1,8 @@
 #include <algorithm>
+#include <atomic>
 #include <inttypes.h>
+#include <memory>
+#include <numeric>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,20 +11,134 @@
 #include <vector>
 
 #include "../common/FileMap.hpp"
+#include "../common/Filesystem.hpp"
 #include "../common/LexiconTypes.hpp"
+#include "../common/MetaView.hpp"
+#include "../common/System.hpp"
+#include "../common/TaskDispatch.hpp"
+
+// Number of words processed by a task at once.
+enum { WordBlock = 256 };
+// Number of most expensive terms listed by default.
+enum { DefaultTopTerms = 50 };
+// Posting list distributions use power of two buckets.
+enum { Buckets = 40 };
 
 struct Stats
 {
+    const char* str;
+    uint32_t postings;
     uint32_t cnt;
-    uint32_t lexdata;
-    uint32_t lexhit;
+    // Bytes in lexhit. Inline hits are stored in lexdata.
+    uint64_t lexhit;
+    uint64_t lexpos;
+    // Size of post ids and child counts encoded as varint deltas.
+    uint64_t delta;
+};
+
+// Field breakdown, summed over words by each task.
+struct Fields
+{
+    uint64_t hits[NUM_LEXICON_TYPES];
+    uint64_t postings[NUM_LEXICON_TYPES];
+    uint64_t words[NUM_LEXICON_TYPES];
 };
 
+static uint32_t VarIntSize( uint32_t v )
+{
+    uint32_t size = 1;
+    while( v >= 0x80 )
+    {
+        v >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static int Bucket( uint64_t v )
+{
+    int b = 0;
+    while( v > 1 && b < Buckets-1 )
+    {
+        v >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// Bytes read to evaluate a word in a query: posting list and hits needed for ranking.
+static uint64_t Cost( const Stats& s )
+{
+    return uint64_t( s.postings ) * sizeof( LexiconDataPacket ) + s.lexhit;
+}
+
+static void PrintJsonString( const char* str )
+{
+    putchar( '"' );
+    for( auto ptr = (const unsigned char*)str; *ptr; ptr++ )
+    {
+        if( *ptr == '"' || *ptr == '\\' )
+        {
+            printf( "\\%c", *ptr );
+        }
+        else if( *ptr < 0x20 )
+        {
+            printf( "\\u%04x", *ptr );
+        }
+        else
+        {
+            putchar( *ptr );
+        }
+    }
+    putchar( '"' );
+}
+
+static double Ratio( uint64_t raw, uint64_t encoded )
+{
+    return encoded > 0 ? double( raw ) / encoded : 0.;
+}
+
+static double Share( uint64_t part, uint64_t total )
+{
+    return total > 0 ? part * 100. / total : 0.;
+}
+
 int main( int argc, char** argv )
 {
+    bool json = false;
+    int top = DefaultTopTerms;
+
+    if( argc < 2 )
+    {
+        fprintf( stderr, "USAGE: %s [params] directory\nParams:\n", argv[0] );
+        fprintf( stderr, " -j              - print analysis report in JSON format\n" );
+        fprintf( stderr, " -n terms        - number of most expensive terms in report (default: %i)\n", top );
+        exit( 1 );
+    }
+
+    for(;;)
+    {
+        if( strcmp( argv[1], "-j" ) == 0 )
+        {
+            json = true;
+            argv++;
+            argc--;
+        }
+        else if( strcmp( argv[1], "-n" ) == 0 && argc > 2 )
+        {
+            top = std::max( 0, atoi( argv[2] ) );
+            argv += 2;
+            argc -= 2;
+        }
+        else
+        {
+            break;
+        }
+        if( argc < 2 ) break;
+    }
     if( argc != 2 )
     {
-        fprintf( stderr, "USAGE: %s directory\n", argv[0] );
+        fprintf( stderr, "Missing archive directory.\n" );
         exit( 1 );
     }
 
@@ -29,76 +146,305 @@ int main( int argc, char** argv )
     base.append( "/" );
     FileMap<LexiconMetaPacket> meta( base + "lexmeta" );
     FileMap<char> str( base + "lexstr" );
-    FileMap<uint32_t> ldata( base + "lexdata" );
+    FileMap<LexiconDataPacket> ldata( base + "lexdata" );
     FileMap<uint8_t> hits( base + "lexhit" );
 
-    std::vector<std::pair<const char*, Stats>> data;
+    std::unique_ptr<FileMap<uint8_t>> lexpos;
+    std::unique_ptr<FileMap<uint32_t>> lexposmeta;
+    if( Exists( base + "lexpos" ) && Exists( base + "lexposmeta" ) )
+    {
+        lexpos = std::make_unique<FileMap<uint8_t>>( base + "lexpos" );
+        lexposmeta = std::make_unique<FileMap<uint32_t>>( base + "lexposmeta" );
+    }
+    const uint8_t* pos = lexpos ? (const uint8_t*)*lexpos : nullptr;
+    const uint32_t* posmeta = lexposmeta ? (const uint32_t*)*lexposmeta : nullptr;
 
-    const auto size = meta.DataSize();
-    uint64_t sizes[6] = {};
-    uint64_t totalSize = 0;
-    for( uint32_t i=0; i<size; i++ )
+    uint32_t msgnum;
     {
-        if( ( i & 0x1FFF ) == 0 )
+        MetaView<uint32_t, uint32_t> conn( base + "connmeta", base + "conndata" );
+        msgnum = conn.Size();
+    }
+    const uint64_t bmpbytes = uint64_t( ( msgnum + 63 ) / 64 ) * sizeof( uint64_t );
+    const uint32_t bmpthreshold = std::max<uint32_t>( 1, msgnum / LexiconBitmapDensity );
+
+    const uint32_t size = meta.DataSize();
+    const uint32_t blocks = ( size + WordBlock - 1 ) / WordBlock;
+    std::vector<Stats> data( size );
+
+    const auto cpus = System::CPUCores();
+    std::vector<Fields> fields( cpus );
+    memset( fields.data(), 0, fields.size() * sizeof( Fields ) );
+
+    TaskDispatch tasks( cpus-1 );
+    std::atomic<uint32_t> cnt( 0 );
+    for( unsigned int t=0; t<cpus; t++ )
+    {
+        tasks.Queue( [&cnt, &data, &meta, &str, &ldata, &hits, &fields, t, json, blocks, size, pos, posmeta] {
+            auto& f = fields[t];
+            for(;;)
+            {
+                const auto b = cnt.fetch_add( 1, std::memory_order_relaxed );
+                if( b >= blocks ) break;
+                if( !json && ( b & 0x1F ) == 0 )
+                {
+                    printf( "%i/%i\r", b * WordBlock, size );
+                    fflush( stdout );
+                }
+
+                const auto end = std::min<uint32_t>( ( b + 1 ) * WordBlock, size );
+                for( uint32_t i=b*WordBlock; i<end; i++ )
+                {
+                    auto mp = meta + i;
+                    auto& s = data[i];
+                    s = Stats { str + mp->str, mp->dataSize, 0, 0, 0, 0 };
+
+                    uint8_t present = 0;
+                    uint32_t prev = 0;
+                    const auto didx = mp->data / sizeof( LexiconDataPacket );
+                    auto dptr = ldata + didx;
+                    for( uint32_t j=0; j<mp->dataSize; j++ )
+                    {
+                        const auto postid = dptr[j].postid & LexiconPostMask;
+                        s.delta += VarIntSize( postid - prev ) + 1;
+                        prev = postid;
+
+                        auto offset = dptr[j].hitoffset;
+                        const uint8_t* hptr;
+                        uint8_t hnum = offset >> LexiconHitShift;
+                        if( hnum == 0 )
+                        {
+                            hptr = hits + ( offset & LexiconHitOffsetMask );
+                            hnum = *hptr++;
+                            s.lexhit += hnum + 1;
+                        }
+                        else
+                        {
+                            hptr = (const uint8_t*)&dptr[j].hitoffset;
+                        }
+                        s.cnt += hnum;
+
+                        uint8_t inPost = 0;
+                        for( uint8_t k=0; k<hnum; k++ )
+                        {
+                            const auto type = LexiconDecodeType( *hptr++ );
+                            f.hits[type]++;
+                            inPost |= 1 << type;
+                        }
+                        for( int k=0; k<NUM_LEXICON_TYPES; k++ )
+                        {
+                            if( inPost & ( 1 << k ) ) f.postings[k]++;
+                        }
+                        present |= inPost;
+
+                        if( posmeta )
+                        {
+                            const auto start = pos + posmeta[didx + j];
+                            auto ptr = start;
+                            uint32_t pcnt, delta;
+                            ptr = LexiconDecodeVarInt( ptr, pcnt );
+                            for( uint32_t k=0; k<pcnt; k++ ) ptr = LexiconDecodeVarInt( ptr, delta );
+                            s.lexpos += ptr - start;
+                        }
+                    }
+                    for( int k=0; k<NUM_LEXICON_TYPES; k++ )
+                    {
+                        if( present & ( 1 << k ) ) f.words[k]++;
+                    }
+                }
+            }
+        } );
+    }
+    tasks.Sync();
+
+    Fields total = {};
+    for( auto& f : fields )
+    {
+        for( int i=0; i<NUM_LEXICON_TYPES; i++ )
+        {
+            total.hits[i] += f.hits[i];
+            total.postings[i] += f.postings[i];
+            total.words[i] += f.words[i];
+        }
+    }
+
+    if( !json )
+    {
+        printf( "%i/%i\n", size, size );
+
+        uint64_t totalSize = 0;
+        for( int i=0; i<NUM_LEXICON_TYPES; i++ ) totalSize += total.hits[i];
+        printf( "Total words: %" PRIu64 "\n", totalSize );
+        for( int i=0; i<NUM_LEXICON_TYPES; i++ )
         {
-            printf( "%i/%zu\r", i, size );
-            fflush( stdout );
+            printf( "Lexicon category %s: %" PRIu64 " hits (%.1f%%)\n", LexiconNames[i], total.hits[i], total.hits[i] * 100.f / totalSize );
         }
 
-        auto mp = meta + i;
-        auto s = str + mp->str;
-        uint32_t cnt = 0;
-        uint32_t ld = 0;
-        uint32_t lh = 0;
+        std::sort( data.begin(), data.end(), [] ( const auto& lhs, const auto& rhs ) { return lhs.cnt > rhs.cnt; } );
 
-        auto dptr = ldata + ( mp->data / sizeof( uint32_t ) );
-        ld += mp->dataSize;
-        for( uint32_t j=0; j<mp->dataSize; j++ )
+        uint64_t dt = 0;
+        uint64_t ht = 0;
+        for( auto& v : data )
         {
-            dptr++;
-            auto offset = *dptr;
-            const uint8_t* hptr;
-            uint8_t hnum = offset >> LexiconHitShift;
-            if( hnum == 0 )
-            {
-                hptr = hits + ( offset & LexiconHitOffsetMask );
-                hnum = *hptr++;
-                lh += hnum + 1;
-            }
-            else
-            {
-                hptr = (const uint8_t*)dptr;
-            }
-            dptr++;
-            cnt += hnum;
-            totalSize += hnum;
-            for( uint8_t k=0; k<hnum; k++ )
-            {
-                sizes[LexiconDecodeType(*hptr++)]++;
-            }
+            dt += v.postings * sizeof( LexiconDataPacket );
+            ht += v.lexhit;
+            fprintf( stderr, "%i\t%s\t(%zu B data, %" PRIu64 " B hits)\n", v.cnt, v.str, v.postings * sizeof( LexiconDataPacket ), v.lexhit );
         }
 
-        data.emplace_back( s, Stats { cnt, ld, lh } );
+        printf( "Total %" PRIu64 "KB data, %" PRIu64 "KB hits\n", dt / 1024, ht / 1024 );
+        return 0;
     }
 
-    printf( "Total words: %" PRIu64 "\n", totalSize );
-    for( int i=0; i<6; i++ )
+    uint64_t postings = 0;
+    uint64_t hitnum = 0;
+    uint64_t cost = 0;
+    uint64_t fixed = 0;
+    uint64_t delta = 0;
+    uint64_t current = 0;
+    uint64_t hybrid = 0;
+    uint64_t hitCurrent = 0;
+    uint64_t hitPacked = 0;
+    uint32_t bitmapWords = 0;
+    uint32_t hybridWords = 0;
+    uint32_t hybridMin = 0;
+    uint64_t lenHist[Buckets][3] = {};
+    uint64_t byteHist[Buckets][3] = {};
+    for( auto& s : data )
     {
-        printf( "Lexicon category %s: %" PRIu64 " hits (%.1f%%)\n", LexiconNames[i], sizes[i], sizes[i] * 100.f / totalSize );
+        const auto c = Cost( s );
+        postings += s.postings;
+        hitnum += s.cnt;
+        cost += c;
+
+        // Post ids with packed child counts, as stored in lexdata.
+        fixed += uint64_t( s.postings ) * sizeof( uint32_t );
+        delta += s.delta;
+        current += uint64_t( s.postings ) * sizeof( uint32_t );
+        if( s.postings >= bmpthreshold )
+        {
+            current += bmpbytes;
+            bitmapWords++;
+        }
+        if( bmpbytes < s.delta )
+        {
+            hybrid += bmpbytes;
+            if( hybridWords == 0 || s.postings < hybridMin ) hybridMin = s.postings;
+            hybridWords++;
+        }
+        else
+        {
+            hybrid += s.delta;
+        }
+        hitCurrent += uint64_t( s.postings ) * sizeof( uint32_t ) + s.lexhit;
+        hitPacked += s.postings + s.cnt;
+
+        auto& l = lenHist[Bucket( s.postings )];
+        l[0]++;
+        l[1] += s.postings;
+        l[2] += c;
+        auto& h = byteHist[Bucket( c )];
+        h[0]++;
+        h[1] += s.postings;
+        h[2] += c;
     }
 
-    std::sort( data.begin(), data.end(), [] ( const auto& lhs, const auto& rhs ) { return lhs.second.cnt > rhs.second.cnt; } );
+    std::vector<uint32_t> order( size );
+    std::iota( order.begin(), order.end(), 0 );
+    const uint32_t topnum = std::min<uint32_t>( top, size );
+    std::partial_sort( order.begin(), order.begin() + topnum, order.end(), [&data] ( const auto& l, const auto& r ) { return Cost( data[l] ) > Cost( data[r] ); } );
+
+    printf( "{\n" );
+    printf( "  \"archive\": " );
+    PrintJsonString( argv[1] );
+    printf( ",\n" );
+    printf( "  \"threads\": %i,\n", cpus );
+    printf( "  \"messages\": %" PRIu32 ",\n", msgnum );
+    printf( "  \"words\": %" PRIu32 ",\n", size );
+    printf( "  \"postings\": %" PRIu64 ",\n", postings );
+    printf( "  \"hits\": %" PRIu64 ",\n", hitnum );
+    printf( "  \"cost_bytes\": %" PRIu64 ",\n", cost );
 
-    uint32_t dt = 0;
-    uint32_t ht = 0;
-    for( auto& v : data )
+    static const char* files[] = { "lexdata", "lexhit", "lexpos", "lexbmp", "lexrank", "lexhdr", "lexdict", "lexstr" };
+    printf( "  \"files\": {\n" );
+    for( size_t i=0; i<sizeof( files ) / sizeof( *files ); i++ )
     {
-        dt += v.second.lexdata * sizeof( uint32_t ) * 2;
-        ht += v.second.lexhit;
-        fprintf( stderr, "%i\t%s\t(%zi B data, %i B hits)\n", v.second.cnt, v.first, v.second.lexdata * sizeof( uint32_t ) * 2, v.second.lexhit );
+        printf( "    \"%s\": %" PRIu64 "%s\n", files[i], GetFileSize( ( base + files[i] ).c_str() ), i == sizeof( files ) / sizeof( *files ) - 1 ? "" : "," );
     }
+    printf( "  },\n" );
+
+    printf( "  \"fields\": {\n" );
+    for( int i=0; i<NUM_LEXICON_TYPES; i++ )
+    {
+        printf( "    \"%s\": { \"hits\": %" PRIu64 ", \"hits_share\": %.2f, \"postings\": %" PRIu64 ", \"words\": %" PRIu64 " }%s\n", LexiconNames[i], total.hits[i], Share( total.hits[i], hitnum ), total.postings[i], total.words[i], i == NUM_LEXICON_TYPES - 1 ? "" : "," );
+    }
+    printf( "  },\n" );
+
+    auto printHist = [] ( const char* name, const uint64_t hist[Buckets][3] ) {
+        int last = 0;
+        for( int i=0; i<Buckets; i++ ) if( hist[i][0] != 0 ) last = i;
+        printf( "  \"%s\": [\n", name );
+        for( int i=0; i<=last; i++ )
+        {
+            printf( "    { \"min\": %" PRIu64 ", \"words\": %" PRIu64 ", \"postings\": %" PRIu64 ", \"bytes\": %" PRIu64 " }%s\n", i == 0 ? 0 : uint64_t( 1 ) << i, hist[i][0], hist[i][1], hist[i][2], i == last ? "" : "," );
+        }
+        printf( "  ],\n" );
+    };
+    printHist( "length_distribution", lenHist );
+    printHist( "bytes_distribution", byteHist );
 
-    printf( "Total %iKB data, %iKB hits\n", dt / 1024, ht / 1024 );
+    printf( "  \"encodings\": {\n" );
+    printf( "    \"post_ids\": {\n" );
+    printf( "      \"fixed32\": { \"bytes\": %" PRIu64 ", \"ratio\": 1.0 },\n", fixed );
+    printf( "      \"current\": { \"bytes\": %" PRIu64 ", \"ratio\": %.3f, \"bitmap_min_postings\": %" PRIu32 ", \"bitmap_words\": %" PRIu32 " },\n", current, Ratio( fixed, current ), bmpthreshold, bitmapWords );
+    printf( "      \"delta_varint\": { \"bytes\": %" PRIu64 ", \"ratio\": %.3f },\n", delta, Ratio( fixed, delta ) );
+    printf( "      \"hybrid\": { \"bytes\": %" PRIu64 ", \"ratio\": %.3f, \"bitmap_min_postings\": %" PRIu32 ", \"bitmap_words\": %" PRIu32 " }\n", hybrid, Ratio( fixed, hybrid ), hybridMin, hybridWords );
+    printf( "    },\n" );
+    printf( "    \"hits\": {\n" );
+    printf( "      \"current\": { \"bytes\": %" PRIu64 ", \"ratio\": 1.0 },\n", hitCurrent );
+    printf( "      \"packed\": { \"bytes\": %" PRIu64 ", \"ratio\": %.3f }\n", hitPacked, Ratio( hitCurrent, hitPacked ) );
+    printf( "    }\n" );
+    printf( "  },\n" );
+
+    static const uint64_t caches[] = { 32 * 1024, 256 * 1024, 1024 * 1024, 8 * 1024 * 1024, 32 * 1024 * 1024 };
+    printf( "  \"cache_footprint\": [\n" );
+    for( size_t i=0; i<sizeof( caches ) / sizeof( *caches ); i++ )
+    {
+        uint32_t larger = 0;
+        uint64_t largerBytes = 0;
+        uint64_t prefix = 0;
+        uint32_t fit = 0;
+        for( uint32_t j=0; j<size; j++ )
+        {
+            const auto c = Cost( data[j] );
+            if( c > caches[i] )
+            {
+                larger++;
+                largerBytes += c;
+            }
+        }
+        for( uint32_t j=0; j<topnum; j++ )
+        {
+            prefix += Cost( data[order[j]] );
+            if( prefix <= caches[i] ) fit++;
+        }
+        printf( "    { \"cache_bytes\": %" PRIu64 ", \"larger_words\": %" PRIu32 ", \"larger_bytes\": %" PRIu64 ", \"larger_share\": %.2f, \"top_words_resident\": %" PRIu32 " }%s\n", caches[i], larger, largerBytes, Share( largerBytes, cost ), fit, i == sizeof( caches ) / sizeof( *caches ) - 1 ? "" : "," );
+    }
+    printf( "  ],\n" );
+
+    printf( "  \"top_cost\": [\n" );
+    uint64_t cumulative = 0;
+    for( uint32_t i=0; i<topnum; i++ )
+    {
+        const auto& s = data[order[i]];
+        const auto c = Cost( s );
+        cumulative += c;
+        printf( "    { \"word\": " );
+        PrintJsonString( s.str );
+        printf( ", \"postings\": %" PRIu32 ", \"hits\": %" PRIu32 ", \"density\": %.4f, \"data_bytes\": %zu, \"hit_bytes\": %" PRIu64 ", \"pos_bytes\": %" PRIu64 ", \"cost_bytes\": %" PRIu64 ", \"share\": %.2f, \"cumulative_share\": %.2f }%s\n",
+            s.postings, s.cnt, msgnum > 0 ? double( s.postings ) / msgnum : 0., s.postings * sizeof( LexiconDataPacket ), s.lexhit, s.lexpos, c, Share( c, cost ), Share( cumulative, cost ), i == topnum - 1 ? "" : "," );
+    }
+    printf( "  ],\n" );
+    printf( "  \"max_rss_kb\": %" PRIu64 "\n", System::PeakMemoryUsage() / 1024 );
+    printf( "}\n" );
 
     return 0;
 }
@@ -1,7 +1,7 @@
 #include <algorithm>
+#include <atomic>
 #include <iterator>
 #include <time.h>
-#include <regex>
 #include <vector>
 
 #include "Archive.hpp"
@@ -9,8 +9,8 @@
 #include "Score.hpp"
 
 #include "../common/Filesystem.hpp"
-#include "../common/String.hpp"
 #include "../common/Package.hpp"
+#include "../common/System.hpp"
 
 Archive* Archive::Open( const std::string& fn )
 {
@@ -18,7 +18,7 @@ Archive* Archive::Open( const std::string& fn )
     {
         auto pkg = PackageAccess::Open( fn );
         if( !pkg ) return nullptr;
-        if( pkg->Version() < PackageVersion ) return nullptr;
+        if( pkg->Version() < PackageMinVersion ) return nullptr;
         return new Archive( pkg );
     }
     else
@@ -63,6 +63,31 @@ Archive::Archive( const std::string& dir )
     {
         m_lexdist = std::make_unique<MetaView<uint32_t, uint32_t>>( dir + "lexdistmeta", dir + "lexdist" );
     }
+    if( Exists( dir + "lexpos" ) && Exists( dir + "lexposmeta" ) )
+    {
+        m_lexpos = std::make_unique<FileMap<uint8_t>>( dir + "lexpos" );
+        m_lexposmeta = std::make_unique<FileMap<uint32_t>>( dir + "lexposmeta" );
+    }
+    if( Exists( dir + "lexdict" ) && Exists( dir + "lexdictmeta" ) )
+    {
+        m_lexdict = std::make_unique<FileMap<uint8_t>>( dir + "lexdict" );
+        m_lexdictmeta = std::make_unique<FileMap<uint32_t>>( dir + "lexdictmeta" );
+    }
+    if( Exists( dir + "lexhdr" ) && Exists( dir + "lexhdrmeta" ) )
+    {
+        m_lexhdr = std::make_unique<FileMap<uint32_t>>( dir + "lexhdr" );
+        m_lexhdrmeta = std::make_unique<FileMap<uint32_t>>( dir + "lexhdrmeta" );
+    }
+    if( Exists( dir + "lexbmp" ) && Exists( dir + "lexbmpmeta" ) )
+    {
+        m_lexbmp = std::make_unique<FileMap<uint64_t>>( dir + "lexbmp" );
+        m_lexbmpmeta = std::make_unique<FileMap<uint32_t>>( dir + "lexbmpmeta" );
+    }
+    if( Exists( dir + "lexrank" ) && Exists( dir + "lexrankmeta" ) )
+    {
+        m_lexrank = std::make_unique<FileMap<uint32_t>>( dir + "lexrank" );
+        m_lexrankmeta = std::make_unique<FileMap<uint32_t>>( dir + "lexrankmeta" );
+    }
 }
 
 Archive::Archive( const PackageAccess* pkg )
@@ -91,57 +116,89 @@ Archive::Archive( const PackageAccess* pkg )
     {
         m_lexdist = std::make_unique<MetaView<uint32_t, uint32_t>>( lexdistmeta, lexdist );
     }
-}
-
-static bool MatchStrings( const std::string& s1, const char* s2, bool exact, bool ignoreCase )
-{
-    if( exact )
+    const auto lexpos = pkg->Get( PackageFile::lexpos );
+    const auto lexposmeta = pkg->Get( PackageFile::lexposmeta );
+    if( lexpos.size > 0 && lexposmeta.size > 0 )
     {
-        if( ignoreCase )
-        {
-            auto l1 = s1.size();
-            auto l2 = strlen( s2 );
-            return l1 == l2 && strnicmpl( s2, s1.c_str(), l1 ) == 0;
-        }
-        else
-        {
-            return strcmp( s1.c_str(), s2 ) == 0;
-        }
+        m_lexpos = std::make_unique<FileMap<uint8_t>>( lexpos );
+        m_lexposmeta = std::make_unique<FileMap<uint32_t>>( lexposmeta );
     }
-    else
+    const auto lexdict = pkg->Get( PackageFile::lexdict );
+    const auto lexdictmeta = pkg->Get( PackageFile::lexdictmeta );
+    if( lexdict.size > 0 && lexdictmeta.size > 0 )
+    {
+        m_lexdict = std::make_unique<FileMap<uint8_t>>( lexdict );
+        m_lexdictmeta = std::make_unique<FileMap<uint32_t>>( lexdictmeta );
+    }
+    const auto lexhdr = pkg->Get( PackageFile::lexhdr );
+    const auto lexhdrmeta = pkg->Get( PackageFile::lexhdrmeta );
+    if( lexhdr.size > 0 && lexhdrmeta.size > 0 )
     {
-        const std::regex r( s1.c_str(), s1.size(), std::regex::flag_type( std::regex_constants::ECMAScript | ( ignoreCase ? std::regex_constants::icase : 0 ) ) );
-        return std::regex_search( s2, r );
+        m_lexhdr = std::make_unique<FileMap<uint32_t>>( lexhdr );
+        m_lexhdrmeta = std::make_unique<FileMap<uint32_t>>( lexhdrmeta );
+    }
+    const auto lexbmp = pkg->Get( PackageFile::lexbmp );
+    const auto lexbmpmeta = pkg->Get( PackageFile::lexbmpmeta );
+    if( lexbmp.size > 0 && lexbmpmeta.size > 0 )
+    {
+        m_lexbmp = std::make_unique<FileMap<uint64_t>>( lexbmp );
+        m_lexbmpmeta = std::make_unique<FileMap<uint32_t>>( lexbmpmeta );
+    }
+    const auto lexrank = pkg->Get( PackageFile::lexrank );
+    const auto lexrankmeta = pkg->Get( PackageFile::lexrankmeta );
+    if( lexrank.size > 0 && lexrankmeta.size > 0 )
+    {
+        m_lexrank = std::make_unique<FileMap<uint32_t>>( lexrank );
+        m_lexrankmeta = std::make_unique<FileMap<uint32_t>>( lexrankmeta );
     }
 }
 
-int Archive::GetMessageScore( uint32_t idx, const std::vector<ScoreEntry>& scoreList ) const
+int Archive::GetMessageScore( uint32_t idx, const ScoreRules& rules ) const
 {
+    if( rules.IsEmpty() ) return 0;
     int score = 0;
-    for( auto& v : scoreList )
+    if( rules.HasField( SF_RealName ) ) score += rules.Match( SF_RealName, GetRealName( idx ) );
+    if( rules.HasField( SF_From ) ) score += rules.Match( SF_From, GetFrom( idx ) );
+    if( rules.HasField( SF_Subject ) ) score += rules.Match( SF_Subject, GetSubject( idx ) );
+    return score;
+}
+
+void Archive::GetMessageScores( uint32_t first, uint32_t num, const ScoreRules& rules, int* out ) const
+{
+    if( rules.IsEmpty() )
     {
-        bool match = false;
-        switch( v.field )
-        {
-        case SF_RealName:
-            match = MatchStrings( v.match, GetRealName( idx ), v.exact != 0, v.ignoreCase != 0 );
-            break;
-        case SF_Subject:
-            match = MatchStrings( v.match, GetSubject( idx ), v.exact != 0, v.ignoreCase != 0 );
-            break;
-        case SF_From:
-            match = MatchStrings( v.match, GetFrom( idx ), v.exact != 0, v.ignoreCase != 0 );
-            break;
-        default:
-            assert( false );
-            break;
-        }
-        if( match )
-        {
-            score += v.score;
-        }
+        std::fill( out, out + num, 0 );
+        return;
     }
-    return score;
+
+    // Parallel scoring is only worth it for larger batches.
+    enum { MinBatch = 256 };
+    const auto cpus = System::CPUCores();
+    const auto workers = std::min<uint32_t>( cpus, num / MinBatch );
+    if( workers < 2 )
+    {
+        for( uint32_t i=0; i<num; i++ ) out[i] = GetMessageScore( first + i, rules );
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock( m_scoreLock );
+    if( !m_scoreTasks ) m_scoreTasks = std::make_unique<TaskDispatch>( cpus - 1 );
+
+    const auto blocks = ( num + MinBatch - 1 ) / MinBatch;
+    std::atomic<uint32_t> cnt( 0 );
+    for( uint32_t t=0; t<workers; t++ )
+    {
+        m_scoreTasks->Queue( [this, first, num, blocks, &cnt, &rules, out] {
+            for(;;)
+            {
+                const auto b = cnt.fetch_add( 1, std::memory_order_relaxed );
+                if( b >= blocks ) break;
+                const auto end = std::min<uint32_t>( num, ( b + 1 ) * MinBatch );
+                for( uint32_t i=b*MinBatch; i<end; i++ ) out[i] = GetMessageScore( first + i, rules );
+            }
+        } );
+    }
+    m_scoreTasks->Sync();
 }
 
 std::map<std::string, uint32_t> Archive::TimeChart() const
@@ -3,6 +3,7 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -12,12 +13,13 @@
 #include "../common/LexiconTypes.hpp"
 #include "../common/MetaView.hpp"
 #include "../common/StringCompress.hpp"
+#include "../common/TaskDispatch.hpp"
 #include "../common/ZMessageView.hpp"
 
 #include "PackageAccess.hpp"
 #include "ViewReference.hpp"
 
-struct ScoreEntry;
+class ScoreRules;
 class ExpandingBuffer;
 
 class Archive
@@ -27,8 +29,9 @@ class Archive
 public:
     static Archive* Open( const std::string& fn );
 
-    const char* GetMessage( uint32_t idx, ExpandingBuffer& eb ) { return idx >= m_mcnt ? nullptr : m_mview.GetMessage( idx, eb ); }
-    const char* GetMessage( const uint8_t* msgid, ExpandingBuffer& eb ) { auto idx = m_midhash.Search( msgid ); return idx >= 0 ? GetMessage( idx, eb ) : nullptr; }
+    // All accessors may be used by many threads at once. Decoded messages are stored in the caller's buffer.
+    const char* GetMessage( uint32_t idx, ExpandingBuffer& eb ) const { return idx >= m_mcnt ? nullptr : m_mview.GetMessage( idx, eb ); }
+    const char* GetMessage( const uint8_t* msgid, ExpandingBuffer& eb ) const { auto idx = m_midhash.Search( msgid ); return idx >= 0 ? GetMessage( idx, eb ) : nullptr; }
     size_t NumberOfMessages() const { return m_mcnt; }
 
     int GetMessageIndex( const uint8_t* msgid ) const { return m_midhash.Search( msgid ); }
@@ -59,7 +62,10 @@ public:
     const char* GetRealName( uint32_t idx ) const { return m_strings[idx*3+2]; }
     const char* GetRealName( const uint8_t* msgid ) const { auto idx = m_midhash.Search( msgid ); return idx >= 0 ? GetRealName( idx ) : nullptr; }
 
-    int GetMessageScore( uint32_t idx, const std::vector<ScoreEntry>& scoreList ) const;
+    int GetMessageScore( uint32_t idx, const ScoreRules& rules ) const;
+    // Scores num consecutive messages starting at first, for example a whole thread or archive. Large batches
+    // are processed in parallel.
+    void GetMessageScores( uint32_t first, uint32_t num, const ScoreRules& rules, int* out ) const;
 
     std::map<std::string, uint32_t> TimeChart() const;
 
@@ -74,6 +80,8 @@ public:
     const StringCompress& GetCompress() const { return m_compress; }
 
     bool HasLexDist() const { return (bool)m_lexdist; }
+    bool HasLexPos() const { return (bool)m_lexpos; }
+    bool HasLexDict() const { return (bool)m_lexdict; }
 
 private:
     Archive( const std::string& dir );
@@ -81,7 +89,7 @@ private:
 
     std::unique_ptr<const PackageAccess> m_pkg;
 
-    ZMessageView m_mview;
+    const ZMessageView m_mview;
     const size_t m_mcnt;
     const FileMap<uint32_t> m_toplevel;
     const HashSearch<uint8_t> m_midhash;
@@ -99,6 +107,20 @@ private:
     const FileMap<char> m_prefix;
     const StringCompress m_compress;
     std::unique_ptr<MetaView<uint32_t, uint32_t>> m_lexdist;
+    std::unique_ptr<FileMap<uint8_t>> m_lexpos;
+    std::unique_ptr<FileMap<uint32_t>> m_lexposmeta;
+    std::unique_ptr<FileMap<uint8_t>> m_lexdict;
+    std::unique_ptr<FileMap<uint32_t>> m_lexdictmeta;
+    std::unique_ptr<FileMap<uint32_t>> m_lexhdr;
+    std::unique_ptr<FileMap<uint32_t>> m_lexhdrmeta;
+    std::unique_ptr<FileMap<uint64_t>> m_lexbmp;
+    std::unique_ptr<FileMap<uint32_t>> m_lexbmpmeta;
+    std::unique_ptr<FileMap<uint32_t>> m_lexrank;
+    std::unique_ptr<FileMap<uint32_t>> m_lexrankmeta;
+
+    // Workers scoring large batches of messages, started on first use. Batches are scored one at a time.
+    mutable std::unique_ptr<TaskDispatch> m_scoreTasks;
+    mutable std::mutex m_scoreLock;
 };
 
 #endif
@@ -0,0 +1,172 @@
+#include <assert.h>
+
+#ifdef __AVX2__
+#  include <immintrin.h>
+#elif defined __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#  include <intrin.h>
+#  define CountBits __popcnt
+#else
+#  define CountBits __builtin_popcount
+#endif
+
+#include "Intersect.hpp"
+#include "../common/LexiconTypes.hpp"
+
+enum { BlockSize = 8 };
+
+// Lists whose sizes differ by more than this factor are intersected with galloping search,
+// otherwise a linear block scan is faster.
+enum { GallopRatio = 32 };
+
+// Post identifiers fit in LexiconPostMask, so signed SIMD comparisons are safe.
+static_assert( LexiconPostMask <= 0x7FFFFFFF, "Post identifiers must fit in signed integer" );
+
+// Returns number of elements in a sorted block of BlockSize values that are smaller than value.
+static inline size_t CountLess( const uint32_t* block, uint32_t value )
+{
+#ifdef __AVX2__
+    const auto vv = _mm256_set1_epi32( value );
+    const auto vb = _mm256_loadu_si256( (const __m256i*)block );
+    const auto cmp = _mm256_cmpgt_epi32( vv, vb );
+    return CountBits( _mm256_movemask_ps( _mm256_castsi256_ps( cmp ) ) );
+#elif defined __SSE2__
+    const auto vv = _mm_set1_epi32( value );
+    const auto c0 = _mm_cmpgt_epi32( vv, _mm_loadu_si128( (const __m128i*)block ) );
+    const auto c1 = _mm_cmpgt_epi32( vv, _mm_loadu_si128( (const __m128i*)( block + 4 ) ) );
+    return CountBits( _mm_movemask_ps( _mm_castsi128_ps( c0 ) ) | ( _mm_movemask_ps( _mm_castsi128_ps( c1 ) ) << 4 ) );
+#else
+    size_t ret = 0;
+    for( int i=0; i<BlockSize; i++ )
+    {
+        if( block[i] < value ) ret++;
+    }
+    return ret;
+#endif
+}
+
+size_t GallopSearch( const uint32_t* data, size_t size, size_t pos, uint32_t value )
+{
+    if( pos >= size || data[pos] >= value ) return pos;
+
+    // data[lo] < value, data[hi] >= value (or hi is past the end)
+    size_t lo = pos;
+    size_t step = BlockSize;
+    size_t hi = lo + step;
+    while( hi < size && data[hi] < value )
+    {
+        lo = hi;
+        step *= 2;
+        hi = lo + step;
+    }
+    if( hi > size ) hi = size;
+
+    while( hi - lo > BlockSize )
+    {
+        const auto mid = lo + ( hi - lo ) / 2;
+        if( data[mid] < value )
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    lo++;
+    if( lo + BlockSize <= size ) return lo + CountLess( data + lo, value );
+    while( lo < hi && data[lo] < value ) lo++;
+    return lo;
+}
+
+static inline size_t ScanSearch( const uint32_t* data, size_t size, size_t pos, uint32_t value )
+{
+    while( pos + BlockSize <= size && data[pos + BlockSize - 1] < value ) pos += BlockSize;
+    if( pos + BlockSize <= size ) return pos + CountLess( data + pos, value );
+    while( pos < size && data[pos] < value ) pos++;
+    return pos;
+}
+
+template<size_t(*Search)( const uint32_t*, size_t, size_t, uint32_t )>
+static size_t IntersectImpl( const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* outa, uint32_t* outb )
+{
+    size_t cnt = 0;
+    size_t j = 0;
+    for( size_t i=0; i<na; i++ )
+    {
+        const auto v = a[i];
+        j = Search( b, nb, j, v );
+        if( j == nb ) break;
+        if( b[j] == v )
+        {
+            outa[cnt] = i;
+            outb[cnt] = j;
+            cnt++;
+            j++;
+        }
+    }
+    return cnt;
+}
+
+size_t Intersect( const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* outa, uint32_t* outb )
+{
+    if( na == 0 || nb == 0 ) return 0;
+    if( na > nb ) return Intersect( b, nb, a, na, outb, outa );
+
+    if( nb / na >= GallopRatio )
+    {
+        return IntersectImpl<GallopSearch>( a, na, b, nb, outa, outb );
+    }
+    else
+    {
+        return IntersectImpl<ScanSearch>( a, na, b, nb, outa, outb );
+    }
+}
+
+size_t Subtract( uint32_t* a, size_t na, const uint32_t* b, size_t nb )
+{
+    if( na == 0 || nb == 0 ) return na;
+
+    const auto search = nb / na >= GallopRatio ? GallopSearch : ScanSearch;
+
+    size_t cnt = 0;
+    size_t j = 0;
+    for( size_t i=0; i<na; i++ )
+    {
+        const auto v = a[i];
+        j = search( b, nb, j, v );
+        if( j == nb || b[j] != v )
+        {
+            a[cnt++] = v;
+        }
+    }
+    return cnt;
+}
+
+size_t IntersectBitmap( uint32_t* a, size_t na, const uint64_t* bitmap )
+{
+    size_t cnt = 0;
+    for( size_t i=0; i<na; i++ )
+    {
+        const auto v = a[i];
+        a[cnt] = v;
+        cnt += ( bitmap[v / 64] >> ( v % 64 ) ) & 1;
+    }
+    return cnt;
+}
+
+size_t SubtractBitmap( uint32_t* a, size_t na, const uint64_t* bitmap )
+{
+    size_t cnt = 0;
+    for( size_t i=0; i<na; i++ )
+    {
+        const auto v = a[i];
+        a[cnt] = v;
+        cnt += ~( bitmap[v / 64] >> ( v % 64 ) ) & 1;
+    }
+    return cnt;
+}
@@ -0,0 +1,25 @@
+#ifndef __INTERSECT_HPP__
+#define __INTERSECT_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernels operating on sorted, duplicate-free arrays of post identifiers.
+
+// Returns index of the first element in [pos, size) that is not less than value.
+size_t GallopSearch( const uint32_t* data, size_t size, size_t pos, uint32_t value );
+
+// Finds elements present in both lists. For each common element its index in a is written to outa
+// and its index in b is written to outb. Returns number of common elements.
+size_t Intersect( const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* outa, uint32_t* outb );
+
+// Removes elements present in b from a, in place. Returns new size of a.
+size_t Subtract( uint32_t* a, size_t na, const uint32_t* b, size_t nb );
+
+// Keeps elements of a which have their bit set in bitmap, in place. Returns new size of a.
+size_t IntersectBitmap( uint32_t* a, size_t na, const uint64_t* bitmap );
+
+// Removes elements of a which have their bit set in bitmap, in place. Returns new size of a.
+size_t SubtractBitmap( uint32_t* a, size_t na, const uint64_t* bitmap );
+
+#endif
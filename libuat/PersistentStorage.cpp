@@ -253,7 +253,7 @@ void PersistentStorage::VerifyVisitedAreValid( const std::string& fn )
     m_visitedLastVerify = std::chrono::steady_clock::now();
 }
 
-void PersistentStorage::LoadScore()
+void PersistentStorage::LoadScoreList()
 {
     const auto fn = m_base + Score;
     if( !Exists( fn ) ) return;
@@ -291,7 +291,7 @@ void PersistentStorage::LoadScore()
         }
         else if( size > 4 && strnicmpl( ptr, "from", 4 ) == 0 )
         {
-            field = SF_Subject;
+            field = SF_From;
             ptr += 4;
             size -= 4;
         }
@@ -347,6 +347,12 @@ void PersistentStorage::LoadScore()
     }
 }
 
+void PersistentStorage::LoadScore()
+{
+    LoadScoreList();
+    m_scoreRules = ScoreRules( m_scoreList );
+}
+
 void PersistentStorage::Preload()
 {
     m_preloadThread = std::thread( [this] {
@@ -13,8 +13,7 @@
 #include "../common/ring_buffer.hpp"
 
 #include "LockedFile.hpp"
-
-struct ScoreEntry;
+#include "Score.hpp"
 
 class PersistentStorage
 {
@@ -38,6 +37,7 @@ public:
     bool MarkVisited( const char* msgid );
 
     const std::vector<ScoreEntry>& GetScoreList() const { return m_scoreList; }
+    const ScoreRules& GetScoreRules() const { return m_scoreRules; }
 
     void Preload();
     void WaitPreload();
@@ -51,6 +51,7 @@ private:
     void VerifyVisitedAreValid( const std::string& fn );
 
     void LoadScore();
+    void LoadScoreList();
 
     std::string m_base;
     robin_hood::unordered_flat_set<const char*, hash, equal_to> m_visited;
@@ -64,6 +65,7 @@ private:
 
     ring_buffer<uint32_t> m_articleHistory;
     std::vector<ScoreEntry> m_scoreList;
+    ScoreRules m_scoreRules;
 
     std::thread m_preloadThread;
 };
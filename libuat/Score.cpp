@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <string.h>
+
+#include "Score.hpp"
+
+static std::string ToLowerAscii( const char* str, size_t len )
+{
+    std::string ret( str, len );
+    for( auto& c : ret )
+    {
+        if( c >= 'A' && c <= 'Z' ) c = c - 'A' + 'a';
+    }
+    return ret;
+}
+
+static bool IsLiteral( const std::string& pattern )
+{
+    return pattern.find_first_of( "\\^$.|?*+()[]{}" ) == std::string::npos;
+}
+
+ScoreRules::ScoreRules( const std::vector<ScoreEntry>& list )
+{
+    for( auto& v : list )
+    {
+        auto& field = m_fields[v.field];
+        if( v.exact )
+        {
+            if( v.ignoreCase )
+            {
+                field.exactLower[ToLowerAscii( v.match.c_str(), v.match.size() )] += v.score;
+            }
+            else
+            {
+                field.exact[v.match] += v.score;
+            }
+        }
+        else if( IsLiteral( v.match ) )
+        {
+            if( v.ignoreCase )
+            {
+                field.literalLower.emplace_back( Literal { ToLowerAscii( v.match.c_str(), v.match.size() ), v.score } );
+            }
+            else
+            {
+                field.literal.emplace_back( Literal { v.match, v.score } );
+            }
+        }
+        else
+        {
+            try
+            {
+                field.regex.emplace_back( Regex { std::regex( v.match, std::regex::flag_type( std::regex_constants::ECMAScript | std::regex_constants::optimize | ( v.ignoreCase ? std::regex_constants::icase : 0 ) ) ), v.score } );
+            }
+            catch( const std::regex_error& )
+            {
+                // invalid pattern can never match anything
+                continue;
+            }
+        }
+        field.empty = false;
+        m_empty = false;
+    }
+}
+
+int ScoreRules::Match( ScoreField field, const char* str ) const
+{
+    auto& f = m_fields[field];
+    if( f.empty ) return 0;
+
+    int score = 0;
+    const auto len = strlen( str );
+    if( !f.exact.empty() )
+    {
+        auto it = f.exact.find( std::string( str, len ) );
+        if( it != f.exact.end() ) score += it->second;
+    }
+    for( auto& v : f.literal )
+    {
+        if( strstr( str, v.str.c_str() ) ) score += v.score;
+    }
+    if( !f.exactLower.empty() || !f.literalLower.empty() )
+    {
+        const auto lower = ToLowerAscii( str, len );
+        auto it = f.exactLower.find( lower );
+        if( it != f.exactLower.end() ) score += it->second;
+        for( auto& v : f.literalLower )
+        {
+            if( strstr( lower.c_str(), v.str.c_str() ) ) score += v.score;
+        }
+    }
+    for( auto& v : f.regex )
+    {
+        if( std::regex_search( str, str + len, v.re ) ) score += v.score;
+    }
+    return score;
+}
@@ -1,14 +1,19 @@
 #ifndef __SCORE_HPP__
 #define __SCORE_HPP__
 
+#include <regex>
 #include <stdint.h>
 #include <string>
+#include <vector>
+
+#include "../contrib/martinus/robin_hood.h"
 
 enum ScoreField
 {
     SF_RealName,
     SF_From,
-    SF_Subject
+    SF_Subject,
+    NUM_SCORE_FIELDS
 };
 
 struct ScoreEntry
@@ -20,4 +25,46 @@ struct ScoreEntry
     std::string match;
 };
 
+// Score list compiled into matchers, so that no patterns have to be processed when messages are scored.
+class ScoreRules
+{
+public:
+    ScoreRules() = default;
+    explicit ScoreRules( const std::vector<ScoreEntry>& list );
+
+    bool IsEmpty() const { return m_empty; }
+    bool HasField( ScoreField field ) const { return !m_fields[field].empty; }
+
+    // Returns sum of scores of all rules of a given field matching the string.
+    int Match( ScoreField field, const char* str ) const;
+
+private:
+    struct Literal
+    {
+        std::string str;
+        int score;
+    };
+
+    struct Regex
+    {
+        std::regex re;
+        int score;
+    };
+
+    struct Field
+    {
+        bool empty = true;
+        // Exact matches are found in a single lookup. Case insensitive ones are stored lowercase.
+        robin_hood::unordered_flat_map<std::string, int> exact;
+        robin_hood::unordered_flat_map<std::string, int> exactLower;
+        // Patterns without regular expression syntax are plain substring searches.
+        std::vector<Literal> literal;
+        std::vector<Literal> literalLower;
+        std::vector<Regex> regex;
+    };
+
+    bool m_empty = true;
+    Field m_fields[NUM_SCORE_FIELDS];
+};
+
 #endif
@@ -0,0 +1,84 @@
+#include <string.h>
+
+#include "SearchContext.hpp"
+#include "SearchEngine.hpp"
+
+static const char* StageNames[] = {
+    "parse",
+    "fuzzy",
+    "filter",
+    "postings",
+    "rank",
+    "distance",
+    "sort",
+};
+static_assert( sizeof( StageNames ) / sizeof( *StageNames ) == SearchStats::NumStages, "Stage names mismatch" );
+
+const char* SearchStats::StageName( int stage )
+{
+    return StageNames[stage];
+}
+
+void SearchStats::Reset()
+{
+    memset( this, 0, sizeof( SearchStats ) );
+}
+
+SearchContext::SearchContext( size_t memoryLimit )
+    : m_arena( memoryLimit )
+    , m_peak( 0 )
+    , m_cancel( nullptr )
+    , m_progressBase( 0 )
+    , m_progressScale( 1 )
+    , m_stats( nullptr )
+    , m_maxResults( 0 )
+{
+}
+
+SearchContext::~SearchContext()
+{
+}
+
+size_t SearchContext::ReservedMemory() const
+{
+    size_t hop = 0;
+    for( auto& v : m_hop )
+    {
+        hop += v[0].capacity() + v[1].capacity();
+    }
+    return m_arena.Reserved() + m_index.capacity() * sizeof( int32_t ) + m_words.capacity() * sizeof( WordData ) +
+        m_positions.capacity() * sizeof( uint32_t ) + m_hits.capacity() + hop;
+}
+
+void SearchContext::Release()
+{
+    m_arena.Release();
+    m_index = std::vector<int32_t>();
+    m_words = std::vector<WordData>();
+    m_phrases = std::vector<PhraseData>();
+    m_positions = std::vector<uint32_t>();
+    m_hits = std::vector<uint8_t>();
+    for( auto& v : m_hop )
+    {
+        v[0] = std::vector<uint8_t>();
+        v[1] = std::vector<uint8_t>();
+    }
+}
+
+void SearchContext::SetProgress( ProgressFn progress, const std::atomic<bool>* cancel )
+{
+    m_progress = std::move( progress );
+    m_cancel = cancel;
+}
+
+void SearchContext::BeginQuery()
+{
+    m_arena.Reset();
+    m_arena.ResetPeak();
+}
+
+void SearchContext::EndQuery()
+{
+    m_peak = m_arena.Peak() + m_index.size() * sizeof( int32_t );
+    m_arena.Reset();
+}
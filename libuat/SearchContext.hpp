@@ -0,0 +1,123 @@
+#ifndef __SEARCHCONTEXT_HPP__
+#define __SEARCHCONTEXT_HPP__
+
+#include <atomic>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "../common/Arena.hpp"
+#include "../common/LexiconTypes.hpp"
+
+struct PhraseData;
+struct SearchData;
+struct WordData;
+
+// Where the time of a search went. Filled in only when enabled with SearchContext::SetStats().
+struct SearchStats
+{
+    enum Stage
+    {
+        ST_Parse,       // query parsing and lexicon lookup
+        ST_Fuzzy,       // similar word expansion
+        ST_Filter,      // set logic, phrase matching and intersection of required words
+        ST_Postings,    // posting list decoding and grouping by post
+        ST_Rank,        // hit ranking
+        ST_Distance,    // word adjacency ranking
+        ST_Sort,        // sorting of results
+        NumStages
+    };
+
+    static const char* StageName( int stage );
+    void Reset();
+
+    uint64_t time[NumStages];   // nanoseconds
+    uint64_t total;             // nanoseconds, also includes everything not covered by stages
+    uint32_t words;             // words searched for, including expansions
+    uint64_t postings;          // postings read from posting lists
+    uint64_t probes;            // posting list and bitmap lookups of candidate posts
+    uint64_t candidates;        // posts ranked
+    uint64_t results;
+    size_t memory;              // peak scratch memory, in bytes
+    uint64_t minorFaults;
+    uint64_t majorFaults;
+};
+
+// Per-caller scratch state of SearchEngine. Reusing one context for many
+// queries avoids repeated allocations. A context may only be used by one
+// search at a time.
+class SearchContext
+{
+    friend class SearchEngine;
+
+public:
+    enum : size_t { DefaultMemoryLimit = size_t( 1024 ) * 1024 * 1024 };
+
+    // Receives overall search progress in 0-1 range and partial results, when these become available.
+    using ProgressFn = std::function<void( float progress, const SearchData* partial )>;
+
+    SearchContext( size_t memoryLimit = DefaultMemoryLimit );
+    ~SearchContext();
+
+    // Peak memory used by the last query, in bytes.
+    size_t PeakMemory() const { return m_peak; }
+    // Memory currently held by the context, in bytes.
+    size_t ReservedMemory() const;
+
+    size_t MemoryLimit() const { return m_arena.Limit(); }
+    void SetMemoryLimit( size_t limit ) { m_arena.SetLimit( limit ); }
+
+    // Returns all memory to the system. Next query will have to allocate it again.
+    void Release();
+
+    // Enables progressive search. Fuzzy searches first report results for exact words only. When the cancel
+    // flag is set, search stops as soon as possible and returns no results.
+    void SetProgress( ProgressFn progress, const std::atomic<bool>* cancel );
+    bool IsCancelled() const { return m_cancel && m_cancel->load( std::memory_order_relaxed ); }
+
+    // Enables collection of search statistics. These are reset at the start of each search, and are written
+    // by the thread doing the search.
+    void SetStats( SearchStats* stats ) { m_stats = stats; }
+
+    // Limits search results to the max best ones, or removes the limit, if zero. Searches for a few best results
+    // may stop early, without ranking all matching posts.
+    void SetMaxResults( size_t max ) { m_maxResults = max; }
+    size_t MaxResults() const { return m_maxResults; }
+
+    SearchContext( const SearchContext& ) = delete;
+    SearchContext& operator=( const SearchContext& ) = delete;
+
+private:
+    void BeginQuery();
+    void EndQuery();
+    void ReportProgress( float progress, const SearchData* partial = nullptr ) const { if( m_progress ) m_progress( m_progressBase + progress * m_progressScale, partial ); }
+
+    Arena m_arena;
+    size_t m_peak;
+
+    ProgressFn m_progress;
+    const std::atomic<bool>* m_cancel;
+    // Part of the overall progress covered by the current search pass.
+    float m_progressBase;
+    float m_progressScale;
+
+    SearchStats* m_stats;
+    size_t m_maxResults;
+
+    // Post index -> result slot, kept filled with -1 between queries.
+    std::vector<int32_t> m_index;
+
+    std::vector<WordData> m_words;
+    std::vector<PhraseData> m_phrases;
+
+    // MatchPhrase scratch buffer
+    std::vector<uint32_t> m_positions;
+
+    // GetWordDistance scratch buffers
+    int8_t m_start[NUM_LEXICON_TYPES][2];
+    std::vector<uint8_t> m_hop[NUM_LEXICON_TYPES][2];
+    std::vector<uint8_t> m_hits;
+};
+
+#endif
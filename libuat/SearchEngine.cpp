@@ -1,16 +1,28 @@
+#include <algorithm>
 #include <assert.h>
+#include <chrono>
 #include <iterator>
 #include <limits>
+#include <string.h>
 
 #include "Archive.hpp"
+#include "Intersect.hpp"
 #include "SearchEngine.hpp"
 
 #include "../contrib/martinus/robin_hood.h"
-#include "../common/Slab.hpp"
 #include "../common/String.hpp"
+#include "../common/System.hpp"
+#include "../common/UTF8.hpp"
 
-enum { SlabSize = 128*1024*1024 };
-static thread_local Slab<SlabSize> slab;
+// Maximum number of words a prefix* query term may expand to. Most common words are used.
+enum { MaxPrefixWords = 256 };
+// Maximum number of similar words found at query time.
+enum { MaxSimilarWords = 32 };
+// Number of consecutive posts sharing date bounds used by date restricted searches.
+enum { DateBlockShift = 8 };
+
+// Rank modifiers of similar words, indexed by edit distance.
+static const float DistMod[] = { 0.f, 0.01f, 0.001f, 0.0001f };
 
 enum WordFlags
 {
@@ -29,17 +41,71 @@ struct PostData
     const uint8_t* hits;
 };
 
+struct WordPost
+{
+    uint32_t word;
+    const PostData* data;
+};
+
+// Accumulates time spent in search stages, if statistics are collected.
+class StageTimer
+{
+public:
+    StageTimer( SearchStats* stats, int stage )
+        : m_stats( stats )
+        , m_stage( stage )
+    {
+        if( m_stats ) m_start = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer() { Stop(); }
+
+    // Ends the current stage and starts the next one.
+    void Next( int stage )
+    {
+        if( !m_stats ) return;
+        const auto now = std::chrono::steady_clock::now();
+        m_stats->time[m_stage] += std::chrono::duration_cast<std::chrono::nanoseconds>( now - m_start ).count();
+        m_start = now;
+        m_stage = stage;
+    }
+
+    void Stop()
+    {
+        if( !m_stats ) return;
+        m_stats->time[m_stage] += std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - m_start ).count();
+        m_stats = nullptr;
+    }
+
+private:
+    SearchStats* m_stats;
+    int m_stage;
+    std::chrono::steady_clock::time_point m_start;
+};
+
 
 SearchEngine::SearchEngine( const Archive& archive )
     : m_archive( archive )
 {
 }
 
-SearchData SearchEngine::Search( const char* query, int flags, int filter ) const
+SearchData SearchEngine::Search( const char* query, int flags, int filter, const DateRange& range ) const
+{
+    SearchContext ctx;
+    return Search( ctx, query, flags, filter, range );
+}
+
+SearchData SearchEngine::Search( const std::vector<std::string>& terms, int flags, int filter, const DateRange& range ) const
+{
+    SearchContext ctx;
+    return Search( ctx, terms, flags, filter, range );
+}
+
+SearchData SearchEngine::Search( SearchContext& ctx, const char* query, int flags, int filter, const DateRange& range ) const
 {
     std::vector<std::string> terms;
     split( query, std::back_inserter( terms ) );
-    return Search( terms, flags, filter );
+    return Search( ctx, terms, flags, filter, range );
 }
 
 static float HitRank( const PostData& data )
@@ -64,12 +130,13 @@ static float PostRank( const PostData& data )
     return ( float( data.children ) / LexiconChildMax ) * 0.75f + 0.25f;
 }
 
-static float GetWordDistance( const std::vector<const PostData*>& list1, const std::vector<const PostData*>& list2 )
+float SearchEngine::GetWordDistance( SearchContext& ctx, const std::vector<const PostData*>& list1, const std::vector<const PostData*>& list2 )
 {
     assert( !list1.empty() && !list2.empty() );
 
-    static thread_local int8_t start[NUM_LEXICON_TYPES][2];
-    static thread_local std::vector<uint8_t> hop[NUM_LEXICON_TYPES][2];
+    auto& start = ctx.m_start;
+    auto& hop = ctx.m_hop;
+    auto& data = ctx.m_hits;
 
     for( int i=0; i<NUM_LEXICON_TYPES; i++ )
     {
@@ -84,8 +151,7 @@ static float GetWordDistance( const std::vector<const PostData*>& list1, const s
 
     for( int i=0; i<2; i++ )
     {
-        uint8_t data[256];
-        int cnt = 0;
+        data.clear();
         const auto& src = list[i];
         for( auto& p : *src )
         {
@@ -94,11 +160,12 @@ static float GetWordDistance( const std::vector<const PostData*>& list1, const s
                 auto pos = LexiconHitPos( p->hits[j] );
                 if( pos < LexiconHitPosMask[LexiconDecodeType( p->hits[j] )] )
                 {
-                    data[cnt++] = p->hits[j];
+                    data.emplace_back( p->hits[j] );
                 }
             }
         }
-        std::sort( data, data+cnt, []( const uint8_t l, const uint8_t r ) { return LexiconHitPos( l ) < LexiconHitPos( r ); } );
+        const int cnt = data.size();
+        std::sort( data.begin(), data.end(), []( const uint8_t l, const uint8_t r ) { return LexiconHitPos( l ) < LexiconHitPos( r ); } );
 
         for( int j=0; j<cnt; j++ )
         {
@@ -189,13 +256,341 @@ static SearchResult PrepareResults( uint32_t postid, float rank, int hitsize )
     return ret;
 }
 
-uint32_t SearchEngine::ExtractWords( const std::vector<std::string>& terms, int flags, std::vector<WordData>& words, std::vector<const char*>& matched ) const
+static int CompareWord( const char* word, size_t wlen, const char* str, size_t len )
+{
+    const auto ret = memcmp( word, str, std::min( wlen, len ) );
+    if( ret != 0 ) return ret;
+    return wlen < len ? -1 : ( wlen > len ? 1 : 0 );
+}
+
+void SearchEngine::ExpandPrefix( const char* prefix, size_t len, size_t max, std::vector<uint32_t>& out ) const
+{
+    out.clear();
+    if( m_archive.m_lexdict )
+    {
+        auto& dict = *m_archive.m_lexdict;
+        auto& dictmeta = *m_archive.m_lexdictmeta;
+
+        // Find the first block starting with a word not less than prefix. Matches may begin in the block before it.
+        size_t lo = 0;
+        size_t hi = dictmeta.DataSize();
+        while( lo < hi )
+        {
+            const auto mid = ( lo + hi ) / 2;
+            uint32_t shared, wlen;
+            auto ptr = LexiconDecodeVarInt( dict + dictmeta[mid], shared );
+            ptr = LexiconDecodeVarInt( ptr, wlen );
+            assert( shared == 0 );
+            if( CompareWord( (const char*)ptr, wlen, prefix, len ) < 0 )
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        if( lo > 0 ) lo--;
+
+        char word[256];
+        const uint8_t* ptr = dict + ( lo < dictmeta.DataSize() ? dictmeta[lo] : dict.Size() );
+        const uint8_t* end = dict + dict.Size();
+        while( ptr < end )
+        {
+            uint32_t shared, wlen, idx;
+            ptr = LexiconDecodeVarInt( ptr, shared );
+            ptr = LexiconDecodeVarInt( ptr, wlen );
+            if( shared + wlen > sizeof( word ) ) break;
+            memcpy( word + shared, ptr, wlen );
+            ptr = LexiconDecodeVarInt( ptr + wlen, idx );
+            const auto size = shared + wlen;
+            if( size >= len && memcmp( word, prefix, len ) == 0 )
+            {
+                out.emplace_back( idx );
+            }
+            else if( CompareWord( word, size, prefix, len ) > 0 )
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        auto& meta = m_archive.m_lexmeta;
+        auto& data = m_archive.m_lexstr;
+        const auto dataSize = meta.DataSize();
+        for( uint32_t i=0; i<dataSize; i++ )
+        {
+            auto mp = meta + i;
+            auto s = data + mp->str;
+            if( strncmp( s, prefix, len ) == 0 )
+            {
+                out.emplace_back( i );
+            }
+        }
+    }
+
+    auto& meta = m_archive.m_lexmeta;
+    const auto cmp = [&meta] ( const auto& l, const auto& r ) { return meta[l].dataSize > meta[r].dataSize || ( meta[l].dataSize == meta[r].dataSize && l < r ); };
+    if( out.size() > max )
+    {
+        std::partial_sort( out.begin(), out.begin() + max, out.end(), cmp );
+        out.resize( max );
+    }
+    else
+    {
+        std::sort( out.begin(), out.end(), cmp );
+    }
+}
+
+std::vector<const char*> SearchEngine::CompleteWord( const char* prefix, size_t max ) const
+{
+    std::vector<uint32_t> list;
+    ExpandPrefix( prefix, strlen( prefix ), max, list );
+
+    std::vector<const char*> ret;
+    ret.reserve( list.size() );
+    for( auto& v : list )
+    {
+        ret.emplace_back( m_archive.m_lexstr + m_archive.m_lexmeta[v].str );
+    }
+    return ret;
+}
+
+// Maximum edit distance of similar words found at query time.
+static int MaxEditDistance( int len )
+{
+    return len <= 5 ? 1 : 2;
+}
+
+static inline char32_t DecodeCodepoint( const char* str, int len )
+{
+    switch( len )
+    {
+    case 1:
+        return str[0];
+    case 2:
+        return ( char32_t( str[0] & 0x1F ) << 6 ) | ( str[1] & 0x3F );
+    case 3:
+        return ( char32_t( str[0] & 0x0F ) << 12 ) | ( char32_t( str[1] & 0x3F ) << 6 ) | ( str[2] & 0x3F );
+    default:
+        return ( char32_t( str[0] & 0x07 ) << 18 ) | ( char32_t( str[1] & 0x3F ) << 12 ) | ( char32_t( str[2] & 0x3F ) << 6 ) | ( str[3] & 0x3F );
+    }
+}
+
+// Walks the sorted dictionary, simulating a Levenshtein automaton. Dictionary words sharing a prefix also share
+// rows of the edit distance matrix, and once a prefix can't lead to a match, all words beginning with it are skipped.
+void SearchEngine::FindSimilarWords( const char* word, size_t len, uint32_t count, std::vector<SimilarWord>& out ) const
+{
+    out.clear();
+    if( !m_archive.m_lexdict ) return;
+
+    enum { MaxQuery = LexiconMaxLen + 2 };
+    char32_t query[MaxQuery];
+    int qlen = 0;
+    const auto wend = word + len;
+    while( word < wend )
+    {
+        if( qlen == MaxQuery ) return;
+        const auto cpl = std::min<int>( codepointlen( *word ), wend - word );
+        query[qlen++] = DecodeCodepoint( word, cpl );
+        word += cpl;
+    }
+    if( qlen == 0 ) return;
+    const int maxd = MaxEditDistance( qlen );
+
+    // rows[k] holds edit distances between the first k codepoints of dictionary word and query prefixes
+    uint8_t rows[LexiconMaxLen+1][MaxQuery+1];
+    for( int j=0; j<=qlen; j++ ) rows[0][j] = j;
+    // end offset of each codepoint of the current dictionary word, for which row is computed
+    uint8_t cpEnd[LexiconMaxLen+1];
+    int valid = 0;
+
+    auto& dict = *m_archive.m_lexdict;
+    auto& dictmeta = *m_archive.m_lexdictmeta;
+    const auto blocks = dictmeta.DataSize();
+    const auto FirstWord = [&dict, &dictmeta] ( size_t block, uint32_t& wlen ) {
+        uint32_t shared;
+        auto ptr = LexiconDecodeVarInt( dict + dictmeta[block], shared );
+        return (const char*)LexiconDecodeVarInt( ptr, wlen );
+    };
+
+    char buf[256];
+    char dead[256];
+    size_t deadLen = 0;
+
+    const uint8_t* ptr = dict;
+    const uint8_t* end = dict + dict.Size();
+    size_t entry = 0;
+    while( ptr < end )
+    {
+        uint32_t shared, wlen, idx;
+        ptr = LexiconDecodeVarInt( ptr, shared );
+        ptr = LexiconDecodeVarInt( ptr, wlen );
+        if( shared + wlen > sizeof( buf ) ) break;
+        memcpy( buf + shared, ptr, wlen );
+        ptr = LexiconDecodeVarInt( ptr + wlen, idx );
+        const auto size = shared + wlen;
+        entry++;
+
+        if( deadLen != 0 )
+        {
+            if( size >= deadLen && memcmp( buf, dead, deadLen ) == 0 )
+            {
+                // If the next block also begins with the dead prefix, skip directly past all words having it.
+                const auto block = entry / LexiconDictBlock;
+                uint32_t flen;
+                const char* first;
+                if( entry % LexiconDictBlock != 0 && block + 1 < blocks && ( first = FirstWord( block + 1, flen ), flen >= deadLen && memcmp( first, dead, deadLen ) == 0 ) )
+                {
+                    size_t lo = block + 1;
+                    size_t hi = blocks;
+                    while( lo < hi )
+                    {
+                        const auto mid = ( lo + hi ) / 2;
+                        first = FirstWord( mid, flen );
+                        if( flen >= deadLen && memcmp( first, dead, deadLen ) == 0 )
+                        {
+                            lo = mid + 1;
+                        }
+                        else
+                        {
+                            hi = mid;
+                        }
+                    }
+                    ptr = dict + dictmeta[lo-1];
+                    entry = ( lo - 1 ) * LexiconDictBlock;
+                    valid = 0;
+                }
+                continue;
+            }
+            deadLen = 0;
+        }
+
+        // rows computed for codepoints fully within the shared prefix are still valid
+        while( valid > 0 && cpEnd[valid-1] > shared ) valid--;
+
+        int k = valid;
+        size_t pos = k == 0 ? 0 : cpEnd[k-1];
+        bool isDead = false;
+        while( pos < size )
+        {
+            if( k == LexiconMaxLen )
+            {
+                isDead = true;
+                break;
+            }
+            const auto cpl = std::min<int>( codepointlen( buf[pos] ), size - pos );
+            const auto cp = DecodeCodepoint( buf + pos, cpl );
+            pos += cpl;
+
+            const auto prev = rows[k];
+            const auto row = rows[k+1];
+            row[0] = k + 1;
+            int min = row[0];
+            for( int j=0; j<qlen; j++ )
+            {
+                const int v = std::min( { prev[j+1] + 1, row[j] + 1, prev[j] + ( cp == query[j] ? 0 : 1 ) } );
+                row[j+1] = v;
+                if( v < min ) min = v;
+            }
+            cpEnd[k] = pos;
+            k++;
+            if( min > maxd )
+            {
+                isDead = true;
+                break;
+            }
+        }
+        valid = k;
+
+        if( isDead )
+        {
+            deadLen = pos;
+            memcpy( dead, buf, deadLen );
+            continue;
+        }
+
+        const auto dist = rows[k][qlen];
+        if( dist > 0 && dist <= maxd )
+        {
+            out.emplace_back( SimilarWord { idx, dist } );
+        }
+    }
+
+    // Similar words have to be reasonably common, relative to the searched word and to each other.
+    auto& meta = m_archive.m_lexmeta;
+    const auto tcnt = count / 10;
+    uint32_t maxCount = 0;
+    for( auto& v : out )
+    {
+        maxCount = std::max( maxCount, meta[v.word].dataSize );
+    }
+    const auto tmc = std::max( tcnt, maxCount / 5 );
+    out.erase( std::remove_if( out.begin(), out.end(), [&meta, tmc] ( const auto& v ) { return meta[v.word].dataSize < tmc; } ), out.end() );
+
+    if( out.size() > MaxSimilarWords )
+    {
+        std::partial_sort( out.begin(), out.begin() + MaxSimilarWords, out.end(), [&meta] ( const auto& l, const auto& r ) {
+            return l.distance < r.distance || ( l.distance == r.distance && meta[l.word].dataSize > meta[r.word].dataSize );
+        } );
+        out.resize( MaxSimilarWords );
+    }
+}
+
+std::vector<const char*> SearchEngine::GetSimilarWords( const char* word, bool precomputed ) const
+{
+    std::vector<const char*> ret;
+    if( precomputed )
+    {
+        if( !m_archive.m_lexdist ) return ret;
+        const auto res = m_archive.m_lexhash.Search( word );
+        if( res < 0 ) return ret;
+        auto ptr = (*m_archive.m_lexdist)[res];
+        const auto size = *ptr++;
+        for( uint32_t i=0; i<size; i++ )
+        {
+            ret.emplace_back( m_archive.m_lexstr + ( *ptr++ & 0x3FFFFFFF ) );
+        }
+    }
+    else
+    {
+        const auto res = m_archive.m_lexhash.Search( word );
+        std::vector<SimilarWord> list;
+        FindSimilarWords( word, strlen( word ), res >= 0 ? m_archive.m_lexmeta[res].dataSize : 0, list );
+        for( auto& v : list )
+        {
+            ret.emplace_back( m_archive.m_lexstr + m_archive.m_lexmeta[v.word].str );
+        }
+    }
+    return ret;
+}
+
+// Checks if word could have been indexed by lexicon, i.e. if it occupies a position in the positional index.
+static bool IsIndexable( const char* str, const char* end )
+{
+    int len = 0;
+    while( str != end )
+    {
+        if( ( *str++ & 0xC0 ) != 0x80 ) len++;
+    }
+    return len >= LexiconMinLen && len <= LexiconMaxLen;
+}
+
+uint32_t SearchEngine::ExtractWords( const SearchContext& ctx, const std::vector<std::string>& terms, int flags, std::vector<WordData>& words, std::vector<PhraseData>& phrases, std::vector<const char*>& matched ) const
 {
     robin_hood::unordered_flat_set<uint32_t> wordset;
+    std::vector<uint32_t> processed;
+    std::vector<SimilarWord> similar;
+    // similar words of misspelled terms, added after fuzzy matching of the other words is done
+    std::vector<WordData> deferred;
     uint32_t group = 0;
     words.reserve( terms.size() );
-    for( auto& v : terms )
+    StageTimer timer( ctx.m_stats, SearchStats::ST_Parse );
+    for( size_t t=0; t<terms.size(); t++ )
     {
+        if( ctx.IsCancelled() ) return 0;
+        auto& v = terms[t];
         uint32_t wf = WF_None;
         const char* str = v.c_str();
         const char* strend = str + v.size();
@@ -240,6 +635,45 @@ uint32_t SearchEngine::ExtractWords( const std::vector<std::string>& terms, int
                 strend--;
                 strictMatch = true;
             }
+            else if( strend - str > 1 && *str == '"' )
+            {
+                // Phrase spans terms up to the one ending with a quote. Its words are matched exactly and must
+                // be present at consecutive positions. Words of a required phrase also take part in ranking.
+                PhraseData phrase { {}, wf & ( WF_From | WF_Subject ), bool( wf & WF_Cant ), false };
+                uint32_t offset = 0;
+                str++;
+                for(;;)
+                {
+                    const bool last = t+1 == terms.size() || ( strend != str && *(strend-1) == '"' );
+                    if( strend != str && *(strend-1) == '"' ) strend--;
+                    if( IsIndexable( str, strend ) )
+                    {
+                        auto res = m_archive.m_lexhash.Search( std::string( str, strend ).c_str() );
+                        if( res >= 0 )
+                        {
+                            phrase.words.emplace_back( PhraseWord { uint32_t( res ), offset } );
+                            if( !phrase.cant && wordset.find( res ) == wordset.end() )
+                            {
+                                words.emplace_back( WordData { uint32_t( res ), 1.f, wf & ( WF_From | WF_Subject ), group++, true } );
+                                wordset.emplace( res );
+                                matched.emplace_back( m_archive.m_lexstr + m_archive.m_lexmeta[res].str );
+                            }
+                        }
+                        else
+                        {
+                            phrase.missing = true;
+                        }
+                        offset++;
+                    }
+                    if( last ) break;
+                    t++;
+                    str = terms[t].c_str();
+                    strend = str + terms[t].size();
+                }
+                // Phrase with unknown word is in no post. If it is excluded, there is nothing to exclude.
+                if( offset != 0 && !( phrase.cant && phrase.missing ) ) phrases.emplace_back( std::move( phrase ) );
+                continue;
+            }
             if( !( wf & ( WF_Must | WF_Cant ) ) )
             {
                 if( *(strend-1) == '*' )
@@ -250,34 +684,46 @@ uint32_t SearchEngine::ExtractWords( const std::vector<std::string>& terms, int
             }
         }
 
-        std::vector<std::string> processed;
+        processed.clear();
         if( !matchAll )
         {
-            processed.emplace_back( str, strend );
-        }
-        else
-        {
-            auto& meta = m_archive.m_lexmeta;
-            auto& data = m_archive.m_lexstr;
-            const auto dataSize = meta.DataSize();
-            for( uint32_t i=0; i<dataSize; i++ )
+            auto res = m_archive.m_lexhash.Search( std::string( str, strend ).c_str() );
+            if( res >= 0 )
             {
-                auto mp = meta + i;
-                auto s = data + mp->str;
-                if( strncmp( s, str, strend - str ) == 0 )
+                processed.emplace_back( res );
+            }
+            else if( ( flags & SF_FuzzySearch ) && !strictMatch && !( wf & ( WF_Must | WF_Cant ) ) )
+            {
+                // Word is not in lexicon, possibly misspelled. Search for similar words instead.
+                timer.Next( SearchStats::ST_Fuzzy );
+                FindSimilarWords( str, strend - str, 0, similar );
+                timer.Next( SearchStats::ST_Parse );
+                bool added = false;
+                for( auto& v : similar )
                 {
-                    processed.emplace_back( s );
+                    if( wordset.find( v.word ) == wordset.end() )
+                    {
+                        wordset.emplace( v.word );
+                        deferred.emplace_back( WordData { v.word, DistMod[v.distance], wf, group, false } );
+                        added = true;
+                    }
                 }
+                if( added ) group++;
+                continue;
             }
         }
+        else
+        {
+            ExpandPrefix( str, strend - str, MaxPrefixWords, processed );
+            std::sort( processed.begin(), processed.end() );
+        }
 
         bool added = false;
-        for( auto& word : processed )
+        for( auto& res : processed )
         {
-            auto res = m_archive.m_lexhash.Search( word.c_str() );
-            if( res >= 0 && wordset.find( res ) == wordset.end() )
+            if( wordset.find( res ) == wordset.end() )
             {
-                words.emplace_back( WordData { uint32_t( res ), 1.f, wf, group, strictMatch } );
+                words.emplace_back( WordData { res, 1.f, wf, group, strictMatch } );
                 wordset.emplace( res );
                 matched.emplace_back( m_archive.m_lexstr + m_archive.m_lexmeta[res].str );
                 added = true;
@@ -289,257 +735,993 @@ uint32_t SearchEngine::ExtractWords( const std::vector<std::string>& terms, int
 
     if( flags & SF_FuzzySearch )
     {
+        timer.Next( SearchStats::ST_Fuzzy );
         const auto sz = words.size();
         for( int i=0; i<sz; i++ )
         {
+            if( ctx.IsCancelled() ) return 0;
             const auto& wd = words[i];
             const auto flags = wd.flags;
             const auto group = wd.group;
 
             if( !wd.strict && !( flags & ( WF_Must | WF_Cant ) ) )
             {
-                auto ptr = (*m_archive.m_lexdist)[wd.word];
-                const auto size = *ptr++;
-                for( uint32_t i=0; i<size; i++ )
-                {
-                    const auto data = *ptr++;
-                    const auto offset = data & 0x3FFFFFFF;
-                    auto word = m_archive.m_lexstr + offset;
-                    auto res2 = m_archive.m_lexhash.Search( word );
-                    assert( res2 >= 0 );
-                    // todo: check if distance modifier is higher than already stored one
-                    if( wordset.find( res2 ) == wordset.end() )
+                if( m_archive.m_lexdist )
+                {
+                    auto ptr = (*m_archive.m_lexdist)[wd.word];
+                    const auto size = *ptr++;
+                    for( uint32_t i=0; i<size; i++ )
+                    {
+                        const auto data = *ptr++;
+                        const auto offset = data & 0x3FFFFFFF;
+                        auto word = m_archive.m_lexstr + offset;
+                        auto res2 = m_archive.m_lexhash.Search( word );
+                        assert( res2 >= 0 );
+                        // todo: check if distance modifier is higher than already stored one
+                        if( wordset.find( res2 ) == wordset.end() )
+                        {
+                            wordset.emplace( res2 );
+                            const auto dist = data >> 30;
+                            assert( dist > 0 && dist <= 3 );
+                            words.emplace_back( WordData { uint32_t( res2 ), DistMod[dist], flags, group, false } );
+                            matched.emplace_back( word );
+                        }
+                    }
+                }
+                else
+                {
+                    const auto meta = m_archive.m_lexmeta[wd.word];
+                    const auto str = m_archive.m_lexstr + meta.str;
+                    FindSimilarWords( str, strlen( str ), meta.dataSize, similar );
+                    for( auto& v : similar )
                     {
-                        wordset.emplace( res2 );
-                        const auto dist = data >> 30;
-                        assert( dist > 0 && dist <= 3 );
-                        static const float DistMod[] = { 0.f, 0.01f, 0.001f, 0.0001f };
-                        words.emplace_back( WordData { uint32_t( res2 ), DistMod[dist], flags, group, false } );
-                        matched.emplace_back( word );
+                        if( wordset.find( v.word ) == wordset.end() )
+                        {
+                            wordset.emplace( v.word );
+                            words.emplace_back( WordData { v.word, DistMod[v.distance], flags, group, false } );
+                            matched.emplace_back( m_archive.m_lexstr + m_archive.m_lexmeta[v.word].str );
+                        }
                     }
                 }
             }
         }
     }
 
+    for( auto& v : deferred )
+    {
+        words.emplace_back( v );
+        matched.emplace_back( m_archive.m_lexstr + m_archive.m_lexmeta[v.word].str );
+    }
+
     return group;
 }
 
-std::vector<SearchEngine::PostDataVec> SearchEngine::GetPostsForWords( const std::vector<WordData>& words, int filter ) const
+void SearchEngine::InitDateBlocks() const
 {
-    std::vector<PostDataVec> wdata;
-    wdata.reserve( words.size() );
-
-    for( int w=0; w<words.size(); w++ )
-    {
-        const auto v = words[w].word;
-        const auto wf = words[w].flags;
-
-        auto meta = m_archive.m_lexmeta[v];
-        auto data = m_archive.m_lexdata + ( meta.data / sizeof( LexiconDataPacket ) );
-
-        const auto allocSize = meta.dataSize;
-        if( allocSize * sizeof( PostData ) > SlabSize )
-        {
-            wdata.emplace_back( 0, nullptr );
-            continue;
-        }
-        auto pdata = (PostData*)slab.Alloc( sizeof( PostData ) * allocSize );
-        auto ptr = pdata;
-
-        for( uint32_t i=0; i<meta.dataSize; i++ )
+    // Posts are stored in thread order, which roughly follows dates. Block bounds allow skipping whole runs of posts.
+    std::call_once( m_dateBlocksInit, [this] {
+        const auto size = m_archive.NumberOfMessages();
+        m_dateBlocks.reserve( ( size >> DateBlockShift ) + 1 );
+        for( size_t i=0; i<size; i+=( 1 << DateBlockShift ) )
         {
-            uint8_t children = data->postid >> LexiconChildShift;
-            uint8_t hitnum = data->hitoffset >> LexiconHitShift;
-            const uint8_t* hits;
-            if( hitnum == 0 )
-            {
-                hits = m_archive.m_lexhit + ( data->hitoffset & LexiconHitOffsetMask );
-                hitnum = *hits++;
-            }
-            else
-            {
-                hits = (const uint8_t*)&data->hitoffset;
-            }
-            if( filter != T_All )
-            {
-                for( int j=0; j<hitnum; j++ )
-                {
-                    if( LexiconDecodeType( hits[j] ) == filter )
-                    {
-                        *ptr++ = PostData { data->postid & LexiconPostMask, hitnum, children, hits };
-                        break;
-                    }
-                }
-            }
-            else if( wf & ( WF_From | WF_Subject ) )
-            {
-                const LexiconType type = ( wf & WF_From ) ? T_From : T_Subject;
-                for( int j=0; j<hitnum; j++ )
-                {
-                    if( LexiconDecodeType( hits[j] ) == type )
-                    {
-                        *ptr++ = PostData { data->postid & LexiconPostMask, hitnum, children, hits };
-                        break;
-                    }
-                }
-            }
-            else
+            DateBlock block = { std::numeric_limits<uint32_t>::max(), 0 };
+            const auto end = std::min<size_t>( size, i + ( 1 << DateBlockShift ) );
+            for( size_t j=i; j<end; j++ )
             {
-                *ptr++ = PostData { data->postid & LexiconPostMask, hitnum, children, hits };
+                const auto date = m_archive.GetDate( j );
+                block.min = std::min( block.min, date );
+                block.max = std::max( block.max, date );
             }
-            data++;
+            m_dateBlocks.emplace_back( block );
         }
+    } );
+}
 
-        const auto psize = ptr - pdata;
-        assert( psize <= allocSize );
-        if( psize != allocSize )
-        {
-            slab.Unalloc( sizeof( PostData ) * ( allocSize - psize ) );
-        }
-        wdata.emplace_back( psize, pdata );
-    }
-
-    return wdata;
+bool SearchEngine::InDateRange( uint32_t postid, const DateRange& range ) const
+{
+    const auto& block = m_dateBlocks[postid >> DateBlockShift];
+    if( block.min >= range.from && block.max <= range.to ) return true;
+    const auto date = m_archive.GetDate( postid );
+    return date >= range.from && date <= range.to;
 }
 
-int SearchEngine::FixupFlags( int flags ) const
+void SearchEngine::GetDateRuns( const DateRange& range, std::vector<PostRange>& out ) const
 {
-    if( flags & SF_FuzzySearch )
+    InitDateBlocks();
+
+    out.clear();
+    for( uint32_t i=0; i<m_dateBlocks.size(); i++ )
     {
-        if( m_archive.m_lexdist )
+        const auto& block = m_dateBlocks[i];
+        if( block.max < range.from || block.min > range.to ) continue;
+        const auto begin = i << DateBlockShift;
+        if( !out.empty() && out.back().end == begin )
         {
-            flags &= ~SF_RequireAllWords;
+            out.back().end = begin + ( 1 << DateBlockShift );
         }
         else
         {
-            flags &= ~SF_FuzzySearch;
+            out.emplace_back( PostRange { begin, begin + ( 1 << DateBlockShift ) } );
         }
     }
-    if( flags & SF_RequireAllWords )
-    {
-        flags &= ~SF_SetLogic;
-    }
-    return flags;
 }
 
-std::vector<SearchResult> SearchEngine::GetSingleResult( const std::vector<SearchEngine::PostDataVec>& wdata, int flags ) const
+static inline const uint8_t* DecodeHits( const LexiconDataPacket* packet, const uint8_t* lexhit, uint8_t& hitnum )
 {
-    std::vector<SearchResult> result;
+    hitnum = packet->hitoffset >> LexiconHitShift;
+    if( hitnum != 0 ) return (const uint8_t*)&packet->hitoffset;
+    auto hits = lexhit + ( packet->hitoffset & LexiconHitOffsetMask );
+    hitnum = *hits++;
+    return hits;
+}
 
-    assert( wdata.size() == 1 );
+static inline bool HasHitType( const uint8_t* hits, uint8_t hitnum, int type )
+{
+    for( int i=0; i<hitnum; i++ )
+    {
+        if( LexiconDecodeType( hits[i] ) == type ) return true;
+    }
+    return false;
+}
 
-    const auto size = wdata[0].first;
-    auto ptr = wdata[0].second;
-    auto end = ptr + size;
-    result.reserve( size );
-    while( ptr != end )
+// Lazily iterates over postings of a word, in post id order. Postings without hits of the requested type, or
+// outside of the searched date range are skipped. Hit data is only decoded on request.
+class SearchEngine::PostCursor
+{
+public:
+    PostCursor( const SearchEngine& engine, const WordData& word, int type, const DateRange& range, const std::vector<PostRange>& runs )
+        : m_engine( engine )
+        , m_index( nullptr )
+        , m_pos( 0 )
+        , m_type( type )
+        , m_range( range )
+        , m_runs( range.IsAll() ? nullptr : &runs )
+        , m_run( 0 )
     {
-        // hits are already sorted
-        if( flags & SF_SimpleSearch )
+        auto& archive = engine.m_archive;
+        const auto meta = archive.m_lexmeta[word.word];
+        m_base = meta.data / sizeof( LexiconDataPacket );
+        m_data = archive.m_lexdata + m_base;
+        m_size = meta.dataSize;
+        // Header searches only have to look at postings with header hits, if these are indexed.
+        if( ( type == T_Subject || type == T_From ) && archive.m_lexhdr )
         {
-            result.emplace_back( PrepareResults( ptr->postid, HitRankSimple( *ptr ), ptr->hitnum ) );
-        }
-        else
-        {
-            result.emplace_back( PrepareResults( ptr->postid, PostRank( *ptr ) * HitRank( *ptr ), ptr->hitnum ) );
+            auto& hdrmeta = *archive.m_lexhdrmeta;
+            m_data = archive.m_lexdata;
+            m_index = *archive.m_lexhdr + hdrmeta[word.word];
+            m_size = hdrmeta[word.word+1] - hdrmeta[word.word];
         }
-        auto& sr = result.back();
-        memcpy( sr.hits, ptr->hits, sr.hitnum );
-        memset( sr.words, 0, sr.hitnum * sizeof( uint32_t ) );
-        ptr++;
+        Skip();
     }
 
-    return result;
-}
+    // Upper bound of the number of postings.
+    uint32_t Size() const { return m_size; }
+    bool AtEnd() const { return m_pos == m_size; }
+    uint32_t PostId() const { return m_postid; }
+    // Current posting index, which can be decoded later.
+    uint32_t Position() const { return m_pos; }
+    // Index of lexicon data packet of posting at pos, relative to the first packet of the word.
+    uint32_t PacketIndex( uint32_t pos ) const { return uint32_t( Packet( pos ) - m_engine.m_archive.m_lexdata ) - m_base; }
 
-std::vector<SearchResult> SearchEngine::GetAllWordResult( const std::vector<SearchEngine::PostDataVec>& wdata, int flags, uint32_t groups, uint32_t missing ) const
-{
-    assert( !( flags & SF_FuzzySearch ) );
+    void Next()
+    {
+        m_pos++;
+        Skip();
+    }
 
-    std::vector<SearchResult> result;
-    const auto wsize = wdata.size();
+    // Moves to the first posting with post id not less than postid. Returns true if the post was found.
+    bool Advance( uint32_t postid )
+    {
+        if( AtEnd() ) return false;
+        if( m_postid < postid )
+        {
+            m_pos = Gallop( m_pos + 1, postid );
+            Skip();
+            if( AtEnd() ) return false;
+        }
+        return m_postid == postid;
+    }
 
-    std::vector<const PostData*> list;
-    list.reserve( 32 );
-    result.reserve( wdata[0].first );
+    PostData Decode( uint32_t pos ) const
+    {
+        auto packet = Packet( pos );
+        uint8_t hitnum;
+        auto hits = DecodeHits( packet, m_engine.m_archive.m_lexhit, hitnum );
+        return PostData { packet->postid & LexiconPostMask, hitnum, uint8_t( packet->postid >> LexiconChildShift ), hits };
+    }
+
+private:
+    const LexiconDataPacket* Packet( uint32_t pos ) const { return m_index ? m_data + m_index[pos] : m_data + pos; }
+    uint32_t PacketPostId( uint32_t pos ) const { return Packet( pos )->postid & LexiconPostMask; }
 
-    auto& vec = *wdata.begin();
-    for( int i=0; i<vec.first; i++ )
+    // Returns index of the first posting in [pos, size) with post id not less than postid.
+    uint32_t Gallop( uint32_t pos, uint32_t postid ) const
     {
-        auto& post = vec.second[i];
-        list.clear();
-        list.emplace_back( &post );
-        bool ok = true;
-        for( size_t i=1; i<wsize; i++ )
+        uint32_t step = 1;
+        uint32_t lo = pos;
+        uint32_t hi = pos;
+        while( hi < m_size && PacketPostId( hi ) < postid )
+        {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        hi = std::min( hi, m_size );
+        while( lo < hi )
         {
-            auto& vtest = wdata[i];
-            auto begin = vtest.second;
-            auto end = begin + vtest.first;
-            auto it = std::lower_bound( begin, end, post, [] ( const auto& l, const auto& r ) { return l.postid < r.postid; } );
-            if( it == end || it->postid != post.postid )
+            const auto mid = ( lo + hi ) / 2;
+            if( PacketPostId( mid ) < postid )
             {
-                ok = false;
-                break;
+                lo = mid + 1;
             }
             else
             {
-                list.emplace_back( &*it );
+                hi = mid;
             }
         }
-        if( ok )
+        return lo;
+    }
+
+    // Moves forward to the first posting passing filters.
+    void Skip()
+    {
+        while( m_pos < m_size )
         {
-            assert( groups == list.size() );
-            float rank = 0;
-            if( flags & SF_SimpleSearch )
+            auto packet = Packet( m_pos );
+            const auto postid = packet->postid & LexiconPostMask;
+            if( m_runs )
+            {
+                auto& runs = *m_runs;
+                while( m_run < runs.size() && postid >= runs[m_run].end ) m_run++;
+                if( m_run == runs.size() )
+                {
+                    m_pos = m_size;
+                    return;
+                }
+                if( postid < runs[m_run].begin )
+                {
+                    m_pos = Gallop( m_pos + 1, runs[m_run].begin );
+                    continue;
+                }
+                if( !m_engine.InDateRange( postid, m_range ) )
+                {
+                    m_pos++;
+                    continue;
+                }
+            }
+            if( m_type != T_All )
             {
-                for( auto& v : list )
+                uint8_t hitnum;
+                auto hits = DecodeHits( packet, m_engine.m_archive.m_lexhit, hitnum );
+                if( !HasHitType( hits, hitnum, m_type ) )
                 {
-                    rank += HitRankSimple( *v );
+                    m_pos++;
+                    continue;
                 }
             }
+            m_postid = postid;
+            return;
+        }
+    }
+
+    const SearchEngine& m_engine;
+    const LexiconDataPacket* m_data;
+    const uint32_t* m_index;
+    uint32_t m_base;
+    uint32_t m_size;
+    uint32_t m_pos;
+    uint32_t m_postid;
+    int m_type;
+    DateRange m_range;
+    const std::vector<PostRange>* m_runs;
+    size_t m_run;
+};
+
+static int GetWordType( const WordData& word, int filter )
+{
+    if( filter == T_All && ( word.flags & ( WF_From | WF_Subject ) ) )
+    {
+        return ( word.flags & WF_From ) ? T_From : T_Subject;
+    }
+    return filter;
+}
+
+SearchEngine::PostCursor SearchEngine::GetCursor( const WordData& word, int filter, const DateRange& range, const std::vector<PostRange>& runs ) const
+{
+    return PostCursor( *this, word, GetWordType( word, filter ), range, runs );
+}
+
+const uint64_t* SearchEngine::GetBitmap( const WordData& word, int filter ) const
+{
+    if( GetWordType( word, filter ) != T_All || !m_archive.m_lexbmp ) return nullptr;
+    const auto offset = (*m_archive.m_lexbmpmeta)[word.word];
+    return offset != LexiconNoBitmap ? *m_archive.m_lexbmp + offset : nullptr;
+}
+
+// Iterates over postings of a word in order of decreasing static rank, skipping postings which do not pass filters.
+// Long posting lists are ordered by the lexrank index. Shorter ones have to be decoded and sorted by the caller.
+class SearchEngine::RankCursor
+{
+public:
+    RankCursor( const SearchEngine& engine, const WordData& word, int type, const DateRange& range )
+        : m_engine( engine )
+        , m_list( nullptr )
+        , m_pos( 0 )
+        , m_type( type )
+        , m_range( range )
+    {
+        auto& archive = engine.m_archive;
+        auto& rankmeta = *archive.m_lexrankmeta;
+        m_data = archive.m_lexdata + ( archive.m_lexmeta[word.word].data / sizeof( LexiconDataPacket ) );
+        m_order = *archive.m_lexrank + rankmeta[word.word];
+        m_size = rankmeta[word.word+1] - rankmeta[word.word];
+        Skip();
+    }
+
+    // Decoded postings, which already passed filters, are visited in the given order.
+    RankCursor( const SearchEngine& engine, const PostData* list, const uint32_t* order, uint32_t size )
+        : m_engine( engine )
+        , m_data( nullptr )
+        , m_list( list )
+        , m_order( order )
+        , m_size( size )
+        , m_pos( 0 )
+        , m_type( T_All )
+    {
+        Skip();
+    }
+
+    bool AtEnd() const { return m_pos == m_size; }
+    // Number of postings looked at so far.
+    uint32_t Position() const { return m_pos; }
+    const PostData& Post() const { return m_post; }
+    // Static rank of the current posting. No posting further in the list has higher rank.
+    float Rank() const { return m_rank; }
+
+    void Next()
+    {
+        m_pos++;
+        Skip();
+    }
+
+private:
+    void Skip()
+    {
+        for( ; m_pos < m_size; m_pos++ )
+        {
+            if( m_list )
+            {
+                m_post = m_list[m_order[m_pos]];
+            }
             else
             {
-                for( auto& v : list )
+                auto packet = m_data + m_order[m_pos];
+                const auto postid = packet->postid & LexiconPostMask;
+                if( !m_range.IsAll() && !m_engine.InDateRange( postid, m_range ) ) continue;
+                uint8_t hitnum;
+                auto hits = DecodeHits( packet, m_engine.m_archive.m_lexhit, hitnum );
+                if( m_type != T_All && !HasHitType( hits, hitnum, m_type ) ) continue;
+                m_post = PostData { postid, hitnum, uint8_t( packet->postid >> LexiconChildShift ), hits };
+            }
+            m_rank = PostRank( m_post ) * HitRank( m_post );
+            return;
+        }
+    }
+
+    const SearchEngine& m_engine;
+    const LexiconDataPacket* m_data;
+    const PostData* m_list;
+    const uint32_t* m_order;
+    uint32_t m_size;
+    uint32_t m_pos;
+    int m_type;
+    DateRange m_range;
+    PostData m_post;
+    float m_rank;
+};
+
+bool SearchEngine::HasRankIndex( const WordData& word ) const
+{
+    if( !m_archive.m_lexrank ) return false;
+    auto& rankmeta = *m_archive.m_lexrankmeta;
+    return rankmeta[word.word+1] != rankmeta[word.word];
+}
+
+// Binary searches word postings for a post. Returns false if the post does not contain the word, or has no hits of
+// the requested type.
+bool SearchEngine::FindPosting( const WordData& word, int type, uint32_t postid, PostData& out ) const
+{
+    const auto meta = m_archive.m_lexmeta[word.word];
+    auto data = m_archive.m_lexdata + ( meta.data / sizeof( LexiconDataPacket ) );
+    auto end = data + meta.dataSize;
+    auto it = std::lower_bound( data, end, postid, [] ( const auto& l, const auto& r ) { return ( l.postid & LexiconPostMask ) < r; } );
+    if( it == end || ( it->postid & LexiconPostMask ) != postid ) return false;
+    uint8_t hitnum;
+    auto hits = DecodeHits( it, m_archive.m_lexhit, hitnum );
+    if( type != T_All && !HasHitType( hits, hitnum, type ) ) return false;
+    out = PostData { postid, hitnum, uint8_t( it->postid >> LexiconChildShift ), hits };
+    return true;
+}
+
+// Decodes postings of a cursor. If include list is given, only postings of these posts are decoded.
+SearchEngine::PostList SearchEngine::GetPosts( SearchContext& ctx, PostCursor& cursor, const uint32_t* include, size_t isize ) const
+{
+    const auto allocSize = include ? std::min<size_t>( isize, cursor.Size() ) : cursor.Size();
+    // post identifiers are kept in a separate contiguous array for the intersection kernels
+    auto pid = (uint32_t*)ctx.m_arena.Alloc( sizeof( uint32_t ) * allocSize );
+    auto pdata = pid ? (PostData*)ctx.m_arena.Alloc( sizeof( PostData ) * allocSize ) : nullptr;
+    if( !pdata )
+    {
+        // word is too common to fit in the memory limit
+        return PostList { 0, nullptr, nullptr };
+    }
+
+    uint32_t psize = 0;
+    if( include )
+    {
+        size_t i = 0;
+        for( ; i<isize && !cursor.AtEnd(); i++ )
+        {
+            if( cursor.Advance( include[i] ) )
+            {
+                pid[psize] = include[i];
+                pdata[psize++] = cursor.Decode( cursor.Position() );
+            }
+        }
+        if( ctx.m_stats ) ctx.m_stats->probes += i;
+    }
+    else
+    {
+        while( !cursor.AtEnd() )
+        {
+            pid[psize] = cursor.PostId();
+            pdata[psize++] = cursor.Decode( cursor.Position() );
+            cursor.Next();
+        }
+    }
+
+    if( ctx.m_stats ) ctx.m_stats->postings += psize;
+
+    assert( psize <= allocSize );
+    if( psize != allocSize )
+    {
+        ctx.m_arena.Unalloc( sizeof( PostData ) * ( allocSize - psize ) );
+    }
+    return PostList { psize, pid, pdata };
+}
+
+// Post identifiers of all postings of a word. Index in list is also index of lexicon data packet.
+SearchEngine::PostList SearchEngine::GetPostIds( SearchContext& ctx, uint32_t word ) const
+{
+    const auto meta = m_archive.m_lexmeta[word];
+    const auto data = m_archive.m_lexdata + ( meta.data / sizeof( LexiconDataPacket ) );
+    auto pid = (uint32_t*)ctx.m_arena.Alloc( sizeof( uint32_t ) * meta.dataSize );
+    if( !pid ) return PostList { 0, nullptr, nullptr };
+    for( uint32_t i=0; i<meta.dataSize; i++ )
+    {
+        pid[i] = data[i].postid & LexiconPostMask;
+    }
+    if( ctx.m_stats ) ctx.m_stats->postings += meta.dataSize;
+    return PostList { meta.dataSize, pid, nullptr };
+}
+
+int SearchEngine::FixupFlags( int flags ) const
+{
+    if( flags & SF_FuzzySearch )
+    {
+        if( m_archive.m_lexdist || m_archive.m_lexdict )
+        {
+            flags &= ~SF_RequireAllWords;
+        }
+        else
+        {
+            flags &= ~SF_FuzzySearch;
+        }
+    }
+    if( flags & SF_RequireAllWords )
+    {
+        flags &= ~SF_SetLogic;
+    }
+    return flags;
+}
+
+std::vector<SearchResult> SearchEngine::GetSingleResult( const SearchEngine::PostList& wdata, int flags ) const
+{
+    std::vector<SearchResult> result;
+
+    const auto size = wdata.size;
+    auto ptr = wdata.data;
+    auto end = ptr + size;
+    result.reserve( size );
+    while( ptr != end )
+    {
+        // hits are already sorted
+        if( flags & SF_SimpleSearch )
+        {
+            result.emplace_back( PrepareResults( ptr->postid, HitRankSimple( *ptr ), ptr->hitnum ) );
+        }
+        else
+        {
+            result.emplace_back( PrepareResults( ptr->postid, PostRank( *ptr ) * HitRank( *ptr ), ptr->hitnum ) );
+        }
+        auto& sr = result.back();
+        memcpy( sr.hits, ptr->hits, sr.hitnum );
+        memset( sr.words, 0, sr.hitnum * sizeof( uint32_t ) );
+        ptr++;
+    }
+
+    return result;
+}
+
+// Intersects all lists, starting with the shortest one, so that the candidate set shrinks as fast as possible.
+// Returns number of posts present in all lists. Their identifiers are stored in ids and for each such post
+// pos[w][k] holds index of its posting in list w.
+uint32_t SearchEngine::IntersectLists( SearchContext& ctx, const std::vector<PostList>& lists, uint32_t*& ids, std::vector<uint32_t*>& pos )
+{
+    const auto wsize = lists.size();
+    assert( wsize > 0 );
+
+    std::vector<uint32_t> order( wsize );
+    for( size_t i=0; i<wsize; i++ ) order[i] = i;
+    std::stable_sort( order.begin(), order.end(), [&lists] ( const auto& l, const auto& r ) { return lists[l].size < lists[r].size; } );
+
+    const auto& shortest = lists[order[0]];
+    uint32_t num = shortest.size;
+    if( num == 0 ) return 0;
+
+    pos.resize( wsize );
+    ids = (uint32_t*)ctx.m_arena.Alloc( sizeof( uint32_t ) * num * ( wsize + 2 ) );
+    if( !ids ) return 0;
+    auto tmp = ids + num;
+    memcpy( ids, shortest.postid, sizeof( uint32_t ) * num );
+    pos[order[0]] = tmp + num;
+    for( uint32_t i=0; i<num; i++ ) pos[order[0]][i] = i;
+
+    for( size_t o=1; o<wsize && num != 0; o++ )
+    {
+        const auto w = order[o];
+        pos[w] = pos[order[o-1]] + shortest.size;
+        num = Intersect( ids, num, lists[w].postid, lists[w].size, tmp, pos[w] );
+        // tmp is strictly increasing and tmp[k] >= k, so compaction can be done in place
+        for( uint32_t k=0; k<num; k++ ) ids[k] = ids[tmp[k]];
+        for( size_t p=0; p<o; p++ )
+        {
+            auto pp = pos[order[p]];
+            for( uint32_t k=0; k<num; k++ ) pp[k] = pp[tmp[k]];
+        }
+    }
+
+    return num;
+}
+
+// The rarest word provides candidate posts, which are then looked up in the lists of more common words. Filters
+// are only checked on postings which are visited. Results are returned in the same way as in IntersectLists, with
+// pos[w][k] holding cursor position of the posting.
+uint32_t SearchEngine::IntersectCursors( SearchContext& ctx, std::vector<PostCursor>& cursors, uint32_t*& ids, std::vector<uint32_t*>& pos )
+{
+    const auto wsize = cursors.size();
+    assert( wsize > 0 );
+
+    std::vector<uint32_t> order( wsize );
+    for( size_t i=0; i<wsize; i++ ) order[i] = i;
+    std::stable_sort( order.begin(), order.end(), [&cursors] ( const auto& l, const auto& r ) { return cursors[l].Size() < cursors[r].Size(); } );
+
+    auto& first = cursors[order[0]];
+    const auto cnum = first.Size();
+    if( cnum == 0 ) return 0;
+    ids = (uint32_t*)ctx.m_arena.Alloc( sizeof( uint32_t ) * cnum * ( wsize + 1 ) );
+    if( !ids ) return 0;
+    pos.resize( wsize );
+    for( size_t i=0; i<wsize; i++ ) pos[order[i]] = ids + cnum * ( i + 1 );
+
+    uint32_t num = 0;
+    while( !first.AtEnd() )
+    {
+        ids[num] = first.PostId();
+        pos[order[0]][num] = first.Position();
+        num++;
+        first.Next();
+    }
+    if( ctx.m_stats ) ctx.m_stats->postings += num;
+
+    for( size_t o=1; o<wsize && num != 0; o++ )
+    {
+        const auto w = order[o];
+        auto& cursor = cursors[w];
+        if( ctx.m_stats ) ctx.m_stats->probes += num;
+        uint32_t cnt = 0;
+        for( uint32_t k=0; k<num && !cursor.AtEnd(); k++ )
+        {
+            if( cursor.Advance( ids[k] ) )
+            {
+                ids[cnt] = ids[k];
+                for( size_t p=0; p<o; p++ ) pos[order[p]][cnt] = pos[order[p]][k];
+                pos[w][cnt] = cursor.Position();
+                cnt++;
+            }
+        }
+        num = cnt;
+    }
+    return num;
+}
+
+// Hit types are not stored with word positions, so a phrase limited to a header (or searched with a type filter)
+// requires all its words to be present in that header, while word order is checked in the whole post.
+void SearchEngine::MatchPhrase( SearchContext& ctx, const PhraseData& phrase, int filter, const DateRange& range, const std::vector<PostRange>& runs, std::vector<uint32_t>& out ) const
+{
+    out.clear();
+    const auto wsize = phrase.words.size();
+    if( wsize == 0 || phrase.missing ) return;
+
+    std::vector<uint32_t> base;
+    base.reserve( wsize );
+    for( auto& pw : phrase.words )
+    {
+        base.emplace_back( m_archive.m_lexmeta[pw.word].data / sizeof( LexiconDataPacket ) );
+    }
+
+    // Postings are identified by index of lexicon data packet, relative to the base packet of each word.
+    uint32_t* ids;
+    std::vector<uint32_t*> pos;
+    uint32_t num;
+    if( range.IsAll() && filter == T_All && phrase.flags == 0 )
+    {
+        std::vector<PostList> lists;
+        lists.reserve( wsize );
+        for( auto& pw : phrase.words )
+        {
+            lists.emplace_back( GetPostIds( ctx, pw.word ) );
+            if( !lists.back().postid ) return;
+        }
+        num = IntersectLists( ctx, lists, ids, pos );
+    }
+    else
+    {
+        std::vector<PostCursor> cursors;
+        cursors.reserve( wsize );
+        for( auto& pw : phrase.words )
+        {
+            cursors.emplace_back( GetCursor( WordData { pw.word, 1.f, phrase.flags, 0, true }, filter, range, runs ) );
+        }
+        num = IntersectCursors( ctx, cursors, ids, pos );
+        for( size_t w=0; w<wsize; w++ )
+        {
+            for( uint32_t k=0; k<num; k++ ) pos[w][k] = cursors[w].PacketIndex( pos[w][k] );
+        }
+    }
+    if( num == 0 ) return;
+
+    // Without positional index only presence of all words can be checked.
+    if( !m_archive.m_lexpos )
+    {
+        out.assign( ids, ids + num );
+        return;
+    }
+
+    auto& lexpos = *m_archive.m_lexpos;
+    auto& lexposmeta = *m_archive.m_lexposmeta;
+    auto& cand = ctx.m_positions;
+    for( uint32_t k=0; k<num; k++ )
+    {
+        // Candidate phrase start positions are narrowed down by each consecutive word.
+        cand.clear();
+        for( size_t w=0; w<wsize && ( w == 0 || !cand.empty() ); w++ )
+        {
+            const auto offset = phrase.words[w].offset;
+            const uint8_t* ptr = lexpos + lexposmeta[base[w] + pos[w][k]];
+            uint32_t cnt, p = 0;
+            ptr = LexiconDecodeVarInt( ptr, cnt );
+            if( w == 0 )
+            {
+                for( uint32_t i=0; i<cnt; i++ )
                 {
-                    rank += HitRank( *v );
+                    uint32_t delta;
+                    ptr = LexiconDecodeVarInt( ptr, delta );
+                    p += delta;
+                    if( p >= offset ) cand.emplace_back( p - offset );
                 }
             }
-            if( flags & SF_AdjacentWords )
+            else
             {
-                int drank = 127 * missing;
-                for( int g=0; g<groups-1; g++ )
+                size_t c = 0, n = 0;
+                const auto csize = cand.size();
+                for( uint32_t i=0; i<cnt && c<csize; i++ )
                 {
-                    drank += GetWordDistance( std::vector<const PostData*> { list[g] }, std::vector<const PostData*> { list[g+1] } );
+                    uint32_t delta;
+                    ptr = LexiconDecodeVarInt( ptr, delta );
+                    p += delta;
+                    if( p < offset ) continue;
+                    const auto v = p - offset;
+                    while( c < csize && cand[c] < v ) c++;
+                    if( c < csize && cand[c] == v ) cand[n++] = cand[c++];
                 }
-                assert( drank != 0 );
-                rank /= drank;
+                cand.resize( n );
+            }
+        }
+        if( !cand.empty() ) out.emplace_back( ids[k] );
+    }
+}
+
+std::vector<SearchResult> SearchEngine::GetAllWordResult( SearchContext& ctx, const std::vector<WordData>& words, int filter, const DateRange& range, int flags, uint32_t groups, uint32_t missing ) const
+{
+    assert( !( flags & SF_FuzzySearch ) );
+
+    std::vector<SearchResult> result;
+    const auto wsize = words.size();
+    StageTimer timer( ctx.m_stats, SearchStats::ST_Filter );
+
+    std::vector<PostRange> runs;
+    if( !range.IsAll() ) GetDateRuns( range, runs );
+
+    std::vector<PostCursor> cursors;
+    cursors.reserve( wsize );
+    for( auto& word : words )
+    {
+        cursors.emplace_back( GetCursor( word, filter, range, runs ) );
+    }
+
+    bool filtered = !range.IsAll();
+    for( auto& word : words )
+    {
+        if( GetWordType( word, filter ) != T_All ) filtered = true;
+    }
+
+    uint32_t* ids;
+    std::vector<uint32_t*> pos;
+    uint32_t num;
+    if( !filtered )
+    {
+        // Every posting is a candidate, so whole post id lists are intersected with the SIMD kernels. Cursor
+        // positions are then indices of lexicon data packets, same as in the lists.
+        std::vector<PostList> lists;
+        lists.reserve( wsize );
+        for( auto& word : words )
+        {
+            lists.emplace_back( GetPostIds( ctx, word.word ) );
+            if( !lists.back().postid ) return result;
+        }
+        num = IntersectLists( ctx, lists, ids, pos );
+    }
+    else
+    {
+        num = IntersectCursors( ctx, cursors, ids, pos );
+    }
+    if( num == 0 ) return result;
+
+    // Hits of candidates are decoded while ranking, and this time is accounted as ranking.
+    timer.Next( SearchStats::ST_Rank );
+    if( ctx.m_stats )
+    {
+        ctx.m_stats->postings += uint64_t( num ) * ( wsize - 1 );
+        ctx.m_stats->candidates += num;
+    }
+    std::vector<PostData> posts( wsize );
+    std::vector<const PostData*> list;
+    list.reserve( wsize );
+    result.reserve( num );
+
+    for( uint32_t k=0; k<num; k++ )
+    {
+        if( ( k & 0xFFF ) == 0 && k != 0 )
+        {
+            if( ctx.IsCancelled() ) return std::vector<SearchResult>();
+            ctx.ReportProgress( float( k ) / num );
+        }
+        list.clear();
+        for( size_t w=0; w<wsize; w++ )
+        {
+            posts[w] = cursors[w].Decode( pos[w][k] );
+            list.emplace_back( &posts[w] );
+        }
+        auto& post = *list[0];
+
+        assert( groups == list.size() );
+        float rank = 0;
+        if( flags & SF_SimpleSearch )
+        {
+            for( auto& v : list )
+            {
+                rank += HitRankSimple( *v );
             }
-            // only used in threadify, no need to output hit data
-            if( flags & SF_SimpleSearch )
+        }
+        else
+        {
+            for( auto& v : list )
             {
-                result.emplace_back( PrepareResults( post.postid, rank, 0 ) );
+                rank += HitRank( *v );
             }
-            else
+        }
+        if( flags & SF_AdjacentWords )
+        {
+            timer.Next( SearchStats::ST_Distance );
+            int drank = 127 * missing;
+            for( int g=0; g<groups-1; g++ )
             {
-                result.emplace_back( PrepareResults( post.postid, rank * PostRank( post ), 0 ) );
+                drank += GetWordDistance( ctx, std::vector<const PostData*> { list[g] }, std::vector<const PostData*> { list[g+1] } );
             }
+            assert( drank != 0 );
+            rank /= drank;
+            timer.Next( SearchStats::ST_Rank );
+        }
+        // only used in threadify, no need to output hit data
+        if( flags & SF_SimpleSearch )
+        {
+            result.emplace_back( PrepareResults( post.postid, rank, 0 ) );
+        }
+        else
+        {
+            result.emplace_back( PrepareResults( post.postid, rank * PostRank( post ), 0 ) );
         }
     }
 
     return result;
 }
 
-std::vector<SearchResult> SearchEngine::GetFullResult( const std::vector<SearchEngine::PostDataVec>& wdata, const std::vector<WordData>& words, int flags, uint32_t groups, uint32_t missing ) const
+// Ranking parameters of a query and scratch buffers reused for all ranked posts.
+struct SearchEngine::RankState
+{
+    SearchContext& ctx;
+    const std::vector<WordData>& words;
+    int flags;
+    uint32_t groups;
+    uint32_t missing;
+    StageTimer& timer;
+
+    std::vector<const PostData*> list1, list2;
+    std::vector<uint8_t> hits;
+    std::vector<uint32_t> wordlist;
+    std::vector<uint32_t> idx;
+};
+
+// Ranks a post containing the given postings, which have to be ordered by word.
+SearchResult SearchEngine::RankPost( RankState& state, uint32_t postid, const WordPost* posts, uint32_t num )
+{
+    auto& words = state.words;
+    const auto flags = state.flags;
+    const auto groups = state.groups;
+    auto& list1 = state.list1;
+    auto& list2 = state.list2;
+    auto& hits = state.hits;
+    auto& wordlist = state.wordlist;
+    auto& idx = state.idx;
+
+    hits.clear();
+    wordlist.clear();
+    idx.clear();
+
+    float rank = 0;
+    for( int m=0; m<num; m++ )
+    {
+        auto& v = posts[m];
+        if( flags & SF_SimpleSearch )
+        {
+            rank += HitRankSimple( *v.data ) * words[v.word].mod;
+        }
+        else
+        {
+            rank += HitRank( *v.data ) * words[v.word].mod;
+        }
+        for( int i=0; i<v.data->hitnum; i++ )
+        {
+            wordlist.emplace_back( v.word );
+            hits.emplace_back( v.data->hits[i] );
+        }
+    }
+    if( flags & SF_AdjacentWords && groups > 1 )
+    {
+        state.timer.Next( SearchStats::ST_Distance );
+        int drank = 127 * state.missing;
+        list1.clear();
+        int g;
+        for( g = 0; g < groups-1; g++ )
+        {
+            for( int m=0; m<num; m++ )
+            {
+                auto& v = posts[m];
+                if( words[v.word].group == g )
+                {
+                    list1.emplace_back( v.data );
+                }
+            }
+            if( !list1.empty() )
+            {
+                g++;
+                break;
+            }
+            drank += 127;
+        }
+        if( !list1.empty() )
+        {
+            for( ; g<groups; g++ )
+            {
+                list2.clear();
+                for( int m=0; m<num; m++ )
+                {
+                    auto& v = posts[m];
+                    if( words[v.word].group == g )
+                    {
+                        list2.emplace_back( v.data );
+                    }
+                }
+                if( list2.empty() )
+                {
+                    drank += 127;
+                }
+                else
+                {
+                    drank += GetWordDistance( state.ctx, list1, list2 );
+                    std::swap( list1, list2 );
+                }
+            }
+        }
+        assert( drank != 0 );
+        rank /= drank;
+        state.timer.Next( SearchStats::ST_Rank );
+    }
+    idx.reserve( hits.size() );
+    for( int i=0; i<hits.size(); i++ )
+    {
+        idx.emplace_back( i );
+    }
+
+    int idxsize = idx.size();
+    if( idxsize > 1 )
+    {
+        std::sort( idx.begin(), idx.end(), [&hits]( const auto& l, const auto& r ) { return LexiconHitRank( hits[l] ) > LexiconHitRank( hits[r] ); } );
+
+        bool hitmask[256];
+        memset( &hitmask, 0, sizeof( hitmask ) );
+        int i=0;
+        while( i<idxsize )
+        {
+            const auto hit = hits[idx[i]];
+            if( !LexiconHitIsMaxPos( hit ) )
+            {
+                if( !hitmask[hit] )
+                {
+                    hitmask[hit] = true;
+                    i++;
+                }
+                else
+                {
+                    idx.erase( idx.begin() + i );
+                    idxsize--;
+                }
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    auto sr = PrepareResults( postid, ( flags & SF_SimpleSearch ) ? rank : rank * PostRank( *posts[0].data ), idxsize );
+    const auto n = sr.hitnum;
+    for( int i=0; i<n; i++ )
+    {
+        sr.hits[i] = hits[idx[i]];
+        sr.words[i] = wordlist[idx[i]];
+    }
+    return sr;
+}
+
+std::vector<SearchResult> SearchEngine::GetFullResult( SearchContext& ctx, const std::vector<WordData>& words, const std::vector<PhraseData>& phrases, int filter, const DateRange& range, int flags, uint32_t groups, uint32_t missing ) const
 {
     std::vector<SearchResult> result;
-    const auto wsize = std::min<size_t>( 1024, wdata.size() );
+    const auto wsize = std::min<size_t>( 1024, words.size() );
+    StageTimer timer( ctx.m_stats, SearchStats::ST_Filter );
+
+    std::vector<PostRange> runs;
+    if( !range.IsAll() ) GetDateRuns( range, runs );
 
+    std::vector<PostList> wdata( words.size() );
+
+    // sorted list of post ids allowed by set logic
     bool checkInclude = false;
-    robin_hood::unordered_flat_set<uint32_t> include;
+    bool hasMust = false;
+    std::vector<uint32_t> include;
     if( flags & SF_SetLogic )
     {
-        bool hasMust = false;
         bool hasCant = false;
 
         for( auto& word : words )
@@ -559,313 +1741,553 @@ std::vector<SearchResult> SearchEngine::GetFullResult( const std::vector<SearchE
                 }
             }
         }
+
+        // posts containing each phrase, matched before everything else to narrow down the candidate set
+        std::vector<std::vector<uint32_t>> phraseMatch( phrases.size() );
+        for( size_t i=0; i<phrases.size(); i++ )
+        {
+            checkInclude = true;
+            if( phrases[i].cant )
+            {
+                hasCant = true;
+            }
+            else
+            {
+                hasMust = true;
+            }
+            MatchPhrase( ctx, phrases[i], filter, range, runs, phraseMatch[i] );
+        }
+
         if( checkInclude )
         {
             if( hasMust )
             {
-                int i;
-                for( i=0; i<wdata.size(); i++ )
+                // Required lists are intersected starting with the shortest one. Other lists are only probed for
+                // the remaining candidates, and common words are tested with bitmaps, if available.
+                struct Required
+                {
+                    uint32_t size;
+                    int word;
+                    const std::vector<uint32_t>* phrase;
+                };
+                std::vector<Required> must;
+                for( int i=0; i<words.size(); i++ )
+                {
+                    if( words[i].flags & WF_Must ) must.emplace_back( Required { m_archive.m_lexmeta[words[i].word].dataSize, i, nullptr } );
+                }
+                for( size_t i=0; i<phrases.size(); i++ )
+                {
+                    if( !phrases[i].cant ) must.emplace_back( Required { uint32_t( phraseMatch[i].size() ), -1, &phraseMatch[i] } );
+                }
+                std::stable_sort( must.begin(), must.end(), [] ( const auto& l, const auto& r ) { return l.size < r.size; } );
+
+                auto& first = must[0];
+                if( first.phrase )
+                {
+                    include = *first.phrase;
+                }
+                else
                 {
-                    if( words[i].flags & WF_Must )
+                    auto cursor = GetCursor( words[first.word], filter, range, runs );
+                    while( !cursor.AtEnd() )
                     {
-                        for( int j=0; j<wdata[i].first; j++ )
-                        {
-                            auto& v = wdata[i].second[j];
-                            include.emplace( v.postid );
-                        }
-                        break;
+                        include.emplace_back( cursor.PostId() );
+                        cursor.Next();
                     }
+                    if( ctx.m_stats ) ctx.m_stats->postings += include.size();
                 }
-                for( i=i+1; i<wdata.size(); i++ )
+                std::vector<uint32_t> tmpa( include.size() ), tmpb( include.size() );
+                for( size_t i=1; i<must.size() && !include.empty(); i++ )
                 {
-                    if( words[i].flags & WF_Must )
+                    auto& vtest = must[i];
+                    if( ctx.m_stats ) ctx.m_stats->probes += include.size();
+                    if( vtest.phrase )
                     {
-                        auto& vtest = wdata[i];
-                        auto begin = vtest.second;
-                        auto end = begin + vtest.first;
-                        auto it = include.begin();
-                        while( it != include.end() )
+                        const auto num = Intersect( include.data(), include.size(), vtest.phrase->data(), vtest.phrase->size(), tmpa.data(), tmpb.data() );
+                        for( size_t k=0; k<num; k++ ) include[k] = include[tmpa[k]];
+                        include.resize( num );
+                    }
+                    else if( auto bitmap = GetBitmap( words[vtest.word], filter ) )
+                    {
+                        include.resize( IntersectBitmap( include.data(), include.size(), bitmap ) );
+                    }
+                    else
+                    {
+                        auto cursor = GetCursor( words[vtest.word], filter, range, runs );
+                        size_t num = 0;
+                        for( size_t k=0; k<include.size() && !cursor.AtEnd(); k++ )
                         {
-                            auto vit = std::lower_bound( begin, end, *it, [] ( const auto& l, const auto& r ) { return l.postid < r; } );
-                            if( vit == end || vit->postid != *it )
-                            {
-                                it = include.erase( it );
-                            }
-                            else
-                            {
-                                ++it;
-                            }
+                            if( cursor.Advance( include[k] ) ) include[num++] = include[k];
                         }
+                        include.resize( num );
                     }
                 }
             }
             else
             {
-                for( int i=0; i<wdata.size(); i++ )
+                timer.Next( SearchStats::ST_Postings );
+                for( int i=0; i<words.size(); i++ )
                 {
                     if( !( words[i].flags & WF_Cant ) )
                     {
                         assert( !( words[i].flags & WF_Must ) );
-                        for( int j=0; j<wdata[i].first; j++ )
-                        {
-                            auto& v = wdata[i].second[j];
-                            include.emplace( v.postid );
-                        }
+                        auto cursor = GetCursor( words[i], filter, range, runs );
+                        wdata[i] = GetPosts( ctx, cursor, nullptr, 0 );
+                        include.insert( include.end(), wdata[i].postid, wdata[i].postid + wdata[i].size );
                     }
                 }
+                timer.Next( SearchStats::ST_Filter );
+                std::sort( include.begin(), include.end() );
+                include.erase( std::unique( include.begin(), include.end() ), include.end() );
             }
             if( include.empty() ) return result;
 
             if( hasCant )
             {
-                for( int i=0; i<wdata.size(); i++ )
+                // Excluded words are only probed for the candidate posts, their postings are never decoded.
+                for( int i=0; i<words.size(); i++ )
                 {
                     if( words[i].flags & WF_Cant )
                     {
-                        for( int j=0; j<wdata[i].first; j++ )
+                        if( ctx.m_stats ) ctx.m_stats->probes += include.size();
+                        if( auto bitmap = GetBitmap( words[i], filter ) )
+                        {
+                            include.resize( SubtractBitmap( include.data(), include.size(), bitmap ) );
+                        }
+                        else
                         {
-                            auto& v = wdata[i].second[j];
-                            auto it = include.find( v.postid );
-                            if( it != include.end() )
+                            auto cursor = GetCursor( words[i], filter, range, runs );
+                            size_t num = 0;
+                            for( size_t k=0; k<include.size(); k++ )
                             {
-                                include.erase( it );
+                                if( !cursor.Advance( include[k] ) ) include[num++] = include[k];
                             }
+                            include.resize( num );
                         }
                     }
                 }
+                for( size_t i=0; i<phrases.size(); i++ )
+                {
+                    if( phrases[i].cant )
+                    {
+                        include.resize( Subtract( include.data(), include.size(), phraseMatch[i].data(), phraseMatch[i].size() ) );
+                    }
+                }
                 if( include.empty() ) return result;
             }
         }
     }
 
-    struct Posts
+    timer.Next( SearchStats::ST_Postings );
+    if( !checkInclude || hasMust )
     {
-        uint32_t word;
-        const PostData* data;
-    };
+        // With required words, only postings of candidate posts are needed.
+        for( int i=0; i<words.size(); i++ )
+        {
+            if( words[i].flags & WF_Cant ) continue;
+            auto cursor = GetCursor( words[i], filter, range, runs );
+            wdata[i] = hasMust ? GetPosts( ctx, cursor, include.data(), include.size() ) : GetPosts( ctx, cursor, nullptr, 0 );
+        }
+    }
 
     int count = 0;
     for( uint32_t word = 0; word < wsize; word++ )
     {
-        count += wdata[word].first;
+        count += wdata[word].size;
     }
 
-    auto index = new int32_t[m_archive.NumberOfMessages()];
-    memset( index, 0xFF, sizeof( int32_t ) * m_archive.NumberOfMessages() );
+    const auto numMsg = m_archive.NumberOfMessages();
+    auto& index = ctx.m_index;
+    if( index.size() != numMsg ) index.assign( numMsg, -1 );
 
-    auto pnum = new uint32_t[count];
-    auto postid = new uint32_t[count];
-    auto pdata = new Posts[count*wsize];
+    auto pnum = (uint32_t*)ctx.m_arena.Alloc( sizeof( uint32_t ) * count * 3 );
+    if( !pnum ) return result;
+    auto pstart = pnum + count;
+    auto postid = pstart + count;
 
-    int next = 0;
-    for( uint32_t word = 0; word < wsize; word++ )
-    {
-        for( int i=0; i<wdata[word].first; i++ )
+    // Calls f( word, post ) for each post that passes set logic filtering.
+    auto forEachPost = [&wdata, wsize, checkInclude, &include] ( auto f ) {
+        for( uint32_t word = 0; word < wsize; word++ )
         {
-            auto& post = wdata[word].second[i];
-            auto pidx = post.postid;
-            if( !checkInclude || include.find( pidx ) != include.end() )
+            size_t inc = 0;
+            for( int i=0; i<wdata[word].size; i++ )
             {
-                int idx;
-                if( index[pidx] == -1 )
-                {
-                    index[pidx] = next;
-                    idx = next++;
-                    pnum[idx] = 0;
-                    postid[idx] = pidx;
-                }
-                else
+                auto& post = wdata[word].data[i];
+                if( checkInclude )
                 {
-                    idx = index[pidx];
+                    inc = GallopSearch( include.data(), include.size(), inc, post.postid );
+                    if( inc == include.size() ) break;
+                    if( include[inc] != post.postid ) continue;
                 }
-                pdata[idx*wsize + pnum[idx]] = Posts { word, &post };
-                pnum[idx]++;
+                f( word, post );
             }
         }
+    };
+
+    int next = 0;
+    forEachPost( [&index, &next, pnum, postid] ( uint32_t word, const PostData& post ) {
+        const auto pidx = post.postid;
+        if( index[pidx] == -1 )
+        {
+            index[pidx] = next;
+            pnum[next] = 1;
+            postid[next] = pidx;
+            next++;
+        }
+        else
+        {
+            pnum[index[pidx]]++;
+        }
+    } );
+
+    uint32_t total = 0;
+    for( int k=0; k<next; k++ )
+    {
+        pstart[k] = total;
+        total += pnum[k];
+        pnum[k] = 0;
     }
 
-    delete[] index;
+    auto pdata = (WordPost*)ctx.m_arena.Alloc( sizeof( WordPost ) * total );
+    if( pdata )
+    {
+        forEachPost( [&index, pnum, pstart, pdata] ( uint32_t word, const PostData& post ) {
+            const auto idx = index[post.postid];
+            pdata[pstart[idx] + pnum[idx]++] = WordPost { word, &post };
+        } );
+    }
 
-    std::vector<const PostData*> list1, list2;
-    list1.reserve( wsize );
-    list2.reserve( wsize );
-    std::vector<uint8_t> hits;
-    std::vector<uint32_t> wordlist;
-    std::vector<uint32_t> idx;
+    for( int k=0; k<next; k++ )
+    {
+        index[postid[k]] = -1;
+    }
+    if( !pdata ) return result;
+
+    timer.Next( SearchStats::ST_Rank );
+    if( ctx.m_stats ) ctx.m_stats->candidates += next;
+    RankState state { ctx, words, flags, groups, missing, timer };
+    state.list1.reserve( wsize );
+    state.list2.reserve( wsize );
     result.reserve( next );
     for( int k=0; k<next; k++ )
     {
-        hits.clear();
-        wordlist.clear();
-        idx.clear();
+        if( ( k & 0xFFF ) == 0 && k != 0 )
+        {
+            if( ctx.IsCancelled() ) return std::vector<SearchResult>();
+            ctx.ReportProgress( float( k ) / next );
+        }
+        result.emplace_back( RankPost( state, postid[k], pdata + pstart[k], pnum[k] ) );
+    }
 
-        float rank = 0;
-        for( int m=0; m<pnum[k]; m++ )
+    return result;
+}
+
+// Returns up to max best results of a single word search. Postings are read in rank order, so only as many of them
+// as there are results have to be decoded. Returns false if the word has no rank index.
+bool SearchEngine::GetTopSingleResult( SearchContext& ctx, const WordData& word, int filter, const DateRange& range, int flags, size_t max, std::vector<SearchResult>& result ) const
+{
+    if( ( flags & SF_SimpleSearch ) || !HasRankIndex( word ) ) return false;
+    if( !range.IsAll() ) InitDateBlocks();
+
+    StageTimer timer( ctx.m_stats, SearchStats::ST_Postings );
+    RankCursor cursor( *this, word, GetWordType( word, filter ), range );
+    std::vector<PostData> posts;
+    while( posts.size() < max && !cursor.AtEnd() )
+    {
+        posts.emplace_back( cursor.Post() );
+        cursor.Next();
+    }
+    if( ctx.m_stats )
+    {
+        ctx.m_stats->postings += cursor.Position();
+        ctx.m_stats->candidates += posts.size();
+    }
+
+    timer.Next( SearchStats::ST_Rank );
+    result = GetSingleResult( PostList { uint32_t( posts.size() ), nullptr, posts.data() }, flags );
+    return true;
+}
+
+// Returns up to max best results of a query without required or excluded words, using the threshold algorithm.
+// Postings of all words are read in order of decreasing static rank, most significant words first, and each newly
+// seen post is fully ranked, by looking up its postings of the other words. Reading stops when no unseen post can
+// rank higher than the worst of results found so far. Returns false if the query cannot be answered this way, or
+// if too many posts would have to be ranked for it to be faster than ranking all of them.
+bool SearchEngine::GetTopResult( SearchContext& ctx, const std::vector<WordData>& words, const std::vector<PhraseData>& phrases, int filter, const DateRange& range, int flags, uint32_t groups, uint32_t missing, size_t max, std::vector<SearchResult>& result ) const
+{
+    // Adjacency of words lowers rank of most posts by orders of magnitude. Bounds of unseen posts would have to
+    // assume the best adjacency, so reading could almost never stop early.
+    if( ( flags & SF_SimpleSearch ) || ( ( flags & SF_AdjacentWords ) && groups > 1 ) || !phrases.empty() ) return false;
+    for( auto& word : words )
+    {
+        if( word.flags & ( WF_Must | WF_Cant ) ) return false;
+    }
+
+    const auto wsize = std::min<size_t>( 1024, words.size() );
+    StageTimer timer( ctx.m_stats, SearchStats::ST_Postings );
+
+    std::vector<PostRange> runs;
+    if( !range.IsAll() ) GetDateRuns( range, runs );
+
+    // Lists without rank index are short, these are decoded and sorted here.
+    std::vector<RankCursor> cursors;
+    std::vector<int> types( wsize );
+    cursors.reserve( wsize );
+    uint64_t total = 0;
+    for( size_t i=0; i<wsize; i++ )
+    {
+        types[i] = GetWordType( words[i], filter );
+        total += m_archive.m_lexmeta[words[i].word].dataSize;
+        if( HasRankIndex( words[i] ) )
         {
-            auto& v = pdata[k*wsize + m];
-            if( flags & SF_SimpleSearch )
-            {
-                rank += HitRankSimple( *v.data ) * words[v.word].mod;
-            }
-            else
-            {
-                rank += HitRank( *v.data ) * words[v.word].mod;
-            }
-            for( int i=0; i<v.data->hitnum; i++ )
-            {
-                wordlist.emplace_back( v.word );
-                hits.emplace_back( v.data->hits[i] );
-            }
+            cursors.emplace_back( *this, words[i], types[i], range );
         }
-        if( flags & SF_AdjacentWords && groups > 1 )
+        else
         {
-            int drank = 127 * missing;
-            list1.clear();
-            int g;
-            for( g = 0; g < groups-1; g++ )
+            auto cursor = GetCursor( words[i], filter, range, runs );
+            auto posts = GetPosts( ctx, cursor, nullptr, 0 );
+            auto order = (uint32_t*)ctx.m_arena.Alloc( sizeof( uint32_t ) * posts.size );
+            auto prank = order ? (float*)ctx.m_arena.Alloc( sizeof( float ) * posts.size ) : nullptr;
+            if( posts.size != 0 && !prank ) return false;
+            for( uint32_t j=0; j<posts.size; j++ )
             {
-                for( int m=0; m<pnum[k]; m++ )
-                {
-                    auto& v = pdata[k*wsize + m];
-                    if( words[v.word].group == g )
-                    {
-                        list1.emplace_back( v.data );
-                    }
-                }
-                if( !list1.empty() )
-                {
-                    g++;
-                    break;
-                }
-                drank += 127;
-            }
-            if( !list1.empty() )
-            {
-                for( ; g<groups; g++ )
-                {
-                    list2.clear();
-                    for( int m=0; m<pnum[k]; m++ )
-                    {
-                        auto& v = pdata[k*wsize + m];
-                        if( words[v.word].group == g )
-                        {
-                            list2.emplace_back( v.data );
-                        }
-                    }
-                    if( list2.empty() )
-                    {
-                        drank += 127;
-                    }
-                    else
-                    {
-                        drank += GetWordDistance( list1, list2 );
-                        std::swap( list1, list2 );
-                    }
-                }
+                order[j] = j;
+                prank[j] = PostRank( posts.data[j] ) * HitRank( posts.data[j] );
             }
-            assert( drank != 0 );
-            rank /= drank;
+            std::stable_sort( order, order + posts.size, [prank] ( const auto& l, const auto& r ) { return prank[l] > prank[r]; } );
+            cursors.emplace_back( *this, posts.data, order, posts.size );
         }
-        idx.reserve( hits.size() );
-        for( int i=0; i<hits.size(); i++ )
+    }
+
+    // Lists are read in order of their contribution to the rank of unseen posts.
+    struct Bound
+    {
+        float rank;
+        uint32_t word;
+        bool operator<( const Bound& other ) const { return rank < other.rank; }
+    };
+    std::vector<Bound> queue;
+    double bound = 0;
+    for( uint32_t i=0; i<wsize; i++ )
+    {
+        if( cursors[i].AtEnd() ) continue;
+        const auto rank = cursors[i].Rank() * words[i].mod;
+        queue.emplace_back( Bound { rank, i } );
+        bound += rank;
+    }
+    std::make_heap( queue.begin(), queue.end() );
+
+    // Sums of floats are not exact. Stop only when the margin is safe.
+    const double slack = 1.001;
+    // Ranking a post requires a lookup in every other list. Sequential reading of all lists is cheaper than that,
+    // if more than a small part of the posts would be ranked.
+    const auto limit = std::max<uint64_t>( max, total / ( 4 * wsize ) );
+
+    const auto numMsg = m_archive.NumberOfMessages();
+    auto& index = ctx.m_index;
+    if( index.size() != numMsg ) index.assign( numMsg, -1 );
+    std::vector<uint32_t> seen;
+    auto clearSeen = [&index, &seen] { for( auto& v : seen ) index[v] = -1; };
+
+    timer.Next( SearchStats::ST_Rank );
+    RankState state { ctx, words, flags, groups, missing, timer };
+    std::vector<PostData> found( wsize );
+    std::vector<WordPost> wp;
+    wp.reserve( wsize );
+    auto compare = [] ( const SearchResult& l, const SearchResult& r ) { return l.rank > r.rank; };
+    std::vector<SearchResult> top;
+    uint64_t postings = 0;
+    while( !queue.empty() )
+    {
+        if( ( postings & 0xFFF ) == 0 && postings != 0 && ctx.IsCancelled() )
         {
-            idx.emplace_back( i );
+            clearSeen();
+            return true;
         }
 
-        int idxsize = idx.size();
-        if( idxsize > 1 )
+        std::pop_heap( queue.begin(), queue.end() );
+        const auto w = queue.back().word;
+        bound -= queue.back().rank;
+        queue.pop_back();
+
+        auto& cursor = cursors[w];
+        const auto postid = cursor.Post().postid;
+        if( index[postid] == -1 )
         {
-            std::sort( idx.begin(), idx.end(), [&hits]( const auto& l, const auto& r ) { return LexiconHitRank( hits[l] ) > LexiconHitRank( hits[r] ); } );
+            if( seen.size() == limit )
+            {
+                clearSeen();
+                return false;
+            }
+            index[postid] = 0;
+            seen.emplace_back( postid );
 
-            bool hitmask[256];
-            memset( &hitmask, 0, sizeof( hitmask ) );
-            int i=0;
-            while( i<idxsize )
+            wp.clear();
+            for( uint32_t i=0; i<wsize; i++ )
             {
-                const auto hit = hits[idx[i]];
-                if( !LexiconHitIsMaxPos( hit ) )
+                if( i == w )
                 {
-                    if( !hitmask[hit] )
-                    {
-                        hitmask[hit] = true;
-                        i++;
-                    }
-                    else
-                    {
-                        idx.erase( idx.begin() + i );
-                        idxsize--;
-                    }
+                    found[i] = cursor.Post();
+                    wp.emplace_back( WordPost { i, &found[i] } );
                 }
-                else
+                else if( FindPosting( words[i], types[i], postid, found[i] ) )
                 {
-                    i++;
+                    wp.emplace_back( WordPost { i, &found[i] } );
                 }
             }
+            const auto sr = RankPost( state, postid, wp.data(), wp.size() );
+            if( top.size() < max )
+            {
+                top.emplace_back( sr );
+                std::push_heap( top.begin(), top.end(), compare );
+            }
+            else if( sr.rank > top[0].rank )
+            {
+                std::pop_heap( top.begin(), top.end(), compare );
+                top.back() = sr;
+                std::push_heap( top.begin(), top.end(), compare );
+            }
         }
 
-        if( flags & SF_SimpleSearch )
+        cursor.Next();
+        postings++;
+        if( !cursor.AtEnd() )
         {
-            result.emplace_back( PrepareResults( postid[k], rank, idxsize ) );
+            const auto rank = cursor.Rank() * words[w].mod;
+            queue.emplace_back( Bound { rank, w } );
+            std::push_heap( queue.begin(), queue.end() );
+            bound += rank;
         }
-        else
-        {
-            result.emplace_back( PrepareResults( postid[k], rank * PostRank( *pdata[k*wsize].data ), idxsize ) );
-        }
-        auto& sr = result.back();
-        const auto n = sr.hitnum;
-        for( int i=0; i<n; i++ )
+
+        if( top.size() == max && top[0].rank >= bound * slack ) break;
+    }
+    clearSeen();
+
+    if( ctx.m_stats )
+    {
+        ctx.m_stats->postings += postings;
+        ctx.m_stats->probes += seen.size() * ( wsize - 1 );
+        ctx.m_stats->candidates += seen.size();
+    }
+    result = std::move( top );
+    return true;
+}
+
+SearchData SearchEngine::Search( SearchContext& ctx, const std::vector<std::string>& terms, int flags, int filter, const DateRange& range ) const
+{
+    flags = FixupFlags( flags );
+
+    const auto t0 = std::chrono::steady_clock::now();
+    uint64_t minorStart, majorStart;
+    if( ctx.m_stats )
+    {
+        ctx.m_stats->Reset();
+        System::PageFaults( minorStart, majorStart );
+    }
+
+    SearchData ret;
+    if( !ctx.m_progress || !( flags & SF_FuzzySearch ) )
+    {
+        ret = SearchPass( ctx, terms, flags, filter, range );
+    }
+    else
+    {
+        // Searching for exact words is much faster than for all their similar words, so these results are reported first.
+        ctx.m_progressBase = 0;
+        ctx.m_progressScale = 0.5f;
+        ret = SearchPass( ctx, terms, flags & ~SF_FuzzySearch, filter, range );
+        if( !ctx.IsCancelled() )
         {
-            sr.hits[i] = hits[idx[i]];
-            sr.words[i] = wordlist[idx[i]];
+            ctx.ReportProgress( 1.f, &ret );
+            ctx.m_progressBase = 0.5f;
+            ret = SearchPass( ctx, terms, flags, filter, range );
         }
+        ctx.m_progressBase = 0;
+        ctx.m_progressScale = 1;
     }
 
-    delete[] pnum;
-    delete[] postid;
-    delete[] pdata;
-
-    return result;
+    if( auto stats = ctx.m_stats )
+    {
+        uint64_t minorEnd, majorEnd;
+        System::PageFaults( minorEnd, majorEnd );
+        stats->total = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - t0 ).count();
+        stats->results = ret.results.size();
+        stats->minorFaults = minorEnd - minorStart;
+        stats->majorFaults = majorEnd - majorStart;
+    }
+    return ret;
 }
 
-SearchData SearchEngine::Search( const std::vector<std::string>& terms, int flags, int filter ) const
+SearchData SearchEngine::SearchPass( SearchContext& ctx, const std::vector<std::string>& terms, int flags, int filter, const DateRange& range ) const
 {
     SearchData ret;
 
-    flags = FixupFlags( flags );
+    // Query is ended on every return, so that peak memory of a previous query is never reported.
+    struct QueryScope
+    {
+        QueryScope( SearchContext& ctx ) : ctx( ctx ) { ctx.BeginQuery(); }
+        ~QueryScope()
+        {
+            ctx.EndQuery();
+            if( ctx.m_stats ) ctx.m_stats->memory = std::max( ctx.m_stats->memory, ctx.PeakMemory() );
+        }
+        SearchContext& ctx;
+    } scope( ctx );
 
-    std::vector<WordData> words;
+    auto& words = ctx.m_words;
+    auto& phrases = ctx.m_phrases;
+    words.clear();
+    phrases.clear();
     std::vector<const char*> matched;
 
-    auto groups = ExtractWords( terms, flags, words, matched );
+    auto groups = ExtractWords( ctx, terms, flags, words, phrases, matched );
     assert( groups <= terms.size() );
-    if( groups == 0 ) return ret;
+    if( ctx.m_stats ) ctx.m_stats->words = words.size();
+    if( groups == 0 || ctx.IsCancelled() ) return ret;
     if( words.size() == 1 && words[0].flags & WF_Cant ) return ret;
 
-    const auto wdata = GetPostsForWords( words, filter );
-    assert( wdata.size() == words.size() );
-
     std::vector<SearchResult> result;
 
-    if( wdata.size() == 1 )
+    const auto max = ctx.m_maxResults;
+    if( words.size() == 1 && phrases.empty() )
     {
-        result = GetSingleResult( wdata, flags );
+        if( max == 0 || !GetTopSingleResult( ctx, words[0], filter, range, flags, max, result ) )
+        {
+            std::vector<PostRange> runs;
+            if( !range.IsAll() ) GetDateRuns( range, runs );
+            auto cursor = GetCursor( words[0], filter, range, runs );
+            StageTimer timer( ctx.m_stats, SearchStats::ST_Postings );
+            auto posts = GetPosts( ctx, cursor, nullptr, 0 );
+            timer.Next( SearchStats::ST_Rank );
+            if( ctx.m_stats ) ctx.m_stats->candidates += posts.size;
+            result = GetSingleResult( posts, flags );
+        }
     }
     else if( flags & SF_RequireAllWords )
     {
         assert( !( flags & SF_SetLogic ) );
         assert( !( flags & SF_FuzzySearch ) );
-        result = GetAllWordResult( wdata, flags, groups, terms.size() - groups );
+        result = GetAllWordResult( ctx, words, filter, range, flags, groups, terms.size() - groups );
     }
-    else
+    else if( max == 0 || !GetTopResult( ctx, words, phrases, filter, range, flags, groups, terms.size() - groups, max, result ) )
     {
-        result = GetFullResult( wdata, words, flags, groups, terms.size() - groups );
+        result = GetFullResult( ctx, words, phrases, filter, range, flags, groups, terms.size() - groups );
     }
 
-    slab.Reset();
-
-    if( result.empty() ) return ret;
+    if( result.empty() || ctx.IsCancelled() ) return ret;
 
-    std::sort( result.begin(), result.end(), []( const auto& l, const auto& r ) { return l.rank > r.rank; } );
+    StageTimer timer( ctx.m_stats, SearchStats::ST_Sort );
+    auto compare = []( const auto& l, const auto& r ) { return l.rank > r.rank; };
+    if( max != 0 && result.size() > max )
+    {
+        std::partial_sort( result.begin(), result.begin() + max, result.end(), compare );
+        result.resize( max );
+    }
+    else
+    {
+        std::sort( result.begin(), result.end(), compare );
+    }
+    timer.Stop();
 
     std::swap( ret.matched, matched );
     std::swap( ret.results, result );
@@ -1,12 +1,16 @@
 #ifndef __SEARCHENGINE_HPP__
 #define __SEARCHENGINE_HPP__
 
+#include <limits>
+#include <mutex>
 #include <stdint.h>
 #include <string>
 #include <vector>
 
 #include "../common/LexiconTypes.hpp"
 
+#include "SearchContext.hpp"
+
 class Archive;
 
 enum { SearchResultMaxHits = 4 };
@@ -36,8 +40,34 @@ struct WordData
 };
 static_assert( sizeof( WordData ) == 12, "Wrong word data struct size" );
 
+struct PhraseWord
+{
+    uint32_t word;
+    uint32_t offset;        // position relative to the start of phrase
+};
+
+struct PhraseData
+{
+    std::vector<PhraseWord> words;
+    uint32_t flags;         // WF_From or WF_Subject, if phrase is limited to a header
+    bool cant;
+    bool missing;           // some phrase word is not in lexicon, so the phrase can't match anything
+};
+
+// Inclusive range of message dates (epoch), used to restrict search results.
+struct DateRange
+{
+    uint32_t from = 0;
+    uint32_t to = std::numeric_limits<uint32_t>::max();
+
+    bool IsAll() const { return from == 0 && to == std::numeric_limits<uint32_t>::max(); }
+};
+
 struct PostData;
+struct WordPost;
 
+// Search engine holds no per-query state. One instance can serve any number of concurrent searches, as long as each
+// thread uses its own SearchContext. Date index needed by date restricted searches is built once, on first use.
 class SearchEngine
 {
 public:
@@ -53,21 +83,82 @@ public:
 
     SearchEngine( const Archive& archive );
 
-    SearchData Search( const char* query, int flags = SF_FlagsNone, int filter = T_All ) const;
-    SearchData Search( const std::vector<std::string>& terms, int flags = SF_FlagsNone, int filter = T_All ) const;
+    // These create a temporary SearchContext. Use the context overloads when issuing many queries.
+    SearchData Search( const char* query, int flags = SF_FlagsNone, int filter = T_All, const DateRange& range = DateRange() ) const;
+    SearchData Search( const std::vector<std::string>& terms, int flags = SF_FlagsNone, int filter = T_All, const DateRange& range = DateRange() ) const;
+
+    SearchData Search( SearchContext& ctx, const char* query, int flags = SF_FlagsNone, int filter = T_All, const DateRange& range = DateRange() ) const;
+    SearchData Search( SearchContext& ctx, const std::vector<std::string>& terms, int flags = SF_FlagsNone, int filter = T_All, const DateRange& range = DateRange() ) const;
+
+    // Returns up to max lexicon words starting with prefix, most common first.
+    std::vector<const char*> CompleteWord( const char* prefix, size_t max = 1024 ) const;
+    // Returns words similar to the given one, either precomputed by lexdist, or found by searching the dictionary.
+    std::vector<const char*> GetSimilarWords( const char* word, bool precomputed ) const;
 
 private:
-    using PostDataVec = std::pair<uint32_t, PostData*>;
+    struct SimilarWord
+    {
+        uint32_t word;
+        uint32_t distance;
+    };
 
-    uint32_t ExtractWords( const std::vector<std::string>& terms, int flags, std::vector<WordData>& words, std::vector<const char*>& matched ) const;
-    std::vector<PostDataVec> GetPostsForWords( const std::vector<WordData>& words, int filter ) const;
+    // Date bounds of a block of consecutive posts.
+    struct DateBlock
+    {
+        uint32_t min;
+        uint32_t max;
+    };
+
+    // Range of post ids [begin, end) which may contain posts in the searched date range.
+    struct PostRange
+    {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    struct PostList
+    {
+        uint32_t size;
+        const uint32_t* postid;
+        const PostData* data;
+    };
+
+    class PostCursor;
+    class RankCursor;
+    struct RankState;
+
+    SearchData SearchPass( SearchContext& ctx, const std::vector<std::string>& terms, int flags, int filter, const DateRange& range ) const;
+    uint32_t ExtractWords( const SearchContext& ctx, const std::vector<std::string>& terms, int flags, std::vector<WordData>& words, std::vector<PhraseData>& phrases, std::vector<const char*>& matched ) const;
+    PostCursor GetCursor( const WordData& word, int filter, const DateRange& range, const std::vector<PostRange>& runs ) const;
+    const uint64_t* GetBitmap( const WordData& word, int filter ) const;
+    PostList GetPosts( SearchContext& ctx, PostCursor& cursor, const uint32_t* include, size_t isize ) const;
+    PostList GetPostIds( SearchContext& ctx, uint32_t word ) const;
+    bool HasRankIndex( const WordData& word ) const;
+    bool FindPosting( const WordData& word, int type, uint32_t postid, PostData& out ) const;
+    void InitDateBlocks() const;
+    bool InDateRange( uint32_t postid, const DateRange& range ) const;
+    void GetDateRuns( const DateRange& range, std::vector<PostRange>& out ) const;
     int FixupFlags( int flags ) const;
+    void ExpandPrefix( const char* prefix, size_t len, size_t max, std::vector<uint32_t>& out ) const;
+    void FindSimilarWords( const char* word, size_t len, uint32_t count, std::vector<SimilarWord>& out ) const;
+    void MatchPhrase( SearchContext& ctx, const PhraseData& phrase, int filter, const DateRange& range, const std::vector<PostRange>& runs, std::vector<uint32_t>& out ) const;
+
+    static uint32_t IntersectLists( SearchContext& ctx, const std::vector<PostList>& lists, uint32_t*& ids, std::vector<uint32_t*>& pos );
+    static uint32_t IntersectCursors( SearchContext& ctx, std::vector<PostCursor>& cursors, uint32_t*& ids, std::vector<uint32_t*>& pos );
+    static float GetWordDistance( SearchContext& ctx, const std::vector<const PostData*>& list1, const std::vector<const PostData*>& list2 );
+    static SearchResult RankPost( RankState& state, uint32_t postid, const WordPost* posts, uint32_t num );
 
-    std::vector<SearchResult> GetSingleResult( const std::vector<PostDataVec>& wdata, int flags ) const;
-    std::vector<SearchResult> GetAllWordResult( const std::vector<PostDataVec>& wdata, int flags, uint32_t groups, uint32_t missing ) const;
-    std::vector<SearchResult> GetFullResult( const std::vector<PostDataVec>& wdata, const std::vector<WordData>& words, int flags, uint32_t groups, uint32_t missing ) const;
+    std::vector<SearchResult> GetSingleResult( const PostList& wdata, int flags ) const;
+    std::vector<SearchResult> GetAllWordResult( SearchContext& ctx, const std::vector<WordData>& words, int filter, const DateRange& range, int flags, uint32_t groups, uint32_t missing ) const;
+    std::vector<SearchResult> GetFullResult( SearchContext& ctx, const std::vector<WordData>& words, const std::vector<PhraseData>& phrases, int filter, const DateRange& range, int flags, uint32_t groups, uint32_t missing ) const;
+    bool GetTopSingleResult( SearchContext& ctx, const WordData& word, int filter, const DateRange& range, int flags, size_t max, std::vector<SearchResult>& result ) const;
+    bool GetTopResult( SearchContext& ctx, const std::vector<WordData>& words, const std::vector<PhraseData>& phrases, int filter, const DateRange& range, int flags, uint32_t groups, uint32_t missing, size_t max, std::vector<SearchResult>& result ) const;
 
     const Archive& m_archive;
+
+    // Built on first date restricted search.
+    mutable std::vector<DateBlock> m_dateBlocks;
+    mutable std::once_flag m_dateBlocksInit;
 };
 
 #endif
@@ -0,0 +1,52 @@
+#include "SearchTask.hpp"
+
+SearchTask::SearchTask( const SearchEngine& engine, SearchContext& ctx, const std::string& query, int flags, int filter, const DateRange& range )
+    : m_ctx( ctx )
+    , m_cancel( false )
+    , m_done( false )
+    , m_progress( 0 )
+    , m_updated( false )
+{
+    m_ctx.SetProgress( [this] ( float progress, const SearchData* partial ) {
+        m_progress.store( progress, std::memory_order_relaxed );
+        if( partial )
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            m_results = *partial;
+            m_updated = true;
+        }
+    }, &m_cancel );
+
+    m_thread = std::thread( [this, &engine, query, flags, filter, range] {
+        auto results = engine.Search( m_ctx, query.c_str(), flags, filter, range );
+        if( !m_cancel.load( std::memory_order_relaxed ) )
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            m_results = std::move( results );
+            m_updated = true;
+        }
+        m_progress.store( 1, std::memory_order_relaxed );
+        m_done.store( true, std::memory_order_release );
+    } );
+}
+
+SearchTask::~SearchTask()
+{
+    Cancel();
+    m_thread.join();
+    m_ctx.SetProgress( nullptr, nullptr );
+}
+
+void SearchTask::Cancel()
+{
+    m_cancel.store( true, std::memory_order_relaxed );
+}
+
+bool SearchTask::FetchResults( SearchData& out )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    if( !m_updated ) return false;
+    out = std::move( m_results );
+    m_updated = false;
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef __SEARCHTASK_HPP__
+#define __SEARCHTASK_HPP__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "SearchEngine.hpp"
+
+// Runs search in a background thread. Partial results are available while search is in progress, and the
+// search can be cancelled at any time. The search context may not be used by anything else until the task
+// is destroyed.
+class SearchTask
+{
+public:
+    SearchTask( const SearchEngine& engine, SearchContext& ctx, const std::string& query, int flags, int filter = T_All, const DateRange& range = DateRange() );
+    ~SearchTask();
+
+    void Cancel();
+    bool IsDone() const { return m_done.load( std::memory_order_acquire ); }
+    float Progress() const { return m_progress.load( std::memory_order_relaxed ); }
+
+    // Moves latest results to out, if there were any changes since the last call. Results are final when
+    // IsDone() returned true before the call.
+    bool FetchResults( SearchData& out );
+
+    SearchTask( const SearchTask& ) = delete;
+    SearchTask& operator=( const SearchTask& ) = delete;
+
+private:
+    SearchContext& m_ctx;
+    std::atomic<bool> m_cancel;
+    std::atomic<bool> m_done;
+    std::atomic<float> m_progress;
+
+    std::mutex m_lock;
+    SearchData m_results;
+    bool m_updated;
+
+    std::thread m_thread;
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include "Socket.hpp"
 
 #include "../common/Filesystem.hpp"
+#include "../common/HeaderIndex.hpp"
 #include "../common/ParseDate.hpp"
 #include "../common/String.hpp"
 
@@ -77,7 +78,7 @@ static bool ReceiveMessage( Socket& sock, const std::string& dir, int article, t
         }
         *dst = '\0';
 
-        auto date = ParseDate( buf2, stats, cache );
+        auto date = ParseDate( HeaderIndex( buf2 ), stats, cache );
         if( date < dateLimit )
         {
             droppedMessages++;
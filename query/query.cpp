@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <chrono>
+#include <inttypes.h>
 #include <memory>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,7 +10,7 @@
 #include "../contrib/martinus/robin_hood.h"
 #include "../common/ExpandingBuffer.hpp"
 #include "../common/Filesystem.hpp"
-#include "../common/MessageLogic.hpp"
+#include "../common/HeaderIndex.hpp"
 #include "../common/TaskDispatch.hpp"
 #include "../common/System.hpp"
 #include "../libuat/Archive.hpp"
@@ -22,11 +24,12 @@ void PrintHelp()
     printf( "  datei idx     - view message's date\n" );
     printf( "  desc          - show descriptions\n" );
     printf( "  from msgid    - view from: field\n" );
+    printf( "  fuzzybench [n] - compare similar word lookup methods\n" );
     printf( "  fromi idx     - view from: field\n" );
     printf( "  info          - archive info\n" );
     printf( "  parent msgid  - view message's parent\n" );
     printf( "  parenti idx   - view message's parent\n" );
-    printf( "  search query  - search archive\n" );
+    printf( "  search [--stats] query [from to] - search archive, optionally in epoch date range\n" );
     printf( "  subject msgid - view subject: field\n" );
     printf( "  subjecti idx  - view subject: field\n" );
     printf( "  timechart     - print time chart\n" );
@@ -43,6 +46,23 @@ void Info( const Archive& archive )
     printf( "Number of toplevel messages: %zu\n", archive.NumberOfTopLevel() );
 }
 
+void PrintStats( const SearchStats& stats )
+{
+    printf( "Search stages:\n" );
+    for( int i=0; i<SearchStats::NumStages; i++ )
+    {
+        printf( "  %-10s %10.3f ms\n", SearchStats::StageName( i ), stats.time[i] / 1000000.f );
+    }
+    printf( "  %-10s %10.3f ms\n", "total", stats.total / 1000000.f );
+    printf( "Words: %u\n", stats.words );
+    printf( "Postings read: %" PRIu64 "\n", stats.postings );
+    printf( "Candidate probes: %" PRIu64 "\n", stats.probes );
+    printf( "Ranked posts: %" PRIu64 "\n", stats.candidates );
+    printf( "Results: %" PRIu64 "\n", stats.results );
+    printf( "Scratch memory: %.1f KB\n", stats.memory / 1024.f );
+    printf( "Page faults: %" PRIu64 " minor, %" PRIu64 " major\n", stats.minorFaults, stats.majorFaults );
+}
+
 void BadArg()
 {
     fprintf( stderr, "Missing argument!\n" );
@@ -253,14 +273,32 @@ int main( int argc, char** argv )
     }
     else if( strcmp( argv[0], "search" ) == 0 )
     {
+        const bool showStats = argc > 1 && strcmp( argv[1], "--stats" ) == 0;
+        if( showStats )
+        {
+            argc--;
+            argv++;
+        }
         if( argc == 1 ) BadArg();
+        DateRange range;
+        if( argc > 2 )
+        {
+            if( argc == 3 ) BadArg();
+            range.from = strtoul( argv[2], nullptr, 10 );
+            range.to = strtoul( argv[3], nullptr, 10 );
+        }
         SearchEngine search( *archive );
+        SearchContext ctx;
+        SearchStats stats;
+        if( showStats ) ctx.SetStats( &stats );
         auto t0 = std::chrono::high_resolution_clock::now();
-        auto results = search.Search( argv[1], SearchEngine::SF_AdjacentWords );
+        auto results = search.Search( ctx, argv[1], SearchEngine::SF_AdjacentWords, T_All, range );
         auto& data = results.results;
         auto t1 = std::chrono::high_resolution_clock::now();
         printf( "Query time %fms.\n", std::chrono::duration_cast<std::chrono::microseconds>( t1 - t0 ).count() / 1000.f );
+        printf( "Peak memory %.1f KB.\n", ctx.PeakMemory() / 1024.f );
         printf( "Found %zu messages.\n", data.size() );
+        if( showStats ) PrintStats( stats );
         if( !data.empty() )
         {
             bool first = true;
@@ -272,6 +310,48 @@ int main( int argc, char** argv )
             printf( "\n" );
         }
     }
+    else if( strcmp( argv[0], "fuzzybench" ) == 0 )
+    {
+        SearchEngine search( *archive );
+        if( !archive->HasLexDict() )
+        {
+            fprintf( stderr, "Archive doesn't have word dictionary.\n" );
+            exit( 1 );
+        }
+        const auto words = search.CompleteWord( "", argc == 1 ? 1000 : atoi( argv[1] ) );
+        const bool lexdist = archive->HasLexDist();
+
+        uint64_t tdist = 0, tdict = 0;
+        size_t ndist = 0, ndict = 0, common = 0;
+        for( auto& w : words )
+        {
+            auto t0 = std::chrono::high_resolution_clock::now();
+            auto r0 = search.GetSimilarWords( w, true );
+            auto t1 = std::chrono::high_resolution_clock::now();
+            auto r1 = search.GetSimilarWords( w, false );
+            auto t2 = std::chrono::high_resolution_clock::now();
+            tdist += std::chrono::duration_cast<std::chrono::nanoseconds>( t1 - t0 ).count();
+            tdict += std::chrono::duration_cast<std::chrono::nanoseconds>( t2 - t1 ).count();
+            ndist += r0.size();
+            ndict += r1.size();
+            for( auto& v : r1 )
+            {
+                if( std::find( r0.begin(), r0.end(), v ) != r0.end() ) common++;
+            }
+        }
+
+        const auto num = std::max<size_t>( 1, words.size() );
+        printf( "Tested %zu words.\n", words.size() );
+        if( lexdist )
+        {
+            printf( "lexdist:    %.2f us/word, %zu similar words\n", tdist / 1000.f / num, ndist );
+        }
+        else
+        {
+            printf( "lexdist:    not available\n" );
+        }
+        printf( "dictionary: %.2f us/word, %zu similar words, %zu in common\n", tdict / 1000.f / num, ndict, common );
+    }
     else if( strcmp( argv[0], "timechart" ) == 0 )
     {
         auto tc = archive->TimeChart();
@@ -333,14 +413,15 @@ int main( int argc, char** argv )
             tasks.Queue( [&cnt, num, &latest, t, &desc, &base] {
                 ExpandingBuffer eb;
                 ZMessageView zview( base + "/zmeta", base + "/zdata", base + "/zdict" );
+                HeaderIndex hdr;
                 for(;;)
                 {
                     auto j = cnt.fetch_add( 1, std::memory_order_relaxed );
                     if( j >= num ) break;
 
-                    auto post = zview.GetMessage( j, eb );
-                    auto ptr = FindOptionalHeader( post, "xref: ", 6 );
-                    if( *ptr == '\n' ) continue;
+                    hdr.Parse( zview.GetMessage( j, eb ) );
+                    auto ptr = hdr.Find( "xref: ", 6 );
+                    if( !ptr ) continue;
 
                     ptr += 6;
                     auto end = ptr;
@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <mutex>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,6 +19,7 @@
 #include "../contrib/zstd/zstd.h"
 #include "../contrib/zstd/zdict.h"
 
+#include "../common/Checkpoint.hpp"
 #include "../common/ExpandingBuffer.hpp"
 #include "../common/Filesystem.hpp"
 #include "../common/FileMap.hpp"
@@ -30,12 +32,14 @@ int main( int argc, char** argv )
 {
     int zlevel = 16;
     int dpower = 31;
+    int interval = Checkpoint::DefaultInterval;
 
     if( argc < 2 )
     {
         fprintf( stderr, "USAGE: %s [params] directory\nParams:\n", argv[0] );
         fprintf( stderr, " -z level        - set compression level (default: %i)\n", zlevel );
         fprintf( stderr, " -s power        - set max sample size to 2^power (default: %i)\n", dpower );
+        fprintf( stderr, " -c seconds      - save progress for resuming at given interval, 0 disables (default: %i)\n", interval );
         exit( 1 );
     }
 
@@ -51,6 +55,11 @@ int main( int argc, char** argv )
             dpower = std::min( 31, std::max( 10, atoi( argv[2] ) ) );
             argv += 2;
         }
+        else if( strcmp( argv[1], "-c" ) == 0 )
+        {
+            interval = std::max( 0, atoi( argv[2] ) );
+            argv += 2;
+        }
         else
         {
             break;
@@ -73,72 +82,113 @@ int main( int argc, char** argv )
     std::string zdatafn = base + "zdata";
     std::string zdictfn = base + "zdict";
 
-    printf( "Building dictionary\n" );
-
-    std::string buf1fn = base + ".sb.tmp";
-    std::string buf2fn = base + ".ss.tmp";
+    // Interrupted run keeps the dictionary and messages written before the last checkpoint.
+    Checkpoint checkpoint( base + ".repack-zstd.checkpoint", interval );
+    checkpoint.Param( uint64_t( size ) );
+    checkpoint.Param( GetFileSize( ( base + "data" ).c_str() ) );
+    checkpoint.Param( zlevel );
+    checkpoint.Param( dpower );
 
-    FILE* buf1 = fopen( buf1fn.c_str(), "wb" );
-    FILE* buf2 = fopen( buf2fn.c_str(), "wb" );
-    uint64_t total = 0;
-    auto samples = size;
-    bool limitHit = false;
-    for( uint32_t i=0; i<size; i++ )
+    uint32_t done = 0;
+    uint64_t offset = 0;
+    bool resume = false;
+    if( checkpoint.Load() )
     {
-        if( ( i & 0x3FF ) == 0 )
-        {
-            printf( "%i/%zu\r", i, size );
-            fflush( stdout );
-        }
-
-        auto raw = mview.Raw( i );
-        if( !limitHit && total + raw.size >= ( 1U << dpower ) )
+        done = checkpoint.Get<uint32_t>();
+        offset = checkpoint.Get<uint64_t>();
+        resume = Exists( zdictfn ) && ( done == 0 || (
+            GetFileSize( zmetafn.c_str() ) >= done * sizeof( RawImportMeta ) &&
+            GetFileSize( zdatafn.c_str() ) >= offset &&
+            TruncateFile( zmetafn, done * sizeof( RawImportMeta ) ) &&
+            TruncateFile( zdatafn, offset ) ) );
+        if( !resume )
         {
-            printf( "Limiting sample size to %zu MB - %i samples in, %zu samples out.\n", total >> 20, i, size - i );
-            samples = i;
-            limitHit = true;
+            done = 0;
+            offset = 0;
         }
-        total += raw.size;
-
-        auto post = mview[i];
-
-        fwrite( post, 1, raw.size, buf1 );
-        fwrite( &raw.size, 1, sizeof( size_t ), buf2 );
     }
-    fclose( buf1 );
-    fclose( buf2 );
 
     enum { DictSize = 4*1024*1024 };
     auto dict = new char[DictSize];
     size_t realDictSize;
 
+    if( resume )
     {
-        auto samplesBuf = FileMap<char>( buf1fn );
-        auto samplesSizes = FileMap<size_t>( buf2fn );
+        printf( "Resuming after %i of %zu messages.\n", done, size );
 
-        printf( "\nWorking...\n" );
-        fflush( stdout );
+        FILE* zdictfile = fopen( zdictfn.c_str(), "rb" );
+        realDictSize = fread( dict, 1, DictSize, zdictfile );
+        fclose( zdictfile );
+    }
+    else
+    {
+        printf( "Building dictionary\n" );
 
-        ZDICT_fastCover_params_t params = {};
-        params.d = 6;
-        params.k = 50;
-        params.f = 30;
-        params.nbThreads = std::thread::hardware_concurrency();
-        params.zParams.compressionLevel = zlevel;
+        std::string buf1fn = base + ".sb.tmp";
+        std::string buf2fn = base + ".ss.tmp";
 
-        realDictSize = ZDICT_optimizeTrainFromBuffer_fastCover( dict, DictSize, samplesBuf, samplesSizes, samples, &params );
-    }
+        FILE* buf1 = fopen( buf1fn.c_str(), "wb" );
+        FILE* buf2 = fopen( buf2fn.c_str(), "wb" );
+        uint64_t total = 0;
+        auto samples = size;
+        bool limitHit = false;
+        for( uint32_t i=0; i<size; i++ )
+        {
+            if( ( i & 0x3FF ) == 0 )
+            {
+                printf( "%i/%zu\r", i, size );
+                fflush( stdout );
+            }
 
-    unlink( buf1fn.c_str() );
-    unlink( buf2fn.c_str() );
+            auto raw = mview.Raw( i );
+            if( !limitHit && total + raw.size >= ( 1U << dpower ) )
+            {
+                printf( "Limiting sample size to %zu MB - %i samples in, %zu samples out.\n", total >> 20, i, size - i );
+                samples = i;
+                limitHit = true;
+            }
+            total += raw.size;
 
-    printf( "Dict size: %zu\n", realDictSize );
+            auto post = mview[i];
 
-    auto zdict = ZSTD_createCDict( dict, realDictSize, zlevel );
+            fwrite( post, 1, raw.size, buf1 );
+            fwrite( &raw.size, 1, sizeof( size_t ), buf2 );
+        }
+        fclose( buf1 );
+        fclose( buf2 );
+
+        {
+            auto samplesBuf = FileMap<char>( buf1fn );
+            auto samplesSizes = FileMap<size_t>( buf2fn );
+
+            printf( "\nWorking...\n" );
+            fflush( stdout );
+
+            ZDICT_fastCover_params_t params = {};
+            params.d = 6;
+            params.k = 50;
+            params.f = 30;
+            params.nbThreads = std::thread::hardware_concurrency();
+            params.zParams.compressionLevel = zlevel;
+
+            realDictSize = ZDICT_optimizeTrainFromBuffer_fastCover( dict, DictSize, samplesBuf, samplesSizes, samples, &params );
+        }
+
+        unlink( buf1fn.c_str() );
+        unlink( buf2fn.c_str() );
+
+        printf( "Dict size: %zu\n", realDictSize );
+
+        FILE* zdictfile = fopen( zdictfn.c_str(), "wb" );
+        fwrite( dict, 1, realDictSize, zdictfile );
+        fclose( zdictfile );
 
-    FILE* zdictfile = fopen( zdictfn.c_str(), "wb" );
-    fwrite( dict, 1, realDictSize, zdictfile );
-    fclose( zdictfile );
+        checkpoint.Put( done );
+        checkpoint.Put( offset );
+        checkpoint.Save();
+    }
+
+    auto zdict = ZSTD_createCDict( dict, realDictSize, zlevel );
     delete[] dict;
 
     const auto cpus = System::CPUCores();
@@ -154,77 +204,90 @@ int main( int argc, char** argv )
 
     Buffer* data = new Buffer[size];
 
-    std::mutex mtx, cntmtx;
-    TaskDispatch tasks( cpus-1 );
-    uint32_t start = 0;
-    uint32_t inPass = ( size + cpus - 1 ) / cpus;
-    uint32_t left = size;
-    uint32_t cnt = 0;
-    for( int i=0; i<cpus; i++ )
-    {
-        uint32_t todo = std::min( left, inPass );
-        tasks.Queue( [data, zdict, start, todo, &mview, &mtx, &cnt, &cntmtx, size] () {
-            auto zctx = ZSTD_createCCtx();
-            ExpandingBuffer eb1, eb2;
-            for( uint32_t i=start; i<start+todo; i++ )
-            {
-                cntmtx.lock();
-                auto c = cnt++;
-                cntmtx.unlock();
-                if( ( c & 0x3FF ) == 0 )
-                {
-                    printf( "%i/%zu\r", c, size );
-                    fflush( stdout );
-                }
+    FILE* zmeta = fopen( zmetafn.c_str(), done != 0 ? "ab" : "wb" );
+    FILE* zdata = fopen( zdatafn.c_str(), done != 0 ? "ab" : "wb" );
 
-                auto raw = mview.Raw( i );
-                auto post = eb1.Request( raw.size );
-                mtx.lock();
-                auto _post = mview[i];
-                memcpy( post, _post, raw.size );
-                mtx.unlock();
+    // Messages are written in order, so only those before all unfinished ones can be written.
+    uint32_t written = done;
+    auto write = [data, zmeta, zdata, &written, &offset, size] ( uint32_t end ) {
+        for( ; written<end; written++ )
+        {
+            if( ( written & 0x3FF ) == 0 )
+            {
+                printf( "%i/%zu\r", written, size );
+                fflush( stdout );
+            }
 
-                auto predSize = ZSTD_compressBound( raw.size );
-                auto dst = eb2.Request( predSize );
-                auto dstSize = ZSTD_compress_usingCDict( zctx, dst, predSize, post, raw.size, zdict );
+            RawImportMeta packet = { offset, data[written].size, data[written].compressedSize };
+            fwrite( &packet, 1, sizeof( RawImportMeta ), zmeta );
 
-                char* buf = new char[dstSize];
-                memcpy( buf, dst, dstSize );
+            fwrite( data[written].data, 1, data[written].compressedSize, zdata );
+            offset += data[written].compressedSize;
+            delete[] data[written].data;
+        }
+    };
 
-                data[i].compressedSize = dstSize;
-                data[i].size = raw.size;
-                data[i].data = buf;
-            }
-            ZSTD_freeCCtx( zctx );
-        } );
-        start += todo;
-        left -= todo;
+    std::mutex mtx;
+    TaskDispatch tasks( cpus-1 );
+    std::atomic<uint32_t> cnt( done );
+    for(;;)
+    {
+        for( int i=0; i<cpus; i++ )
+        {
+            tasks.Queue( [data, zdict, &mview, &mtx, &cnt, &checkpoint, size] () {
+                auto zctx = ZSTD_createCCtx();
+                ExpandingBuffer eb1, eb2;
+                while( !checkpoint.Due() )
+                {
+                    const auto i = cnt.fetch_add( 1, std::memory_order_relaxed );
+                    if( i >= size ) break;
+                    if( ( i & 0x3FF ) == 0 )
+                    {
+                        printf( "%i/%zu\r", i, size );
+                        fflush( stdout );
+                    }
+
+                    auto raw = mview.Raw( i );
+                    auto post = eb1.Request( raw.size );
+                    mtx.lock();
+                    auto _post = mview[i];
+                    memcpy( post, _post, raw.size );
+                    mtx.unlock();
+
+                    auto predSize = ZSTD_compressBound( raw.size );
+                    auto dst = eb2.Request( predSize );
+                    auto dstSize = ZSTD_compress_usingCDict( zctx, dst, predSize, post, raw.size, zdict );
+
+                    char* buf = new char[dstSize];
+                    memcpy( buf, dst, dstSize );
+
+                    data[i].compressedSize = dstSize;
+                    data[i].size = raw.size;
+                    data[i].data = buf;
+                }
+                ZSTD_freeCCtx( zctx );
+            } );
+        }
+        tasks.Sync();
+        if( cnt.load() >= size ) break;
+
+        // Workers finish taken messages, so all messages before the counter are compressed.
+        checkpoint.Begin();
+        const uint32_t end = cnt.load();
+        write( end );
+        fflush( zmeta );
+        fflush( zdata );
+        checkpoint.Put( end );
+        checkpoint.Put( offset );
+        checkpoint.Save();
     }
-    tasks.Sync();
 
     ZSTD_freeCDict( zdict );
 
     printf( "\nWriting to disk...\n" );
     fflush( stdout );
 
-    FILE* zmeta = fopen( zmetafn.c_str(), "wb" );
-    FILE* zdata = fopen( zdatafn.c_str(), "wb" );
-
-    uint64_t offset = 0;
-    for( uint32_t i=0; i<size; i++ )
-    {
-        if( ( i & 0x3FF ) == 0 )
-        {
-            printf( "%i/%zu\r", i, size );
-            fflush( stdout );
-        }
-
-        RawImportMeta packet = { offset, data[i].size, data[i].compressedSize };
-        fwrite( &packet, 1, sizeof( RawImportMeta ), zmeta );
-
-        fwrite( data[i].data, 1, data[i].compressedSize, zdata );
-        offset += data[i].compressedSize;
-    }
+    write( size );
 
     printf( "\n" );
 
@@ -233,5 +296,7 @@ int main( int argc, char** argv )
 
     delete[] data;
 
+    checkpoint.Remove();
+
     return 0;
 }
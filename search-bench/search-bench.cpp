@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctype.h>
+#include <inttypes.h>
+#include <iterator>
+#include <math.h>
+#include <memory>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "../common/ExpandingBuffer.hpp"
+#include "../common/String.hpp"
+#include "../common/System.hpp"
+#include "../common/TaskDispatch.hpp"
+#include "../contrib/xxhash/xxhash.h"
+#include "../libuat/Archive.hpp"
+#include "../libuat/Galaxy.hpp"
+#include "../libuat/SearchEngine.hpp"
+
+enum { DefaultFlags = SearchEngine::SF_AdjacentWords | SearchEngine::SF_FuzzySearch | SearchEngine::SF_SetLogic };
+enum { SlowestQueries = 10 };
+
+struct FlagName
+{
+    const char* name;
+    int flag;
+};
+
+static const FlagName FlagNames[] = {
+    { "adjacent", SearchEngine::SF_AdjacentWords },
+    { "all", SearchEngine::SF_RequireAllWords },
+    { "fuzzy", SearchEngine::SF_FuzzySearch },
+    { "setlogic", SearchEngine::SF_SetLogic },
+    { "simple", SearchEngine::SF_SimpleSearch },
+};
+
+struct Query
+{
+    std::string text;
+    std::vector<std::string> terms;
+    int flags;
+    int filter;
+    DateRange range;
+};
+
+struct Target
+{
+    std::shared_ptr<Archive> archive;
+    std::unique_ptr<SearchEngine> engine;
+    std::unique_ptr<SearchContext> ctx;
+};
+
+struct PassStats
+{
+    std::vector<float> latency;     // milliseconds, one per executed query
+    uint64_t results = 0;
+    size_t peakMemory = 0;
+};
+
+static bool ParseFlags( const std::string& str, int& flags )
+{
+    if( str.empty() || str == "-" ) return true;
+    flags = SearchEngine::SF_FlagsNone;
+    size_t pos = 0;
+    for(;;)
+    {
+        const auto end = str.find( ',', pos );
+        const auto name = str.substr( pos, end == std::string::npos ? std::string::npos : end - pos );
+        auto it = std::find_if( std::begin( FlagNames ), std::end( FlagNames ), [&name] ( const auto& f ) { return name == f.name; } );
+        if( it == std::end( FlagNames ) ) return false;
+        flags |= it->flag;
+        if( end == std::string::npos ) return true;
+        pos = end + 1;
+    }
+}
+
+static bool ParseFilter( std::string str, int& filter )
+{
+    std::transform( str.begin(), str.end(), str.begin(), ::tolower );
+    if( str.empty() || str == "-" || str == "all" )
+    {
+        filter = T_All;
+        return true;
+    }
+    for( int i=0; i<NUM_LEXICON_TYPES; i++ )
+    {
+        const auto len = strlen( LexiconNames[i] );
+        if( str.size() == len && strnicmpl( LexiconNames[i], str.c_str(), len ) == 0 )
+        {
+            filter = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Each line contains a query, optionally followed by tab separated flags, filter and date range.
+static std::vector<Query> LoadQueries( const char* fn, int flags )
+{
+    FILE* f = fopen( fn, "rb" );
+    if( !f )
+    {
+        fprintf( stderr, "Cannot open query file %s.\n", fn );
+        exit( 1 );
+    }
+
+    std::vector<Query> ret;
+    std::string line;
+    int lineNum = 0;
+    while( ReadLine( f, line ) )
+    {
+        lineNum++;
+        if( line.empty() || line[0] == '#' ) continue;
+
+        std::vector<std::string> fields;
+        size_t pos = 0;
+        for(;;)
+        {
+            const auto end = line.find( '\t', pos );
+            fields.emplace_back( line.substr( pos, end == std::string::npos ? std::string::npos : end - pos ) );
+            if( end == std::string::npos ) break;
+            pos = end + 1;
+        }
+
+        Query q;
+        q.text = fields[0];
+        q.flags = flags;
+        q.filter = T_All;
+        split( q.text.c_str(), std::back_inserter( q.terms ) );
+        if( q.terms.empty() ) continue;
+        if( ( fields.size() > 1 && !ParseFlags( fields[1], q.flags ) ) ||
+            ( fields.size() > 2 && !ParseFilter( fields[2], q.filter ) ) ||
+            fields.size() == 4 || fields.size() > 5 )
+        {
+            fprintf( stderr, "Invalid query specification in line %i.\n", lineNum );
+            exit( 1 );
+        }
+        if( fields.size() == 5 )
+        {
+            q.range.from = strtoul( fields[3].c_str(), nullptr, 10 );
+            q.range.to = strtoul( fields[4].c_str(), nullptr, 10 );
+        }
+        ret.emplace_back( std::move( q ) );
+    }
+    fclose( f );
+    return ret;
+}
+
+static std::vector<Target> OpenTargets( const char* fn, size_t maxResults )
+{
+    std::vector<Target> ret;
+    std::unique_ptr<Galaxy> galaxy( Galaxy::Open( fn ) );
+    if( galaxy )
+    {
+        for( auto idx : galaxy->GetAvailableArchives() )
+        {
+            ret.emplace_back( Target { galaxy->GetArchive( idx, false ) } );
+        }
+    }
+    else
+    {
+        auto archive = Archive::Open( fn );
+        if( archive ) ret.emplace_back( Target { std::shared_ptr<Archive>( archive ) } );
+    }
+    if( ret.empty() )
+    {
+        fprintf( stderr, "Cannot open %s.\n", fn );
+        exit( 1 );
+    }
+    for( auto& v : ret )
+    {
+        v.engine = std::make_unique<SearchEngine>( *v.archive );
+        v.ctx = std::make_unique<SearchContext>();
+        v.ctx->SetMaxResults( maxResults );
+    }
+    return ret;
+}
+
+// Searches all targets. Galaxy queries are complete only after all archives are searched.
+static float RunQuery( std::vector<Target>& targets, const Query& q, PassStats& stats, uint32_t& results )
+{
+    results = 0;
+    const auto t0 = std::chrono::high_resolution_clock::now();
+    for( auto& v : targets )
+    {
+        const auto data = v.engine->Search( *v.ctx, q.terms, q.flags, q.filter, q.range );
+        results += data.results.size();
+        stats.peakMemory = std::max( stats.peakMemory, v.ctx->PeakMemory() );
+    }
+    const auto t1 = std::chrono::high_resolution_clock::now();
+    const auto ms = std::chrono::duration_cast<std::chrono::nanoseconds>( t1 - t0 ).count() / 1000000.f;
+    stats.latency.emplace_back( ms );
+    stats.results += results;
+    return ms;
+}
+
+// Everything a query returns in all targets. Messages of the best results are decoded as well, so that concurrent
+// message access is also exercised.
+struct Outcome
+{
+    std::vector<SearchResult> results;
+    std::vector<uint32_t> messages;
+};
+
+static void Execute( const std::vector<Target>& targets, std::vector<SearchContext>& ctx, const Query& q, ExpandingBuffer& eb, Outcome& out )
+{
+    out.results.clear();
+    out.messages.clear();
+    for( size_t i=0; i<targets.size(); i++ )
+    {
+        auto& archive = *targets[i].archive;
+        const auto data = targets[i].engine->Search( ctx[i], q.terms, q.flags, q.filter, q.range );
+        out.results.insert( out.results.end(), data.results.begin(), data.results.end() );
+        for( size_t j=0; j<std::min<size_t>( 4, data.results.size() ); j++ )
+        {
+            const auto msg = archive.GetMessage( data.results[j].postid, eb );
+            out.messages.emplace_back( XXH32( msg, strlen( msg ), 0 ) );
+        }
+    }
+}
+
+static bool IsSame( const Outcome& l, const Outcome& r )
+{
+    if( l.results.size() != r.results.size() || l.messages != r.messages ) return false;
+    for( size_t i=0; i<l.results.size(); i++ )
+    {
+        auto& a = l.results[i];
+        auto& b = r.results[i];
+        if( a.postid != b.postid || a.rank != b.rank || a.hitnum != b.hitnum ||
+            memcmp( a.hits, b.hits, a.hitnum ) != 0 ||
+            memcmp( a.words, b.words, a.hitnum * sizeof( uint32_t ) ) != 0 ) return false;
+    }
+    return true;
+}
+
+// Runs queries in random order on many threads sharing one search engine per archive, each thread with its own
+// search contexts. Every result has to be identical to the one obtained by a single thread. Returns number of
+// mismatched results.
+static size_t Stress( const std::vector<Target>& targets, const std::vector<Query>& queries, int threads, int iterations, size_t maxResults )
+{
+    auto makeContexts = [&targets, maxResults] {
+        std::vector<SearchContext> ctx( targets.size() );
+        for( auto& v : ctx ) v.SetMaxResults( maxResults );
+        return ctx;
+    };
+
+    std::vector<Outcome> reference( queries.size() );
+    {
+        auto ctx = makeContexts();
+        ExpandingBuffer eb;
+        for( size_t i=0; i<queries.size(); i++ ) Execute( targets, ctx, queries[i], eb, reference[i] );
+    }
+
+    const size_t total = queries.size() * iterations;
+    std::atomic<size_t> next( 0 );
+    std::atomic<size_t> mismatches( 0 );
+    std::atomic<size_t> reported( 0 );
+
+    const auto t0 = std::chrono::high_resolution_clock::now();
+    TaskDispatch td( threads );
+    for( int t=0; t<threads; t++ )
+    {
+        td.Queue( [&, t] {
+            auto ctx = makeContexts();
+            ExpandingBuffer eb;
+            Outcome outcome;
+            std::minstd_rand rng( t + 1 );
+            while( next.fetch_add( 1, std::memory_order_relaxed ) < total )
+            {
+                const auto idx = rng() % queries.size();
+                Execute( targets, ctx, queries[idx], eb, outcome );
+                if( !IsSame( outcome, reference[idx] ) )
+                {
+                    mismatches.fetch_add( 1, std::memory_order_relaxed );
+                    if( reported.fetch_add( 1, std::memory_order_relaxed ) < SlowestQueries )
+                    {
+                        fprintf( stderr, "Result mismatch in query: %s\n", queries[idx].text.c_str() );
+                    }
+                }
+            }
+        } );
+    }
+    td.Sync();
+    const auto t1 = std::chrono::high_resolution_clock::now();
+    const auto ms = std::chrono::duration_cast<std::chrono::nanoseconds>( t1 - t0 ).count() / 1000000.;
+
+    printf( "  \"stress\": {\n" );
+    printf( "    \"threads\": %i,\n", threads );
+    printf( "    \"queries\": %zu,\n", total );
+    printf( "    \"mismatches\": %zu,\n", mismatches.load() );
+    printf( "    \"total_ms\": %.4f,\n", ms );
+    printf( "    \"throughput_qps\": %.2f\n", ms > 0 ? total * 1000. / ms : 0. );
+    printf( "  },\n" );
+    return mismatches.load();
+}
+
+static float Percentile( const std::vector<float>& sorted, float p )
+{
+    const auto idx = std::max<size_t>( 1, size_t( ceilf( p * sorted.size() ) ) ) - 1;
+    return sorted[std::min( idx, sorted.size() - 1 )];
+}
+
+static void PrintJsonString( const char* str )
+{
+    putchar( '"' );
+    for( auto ptr = (const unsigned char*)str; *ptr; ptr++ )
+    {
+        if( *ptr == '"' || *ptr == '\\' )
+        {
+            printf( "\\%c", *ptr );
+        }
+        else if( *ptr < 0x20 )
+        {
+            printf( "\\u%04x", *ptr );
+        }
+        else
+        {
+            putchar( *ptr );
+        }
+    }
+    putchar( '"' );
+}
+
+static void PrintPass( const char* name, const PassStats& stats, size_t passes, bool last )
+{
+    auto sorted = stats.latency;
+    std::sort( sorted.begin(), sorted.end() );
+    double total = 0;
+    for( auto& v : sorted ) total += v;
+
+    printf( "  \"%s\": {\n", name );
+    printf( "    \"passes\": %zu,\n", passes );
+    printf( "    \"queries\": %zu,\n", sorted.size() );
+    printf( "    \"p50_ms\": %.4f,\n", Percentile( sorted, 0.5f ) );
+    printf( "    \"p95_ms\": %.4f,\n", Percentile( sorted, 0.95f ) );
+    printf( "    \"p99_ms\": %.4f,\n", Percentile( sorted, 0.99f ) );
+    printf( "    \"max_ms\": %.4f,\n", sorted.back() );
+    printf( "    \"mean_ms\": %.4f,\n", total / sorted.size() );
+    printf( "    \"total_ms\": %.4f,\n", total );
+    printf( "    \"throughput_qps\": %.2f,\n", total > 0 ? sorted.size() * 1000. / total : 0. );
+    printf( "    \"results\": %" PRIu64 ",\n", stats.results / passes );
+    printf( "    \"peak_scratch_bytes\": %zu\n", stats.peakMemory );
+    printf( "  }%s\n", last ? "" : "," );
+}
+
+int main( int argc, char** argv )
+{
+    int iterations = 10;
+    int flags = DefaultFlags;
+    size_t maxResults = 0;
+    int threads = 0;
+
+    if( argc < 3 )
+    {
+        fprintf( stderr, "USAGE: %s [params] archive|galaxy queries\nParams:\n", argv[0] );
+        fprintf( stderr, " -i iterations   - number of warm passes over all queries (default: %i)\n", iterations );
+        fprintf( stderr, " -f flags        - default search flags (default: adjacent,fuzzy,setlogic)\n" );
+        fprintf( stderr, " -k results      - return only the best results of each query (default: all)\n" );
+        fprintf( stderr, " -t threads      - stress test: run queries concurrently and verify results\n" );
+        fprintf( stderr, "Query file lines: query[<TAB>flags[<TAB>filter[<TAB>from<TAB>to]]]\n" );
+        exit( 1 );
+    }
+
+    for(;;)
+    {
+        if( strcmp( argv[1], "-i" ) == 0 )
+        {
+            iterations = std::max( 1, atoi( argv[2] ) );
+            argv += 2;
+            argc -= 2;
+        }
+        else if( strcmp( argv[1], "-f" ) == 0 )
+        {
+            if( !ParseFlags( argv[2], flags ) )
+            {
+                fprintf( stderr, "Invalid search flags %s.\n", argv[2] );
+                exit( 1 );
+            }
+            argv += 2;
+            argc -= 2;
+        }
+        else if( strcmp( argv[1], "-t" ) == 0 )
+        {
+            threads = std::max( 1, atoi( argv[2] ) );
+            argv += 2;
+            argc -= 2;
+        }
+        else if( strcmp( argv[1], "-k" ) == 0 )
+        {
+            maxResults = std::max( 0, atoi( argv[2] ) );
+            argv += 2;
+            argc -= 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if( argc < 3 )
+    {
+        fprintf( stderr, "Missing archive or query file.\n" );
+        exit( 1 );
+    }
+
+    const auto queries = LoadQueries( argv[2], flags );
+    if( queries.empty() )
+    {
+        fprintf( stderr, "No queries to run.\n" );
+        exit( 1 );
+    }
+
+    auto targets = OpenTargets( argv[1], maxResults );
+    auto printHeader = [&] {
+        printf( "{\n" );
+        printf( "  \"archive\": " );
+        PrintJsonString( argv[1] );
+        printf( ",\n" );
+        printf( "  \"archives\": %zu,\n", targets.size() );
+        printf( "  \"queries\": %zu,\n", queries.size() );
+        printf( "  \"iterations\": %i,\n", iterations );
+        printf( "  \"max_results\": %zu,\n", maxResults );
+    };
+
+    if( threads != 0 )
+    {
+        printHeader();
+        const auto mismatches = Stress( targets, queries, threads, iterations, maxResults );
+        printf( "  \"max_rss_kb\": %" PRIu64 "\n", System::PeakMemoryUsage() / 1024 );
+        printf( "}\n" );
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    // First pass runs on freshly opened archives, with empty search contexts. Archive pages which are not
+    // in the operating system cache yet have to be read from disk.
+    uint32_t results;
+    PassStats cold;
+    for( auto& q : queries )
+    {
+        RunQuery( targets, q, cold, results );
+    }
+
+    PassStats warm;
+    std::vector<std::vector<float>> perQuery( queries.size() );
+    std::vector<uint32_t> perQueryResults( queries.size() );
+    for( int i=0; i<iterations; i++ )
+    {
+        for( size_t j=0; j<queries.size(); j++ )
+        {
+            perQuery[j].emplace_back( RunQuery( targets, queries[j], warm, results ) );
+            perQueryResults[j] = results;
+        }
+    }
+
+    std::vector<std::pair<float, size_t>> slowest;
+    for( size_t j=0; j<queries.size(); j++ )
+    {
+        auto& v = perQuery[j];
+        std::sort( v.begin(), v.end() );
+        slowest.emplace_back( Percentile( v, 0.5f ), j );
+    }
+    std::sort( slowest.begin(), slowest.end(), [] ( const auto& l, const auto& r ) { return l.first > r.first; } );
+    if( slowest.size() > SlowestQueries ) slowest.resize( SlowestQueries );
+
+    printHeader();
+    PrintPass( "cold", cold, 1, false );
+    PrintPass( "warm", warm, iterations, false );
+    printf( "  \"max_rss_kb\": %" PRIu64 ",\n", System::PeakMemoryUsage() / 1024 );
+    printf( "  \"slowest\": [\n" );
+    for( size_t i=0; i<slowest.size(); i++ )
+    {
+        const auto idx = slowest[i].second;
+        printf( "    { \"query\": " );
+        PrintJsonString( queries[idx].text.c_str() );
+        printf( ", \"p50_ms\": %.4f, \"results\": %" PRIu32 " }%s\n", slowest[i].first, perQueryResults[idx], i == slowest.size() - 1 ? "" : "," );
+    }
+    printf( "  ]\n" );
+    printf( "}\n" );
+
+    return 0;
+}
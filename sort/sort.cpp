@@ -100,6 +100,16 @@ int main( int argc, char** argv )
     CopyFile( base + "lexhit", dbase + "lexhit" );
     CopyFile( base + "lexmeta", dbase + "lexmeta" );
     CopyFile( base + "lexstr", dbase + "lexstr" );
+    if( Exists( base + "lexdict" ) && Exists( base + "lexdictmeta" ) )
+    {
+        CopyFile( base + "lexdict", dbase + "lexdict" );
+        CopyFile( base + "lexdictmeta", dbase + "lexdictmeta" );
+    }
+    if( Exists( base + "lexpos" ) && Exists( base + "lexposmeta" ) )
+    {
+        CopyFile( base + "lexpos", dbase + "lexpos" );
+        CopyFile( base + "lexposmeta", dbase + "lexposmeta" );
+    }
 
     printf( " done\n" );
 
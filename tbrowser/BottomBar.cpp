@@ -39,6 +39,23 @@ void BottomBar::Resize()
 }
 
 std::string BottomBar::Query( const char* prompt, const char* entry, bool filesystem )
+{
+    if( filesystem )
+    {
+        return QueryImpl( prompt, entry, [this] ( std::string& str, int& pos ) { SuggestFiles( str, pos ); } );
+    }
+    else
+    {
+        return QueryImpl( prompt, entry, nullptr );
+    }
+}
+
+std::string BottomBar::Query( const char* prompt, const char* entry, const std::function<std::vector<const char*>(const std::string&)>& suggest )
+{
+    return QueryImpl( prompt, entry, [this, &suggest] ( std::string& str, int& pos ) { SuggestWords( str, pos, suggest ); } );
+}
+
+std::string BottomBar::QueryImpl( const char* prompt, const char* entry, const std::function<void(std::string&, int&)>& complete )
 {
     std::string ret;
     int insert = 0;
@@ -120,9 +137,9 @@ std::string BottomBar::Query( const char* prompt, const char* entry, bool filesy
             m_parent->Resize();
             break;
         case '\t':
-            if( filesystem )
+            if( complete )
             {
-                SuggestFiles( ret, insert );
+                complete( ret, insert );
                 break;
             }
             // fallthrough
@@ -291,7 +308,7 @@ void BottomBar::PrintHelp()
     case HelpSet::Search:
         waddch( m_win, ACS_DARROW );
         waddch( m_win, ACS_UARROW );
-        wprintw( m_win, ":Move q:Quit s:Search RET:Open a:SortAsc d:SortDesc r:SortRank" );
+        wprintw( m_win, ":Move q:Quit s:Search RET:Open a:SortAsc d:SortDesc r:SortRank i:Stats" );
         break;
     case HelpSet::Text:
         waddch( m_win, ACS_DARROW );
@@ -386,3 +403,48 @@ void BottomBar::SuggestFiles( std::string& str, int& pos ) const
         ms++;
     }
 }
+
+void BottomBar::SuggestWords( std::string& str, int& pos, const std::function<std::vector<const char*>(const std::string&)>& suggest ) const
+{
+    // Find start of the word under cursor, skipping search syntax decorations.
+    int start = pos;
+    while( start > 0 && str[start-1] != ' ' ) start--;
+    if( start < pos && ( str[start] == '+' || str[start] == '-' ) ) start++;
+    if( pos - start > 5 && strncmp( str.c_str() + start, "from:", 5 ) == 0 )
+    {
+        start += 5;
+    }
+    else if( pos - start > 8 && strncmp( str.c_str() + start, "subject:", 8 ) == 0 )
+    {
+        start += 8;
+    }
+    if( start < pos && str[start] == '"' ) start++;
+    if( start == pos ) return;
+
+    const auto word = str.substr( start, pos - start );
+    const auto list = suggest( word );
+    if( list.empty() ) return;
+
+    size_t ms = word.size();
+    for(;;)
+    {
+        const auto test = list[0][ms];
+        if( test == '\0' ) break;
+        bool same = true;
+        for( size_t i=1; i<list.size(); i++ )
+        {
+            if( list[i][ms] != test )
+            {
+                same = false;
+                break;
+            }
+        }
+        if( !same ) break;
+        ms++;
+    }
+    while( ms > word.size() && iscontinuationbyte( list[0][ms] ) ) ms--;
+    if( ms == word.size() ) return;
+
+    str.replace( start, pos - start, list[0], ms );
+    pos = start + ms;
+}
@@ -27,6 +27,8 @@ public:
     void Resize();
 
     std::string Query( const char* prompt, const char* entry = nullptr, bool filesystem = false );
+    // Tab key completes word under cursor using list of words returned by suggest.
+    std::string Query( const char* prompt, const char* entry, const std::function<std::vector<const char*>(const std::string&)>& suggest );
     std::string InteractiveQuery( const char* prompt, const std::function<void(const std::string&)>& cb, const char* entry = nullptr );
     int KeyQuery( const char* prompt );
     void Status( const char* status, int timeout = 2 );
@@ -36,7 +38,9 @@ public:
 private:
     void PrintHelp();
     void PrintQuery( const char* prompt, const char* str ) const;
+    std::string QueryImpl( const char* prompt, const char* entry, const std::function<void(std::string&, int&)>& complete );
     void SuggestFiles( std::string& str, int& pos ) const;
+    void SuggestWords( std::string& str, int& pos, const std::function<std::vector<const char*>(const std::string&)>& suggest ) const;
 
     Browser* m_parent;
     int m_reset;
@@ -90,13 +90,13 @@ void ChartView::Entry()
         case 's':
         case '/':
         {
-            auto query = m_bar.Query( "Search: ", m_query.c_str() );
+            auto query = m_bar.Query( "Search: ", m_query.c_str(), [this] ( const std::string& word ) { return m_search->CompleteWord( word.c_str() ); } );
             if( !query.empty() )
             {
                 m_galaxyMode = false;
                 m_posts.clear();
                 std::swap( m_query, query );
-                const auto res = m_search->Search( m_query.c_str(), SearchEngine::SF_AdjacentWords | SearchEngine::SF_FuzzySearch | SearchEngine::SF_SetLogic );
+                const auto res = m_search->Search( m_searchCtx, m_query.c_str(), SearchEngine::SF_AdjacentWords | SearchEngine::SF_FuzzySearch | SearchEngine::SF_SetLogic );
                 const auto sz = res.results.size();
                 if( sz > 1 )
                 {
@@ -438,6 +438,7 @@ void ChartView::Reset( Archive& archive )
 {
     m_archive = &archive;
     m_search = std::make_unique<SearchEngine>( archive );
+    m_searchCtx.Release();
     m_query.clear();
     m_posts.clear();
 }
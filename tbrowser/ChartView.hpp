@@ -3,6 +3,8 @@
 
 #include <vector>
 
+#include "../libuat/SearchContext.hpp"
+
 #include "View.hpp"
 
 class Archive;
@@ -31,6 +33,7 @@ private:
 
     Archive* m_archive;
     std::unique_ptr<SearchEngine> m_search;
+    SearchContext m_searchCtx;
     std::string m_query;
     BottomBar& m_bar;
     Galaxy* m_galaxy;
@@ -112,12 +112,17 @@ const char* SearchHelpContents =
 "  Enter keywords you wish to search for. Search hints:\n"
 "\n"
 "  - Quote words to disable fuzzy search.\n"
+"  - Quote multiple words to search for an exact phrase.\n"
 "  - Prepend word with from: to search for author.\n"
 "  - Prepend word with subject: to search in subject.\n"
+"  - Phrases in from: or subject: need all words in that field, but word\n"
+"    order is checked in the whole message.\n"
 "  - Prepend word with + to require this word.\n"
 "  - Prepend word with - to exclude this word.\n"
 "  - Append word with * to search for any word with such beginning.\n"
+"  - Press tab to complete the word under cursor.\n"
 "\n"
+"  Press 'i' to show how long each stage of the last search took.\n"
 "\n"
 "  For example, to require an exact match in a 'from' field, type:\n"
 "\n"
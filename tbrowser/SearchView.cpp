@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <chrono>
 #include <ctype.h>
+#include <inttypes.h>
 #include <map>
 #include <sstream>
 #include <vector>
@@ -9,8 +10,9 @@
 #include "../libuat/Archive.hpp"
 #include "../libuat/PersistentStorage.hpp"
 #include "../libuat/SearchEngine.hpp"
+#include "../libuat/SearchTask.hpp"
+#include "../common/BodyLines.hpp"
 #include "../common/ICU.hpp"
-#include "../common/MessageLogic.hpp"
 #include "../common/UTF8.hpp"
 
 #include "BottomBar.hpp"
@@ -28,9 +30,16 @@ SearchView::SearchView( Browser* parent, BottomBar& bar, Archive& archive, Persi
     , m_search( std::make_unique<SearchEngine>( archive ) )
     , m_storage( storage )
     , m_active( false )
+    , m_showStats( false )
+    , m_statsValid( false )
     , m_top( 0 )
     , m_bottom( 0 )
     , m_cursor( 0 )
+{
+    m_searchCtx.SetStats( &m_stats );
+}
+
+SearchView::~SearchView()
 {
 }
 
@@ -44,31 +53,35 @@ void SearchView::Entry()
     {
         switch( key )
         {
+        case ERR:
+            // input timeout, only happens while search is running
+            PollSearch();
+            doupdate();
+            continue;
         case KEY_RESIZE:
             m_parent->Resize();
             break;
         case KEY_EXIT:
         case 27:
         case 'q':
+            StopSearch();
             m_active = false;
             return;
         case 's':
         case '/':
         {
-            auto query = m_bar.Query( "Search: ", m_query.c_str() );
+            const bool running = (bool)m_task;
+            StopSearch();
+            auto query = m_bar.Query( "Search: ", m_query.c_str(), [this] ( const std::string& word ) { return m_search->CompleteWord( word.c_str() ); } );
             if( !query.empty() )
             {
                 std::swap( m_query, query );
-                auto start = std::chrono::high_resolution_clock::now();
-                m_result = m_search->Search( m_query.c_str(), SearchEngine::SF_AdjacentWords | SearchEngine::SF_FuzzySearch | SearchEngine::SF_SetLogic );
-                m_queryTime = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::high_resolution_clock::now() - start ).count() / 1000.f;
-                FixupRank();
-                m_preview.clear();
-                m_preview.reserve( m_result.results.size() );
-                m_top = m_bottom = m_cursor = 0;
+                StartSearch();
             }
             else
             {
+                // editing was cancelled, continue with the previous query
+                if( running ) StartSearch();
                 m_bar.Update();
             }
             Draw();
@@ -98,6 +111,7 @@ void SearchView::Entry()
         case 459:   // numpad enter
             if( !m_result.results.empty() )
             {
+                StopSearch();
                 m_parent->OpenMessage( m_result.results[m_cursor].postid );
                 m_active = false;
                 return;
@@ -124,6 +138,11 @@ void SearchView::Entry()
             Draw();
             doupdate();
             break;
+        case 'i':
+            m_showStats = !m_showStats;
+            Draw();
+            doupdate();
+            break;
         case '?':
             m_parent->DisplayTextView( SearchHelpContents );
             Draw();
@@ -135,6 +154,51 @@ void SearchView::Entry()
     }
 }
 
+void SearchView::StartSearch()
+{
+    StopSearch();
+    m_result = SearchData();
+    ResetResults();
+    m_statsValid = false;
+    m_searchStart = std::chrono::high_resolution_clock::now();
+    m_task = std::make_unique<SearchTask>( *m_search, m_searchCtx, m_query, SearchEngine::SF_AdjacentWords | SearchEngine::SF_FuzzySearch | SearchEngine::SF_SetLogic );
+    // poll for partial results while waiting for input
+    wtimeout( m_win, 50 );
+    PollSearch();
+}
+
+void SearchView::StopSearch()
+{
+    if( !m_task ) return;
+    m_task.reset();
+    wtimeout( m_win, -1 );
+}
+
+void SearchView::PollSearch()
+{
+    if( !m_task ) return;
+    const auto done = m_task->IsDone();
+    if( m_task->FetchResults( m_result ) )
+    {
+        FixupRank();
+        ResetResults();
+    }
+    m_queryTime = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::high_resolution_clock::now() - m_searchStart ).count() / 1000.f;
+    if( done )
+    {
+        StopSearch();
+        m_statsValid = true;
+    }
+    Draw();
+}
+
+void SearchView::ResetResults()
+{
+    m_preview.clear();
+    m_preview.reserve( m_result.results.size() );
+    m_top = m_bottom = m_cursor = 0;
+}
+
 void SearchView::Resize()
 {
     ResizeView( 0, 1, 0, -2 );
@@ -151,6 +215,10 @@ void SearchView::Draw()
         {
             mvwprintw( m_win, 2, 4, "Nothing to show." );
         }
+        else if( m_task )
+        {
+            mvwprintw( m_win, 2, 4, "Searching for: %s (%.0f%%)", m_query.c_str(), m_task->Progress() * 100.f );
+        }
         else
         {
             mvwprintw( m_win, 2, 4, "No results for: %s", m_query.c_str() );
@@ -176,7 +244,14 @@ void SearchView::Draw()
         wattron( m_win, A_BOLD );
         wprintw( m_win, "%s", m_query.c_str() );
         wattron( m_win, COLOR_PAIR( 8 ) );
-        wprintw( m_win, " (%.3f ms elapsed)", m_queryTime );
+        if( m_task )
+        {
+            wprintw( m_win, " (searching, %.0f%% done)", m_task->Progress() * 100.f );
+        }
+        else
+        {
+            wprintw( m_win, " (%.3f ms elapsed)", m_queryTime );
+        }
         wattroff( m_win, COLOR_PAIR( 8 ) | A_BOLD );
 
         const int h = getmaxy( m_win ) - 1;
@@ -311,13 +386,77 @@ void SearchView::Draw()
         }
         m_bottom = cnt;
     }
+    if( m_showStats ) DrawStats();
     wnoutrefresh( m_win );
 }
 
+void SearchView::DrawStats()
+{
+    enum { Width = 32 };
+    const int h = SearchStats::NumStages + 10;
+    const int x = getmaxx( m_win ) - Width - 1;
+    if( x < 0 || getmaxy( m_win ) < h + 1 ) return;
+
+    // Statistics are written by the search thread, so these are only shown after the search is finished.
+    char buf[Width];
+    std::vector<std::string> lines;
+    if( m_statsValid )
+    {
+        for( int i=0; i<SearchStats::NumStages; i++ )
+        {
+            snprintf( buf, Width, "%-10s %12.3f ms", SearchStats::StageName( i ), m_stats.time[i] / 1000000.f );
+            lines.emplace_back( buf );
+        }
+        snprintf( buf, Width, "%-10s %12.3f ms", "total", m_stats.total / 1000000.f );
+        lines.emplace_back( buf );
+        snprintf( buf, Width, "words      %15u", m_stats.words );
+        lines.emplace_back( buf );
+        snprintf( buf, Width, "postings   %15" PRIu64, m_stats.postings );
+        lines.emplace_back( buf );
+        snprintf( buf, Width, "probes     %15" PRIu64, m_stats.probes );
+        lines.emplace_back( buf );
+        snprintf( buf, Width, "ranked     %15" PRIu64, m_stats.candidates );
+        lines.emplace_back( buf );
+        snprintf( buf, Width, "memory     %12.1f KB", m_stats.memory / 1024.f );
+        lines.emplace_back( buf );
+        snprintf( buf, Width, "faults     %15" PRIu64, m_stats.minorFaults + m_stats.majorFaults );
+        lines.emplace_back( buf );
+    }
+    else
+    {
+        lines.emplace_back( m_task ? "search in progress" : "no search done" );
+    }
+
+    wattron( m_win, COLOR_PAIR(6) );
+    mvwaddch( m_win, 1, x, ACS_ULCORNER );
+    whline( m_win, ACS_HLINE, Width - 2 );
+    mvwaddch( m_win, 1, x + Width - 1, ACS_URCORNER );
+    int y = 2;
+    for( auto& v : lines )
+    {
+        mvwaddch( m_win, y, x, ACS_VLINE );
+        wattroff( m_win, COLOR_PAIR(6) );
+        wprintw( m_win, " %-*s", Width - 3, v.c_str() );
+        wattron( m_win, COLOR_PAIR(6) );
+        waddch( m_win, ACS_VLINE );
+        y++;
+    }
+    mvwaddch( m_win, y, x, ACS_LLCORNER );
+    whline( m_win, ACS_HLINE, Width - 2 );
+    mvwaddch( m_win, y, x + Width - 1, ACS_LRCORNER );
+    wattroff( m_win, COLOR_PAIR(6) );
+    wattron( m_win, A_BOLD );
+    mvwprintw( m_win, 1, x + 2, " Search stats " );
+    wattroff( m_win, A_BOLD );
+}
+
 void SearchView::Reset( Archive& archive )
 {
+    StopSearch();
     m_archive = &archive;
     m_search = std::make_unique<SearchEngine>( archive );
+    m_searchCtx.Release();
+    m_statsValid = false;
     m_result.results.clear();
     m_query.clear();
     m_top = m_bottom = m_cursor = 0;
@@ -342,37 +481,30 @@ void SearchView::FillPreview( int idx )
     }
     content++;
 
-    int wrote = DetectWrote( content );
+    BodyLines body;
+    body.Parse( content );
 
     std::vector<std::vector<std::pair<const char*, const char*>>> wlmap;    // word-line map
     std::vector<std::pair<const char*, const char*>> lines;  // start-end addresses of all lines
+    std::vector<const BodyLines::Line*> lineinfo;
     std::vector<LexiconType> linetype;
+    for( auto& bl : body.Lines() )
     {
-        auto line = content;
-        for(;;)
+        if( bl.flags & BodyLines::F_SignatureMark ) break;
+        if( bl.text != bl.len )
         {
-            auto end = line;
-            while( *end != '\n' && *end != '\0' ) end++;
-            if( end - line == 3 && strncmp( line, "-- ", 3 ) == 0 ) break;  // start of signature
-            auto tmp = line;
-            const auto quotLevel = QuotationLevel( tmp, end );
-            assert( wrote <= 0 || quotLevel == 0 );
-            if( tmp != end )
+            const auto line = content + bl.offset;
+            lines.emplace_back( line, line + bl.len );
+            lineinfo.emplace_back( &bl );
+            wlmap.emplace_back();
+            if( bl.flags & BodyLines::F_Wrote )
             {
-                lines.emplace_back( line, end );
-                wlmap.emplace_back();
-                if( wrote > 0 )
-                {
-                    linetype.emplace_back( T_Wrote );
-                    wrote--;
-                }
-                else
-                {
-                    linetype.emplace_back( LexiconTypeFromQuotLevel( quotLevel ) );
-                }
+                linetype.emplace_back( T_Wrote );
+            }
+            else
+            {
+                linetype.emplace_back( LexiconTypeFromQuotLevel( bl.level ) );
             }
-            if( *end == '\0' ) break;
-            line = end + 1;
         }
     }
 
@@ -393,11 +525,8 @@ void SearchView::FillPreview( int idx )
         int basePos = 0;
         for( int i=0; i<lines.size(); i++ )
         {
-            auto line = lines[i].first;
+            auto ptr = lines[i].first + lineinfo[i]->text;
             auto end = lines[i].second;
-
-            auto ptr = line;
-            QuotationLevel( ptr, end ); // just to walk ptr
             if( linetype[i] == htype )
             {
                 SplitLine( ptr, end, wordbuf, hpos == max );
@@ -547,8 +676,7 @@ void SearchView::FillPreview( int idx )
             }
             else
             {
-                auto tmp = ptr;
-                auto quotLevel = QuotationLevel( tmp, end );
+                const int quotLevel = lineinfo[i]->level;
 
                 auto color = quotLevel == 0 ? 0 : QuoteFlags[std::min( quotLevel-1, NumQuoteFlags-1 )];
                 preview.emplace_back( PreviewData { std::string( ptr, end ), color, true } );
@@ -556,8 +684,7 @@ void SearchView::FillPreview( int idx )
         }
         else
         {
-            auto tmp = ptr;
-            auto quotLevel = QuotationLevel( tmp, end );
+            const int quotLevel = lineinfo[i]->level;
             auto color = quotLevel == 0 ? 0 : QuoteFlags[std::min( quotLevel-1, NumQuoteFlags-1 )];
             for( auto& v : wlmap[i] )
             {
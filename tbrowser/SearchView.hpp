@@ -1,6 +1,7 @@
 #ifndef __SEARCHVIEW_HPP__
 #define __SEARCHVIEW_HPP__
 
+#include <chrono>
 #include <memory>
 #include <string>
 #include <vector>
@@ -13,11 +14,13 @@
 class BottomBar;
 class Browser;
 class PersistentStorage;
+class SearchTask;
 
 class SearchView : public View
 {
 public:
     SearchView( Browser* parent, BottomBar& bar, Archive& archive, PersistentStorage& storage );
+    ~SearchView();
 
     void Entry();
 
@@ -34,6 +37,12 @@ private:
         bool newline;
     };
 
+    void StartSearch();
+    void StopSearch();
+    void PollSearch();
+    void ResetResults();
+    void DrawStats();
+
     void FillPreview( int idx );
     void MoveCursor( int offset );
     void FixupRank();
@@ -43,12 +52,18 @@ private:
     BottomBar& m_bar;
     Archive* m_archive;
     std::unique_ptr<SearchEngine> m_search;
+    SearchContext m_searchCtx;
+    SearchStats m_stats;
+    std::unique_ptr<SearchTask> m_task;
+    std::chrono::high_resolution_clock::time_point m_searchStart;
     PersistentStorage& m_storage;
     std::string m_query;
     float m_queryTime;
     SearchData m_result;
     std::vector<std::vector<PreviewData>> m_preview;
     bool m_active;
+    bool m_showStats;
+    bool m_statsValid;
 
     int m_top, m_bottom;
     int m_cursor;
@@ -140,20 +140,27 @@ ScoreState ThreadTree::GetScoreState( int idx )
     auto state = GetScoreStateRaw( idx );
     if( state == ScoreState::Unknown )
     {
-        int score = m_archive->GetMessageScore( idx, m_storage.GetScoreList() );
-        if( score == 0 )
+        // Scores of the whole thread are calculated at once, as the other messages will be displayed next.
+        const auto root = GetRoot( idx );
+        const auto num = m_archive->GetTotalChildrenCount( root );
+        std::vector<int> scores( num );
+        m_archive->GetMessageScores( root, num, m_storage.GetScoreRules(), scores.data() );
+        for( uint32_t i=0; i<num; i++ )
         {
-            state = ScoreState::Neutral;
-        }
-        else if( score < 0 )
-        {
-            state = ScoreState::Negative;
-        }
-        else
-        {
-            state = ScoreState::Positive;
+            if( scores[i] == 0 )
+            {
+                SetScoreState( root + i, ScoreState::Neutral );
+            }
+            else if( scores[i] < 0 )
+            {
+                SetScoreState( root + i, ScoreState::Negative );
+            }
+            else
+            {
+                SetScoreState( root + i, ScoreState::Positive );
+            }
         }
-        SetScoreState( idx, state );
+        state = GetScoreStateRaw( idx );
     }
     return state;
 }
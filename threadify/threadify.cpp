@@ -13,10 +13,11 @@
 
 #include "../libuat/Archive.hpp"
 #include "../libuat/SearchEngine.hpp"
+#include "../common/BodyLines.hpp"
+#include "../common/Checkpoint.hpp"
 #include "../common/ExpandingBuffer.hpp"
 #include "../common/ICU.hpp"
 #include "../common/KillRe.hpp"
-#include "../common/MessageLogic.hpp"
 #include "../common/ReferencesParent.hpp"
 #include "../common/System.hpp"
 #include "../common/TaskDispatch.hpp"
@@ -35,6 +36,10 @@ void Sort( std::vector<uint32_t>& vec, const Message* msg )
     std::sort( vec.begin(), vec.end(), [msg]( const uint32_t l, const uint32_t r ) { return msg[l].epoch < msg[r].epoch; } );
 }
 
+// Number of messages searched for quotes before found matches are applied.
+enum { MatchBlock = 4096 };
+static constexpr uint32_t NoMatch = std::numeric_limits<uint32_t>::max();
+
 uint32_t* root;
 Message* msgdata;
 
@@ -90,11 +95,14 @@ static bool HasUniqueElements( std::vector<T>& v )
 
 int main( int argc, char** argv )
 {
-    if( argc < 2 || ( argc != 3 && ( argc % 2 ) == 1 ) )
+    int interval = Checkpoint::DefaultInterval;
+
+    if( argc < 2 )
     {
-        fprintf( stderr, "USAGE: %s raw ( [-i ignore]* | [-g] )\n", argv[0] );
+        fprintf( stderr, "USAGE: %s raw ( [-i ignore]* | [-g] ) [-c seconds]\n", argv[0] );
         fprintf( stderr, "  -i: add string to re:-list filter\n" );
         fprintf( stderr, "  -g: group threads by scanning for missing references\n" );
+        fprintf( stderr, "  -c: save matching progress for resuming at given interval, 0 disables (default: %i)\n", interval );
         exit( 1 );
     }
 
@@ -113,12 +121,20 @@ int main( int argc, char** argv )
     kr.LoadPrefixList( *archive );
 
     bool groupMode = false;
+    std::vector<std::string> ignore;
 
     while( argc > 2 )
     {
-        if( strcmp( argv[2], "-i" ) == 0 )
+        if( argc > 3 && strcmp( argv[2], "-i" ) == 0 )
         {
             kr.Add( argv[3] );
+            ignore.emplace_back( argv[3] );
+            argv += 2;
+            argc -= 2;
+        }
+        else if( argc > 3 && strcmp( argv[2], "-c" ) == 0 )
+        {
+            interval = std::max( 0, atoi( argv[3] ) );
             argv += 2;
             argc -= 2;
         }
@@ -183,6 +199,11 @@ int main( int argc, char** argv )
     int cntnew = 0, cntsure = 0, cntbad = 0, cnttime = 0;
     printf( "\nGrouping messages...\n" );
 
+    Checkpoint checkpoint( base + ".threadify.checkpoint", interval );
+    checkpoint.Param( uint64_t( size ) );
+    checkpoint.Param( uint64_t( topsize ) );
+    for( auto& v : ignore ) checkpoint.Param( v );
+
     if( groupMode )
     {
         struct Group
@@ -191,6 +212,7 @@ int main( int argc, char** argv )
         };
 
         ExpandingBuffer eb;
+        HeaderIndex hdr;
         robin_hood::unordered_flat_map<uint32_t, Group> groups;
         robin_hood::unordered_flat_map<std::string, uint32_t> refgroup;
         uint32_t curgroup = 0;
@@ -204,9 +226,8 @@ int main( int argc, char** argv )
             }
 
             auto i = toplevel[j];
-            auto post = archive->GetMessage( i, eb );
-
-            const auto refs = GetAllReferences( post, archive->GetCompress() );
+            hdr.Parse( archive->GetMessage( i, eb ) );
+            const auto refs = GetAllReferences( hdr, archive->GetCompress() );
 
             if( !refs.empty() )
             {
@@ -311,152 +332,161 @@ int main( int argc, char** argv )
             root[i] = idx;
         }
 
+        // Matches move subtrees to new roots, so they are replayed in the order they were found.
+        uint32_t done = 0;
+        if( checkpoint.Load() )
+        {
+            done = checkpoint.Get<uint32_t>();
+            cntnew = checkpoint.Get<int>();
+            cntsure = checkpoint.Get<int>();
+            cntbad = checkpoint.Get<int>();
+            cnttime = checkpoint.Get<int>();
+            std::vector<uint32_t> saved;
+            checkpoint.Get( saved );
+            for( size_t i=0; i<saved.size(); i+=2 )
+            {
+                found.emplace_back( saved[i], saved[i+1] );
+                SetRootTo( saved[i], root[saved[i+1]] );
+            }
+            printf( "\nResuming after %i of %zu messages.", done, topsize );
+        }
+
         printf( "\nMatching messages...\n" );
 
         const auto cpus = System::CPUCores();
         TaskDispatch tasks( cpus-1 );
-        std::atomic<uint32_t> cnt( 0 );
+        std::atomic<uint32_t> cnt;
 
-        std::mutex viewLock, resLock, splitLock;
+        std::mutex viewLock;
 
-        for( int t=0; t<cpus; t++ )
+        // Quotes are searched for in parallel, one block of messages at a time. Matches change thread roots,
+        // which are checked by later matches, so they are applied in message order, after the block is done.
+        // Results do not depend on number of threads, or on where the run was interrupted.
+        std::vector<uint32_t> best( MatchBlock );
+        while( done < topsize )
         {
-            tasks.Queue( [&cnt, &topsize, &toplevel, &viewLock, &resLock, &splitLock, &archive, &search, &found, &cntnew, &cntsure, &cntbad, &cnttime, &kr] {
-                ExpandingBuffer eb;
-                robin_hood::unordered_flat_map<uint32_t, float> hits;
-                std::vector<std::string> wordbuf;
+            const uint32_t end = std::min<size_t>( done + MatchBlock, topsize );
+            cnt.store( done );
+            for( int t=0; t<cpus; t++ )
+            {
+                tasks.Queue( [&cnt, end, done, &best, &topsize, &toplevel, &viewLock, &archive, &search] {
+                    ExpandingBuffer eb;
+                    SearchContext ctx;
+                    robin_hood::unordered_flat_map<uint32_t, float> hits;
+                    std::vector<std::string> wordbuf;
+                    BodyLines body;
 
-                for(;;)
-                {
-                    auto j = cnt.fetch_add( 1, std::memory_order_relaxed );
-                    if( j >= topsize ) break;
-                    if( ( j & 0x1F ) == 0 )
+                    for(;;)
                     {
-                        printf( "%i/%zu\r", j, topsize );
-                        fflush( stdout );
-                    }
+                        auto j = cnt.fetch_add( 1, std::memory_order_relaxed );
+                        if( j >= end ) break;
+                        if( ( j & 0x1F ) == 0 )
+                        {
+                            printf( "%i/%zu\r", j, topsize );
+                            fflush( stdout );
+                        }
 
-                    auto i = toplevel[j];
-                    bool headers = true;
-                    bool wroteDone = false;
-                    int remaining = 16;
+                        auto i = toplevel[j];
+                        int remaining = 16;
 
-                    viewLock.lock();
-                    auto post = archive->GetMessage( i, eb );
-                    viewLock.unlock();
+                        viewLock.lock();
+                        auto post = archive->GetMessage( i, eb );
+                        viewLock.unlock();
 
-                    for(;;)
-                    {
-                        auto end = post;
-                        if( headers )
+                        while( *post != '\n' )
                         {
-                            if( *end == '\n' )
-                            {
-                                headers = false;
-                                continue;
-                            }
-
-                            while( *end != '\n' ) end++;
-                            post = end + 1;
+                            while( *post++ != '\n' ) {}
                         }
-                        else
+                        body.Parse( post );
+
+                        // Text of first level quotes is searched for in the archive.
+                        for( auto& bl : body.Lines() )
                         {
-                            const char* line = end;
-                            while( *end != '\n' && *end != '\0' ) end++;
-                            int quotLevel = QuotationLevel( line, end );
-                            if( line != end && quotLevel == 1 )
+                            if( bl.level != 1 || bl.text == bl.len ) continue;
+                            const auto line = post + bl.offset;
+                            SplitLine( line + bl.text, line + bl.len, wordbuf );
+                            if( !wordbuf.empty() )
                             {
-                                const char* wrote = line;
-                                if( !wroteDone )
-                                {
-                                    wrote = DetectWroteEnd( line, 1 );
-                                    wroteDone = true;
-                                }
-                                if( wrote == line )
+                                auto results = search.Search( ctx, wordbuf, SearchEngine::SF_RequireAllWords | SearchEngine::SF_SimpleSearch, T_Content );
+                                auto& res = results.results;
+                                if( !res.empty() )
                                 {
-                                    splitLock.lock();
-                                    SplitLine( line, end, wordbuf );
-                                    splitLock.unlock();
-                                    if( !wordbuf.empty() )
+                                    auto terminate = res[0].rank * 0.02;
+                                    auto matched = results.matched.size();
+                                    for( auto& r : res )
                                     {
-                                        auto results = search.Search( wordbuf, SearchEngine::SF_RequireAllWords | SearchEngine::SF_SimpleSearch, T_Content );
-                                        auto& res = results.results;
-                                        if( !res.empty() )
-                                        {
-                                            auto terminate = res[0].rank * 0.02;
-                                            auto matched = results.matched.size();
-                                            for( auto& r : res )
-                                            {
-                                                if( r.rank < terminate ) break;
-                                                hits[r.postid] += r.rank * matched * matched;
-                                            }
-                                        }
-                                        wordbuf.clear();
+                                        if( r.rank < terminate ) break;
+                                        hits[r.postid] += r.rank * matched * matched;
                                     }
-                                    if( --remaining == 0 ) break;
-                                }
-                                else
-                                {
-                                    end = wrote;
-                                    while( *end != '\n' ) end--;
                                 }
+                                wordbuf.clear();
                             }
-                            if( *end == '\0' ) break;
-                            post = end + 1;
+                            if( --remaining == 0 ) break;
                         }
-                    }
 
-                    resLock.lock();
-                    if( hits.empty() )
-                    {
-                        cntnew++;
-                    }
-                    else
-                    {
-                        uint32_t best = 0;
+                        uint32_t b = hits.empty() ? NoMatch : 0;
                         float rank = 0;
                         for( auto& h : hits )
                         {
                             if( h.second > rank )
                             {
                                 rank = h.second;
-                                best = h.first;
+                                b = h.first;
                             }
                         }
                         hits.clear();
-                        if( root[i] == root[best] )
-                        {
-                            cntnew++;
-                        }
-                        else
-                        {
-                            time_t t1 = archive->GetDate( i );
-                            time_t t2 = archive->GetDate( best );
-                            if( ( t1 > t2 + 60 * 60 * 24 * 365 ) ||     // child message is year+ younger than parent
-                                ( t1 < t2 - 60 * 60 * 24 * 30 ) )       // child message is month+ older than parent
-                            {
-                                cnttime++;
-                            }
-                            else
-                            {
-                                if( IsSubjectMatch( archive->GetSubject( i ), archive->GetSubject( best ), kr ) )
-                                {
-                                    cntsure++;
-                                    found.emplace_back( i, best );
-                                    SetRootTo( i, root[best] );
-                                }
-                                else
-                                {
-                                    cntbad++;
-                                }
-                            }
-                        }
+                        best[j-done] = b;
                     }
-                    resLock.unlock();
+                } );
+            }
+            tasks.Sync();
+
+            for( uint32_t j=done; j<end; j++ )
+            {
+                const auto i = toplevel[j];
+                const auto b = best[j-done];
+                if( b == NoMatch || root[i] == root[b] )
+                {
+                    cntnew++;
+                    continue;
+                }
+                time_t t1 = archive->GetDate( i );
+                time_t t2 = archive->GetDate( b );
+                if( ( t1 > t2 + 60 * 60 * 24 * 365 ) ||     // child message is year+ younger than parent
+                    ( t1 < t2 - 60 * 60 * 24 * 30 ) )       // child message is month+ older than parent
+                {
+                    cnttime++;
                 }
-            } );
+                else if( IsSubjectMatch( archive->GetSubject( i ), archive->GetSubject( b ), kr ) )
+                {
+                    cntsure++;
+                    found.emplace_back( i, b );
+                    SetRootTo( i, root[b] );
+                }
+                else
+                {
+                    cntbad++;
+                }
+            }
+            done = end;
+            if( done >= topsize || !checkpoint.Due() ) continue;
+
+            checkpoint.Begin();
+            std::vector<uint32_t> saved;
+            saved.reserve( found.size() * 2 );
+            for( auto& v : found )
+            {
+                saved.emplace_back( v.first );
+                saved.emplace_back( v.second );
+            }
+            checkpoint.Put( done );
+            checkpoint.Put( cntnew );
+            checkpoint.Put( cntsure );
+            checkpoint.Put( cntbad );
+            checkpoint.Put( cnttime );
+            checkpoint.Put( saved );
+            checkpoint.Save();
         }
-        tasks.Sync();
         std::sort( found.begin(), found.end(), [] ( const auto& l, const auto& r ) { return l.first < r.first; } );
     }
     printf( "%zu/%zu\n", topsize, topsize );
@@ -554,6 +584,8 @@ int main( int argc, char** argv )
         fclose( flex );
     }
 
+    checkpoint.Remove();
+
     printf( "\nFound %i new threads.\nSurely matched %i messages (same subject line). Wrong guesses: %i due to different subject + %i non-chronological\n", cntnew, cntsure, cntbad, cnttime );
 
     return cntsure != 0 ? 1 : 0;